@@ -14,164 +14,121 @@ global DynamicCall
 
 ;--------------------------------------------------------------------------------------------------
 ; DynamicCall procedure
+;
+; RCX = PArgumentTable, RDX = address of the function, R8 = PRESULT, R9D = return flag.
+; The outgoing area is sized from the number of arguments. Each register argument is loaded into
+; both its integer and floating point register, the function reads the one matching its type, and
+; stack arguments are copied as raw 64-bit values. RBP is the only non-volatile register used.
 ;--------------------------------------------------------------------------------------------------
 section .text
 DynamicCall:
-    %push mycontext             ; save the current context 
-    %stacksize flat64            ; tell NASM to use bp 
-    %assign %$localsize 0
-    %local lpFunction:qword, lpTableArguments:qword, dwArguments:dword, lpResult:qword, dwReturnFlag:dword
-
-    enter %$localsize, 0x00 ;
-    push rbp                ; 
-    push rbx                ;
-    push rsi                ;
-    push rdi                ;
-    push r15                ;
-    push r14                ;
-    push r13                ;
-    push r12                ;
-    push r11                ;
-    sub rsp, 200h           ; Reserve 512 bytes on the stack
-
-;--------------------------------------------------------------------------------------------------
-; Fill local stack variables
-;--------------------------------------------------------------------------------------------------
-    mov [lpFunction], rdx                              ; Second parameter
-    mov [lpResult], r8                                 ; Address to the RESULT.
-    mov [dwReturnFlag], r9d                            ; Whether the data to return is scalar
-
-    mov r12, rcx                                       ;
-    mov r11d, dword [r12 + ArgumentTable.dwArguments]  ; Get number of parameters to parse
-    mov [dwArguments], r11d                            ;
-
-    mov r11, [r12 + ArgumentTable.lpArguments]         ; Get the address of the list of parameters
-    mov [lpTableArguments], r11                        ;
-
-;--------------------------------------------------------------------------------------------------
-; Parse each argument one by one
-;--------------------------------------------------------------------------------------------------
-.parse_arguments:
-    mov eax, dword [dwArguments]      ; Total number of arguments 
-    dec rax                           ; Index start to 0, hence -1 
-    imul rax, rax, 10h                ; Calculate argument index
-
-    add rax, qword [lpTableArguments] ; EAX = PArgument
-    mov ebx, [rax + Argument.dwSize]  ; 
-
-    cmp dword [dwArguments], 4h       ; Check if shadow stack or actual stack
-    jle .shadow_stack                 ;
-
-;--------------------------------------------------------------------------------------------------
-; Allocate data to stack
-;--------------------------------------------------------------------------------------------------
-    mov ebx, dword [dwArguments]                    ; EBX = number of argumetns
-    sub rbx, 5h                                     ; EBX - shadow stack parameters - 1
-    imul rbx, rbx, 8h                               ; EBX = 8 * EBX
-
-    add rbx, 20h                                    ; EBX = EBX + 20h
-    add rbx, rsp                                    ; EBX = position in the stack
-
-    and dword [rax + Argument.dwFlag], ARGUMENT_FLT ; Is non-scalar value
-    jnz .stack_xmmx
-    mov r10, [rax + Argument.value]                 ; Value as scalar data
-    mov qword [rbx], r10                            ; Push value to the stack
-    jmp .next                                       ;
-.stack_xmmx:
-    movsd xmm5, [rax + Argument.value]              ; Value as non-scalar data
-    movsd [rbx], xmm5                               ; Push value to the stack
-    jmp .next                                       ;
-
-;--------------------------------------------------------------------------------------------------
-; Allocate data to shadow stack
-;--------------------------------------------------------------------------------------------------
-.shadow_stack:
-    mov r10d, dword [dwArguments]                   ;
-    cmp r10d, 4h                                    ; 1 parameter
-    je .param4                                      ; 
-    cmp r10d, 3h                                    ; 2 parameter
-    je .param3                                      ;
-    cmp r10d, 2h                                    ; 3 parameter
-    je .param2                                      ;
-    cmp r10d, 1h                                    ; 4 parameter
-    je .param1                                      ;
-    jmp .failure                                    ; Something went wrong at this point
-.param1:
-    and dword [rax + Argument.dwFlag], ARGUMENT_FLT
-    jnz .param1_xmmx
-    mov rcx, [rax + Argument.value]
-    jmp .next
-.param1_xmmx:
-    movsd xmm0, [rax + Argument.value]              ; floating point value 
-    jmp .next                                       ;
-.param2:
-    and dword [rax + Argument.dwFlag], ARGUMENT_FLT ;
-    jnz .param2_xmmx                                ;
-    mov rdx, [rax + Argument.value]                 ; floating point value 
-    jmp .next
-.param2_xmmx:
-    movsd xmm1, [rax + Argument.value]              ; floating point value 
-    jmp .next                                       ;
-.param3:
-    and dword [rax + Argument.dwFlag], ARGUMENT_FLT ;
-    jnz .param3_xmmx                                ;
-    mov r8, [rax + Argument.value]                  ; floating point value 
-    jmp .next
-.param3_xmmx:
-    movsd xmm2, [rax + Argument.value]              ; floating point value 
-    jmp .next                                       ;
-.param4:
-    and dword [rax + Argument.dwFlag], ARGUMENT_FLT ;
-    jnz .param4_xmmx                                ;
-    mov r9, [rax + Argument.value]                  ;
-    jmp .next
-.param4_xmmx:
-    movsd xmm3, [rax + Argument.value]              ; floating point value 
-    jmp .next                                       ;
-.next:
-    dec dword [dwArguments]                         ; Next argument
-    jnz .parse_arguments                            ; 
+    push rbp                                            ; Prologue, described by the unwind data below
+    mov rbp, rsp                                        ; RSP is now 16-byte aligned
+    mov [rbp + 20h], r8                                 ; Address of the RESULT, in the home space of R8
+    mov [rbp + 28h], r9d                                ; Return flag, in the home space of R9
+
+    mov r10, rdx                                        ; Address of the function
+    mov r11, [rcx + ArgumentTable.lpArguments]          ; Address of the first argument
+    mov eax, [rcx + ArgumentTable.dwArguments]          ; Number of arguments
+    cmp eax, 4h                                         ; Check if some arguments go to the stack
+    ja .stack_arguments                                 ;
+    sub rsp, 20h                                        ; Shadow space only
+
+;--------------------------------------------------------------------------------------------------
+; Register arguments, one entry point per arity
+;--------------------------------------------------------------------------------------------------
+    cmp eax, 3h                                         ;
+    je .argument3                                       ;
+    ja .argument4                                       ;
+    cmp eax, 1h                                         ;
+    je .argument1                                       ;
+    ja .argument2                                       ;
+    jmp .call                                           ; No argument
+.argument4:
+    mov r9, [r11 + 3 * Argument_size + Argument.value]  ;
+    movq xmm3, r9                                       ;
+.argument3:
+    mov r8, [r11 + 2 * Argument_size + Argument.value]  ;
+    movq xmm2, r8                                       ;
+.argument2:
+    mov rdx, [r11 + 1 * Argument_size + Argument.value] ;
+    movq xmm1, rdx                                      ;
+.argument1:
+    mov rcx, [r11 + Argument.value]                     ;
+    movq xmm0, rcx                                      ;
 
 ;--------------------------------------------------------------------------------------------------
 ; Call function
 ;--------------------------------------------------------------------------------------------------
-    mov rax, qword [lpFunction] ; Address of the function
-    call rax                    ;
+.call:
+    call r10                                            ;
 
 ;--------------------------------------------------------------------------------------------------
 ; Get return value
 ;--------------------------------------------------------------------------------------------------
-    mov rbx, qword [lpResult]            ; Address of the RESULT union
-    and dword [dwReturnFlag], RETURN_FLT ; Whether non-scalar return value
-    jnz .result_xmmx                     ;
-    mov qword [rbx], rax                 ; Move scalar data
-    jmp .exit                            ;
+    mov rcx, [rbp + 20h]                                ; Address of the RESULT union
+    test dword [rbp + 28h], RETURN_FLT                  ; Whether non-scalar return value
+    jnz .result_xmmx                                    ;
+    mov [rcx], rax                                      ; Move scalar data
+    mov eax, 1h                                         ; TRUE
+    leave                                               ;
+    ret                                                 ;
 .result_xmmx:
-    movsd [rbx], xmm0                    ; Move non-scalar data
-    jmp .exit                            ;
-
-;--------------------------------------------------------------------------------------------------
-; Failure
-;--------------------------------------------------------------------------------------------------
-.failure:
-    xor eax, eax  ; FALSE
-    jmp .exit     ;
-
-;--------------------------------------------------------------------------------------------------
-; Exit procedure
-;--------------------------------------------------------------------------------------------------
-.exit: 
-    add rsp, 200h ;
-    pop r11       ;
-    pop r12       ;
-    pop r13       ;
-    pop r14       ;
-    pop r15       ;
-    pop rdi       ;
-    pop rsi       ;
-    pop rbx       ;
-    pop rbp       ;
-
-    leave 
-    ret           ;
-    %pop
\ No newline at end of file
+    movsd [rcx], xmm0                                   ; Move non-scalar data
+    mov eax, 1h                                         ; TRUE
+    leave                                               ;
+    ret                                                 ;
+
+;--------------------------------------------------------------------------------------------------
+; Stack arguments: shadow space plus 8 bytes per argument beyond the fourth, i.e. 8 bytes per
+; argument, rounded up to keep RSP 16-byte aligned. Pages are committed in order as done by
+; __chkstk, so that the guard page of the thread stack is never skipped.
+;--------------------------------------------------------------------------------------------------
+.stack_arguments:
+    lea rcx, [rax * 8 + 0Fh]                            ; Size of the outgoing area
+    and rcx, -10h                                       ;
+.probe:
+    cmp rcx, 1000h                                      ;
+    jb .allocate                                        ;
+    sub rsp, 1000h                                      ; Next page
+    test [rsp], rsp                                     ; Touch it
+    sub rcx, 1000h                                      ;
+    jmp .probe                                          ;
+.allocate:
+    sub rsp, rcx                                        ;
+
+    lea rdx, [r11 + 4 * Argument_size + Argument.value] ; Fifth argument
+    lea r8, [rsp + 20h]                                 ; Its location, above the shadow space
+    sub eax, 4h                                         ; Number of stack arguments
+.copy:
+    mov r9, [rdx]                                       ;
+    mov [r8], r9                                        ;
+    add rdx, Argument_size                              ;
+    add r8, 8h                                          ;
+    dec eax                                             ;
+    jnz .copy                                           ;
+    jmp .argument4                                      ;
+DynamicCall_end:
+
+;--------------------------------------------------------------------------------------------------
+; Unwind data, so that exceptions raised by the function can unwind through DynamicCall
+;--------------------------------------------------------------------------------------------------
+%ifidn __OUTPUT_FORMAT__, win64
+section .pdata rdata align=4
+    dd DynamicCall wrt ..imagebase                      ; Start of the function
+    dd DynamicCall_end wrt ..imagebase                  ; End of the function
+    dd DynamicCall_unwind wrt ..imagebase               ; UNWIND_INFO
+
+section .xdata rdata align=8
+DynamicCall_unwind:
+    db 01h                                              ; Version 1, no flag
+    db 04h                                              ; Size of the prologue
+    db 02h                                              ; Number of unwind codes
+    db 05h                                              ; Frame register RBP, offset 0
+    db 04h, 03h                                         ; mov rbp, rsp: UWOP_SET_FPREG
+    db 01h, 50h                                         ; push rbp: UWOP_PUSH_NONVOL RBP
+%endif
+
+%ifidn __OUTPUT_FORMAT__, elf64
+section .note.GNU-stack noalloc noexec nowrite progbits
+%endif
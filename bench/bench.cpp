@@ -0,0 +1,1317 @@
+/**
+* @file         bench.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Microbenchmarks of the name lookup, marshalling and call pipeline.
+* @details      Builds on Linux with GCC or Clang against the shim in bench/shim, target functions use the Microsoft x64
+*               calling convention. Results are written to stdout as JSON lines, one measurement per line with stable keys
+*               and ordering, so that the output of two versions can be diffed. Run with --help for the options.
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cwctype>
+#include <memory>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <x86intrin.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "types.hpp"
+#include "NameIndex.hpp"
+#include "MarshalPlan.hpp"
+#include "CallThunk.hpp"
+#include "DynamicMethod.hpp"
+#include "ThreadArena.hpp"
+#include "MethodTable.hpp"
+#include "StructLayout.hpp"
+#include "BindingCache.hpp"
+
+#define BENCH_SAMPLES         5        /* Default number of samples per measurement */
+#define BENCH_MIN_TIME        20000000 /* Default minimum duration of a sample, in nanoseconds */
+#define BENCH_QUICK_TIME      2000000  /* Minimum duration of a sample with --quick, in nanoseconds */
+#define BENCH_QUERIES         4096     /* Number of names looked up in turn */
+#define BENCH_HOT_QUERIES     16       /* Number of distinct names looked up by the hit_hot case */
+#define BENCH_MAX_ARGUMENTS   16       /* Largest arity measured */
+#define BENCH_MIN_STRING      16       /* Shortest string converted, in characters */
+#define BENCH_MAX_STRING      0x10000  /* Longest string converted, in characters */
+#define BENCH_MIN_BUFFER      0x1000   /* Smallest buffer passed, in bytes */
+#define BENCH_MAX_BUFFER      0x100000 /* Largest buffer passed, in bytes */
+#define BENCH_MAX_ENGINE      128      /* Largest arity measured through DynamicCall */
+#define BENCH_MAX_LEGACY      64       /* Largest arity the stack of DynamicCallLegacy can hold */
+#define BENCH_METHODS         10000    /* Number of methods registered by the methods suite */
+#define BENCH_OWN_METHODS     256      /* Largest number of methods registered by the instance suite */
+#define BENCH_INSTANCES       1024     /* Number of objects whose heap is measured by the instance suite */
+
+/**
+ * @brief Options of the run.
+*/
+typedef struct _BenchOptions {
+	std::string Filter;      /* Only run measurements whose "suite/case" contains this string */
+	LONGLONG    qwMinTime;   /* Minimum duration of a sample, in nanoseconds */
+	DWORD       dwSamples;   /* Number of samples per measurement */
+} BenchOptions;
+
+/**
+ * @brief Result of a measurement.
+*/
+typedef struct _BenchResult {
+	ULONGLONG qwIterations;  /* Iterations per sample */
+	DOUBLE    dbMedian;      /* Median of the samples, in nanoseconds per iteration */
+	DOUBLE    dbMin;         /* Fastest sample, in nanoseconds per iteration */
+} BenchResult;
+
+/**
+ * @brief Kind of the arguments of a signature.
+*/
+typedef enum _BenchMix {
+	BenchMixInt,     /* All 32-bit integers */
+	BenchMixFloat,   /* All doubles */
+	BenchMixMixed,   /* Integers at even positions, doubles at odd positions */
+	BenchMixCoerce   /* Doubles provided as VT_I4, converted by VariantChangeType */
+} BenchMix;
+
+static LPCSTR s_aMixNames[] = { "int", "float", "mixed", "coerce" };
+
+/**
+ * @brief Sink of the results, keeps the compiler from discarding the measured code.
+*/
+static volatile ULONGLONG s_qwSink = 0;
+
+/**
+ * @brief Target of the calls. Only the call overhead is measured, hence it ignores its arguments.
+ * @return Always TRUE, DynamicCall returns the value of the function.
+*/
+__attribute__((noinline)) static ULONGLONG THUNKCALLTYPE BenchTarget(VOID) {
+	__asm__ __volatile__("");
+	return TRUE;
+}
+
+#ifndef BENCH_DYNAMICCALL
+/**
+ * @brief Stand-in for the NASM routine when it is not built. Dynamic methods only fall back to it beyond
+ *        THUNK_MAX_ARGUMENTS arguments, which are not measured.
+*/
+extern "C" BOOL THUNKCALLTYPE DynamicCall(
+	_In_  PArgumentTable lpTable,
+	_In_  LPVOID         lpFunction,
+	_Out_ PRESULT        lpResut,
+	_In_  DWORD          dwReturnFlag
+) {
+	(VOID)lpTable, (VOID)lpFunction, (VOID)dwReturnFlag;
+	lpResut->int64 = 0;
+	return FALSE;
+}
+#else
+#pragma pack(push)
+#pragma pack(1)
+/**
+ * @brief Argument in the layout expected by DynamicCallLegacy.
+*/
+typedef struct _LegacyArgument {
+	DWORD   dwFlag;
+	DWORD   dwSize;
+	DWORD64 qwValue;
+} LegacyArgument;
+
+/**
+ * @brief Table of arguments in the layout expected by DynamicCallLegacy.
+*/
+typedef struct _LegacyArgumentTable {
+	DWORD           dwArguments;
+	LegacyArgument* lpArguments;
+} LegacyArgumentTable;
+#pragma pack(pop)
+
+/**
+ * @brief DynamicCall as of version 1.0, see bench/asm/DynamicCallLegacy.asm. It does not call the function when there
+ *        is no argument, and overflows its fixed stack beyond BENCH_MAX_LEGACY arguments.
+*/
+extern "C" BOOL THUNKCALLTYPE DynamicCallLegacy(
+	_In_  LegacyArgumentTable* lpTable,
+	_In_  LPVOID               lpFunction,
+	_Out_ PRESULT              lpResut,
+	_In_  DWORD                dwReturnFlag
+);
+#endif
+
+/**
+ * @brief Measure a piece of code.
+ * @param Options The options of the run.
+ * @param Body Callable running the code a given number of times.
+ * @return The result of the measurement.
+*/
+template<typename TBody>
+static BenchResult Measure(
+	_In_ const BenchOptions& Options,
+	_In_ TBody&&             Body
+) {
+	typedef std::chrono::steady_clock Clock;
+	auto Run = [&Body](ULONGLONG qwIterations) -> LONGLONG {
+		Clock::time_point start = Clock::now();
+		Body(qwIterations);
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+	};
+
+	// Find a number of iterations lasting at least the minimum duration, which also warms up caches and predictors
+	ULONGLONG qwIterations = 1;
+	for (LONGLONG qwElapsed = Run(qwIterations); qwElapsed < Options.qwMinTime; qwElapsed = Run(qwIterations)) {
+		ULONGLONG qwScale = qwElapsed > 0 ? static_cast<ULONGLONG>(Options.qwMinTime / qwElapsed) + 1 : 16;
+		qwIterations *= std::min<ULONGLONG>(std::max<ULONGLONG>(qwScale, 2), 16);
+	}
+
+	std::vector<DOUBLE> aSamples{};
+	for (DWORD cx = 0; cx < Options.dwSamples; cx++)
+		aSamples.push_back(static_cast<DOUBLE>(Run(qwIterations)) / static_cast<DOUBLE>(qwIterations));
+	std::sort(aSamples.begin(), aSamples.end());
+
+	return { qwIterations, aSamples[aSamples.size() / 2], aSamples[0] };
+}
+
+/**
+ * @brief Whether a measurement is selected by the filter.
+*/
+static BOOL Selected(
+	_In_ const BenchOptions& Options,
+	_In_ LPCSTR              szSuite,
+	_In_ LPCSTR              szCase
+) {
+	std::string Name = std::string(szSuite) + "/" + szCase;
+	return Options.Filter.empty() || Name.find(Options.Filter) != std::string::npos;
+}
+
+/**
+ * @brief Write a measurement.
+ * @param szSuite The suite of the measurement.
+ * @param szCase The case within the suite.
+ * @param szParameters The parameters of the case, as JSON members without braces.
+ * @param pResult The result, or NULL if the case is not supported.
+*/
+static VOID Emit(
+	_In_     LPCSTR             szSuite,
+	_In_     LPCSTR             szCase,
+	_In_     const std::string& szParameters,
+	_In_opt_ const BenchResult* pResult
+) {
+	std::printf("{\"suite\":\"%s\",\"case\":\"%s\",%s,", szSuite, szCase, szParameters.c_str());
+	if (pResult == nullptr)
+		std::printf("\"supported\":false}\n");
+	else
+		std::printf("\"supported\":true,\"iterations\":%llu,\"ns_median\":%.3f,\"ns_min\":%.3f}\n",
+			static_cast<unsigned long long>(pResult->qwIterations), pResult->dbMedian, pResult->dbMin);
+	std::fflush(stdout);
+}
+
+/**
+ * @brief Build the signature string of a function taking dwArguments arguments of a given mix and returning an integer.
+*/
+static std::wstring Signature(
+	_In_ DWORD    dwArguments,
+	_In_ BenchMix eMix
+) {
+	std::wstring Signature{};
+	for (DWORD cx = 0; cx < dwArguments; cx++) {
+		BOOL bFloat = eMix == BenchMixFloat || eMix == BenchMixCoerce || (eMix == BenchMixMixed && (cx & 1));
+		Signature.push_back(bFloat ? L'd' : L'i');
+	}
+	return Signature + L"=i";
+}
+
+/**
+ * @brief Build the parameters a client would provide for a signature, in reverse order as in DISPPARAMS.
+*/
+static std::vector<VARIANT> Parameters(
+	_In_ DWORD    dwArguments,
+	_In_ BenchMix eMix
+) {
+	std::vector<VARIANT> aParameters(dwArguments);
+	for (DWORD cx = 0; cx < dwArguments; cx++) {
+		VARIANT* pVariant = &aParameters[dwArguments - cx - 1];
+		::VariantInit(pVariant);
+
+		BOOL bFloat = eMix == BenchMixFloat || (eMix == BenchMixMixed && (cx & 1));
+		if (bFloat) {
+			V_VT(pVariant) = VT_R8;
+			V_R8(pVariant) = 1.5 * cx;
+		}
+		else {
+			V_VT(pVariant) = VT_I4;
+			V_I4(pVariant) = static_cast<LONG>(cx);
+		}
+	}
+	return aParameters;
+}
+
+/**
+ * @brief Name lookup, as done by GetIDsOfNames: exact case, different case and unknown names.
+ * @details Probes per lookup do not depend on the number of names, the load factor staying between 25% and 50%. Once the
+ *          table and the interned names no longer fit in the cache, hits pay for a cache miss on the entry and another
+ *          one on the name compared, which hit_hot avoids by looking up the same few names in turn.
+*/
+static VOID BenchLookup(
+	_In_ const BenchOptions& Options
+) {
+	const DWORD aSizes[] = { 10, 1000, 50000 };
+	std::mt19937 rng(0x4457);
+
+	for (DWORD dwSize : aSizes) {
+		NameIndex index{};
+		std::vector<std::wstring> aNames{};
+		for (DWORD cx = 0; cx < dwSize; cx++) {
+			aNames.push_back(L"BenchFunction" + std::to_wstring(cx) + L"Ex");
+			index.Insert(aNames.back().c_str(), static_cast<DISPID>(cx), NULL);
+		}
+
+		// Queries are picked at random so that the table is not walked in order
+		std::vector<std::wstring> aExact{}, aHot{}, aUpper{}, aMissing{};
+		for (DWORD cx = 0; cx < BENCH_QUERIES; cx++) {
+			const std::wstring& Name = aNames[rng() % dwSize];
+			aExact.push_back(Name);
+			aHot.push_back(aExact[cx % BENCH_HOT_QUERIES]);
+			aUpper.push_back(Name);
+			std::transform(aUpper.back().begin(), aUpper.back().end(), aUpper.back().begin(), ::towupper);
+			aMissing.push_back(L"MissingFunction" + std::to_wstring(rng()));
+		}
+
+		const std::pair<LPCSTR, std::vector<std::wstring>*> aCases[] = { { "hit", &aExact }, { "hit_hot", &aHot }, { "hit_upper", &aUpper }, { "miss", &aMissing } };
+		for (auto& Case : aCases) {
+			if (!Selected(Options, "lookup", Case.first))
+				continue;
+
+			std::vector<LPCWSTR> aQueries{};
+			for (const std::wstring& Query : *Case.second)
+				aQueries.push_back(Query.c_str());
+
+			BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+				ULONGLONG qwSum = 0;
+				for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+					DISPID lDispId = DISPID(-1);
+					index.Find(aQueries[cx % BENCH_QUERIES], &lDispId);
+					qwSum += static_cast<ULONGLONG>(lDispId);
+				}
+				s_qwSink = qwSum;
+			});
+			Emit("lookup", Case.first, "\"names\":" + std::to_string(dwSize), &Result);
+		}
+	}
+}
+
+/**
+ * @brief Conversion of the client parameters into native arguments by a marshalling plan.
+*/
+static VOID BenchMarshal(
+	_In_ const BenchOptions& Options
+) {
+	for (DWORD eMix = BenchMixInt; eMix <= BenchMixCoerce; eMix++) {
+		if (!Selected(Options, "marshal", s_aMixNames[eMix]))
+			continue;
+
+		for (DWORD dwArguments = 0; dwArguments <= BENCH_MAX_ARGUMENTS; dwArguments++) {
+			std::unique_ptr<MarshalPlan> pPlan{};
+			if (FAILED(MarshalPlan::Compile(Signature(dwArguments, static_cast<BenchMix>(eMix)).c_str(), &pPlan)))
+				continue;
+
+			std::vector<VARIANT> aParameters = Parameters(dwArguments, static_cast<BenchMix>(eMix));
+			DISPPARAMS DispParams = { aParameters.data(), NULL, dwArguments, 0 };
+			Argument aArguments[BENCH_MAX_ARGUMENTS + 1];
+			ArenaScope Scope{};
+
+			BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+				for (ULONGLONG cx = 0; cx < qwIterations; cx++)
+					pPlan->Marshal(&DispParams, aArguments, &Scope, NULL);
+				s_qwSink = aArguments[0].qwValue;
+			});
+			Emit("marshal", s_aMixNames[eMix], "\"arity\":" + std::to_string(dwArguments), &Result);
+		}
+	}
+}
+
+/**
+ * @brief Native call of marshalled arguments: generated thunk against the NASM DynamicCall.
+*/
+static VOID BenchCall(
+	_In_ const BenchOptions& Options
+) {
+	LPVOID lpFunction = reinterpret_cast<LPVOID>(&BenchTarget);
+
+	// Baseline: indirect call without any argument handling
+	if (Selected(Options, "call", "direct")) {
+		ULONGLONG(THUNKCALLTYPE* volatile lpDirect)(VOID) = &BenchTarget;
+		BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+			ULONGLONG qwSum = 0;
+			for (ULONGLONG cx = 0; cx < qwIterations; cx++)
+				qwSum += lpDirect();
+			s_qwSink = qwSum;
+		});
+		Emit("call", "direct", "\"arity\":0,\"mix\":\"int\"", &Result);
+	}
+
+	for (DWORD eMix = BenchMixInt; eMix <= BenchMixMixed; eMix++) {
+		for (DWORD dwArguments = 0; dwArguments <= BENCH_MAX_ARGUMENTS; dwArguments++) {
+			std::unique_ptr<MarshalPlan> pPlan{};
+			if (FAILED(MarshalPlan::Compile(Signature(dwArguments, static_cast<BenchMix>(eMix)).c_str(), &pPlan)))
+				continue;
+
+			std::vector<VARIANT> aParameters = Parameters(dwArguments, static_cast<BenchMix>(eMix));
+			DISPPARAMS DispParams = { aParameters.data(), NULL, dwArguments, 0 };
+			Argument aArguments[BENCH_MAX_ARGUMENTS + 1];
+			ArenaScope Scope{};
+			pPlan->Marshal(&DispParams, aArguments, &Scope, NULL);
+
+			std::string Json = "\"arity\":" + std::to_string(dwArguments) + ",\"mix\":\"" + s_aMixNames[eMix] + "\"";
+
+			if (Selected(Options, "call", "thunk")) {
+				CallThunk lpThunk = CallThunkCache::Instance().Get(dwArguments, pPlan->m_dwFloatMask, pPlan->m_dwReturnFlag);
+				BenchResult Result{};
+				if (lpThunk != NULL) {
+					Result = Measure(Options, [&](ULONGLONG qwIterations) {
+						RESULT res{ 0 };
+						ULONGLONG qwSum = 0;
+						for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+							lpThunk(aArguments, lpFunction, &res);
+							qwSum += res.int64;
+						}
+						s_qwSink = qwSum;
+					});
+				}
+				Emit("call", "thunk", Json, lpThunk != NULL ? &Result : nullptr);
+			}
+
+#ifdef BENCH_DYNAMICCALL
+			if (Selected(Options, "call", "dynamiccall")) {
+				ArgumentTable Table = { aArguments, dwArguments };
+				RESULT res{ 0 };
+				BOOL bSupported = DynamicCall(&Table, lpFunction, &res, pPlan->m_dwReturnFlag) != FALSE;
+				BenchResult Result{};
+				if (bSupported) {
+					Result = Measure(Options, [&](ULONGLONG qwIterations) {
+						ULONGLONG qwSum = 0;
+						for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+							DynamicCall(&Table, lpFunction, &res, pPlan->m_dwReturnFlag);
+							qwSum += res.int64;
+						}
+						s_qwSink = qwSum;
+					});
+				}
+				Emit("call", "dynamiccall", Json, bSupported ? &Result : nullptr);
+			}
+#endif
+		}
+	}
+}
+
+/**
+ * @brief Whole dispatch of a dynamic method: marshalling, call and conversion of the result, with signature, without
+ *        signature through the generic path, and without signature with the type feedback of the previous calls.
+*/
+static VOID BenchInvoke(
+	_In_ const BenchOptions& Options
+) {
+	LPVOID lpFunction = reinterpret_cast<LPVOID>(&BenchTarget);
+
+	for (DWORD eMix = BenchMixInt; eMix <= BenchMixMixed; eMix++) {
+		for (DWORD dwArguments = 0; dwArguments <= BENCH_MAX_ARGUMENTS; dwArguments++) {
+			std::unique_ptr<MarshalPlan> pPlan{};
+			if (FAILED(MarshalPlan::Compile(Signature(dwArguments, static_cast<BenchMix>(eMix)).c_str(), &pPlan)))
+				continue;
+
+			std::vector<VARIANT> aParameters = Parameters(dwArguments, static_cast<BenchMix>(eMix));
+			DISPPARAMS DispParams = { aParameters.data(), NULL, dwArguments, 0 };
+			std::string Json = "\"arity\":" + std::to_string(dwArguments) + ",\"mix\":\"" + s_aMixNames[eMix] + "\"";
+
+			TypeFeedback Feedback{};
+			const std::tuple<LPCSTR, const MarshalPlan*, TypeFeedback*> aCases[] = {
+				{ "signature", pPlan.get(), nullptr }, { "legacy", nullptr, nullptr }, { "feedback", nullptr, &Feedback }
+			};
+			for (auto& Case : aCases) {
+				if (!Selected(Options, "invoke", std::get<0>(Case)))
+					continue;
+
+				DynamicMethod Method(lpFunction, std::get<1>(Case), std::get<2>(Case));
+				BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+					VARIANT VarResult;
+					ULONGLONG qwSum = 0;
+					for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+						Method.Invoke(&DispParams, &VarResult, NULL);
+						qwSum += VarResult.ullVal;
+					}
+					s_qwSink = qwSum;
+				});
+				Emit("invoke", std::get<0>(Case), Json, &Result);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Dynamic method as stored before methods were kept by value in MethodTable: one heap block per method, holding
+ *        its metadata along with its call state, reached through segments of pointers.
+*/
+typedef struct _BenchHeapMethod {
+	DynamicMethod                Method;          /* Call state */
+	DWORD                        dwDispatchId;    /* Dispatch ID of the method */
+	LPCWSTR                      wszFunctionName; /* Name of the method */
+	std::unique_ptr<MarshalPlan> pPlan;           /* Plan owned by the method */
+} BenchHeapMethod;
+
+/**
+ * @brief Get the number of bytes of heap in use, as seen by the allocator.
+ * @return Whether the allocator reports it.
+*/
+static BOOL HeapInUse(
+	_Out_ SIZE_T* pdwBytes
+) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 info = ::mallinfo2();
+	*pdwBytes = info.uordblks + info.hblkhd;
+	return TRUE;
+#else
+	*pdwBytes = 0;
+	return FALSE;
+#endif
+}
+
+/**
+ * @brief Registration of BENCH_METHODS methods with a signature, in the dense table of methods against one heap block
+ *        per method. The heap used by the registration is reported with the per-call latency of the methods called
+ *        by dispatch ID in a random order.
+*/
+static VOID BenchMethods(
+	_In_ const BenchOptions& Options
+) {
+	LPVOID lpFunction = reinterpret_cast<LPVOID>(&BenchTarget);
+	std::vector<std::wstring> aNames{};
+	for (DWORD cx = 0; cx < BENCH_METHODS; cx++)
+		aNames.push_back(L"BenchFunction" + std::to_wstring(cx) + L"Ex");
+
+	std::vector<DWORD> aQueries(BENCH_QUERIES);
+	std::mt19937 Random(42);
+	std::uniform_int_distribution<DWORD> Distribution(0, BENCH_METHODS - 1);
+	for (DWORD& dwIndex : aQueries)
+		dwIndex = Distribution(Random);
+
+	std::vector<VARIANT> aParameters = Parameters(2, BenchMixInt);
+	DISPPARAMS DispParams = { aParameters.data(), NULL, 2, 0 };
+	std::wstring wsSignature = Signature(2, BenchMixInt);
+
+	// Methods by value, in segments allocated once per doubling
+	if (Selected(Options, "methods", "table")) {
+		SIZE_T dwBefore = 0, dwAfter = 0;
+		BOOL bHeap = HeapInUse(&dwBefore);
+		std::unique_ptr<MethodTable> pMethods{ new MethodTable() };
+		for (DWORD cx = 0; cx < BENCH_METHODS; cx++) {
+			DynamicMethodInfo info{};
+			info.wsFunctionName = aNames[cx];
+			MarshalPlan::Compile(wsSignature.c_str(), &info.pPlan);
+			pMethods->Append(lpFunction, &info, NULL);
+		}
+		bHeap = bHeap && HeapInUse(&dwAfter);
+
+		// Call every method once, state allocated on first call is not measured
+		VARIANT VarResult;
+		for (DWORD cx = 0; cx < BENCH_METHODS; cx++)
+			pMethods->Get(cx)->Invoke(&DispParams, &VarResult, NULL);
+
+		BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+			VARIANT VarResult;
+			ULONGLONG qwSum = 0;
+			for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+				pMethods->Get(aQueries[cx % BENCH_QUERIES])->Invoke(&DispParams, &VarResult, NULL);
+				qwSum += VarResult.ullVal;
+			}
+			s_qwSink = qwSum;
+		});
+		std::string Json = "\"methods\":" + std::to_string(BENCH_METHODS) + ",\"bytes\":"
+			+ (bHeap ? std::to_string(dwAfter - dwBefore) : std::string("null"));
+		Emit("methods", "table", Json, &Result);
+	}
+
+	// One heap block per method, as done before
+	if (Selected(Options, "methods", "heap")) {
+		SIZE_T dwBefore = 0, dwAfter = 0;
+		BOOL bHeap = HeapInUse(&dwBefore);
+		std::vector<std::unique_ptr<BenchHeapMethod*[]>> aSegments(METHODTABLE_SEGMENTS);
+		for (DWORD cx = 0; cx < BENCH_METHODS; cx++) {
+			std::unique_ptr<MarshalPlan> pPlan{};
+			MarshalPlan::Compile(wsSignature.c_str(), &pPlan);
+
+			DWORD dwOffset = 0;
+			DWORD dwSegment = MethodTable::Segment(cx, &dwOffset);
+			if (aSegments[dwSegment] == nullptr)
+				aSegments[dwSegment].reset(new BenchHeapMethod*[static_cast<SIZE_T>(METHODTABLE_FIRST_SEGMENT) << dwSegment]);
+			aSegments[dwSegment][dwOffset] = new BenchHeapMethod{ DynamicMethod(lpFunction, pPlan.get(), nullptr), cx, aNames[cx].c_str(), std::move(pPlan) };
+		}
+		bHeap = bHeap && HeapInUse(&dwAfter);
+
+		VARIANT VarResult;
+		for (DWORD cx = 0; cx < BENCH_METHODS; cx++) {
+			DWORD dwOffset = 0;
+			DWORD dwSegment = MethodTable::Segment(cx, &dwOffset);
+			aSegments[dwSegment][dwOffset]->Method.Invoke(&DispParams, &VarResult, NULL);
+		}
+
+		BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+			VARIANT VarResult;
+			ULONGLONG qwSum = 0;
+			for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+				DWORD dwOffset = 0;
+				DWORD dwSegment = MethodTable::Segment(aQueries[cx % BENCH_QUERIES], &dwOffset);
+				aSegments[dwSegment][dwOffset]->Method.Invoke(&DispParams, &VarResult, NULL);
+				qwSum += VarResult.ullVal;
+			}
+			s_qwSink = qwSum;
+		});
+		std::string Json = "\"methods\":" + std::to_string(BENCH_METHODS) + ",\"bytes\":"
+			+ (bHeap ? std::to_string(dwAfter - dwBefore) : std::string("null"));
+		Emit("methods", "heap", Json, &Result);
+
+		for (DWORD cx = 0; cx < BENCH_METHODS; cx++) {
+			DWORD dwOffset = 0;
+			DWORD dwSegment = MethodTable::Segment(cx, &dwOffset);
+			delete aSegments[dwSegment][dwOffset];
+		}
+	}
+}
+
+/**
+ * @brief Names and methods registered by one COM Automation object, as kept by AutomationFactory: the index of its
+ *        names and the segments of catalog indexes, both allocated on first registration and freed by Reset.
+*/
+typedef struct _BenchInstance {
+	std::unique_ptr<NameIndex> pNames;                            /* Names of the methods registered */
+	std::unique_ptr<DWORD[]>   aOwnSegments[METHODTABLE_SEGMENTS]; /* Catalog index of the methods registered */
+	DWORD                      dwOwn;                             /* Number of methods registered */
+} BenchInstance;
+
+/**
+ * @brief Register a method as done by AutomationFactory::Adopt.
+*/
+static HRESULT BenchAdopt(
+	_Inout_ BenchInstance& Instance,
+	_In_    LPCWSTR        wszFunctionName,
+	_In_    DWORD          dwCatalogIndex
+) {
+	if (Instance.pNames == nullptr)
+		Instance.pNames.reset(new (std::nothrow) NameIndex());
+
+	DWORD dwOffset = 0;
+	DWORD dwSegment = MethodTable::Segment(Instance.dwOwn, &dwOffset);
+	if (Instance.aOwnSegments[dwSegment] == nullptr)
+		Instance.aOwnSegments[dwSegment].reset(new (std::nothrow) DWORD[static_cast<SIZE_T>(METHODTABLE_FIRST_SEGMENT) << dwSegment]);
+	if (Instance.pNames == nullptr || Instance.aOwnSegments[dwSegment] == nullptr)
+		return E_OUTOFMEMORY;
+
+	Instance.aOwnSegments[dwSegment][dwOffset] = dwCatalogIndex;
+	return Instance.pNames->Insert(wszFunctionName, static_cast<DISPID>(Instance.dwOwn++), NULL);
+}
+
+/**
+ * @brief Registration state of one object. Objects come from a pool and own nothing until their first registration,
+ *        hence creating one is O(1) and only the names and methods registered are allocated. The heap allocated per
+ *        object to register a number of methods is reported with the latency of registering them and resetting it.
+*/
+static VOID BenchInstances(
+	_In_ const BenchOptions& Options
+) {
+	if (!Selected(Options, "instance", "register"))
+		return;
+
+	std::vector<std::wstring> aNames{};
+	for (DWORD cx = 0; cx < BENCH_OWN_METHODS; cx++)
+		aNames.push_back(L"BenchFunction" + std::to_wstring(cx) + L"Ex");
+
+	for (DWORD dwMethods = 1; dwMethods <= BENCH_OWN_METHODS; dwMethods *= 16) {
+		// Blocks freed recently are cached by the allocator and still reported in use, hence many objects are measured
+		std::vector<BenchInstance> aInstances(BENCH_INSTANCES);
+		SIZE_T dwBefore = 0, dwAfter = 0;
+		BOOL bHeap = HeapInUse(&dwBefore);
+		for (BenchInstance& Instance : aInstances) {
+			for (DWORD cx = 0; cx < dwMethods; cx++)
+				BenchAdopt(Instance, aNames[cx].c_str(), cx);
+		}
+		bHeap = bHeap && HeapInUse(&dwAfter);
+		aInstances.clear();
+
+		BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+			ULONGLONG qwSum = 0;
+			for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+				BenchInstance Instance{};
+				for (DWORD dwMethod = 0; dwMethod < dwMethods; dwMethod++)
+					BenchAdopt(Instance, aNames[dwMethod].c_str(), dwMethod);
+				qwSum += Instance.dwOwn;
+			}
+			s_qwSink = qwSum;
+		});
+		std::string Json = "\"methods\":" + std::to_string(dwMethods) + ",\"bytes\":"
+			+ (bHeap ? std::to_string((dwAfter - dwBefore) / BENCH_INSTANCES) : std::string("null"));
+		Emit("instance", "register", Json, &Result);
+	}
+}
+
+/**
+ * @brief Conversion of string arguments: UTF-16 in place, ANSI and UTF-8 into the scratch memory of the call. Strings
+ *        are either ASCII or have one accented character every 8 characters.
+*/
+static VOID BenchString(
+	_In_ const BenchOptions& Options
+) {
+	const std::pair<LPCSTR, ArgumentKind> aKinds[] = {
+		{ "utf16", ArgumentKindString }, { "ansi", ArgumentKindAnsi }, { "utf8", ArgumentKindUtf8 }
+	};
+	LPCSTR aContents[] = { "ascii", "accented" };
+
+	for (auto& Kind : aKinds) {
+		if (!Selected(Options, "string", Kind.first))
+			continue;
+		ArgumentConverter lpConverter = MarshalPlan::GetConverter(Kind.second);
+
+		for (DWORD dwContent = 0; dwContent < ARRAYSIZE(aContents); dwContent++) {
+			for (DWORD dwLength = BENCH_MIN_STRING; dwLength <= BENCH_MAX_STRING; dwLength *= 4) {
+				std::wstring String(dwLength, L'a');
+				for (DWORD cx = 0; cx < dwLength; cx++)
+					String[cx] = dwContent != 0 && cx % 8 == 7 ? L'\u00e9' : static_cast<WCHAR>(L'a' + cx % 26);
+
+				VARIANT Variant;
+				V_VT(&Variant) = VT_BSTR;
+				V_BSTR(&Variant) = ::SysAllocStringLen(String.c_str(), dwLength);
+
+				BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+					ULONGLONG qwSum = 0;
+					for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+						ArenaScope Scope{};
+						Argument argument;
+						lpConverter(&Variant, &argument, &Scope);
+						qwSum += *reinterpret_cast<const BYTE*>(argument.lpValue);
+					}
+					s_qwSink = qwSum;
+				});
+				Emit("string", Kind.first, "\"chars\":" + std::to_string(dwLength) + ",\"content\":\"" + aContents[dwContent] + "\"", &Result);
+				::VariantClear(&Variant);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Buffer passed to a native function: array of bytes passed in place against the copy into native memory
+ *        that scripts had to make beforehand.
+*/
+static VOID BenchBuffer(
+	_In_ const BenchOptions& Options
+) {
+	std::unique_ptr<MarshalPlan> pPlan{};
+	MarshalPlan::Compile(L"pi=i", &pPlan);
+
+	for (DWORD dwBytes = BENCH_MIN_BUFFER; dwBytes <= BENCH_MAX_BUFFER; dwBytes *= 4) {
+		std::vector<BYTE> Data(dwBytes, 0x41);
+		std::vector<BYTE> Native(dwBytes);
+		SAFEARRAY Array = { 1, 0, 1, 0, Data.data(), { { dwBytes, 0 } } };
+
+		std::vector<VARIANT> aParameters(2);
+		V_VT(&aParameters[0]) = VT_I4;
+		V_I4(&aParameters[0]) = static_cast<LONG>(dwBytes);
+		V_VT(&aParameters[1]) = VT_ARRAY | VT_UI1;
+		V_ARRAY(&aParameters[1]) = &Array;
+		DISPPARAMS DispParams = { aParameters.data(), NULL, 2, 0 };
+		std::string Json = "\"bytes\":" + std::to_string(dwBytes);
+
+		if (Selected(Options, "buffer", "array")) {
+			BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+				ULONGLONG qwSum = 0;
+				for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+					ArenaScope Scope{};
+					Argument aArguments[2];
+					pPlan->Marshal(&DispParams, aArguments, &Scope, NULL);
+					qwSum += *reinterpret_cast<const BYTE*>(aArguments[0].lpValue);
+				}
+				s_qwSink = qwSum;
+			});
+			Emit("buffer", "array", Json, &Result);
+		}
+
+		if (Selected(Options, "buffer", "copy")) {
+			BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+				ULONGLONG qwSum = 0;
+				for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+					std::memcpy(Native.data(), Data.data(), dwBytes);
+					__asm__ __volatile__("" : : "r"(Native.data()) : "memory");
+					qwSum += Native[cx % dwBytes];
+				}
+				s_qwSink = qwSum;
+			});
+			Emit("buffer", "copy", Json, &Result);
+		}
+	}
+}
+
+/**
+ * @brief Write and read a structure with a compiled layout. The layouts are checked against the compiler by the struct
+ *        suite of the tests.
+*/
+static VOID BenchStruct(
+	_In_ const BenchOptions& Options
+) {
+	const std::pair<LPCSTR, LPCWSTR> aCases[] = {
+		{ "startupinfo", L"cb:i; lpReserved:p; lpDesktop:p; lpTitle:p; dwX:i; dwY:i; dwXSize:i; dwYSize:i; dwXCountChars:i;"
+			L"dwYCountChars:i; dwFillAttribute:i; dwFlags:i; wShowWindow:h; cbReserved2:h; lpReserved2:p; hStdInput:p;"
+			L"hStdOutput:p; hStdError:p" },
+		{ "padded", L"c:c; d:d; h:h[3]; i:i; a:c[5]; l:l; b:c" }
+	};
+	for (DWORD dwCase = 0; dwCase < ARRAYSIZE(aCases); dwCase++) {
+		std::unique_ptr<StructLayout> pLayout{};
+		if (FAILED(StructLayout::Compile(aCases[dwCase].second, &pLayout))) {
+			Emit("struct", aCases[dwCase].first, "\"size\":0", nullptr);
+			continue;
+		}
+		std::string Json = "\"size\":" + std::to_string(pLayout->m_dwSize);
+
+		// Every element is a small integer, valid for every kind
+		std::vector<VARIANT> aValues(pLayout->m_dwElements);
+		for (DWORD cx = 0; cx < pLayout->m_dwElements; cx++) {
+			V_VT(&aValues[cx]) = VT_I4;
+			V_I4(&aValues[cx]) = static_cast<LONG>(cx + 1);
+		}
+		std::vector<BYTE> Buffer(pLayout->m_dwSize);
+
+		if (Selected(Options, "struct", (std::string(aCases[dwCase].first) + "/pack").c_str())) {
+			BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+				DWORD dwFailed = 0;
+				for (ULONGLONG cx = 0; cx < qwIterations; cx++)
+					pLayout->Pack(Buffer.data(), aValues.data(), &dwFailed);
+				s_qwSink = Buffer[0];
+			});
+			Emit("struct", (std::string(aCases[dwCase].first) + "/pack").c_str(), Json, &Result);
+		}
+
+		if (Selected(Options, "struct", (std::string(aCases[dwCase].first) + "/unpack").c_str())) {
+			std::vector<VARIANT> aFields(pLayout->m_dwElements);
+			BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+				for (ULONGLONG cx = 0; cx < qwIterations; cx++)
+					pLayout->Unpack(Buffer.data(), aFields.data());
+				s_qwSink = aFields[0].ullVal;
+			});
+			Emit("struct", (std::string(aCases[dwCase].first) + "/unpack").c_str(), Json, &Result);
+		}
+	}
+}
+
+/**
+ * @brief Integer arguments passed by value against the same arguments passed by reference, as VBScript does for
+ *        variables, read into call slots and written back to the variables after the call.
+*/
+static VOID BenchReference(
+	_In_ const BenchOptions& Options
+) {
+	LPVOID lpFunction = reinterpret_cast<LPVOID>(&BenchTarget);
+
+	for (DWORD dwArguments = 1; dwArguments <= BENCH_MAX_ARGUMENTS; dwArguments *= 2) {
+		std::vector<VARIANT> aVariables = Parameters(dwArguments, BenchMixInt);
+		std::vector<VARIANT> aReferences(dwArguments);
+		for (DWORD cx = 0; cx < dwArguments; cx++) {
+			V_VT(&aReferences[cx]) = VT_VARIANT | VT_BYREF;
+			V_VARIANTREF(&aReferences[cx]) = &aVariables[cx];
+		}
+
+		std::wstring Value(dwArguments, L'i');
+		std::wstring Reference{};
+		for (DWORD cx = 0; cx < dwArguments; cx++)
+			Reference += L"&i";
+
+		const std::pair<LPCSTR, std::wstring> aCases[] = { { "value", Value + L"=i" }, { "reference", Reference + L"=i" } };
+		for (auto& Case : aCases) {
+			if (!Selected(Options, "reference", Case.first))
+				continue;
+
+			std::unique_ptr<MarshalPlan> pPlan{};
+			MarshalPlan::Compile(Case.second.c_str(), &pPlan);
+			DISPPARAMS DispParams = { pPlan->m_dwReferences != 0 ? aReferences.data() : aVariables.data(), NULL, dwArguments, 0 };
+
+			DynamicMethod Method(lpFunction, pPlan.get(), nullptr);
+			BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+				VARIANT VarResult;
+				ULONGLONG qwSum = 0;
+				for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+					Method.Invoke(&DispParams, &VarResult, NULL);
+					qwSum += VarResult.ullVal;
+				}
+				s_qwSink = qwSum;
+			});
+			Emit("reference", Case.first, "\"arity\":" + std::to_string(dwArguments), &Result);
+		}
+	}
+}
+
+/**
+ * @brief Copy an element out of a batch, as done by SafeArrayGetElement. Strings are duplicated.
+*/
+static HRESULT CopyElement(
+	_Out_ VARIANT*       pDestination,
+	_In_  const VARIANT* pSource
+) {
+	*pDestination = *pSource;
+	if (V_VT(pSource) != VT_BSTR)
+		return S_OK;
+	V_BSTR(pDestination) = ::SysAllocStringLen(V_BSTR(pSource), ::SysStringLen(V_BSTR(pSource)));
+	return V_BSTR(pDestination) != NULL ? S_OK : E_OUTOFMEMORY;
+}
+
+/**
+ * @brief Execute a call of a batch as done by IDynamicWrapperEx::BatchCall: the call is read in place, every argument
+ *        is copied out of the call in reverse order into storage from the arena of the thread, and "@n" is replaced by
+ *        a reference to the result of the call n. The first element of a call is the dispatch ID of the method.
+*/
+static HRESULT BatchCall(
+	_In_    const std::vector<VARIANT>& aCall,
+	_In_    DWORD                       dwCall,
+	_In_    const DynamicMethod&        Method,
+	_Inout_ VARIANT*                    aResults
+) {
+	HRESULT hr = S_OK;
+	DWORD dwArguments = static_cast<DWORD>(aCall.size() - 1);
+	ArenaScope scope{};
+	VARIANT* aArguments = reinterpret_cast<VARIANT*>(scope.Allocate(sizeof(VARIANT) * dwArguments));
+	if (aArguments == NULL)
+		return E_OUTOFMEMORY;
+
+	DWORD dwFetched = 0;
+	for (; dwFetched < dwArguments && SUCCEEDED(hr); dwFetched++) {
+		VARIANT* pArgument = &aArguments[dwArguments - dwFetched - 1];
+		hr = CopyElement(pArgument, &aCall[dwFetched + 1]);
+		if (FAILED(hr) || V_VT(pArgument) != VT_BSTR || V_BSTR(pArgument)[0] != L'@')
+			continue;
+
+		BSTR bstrReference = V_BSTR(pArgument);
+		DWORD dwResult = 0;
+		LPCWSTR wsz = bstrReference + 1;
+		for (; *wsz >= L'0' && *wsz <= L'9' && dwResult < dwCall; wsz++)
+			dwResult = dwResult * 10 + (*wsz - L'0');
+		if (wsz == bstrReference + 1 || *wsz != L'\0' || dwResult >= dwCall) {
+			hr = E_INVALIDARG;
+			continue;
+		}
+
+		::SysFreeString(bstrReference);
+		V_VT(pArgument) = VT_VARIANT | VT_BYREF;
+		V_VARIANTREF(pArgument) = &aResults[dwResult];
+	}
+
+	DISPPARAMS DispParams = { aArguments, NULL, dwArguments, 0 };
+	if (SUCCEEDED(hr))
+		hr = Method.Invoke(&DispParams, &aResults[dwCall], NULL);
+
+	for (DWORD cx = 0; cx < dwFetched; cx++) {
+		VARIANT* pArgument = &aArguments[dwArguments - cx - 1];
+		if (V_VT(pArgument) != (VT_VARIANT | VT_BYREF))
+			::VariantClear(pArgument);
+	}
+	return hr;
+}
+
+/**
+ * @brief Object called by the client in the batch suite, dispatching as done by IDynamicWrapperEx::Invoke: DwBatch runs
+ *        every call of the batch, any other dispatch ID is the dynamic method.
+*/
+typedef struct _BenchDispatch {
+	const DynamicMethod*                     pMethod;  /* Dynamic method, dispatch ID BENCH_DISPID_METHOD */
+	const std::vector<std::vector<VARIANT>>* pBatch;   /* Calls of the batch, parameter of DwBatch */
+} BenchDispatch;
+
+#define BENCH_DISPID_BATCH  6  /* Dispatch ID of DwBatch */
+#define BENCH_DISPID_METHOD 17 /* Dispatch ID of the dynamic method, after the internal methods */
+
+/**
+ * @brief IDispatch::Invoke of the batch suite. Not inlined, as the client calls it through the vtable.
+*/
+__attribute__((noinline)) static HRESULT BenchDispatchInvoke(
+	_In_  const BenchDispatch& Object,
+	_In_  DISPID               lDispId,
+	_In_  DISPPARAMS*          pDispParams,
+	_Out_ VARIANT*             pVarResult
+) {
+	if (lDispId == BENCH_DISPID_METHOD)
+		return Object.pMethod->Invoke(pDispParams, pVarResult, NULL);
+	if (lDispId != BENCH_DISPID_BATCH)
+		return DISP_E_MEMBERNOTFOUND;
+
+	// Results are returned to the client as an array, which releases them
+	const std::vector<std::vector<VARIANT>>& Batch = *Object.pBatch;
+	std::vector<VARIANT> aResults(Batch.size());
+	HRESULT hr = S_OK;
+	for (DWORD dwCall = 0; dwCall < Batch.size() && SUCCEEDED(hr); dwCall++)
+		hr = BatchCall(Batch[dwCall], dwCall, *Object.pMethod, aResults.data());
+	*pVarResult = aResults.back();
+	return hr;
+}
+
+/**
+ * @brief Batches of calls, as run by DwBatch, against one late-bound Invoke per call. Calls take two integers, with
+ *        references every call but the first one takes the result of the previous call as first argument. Times are
+ *        per call.
+ * @details A late-bound client resolves the name of the method through GetIDsOfNames and copies its arguments into the
+ *          parameters of every Invoke, which is what a batch saves. A batch is resolved and invoked once, its calls
+ *          refer to the method by dispatch ID. The cost of building the batch on the client side is not measured. The
+ *          direct case invokes the method with the arguments already decoded, the floor of both.
+*/
+static VOID BenchBatch(
+	_In_ const BenchOptions& Options
+) {
+	LPVOID lpFunction = reinterpret_cast<LPVOID>(&BenchTarget);
+	const DWORD aSizes[] = { 1, 16, 1024 };
+
+	std::unique_ptr<MarshalPlan> pPlan{};
+	if (FAILED(MarshalPlan::Compile(Signature(2, BenchMixInt).c_str(), &pPlan)))
+		return;
+	DynamicMethod Method(lpFunction, pPlan.get(), nullptr);
+	std::vector<VARIANT> aParameters = Parameters(2, BenchMixInt);
+	DISPPARAMS DispParams = { aParameters.data(), NULL, 2, 0 };
+
+	// Names of the internal methods, followed by the dynamic method
+	NameIndex index{};
+	LPCWSTR aNames[] = { L"DwRegister", L"WriteByte", L"WriteBytes", L"ReadBytes", L"CopyBytes", L"FillBytes", L"DwBatch",
+		L"DwStats", L"DwInvokeAsync", L"DwWaitAny", L"DwMap", L"DwCollector", L"DwStruct", L"DwView", L"DwLoadCache",
+		L"DwSaveCache", L"DwTrace", L"BenchFunction" };
+	for (DWORD cx = 0; cx < ARRAYSIZE(aNames); cx++)
+		index.Insert(aNames[cx], static_cast<DISPID>(cx), NULL);
+
+	for (DWORD dwCalls : aSizes) {
+		std::string Json = "\"calls\":" + std::to_string(dwCalls);
+
+		if (Selected(Options, "batch", "direct")) {
+			BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+				VARIANT VarResult;
+				ULONGLONG qwSum = 0;
+				for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+					for (DWORD dwCall = 0; dwCall < dwCalls; dwCall++) {
+						Method.Invoke(&DispParams, &VarResult, NULL);
+						qwSum += VarResult.ullVal;
+					}
+				}
+				s_qwSink = qwSum;
+			});
+			Result.dbMedian /= dwCalls;
+			Result.dbMin /= dwCalls;
+			Emit("batch", "direct", Json, &Result);
+		}
+
+		BenchDispatch Object = { &Method, nullptr };
+		if (Selected(Options, "batch", "invoke")) {
+			BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+				VARIANT aArguments[2];
+				VARIANT VarResult;
+				ULONGLONG qwSum = 0;
+				for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+					for (DWORD dwCall = 0; dwCall < dwCalls; dwCall++) {
+						DISPID lDispId = DISPID_UNKNOWN;
+						index.Find(L"BenchFunction", &lDispId);
+						CopyElement(&aArguments[0], &aParameters[0]);
+						CopyElement(&aArguments[1], &aParameters[1]);
+						DISPPARAMS Params = { aArguments, NULL, 2, 0 };
+						BenchDispatchInvoke(Object, lDispId, &Params, &VarResult);
+						qwSum += VarResult.ullVal;
+						::VariantClear(&aArguments[0]);
+						::VariantClear(&aArguments[1]);
+					}
+				}
+				s_qwSink = qwSum;
+			});
+			Result.dbMedian /= dwCalls;
+			Result.dbMin /= dwCalls;
+			Emit("batch", "invoke", Json, &Result);
+		}
+
+		const std::pair<LPCSTR, BOOL> aCases[] = { { "value", FALSE }, { "reference", TRUE } };
+		for (auto& Case : aCases) {
+			if (!Selected(Options, "batch", Case.first))
+				continue;
+			if (Case.second && dwCalls == 1) {
+				Emit("batch", Case.first, Json, nullptr);
+				continue;
+			}
+
+			// Dispatch ID followed by the arguments, in the order given by the script
+			std::vector<std::vector<VARIANT>> aBatch(dwCalls, std::vector<VARIANT>(3));
+			for (DWORD dwCall = 0; dwCall < dwCalls; dwCall++) {
+				for (VARIANT& var : aBatch[dwCall]) {
+					V_VT(&var) = VT_I4;
+					V_I4(&var) = static_cast<LONG>(dwCall);
+				}
+				V_I4(&aBatch[dwCall][0]) = BENCH_DISPID_METHOD;
+				if (Case.second && dwCall != 0) {
+					std::wstring Reference = L"@" + std::to_wstring(dwCall - 1);
+					V_VT(&aBatch[dwCall][1]) = VT_BSTR;
+					V_BSTR(&aBatch[dwCall][1]) = ::SysAllocString(Reference.c_str());
+				}
+			}
+			Object.pBatch = &aBatch;
+
+			HRESULT hr = S_OK;
+			BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+				VARIANT VarResult;
+				ULONGLONG qwSum = 0;
+				for (ULONGLONG cx = 0; cx < qwIterations && SUCCEEDED(hr); cx++) {
+					DISPID lDispId = DISPID_UNKNOWN;
+					index.Find(L"DwBatch", &lDispId);
+					hr = BenchDispatchInvoke(Object, lDispId, NULL, &VarResult);
+					qwSum += VarResult.ullVal;
+				}
+				s_qwSink = qwSum;
+			});
+			Result.dbMedian /= dwCalls;
+			Result.dbMin /= dwCalls;
+			Emit("batch", Case.first, Json, SUCCEEDED(hr) ? &Result : nullptr);
+
+			for (std::vector<VARIANT>& aCallElements : aBatch) {
+				for (VARIANT& var : aCallElements)
+					::VariantClear(&var);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Calls from a host driver: late bound, resolving the name through GetIDsOfNames before every call as done without
+ *        type information, against bound, with the dispatch ID resolved once from the type information.
+*/
+static VOID BenchBinding(
+	_In_ const BenchOptions& Options
+) {
+	LPVOID lpFunction = reinterpret_cast<LPVOID>(&BenchTarget);
+	const DWORD dwNames = 1024;
+
+	NameIndex index{};
+	std::vector<std::wstring> aNames{};
+	for (DWORD cx = 0; cx < dwNames; cx++) {
+		aNames.push_back(L"BenchFunction" + std::to_wstring(cx) + L"Ex");
+		index.Insert(aNames.back().c_str(), static_cast<DISPID>(cx), NULL);
+	}
+	LPCWSTR wszName = aNames[dwNames / 2].c_str();
+
+	for (DWORD dwArguments = 0; dwArguments <= BENCH_MAX_ARGUMENTS; dwArguments += 4) {
+		std::unique_ptr<MarshalPlan> pPlan{};
+		if (FAILED(MarshalPlan::Compile(Signature(dwArguments, BenchMixInt).c_str(), &pPlan)))
+			continue;
+
+		std::vector<VARIANT> aParameters = Parameters(dwArguments, BenchMixInt);
+		DISPPARAMS DispParams = { aParameters.data(), NULL, dwArguments, 0 };
+		DynamicMethod Method(lpFunction, pPlan.get(), nullptr);
+		std::string Json = "\"arity\":" + std::to_string(dwArguments) + ",\"names\":" + std::to_string(dwNames);
+
+		const std::pair<LPCSTR, BOOL> aCases[] = { { "late", TRUE }, { "bound", FALSE } };
+		for (auto& Case : aCases) {
+			if (!Selected(Options, "binding", Case.first))
+				continue;
+
+			BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+				VARIANT VarResult;
+				ULONGLONG qwSum = 0;
+				DISPID lDispId = DISPID(-1);
+				index.Find(wszName, &lDispId);
+				for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+					if (Case.second)
+						index.Find(wszName, &lDispId);
+					Method.Invoke(&DispParams, &VarResult, NULL);
+					qwSum += VarResult.ullVal + static_cast<ULONGLONG>(lDispId);
+				}
+				s_qwSink = qwSum;
+			});
+			Emit("binding", Case.first, Json, &Result);
+		}
+	}
+}
+
+/**
+ * @brief Binding cache files: serialisation of the methods registered, and parsing of the file mapped at startup.
+*/
+static VOID BenchCache(
+	_In_ const BenchOptions& Options
+) {
+	const DWORD aSizes[] = { 16, 1024 };
+	LPCWSTR aModules[] = { L"kernel32.dll", L"user32.dll", L"ntdll.dll", L"advapi32.dll" };
+
+	for (DWORD dwSize : aSizes) {
+		BindingCache cache{};
+		for (DWORD cx = 0; cx < dwSize; cx++) {
+			BindingModule module{ aModules[cx % ARRAYSIZE(aModules)], 0x5F5E1000 + static_cast<DWORD>(cx % ARRAYSIZE(aModules)), 0x000F4240, 0x00100000 };
+			BindingEntry entry{ cache.AddModule(&module), L"BenchFunction" + std::to_wstring(cx) + L"Ex", cx % 2 == 0, L"ppi=i", 0x1000 + cx * 0x10 };
+			cache.m_aEntries.push_back(std::move(entry));
+		}
+
+		std::vector<BYTE> data{};
+		cache.Serialize(&data);
+		std::string Json = "\"methods\":" + std::to_string(dwSize) + ",\"bytes\":" + std::to_string(data.size());
+
+		if (Selected(Options, "cache", "serialize")) {
+			BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+				std::vector<BYTE> buffer{};
+				for (ULONGLONG cx = 0; cx < qwIterations; cx++)
+					cache.Serialize(&buffer);
+				s_qwSink = buffer.size();
+			});
+			Emit("cache", "serialize", Json, &Result);
+		}
+
+		if (Selected(Options, "cache", "parse")) {
+			BindingCache parsed{};
+			BenchResult Result = Measure(Options, [&](ULONGLONG qwIterations) {
+				for (ULONGLONG cx = 0; cx < qwIterations; cx++)
+					parsed.Parse(data.data(), data.size());
+				s_qwSink = parsed.m_aEntries.size();
+			});
+			Emit("cache", "parse", Json, &Result);
+		}
+	}
+}
+
+#ifdef BENCH_DYNAMICCALL
+/**
+ * @brief Count the cycles of a piece of code, with the number of iterations found by Measure.
+ * @return The median number of reference cycles per iteration.
+*/
+template<typename TBody>
+static DOUBLE MeasureCycles(
+	_In_ const BenchOptions& Options,
+	_In_ ULONGLONG           qwIterations,
+	_In_ TBody&&             Body
+) {
+	std::vector<DOUBLE> aSamples{};
+	for (DWORD cx = 0; cx < Options.dwSamples; cx++) {
+		ULONGLONG qwStart = __rdtsc();
+		Body(qwIterations);
+		aSamples.push_back(static_cast<DOUBLE>(__rdtsc() - qwStart) / static_cast<DOUBLE>(qwIterations));
+	}
+	std::sort(aSamples.begin(), aSamples.end());
+	return aSamples[aSamples.size() / 2];
+}
+
+/**
+ * @brief Generic call engine against its version 1.0, by arity, with doubles at odd positions. The number of
+ *        reference cycles per call is reported along with the time.
+*/
+static VOID BenchEngine(
+	_In_ const BenchOptions& Options
+) {
+	LPVOID lpFunction = reinterpret_cast<LPVOID>(&BenchTarget);
+	std::vector<Argument> aArguments(BENCH_MAX_ENGINE);
+	std::vector<LegacyArgument> aLegacy(BENCH_MAX_ENGINE);
+	for (DWORD cx = 0; cx < BENCH_MAX_ENGINE; cx++) {
+		aArguments[cx].dwFlag = (cx & 1) ? ARGUMENT_FLT : ARGUMENT_STD;
+		aArguments[cx].qwValue = cx;
+		aLegacy[cx] = { aArguments[cx].dwFlag, sizeof(DWORD64), aArguments[cx].qwValue };
+	}
+
+	for (DWORD dwArguments = 0; dwArguments <= BENCH_MAX_ENGINE; dwArguments = dwArguments < BENCH_MAX_ARGUMENTS ? dwArguments + 1 : dwArguments * 2) {
+		std::string Json = "\"arity\":" + std::to_string(dwArguments);
+
+		if (Selected(Options, "engine", "current")) {
+			ArgumentTable Table = { aArguments.data(), dwArguments };
+			auto Body = [&](ULONGLONG qwIterations) {
+				RESULT res{ 0 };
+				ULONGLONG qwSum = 0;
+				for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+					DynamicCall(&Table, lpFunction, &res, RETURN_STD);
+					qwSum += res.int64;
+				}
+				s_qwSink = qwSum;
+			};
+			BenchResult Result = Measure(Options, Body);
+			DOUBLE dbCycles = MeasureCycles(Options, Result.qwIterations, Body);
+			Emit("engine", "current", Json + ",\"cycles\":" + std::to_string(static_cast<ULONGLONG>(dbCycles + 0.5)), &Result);
+		}
+
+		if (Selected(Options, "engine", "legacy")) {
+			if (dwArguments == 0 || dwArguments > BENCH_MAX_LEGACY) {
+				Emit("engine", "legacy", Json, nullptr);
+				continue;
+			}
+
+			LegacyArgumentTable Table = { dwArguments, aLegacy.data() };
+			auto Body = [&](ULONGLONG qwIterations) {
+				RESULT res{ 0 };
+				ULONGLONG qwSum = 0;
+				for (ULONGLONG cx = 0; cx < qwIterations; cx++) {
+					DynamicCallLegacy(&Table, lpFunction, &res, RETURN_STD);
+					qwSum += res.int64;
+				}
+				s_qwSink = qwSum;
+			};
+			BenchResult Result = Measure(Options, Body);
+			DOUBLE dbCycles = MeasureCycles(Options, Result.qwIterations, Body);
+			Emit("engine", "legacy", Json + ",\"cycles\":" + std::to_string(static_cast<ULONGLONG>(dbCycles + 0.5)), &Result);
+		}
+	}
+}
+#endif
+
+/**
+ * @brief Print the usage of the program.
+*/
+static VOID Usage(
+	_In_ LPCSTR szProgram
+) {
+	std::fprintf(stderr,
+		"Usage: %s [--quick] [--samples N] [--filter SUITE/CASE]\n"
+		"  --quick     Shorter samples, for smoke testing\n"
+		"  --samples   Number of samples per measurement, the median is reported (default %u)\n"
+		"  --filter    Only run measurements whose \"suite/case\" contains the string, e.g. call/thunk\n",
+		szProgram, BENCH_SAMPLES);
+}
+
+int main(int argc, char** argv) {
+	BenchOptions Options = { "", BENCH_MIN_TIME, BENCH_SAMPLES };
+	for (int cx = 1; cx < argc; cx++) {
+		std::string Argument = argv[cx];
+		if (Argument == "--quick") {
+			Options.qwMinTime = BENCH_QUICK_TIME;
+		}
+		else if (Argument == "--samples" && cx + 1 < argc) {
+			Options.dwSamples = static_cast<DWORD>(std::max(1, std::atoi(argv[++cx])));
+		}
+		else if (Argument == "--filter" && cx + 1 < argc) {
+			Options.Filter = argv[++cx];
+		}
+		else {
+			Usage(argv[0]);
+			return Argument == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+#ifdef DWEX_ENABLE_STATS
+	LPCSTR szStats = "true";
+#else
+	LPCSTR szStats = "false";
+#endif
+#ifdef BENCH_DYNAMICCALL
+	LPCSTR szDynamicCall = "true";
+#else
+	LPCSTR szDynamicCall = "false";
+#endif
+	std::printf("{\"suite\":\"meta\",\"compiler\":\"%s\",\"stats\":%s,\"dynamiccall\":%s,\"samples\":%u,\"min_time_ns\":%lld}\n",
+		__VERSION__, szStats, szDynamicCall, Options.dwSamples, static_cast<long long>(Options.qwMinTime));
+
+	BenchLookup(Options);
+	BenchMarshal(Options);
+	BenchCall(Options);
+	BenchInvoke(Options);
+	BenchMethods(Options);
+	BenchInstances(Options);
+	BenchString(Options);
+	BenchBuffer(Options);
+	BenchStruct(Options);
+	BenchReference(Options);
+	BenchBatch(Options);
+	BenchBinding(Options);
+	BenchCache(Options);
+#ifdef BENCH_DYNAMICCALL
+	BenchEngine(Options);
+#endif
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,47 @@
+/**
+* @file         intrin.h
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        MSVC intrinsics used by the benchmarked translation units, for GCC and Clang.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <x86intrin.h>
+
+#include "windows.h"
+
+#ifndef __BENCH_INTRIN_H
+#define __BENCH_INTRIN_H
+
+/**
+ * @brief Index of the most significant bit set.
+ * @return Whether a bit is set.
+*/
+static inline BYTE _BitScanReverse(
+	_Out_ PDWORD pdwIndex,
+	_In_  DWORD  dwMask
+) {
+	if (dwMask == 0)
+		return 0;
+	*pdwIndex = 31 - static_cast<DWORD>(__builtin_clz(dwMask));
+	return 1;
+}
+
+/**
+ * @brief Index of the most significant bit set.
+ * @return Whether a bit is set.
+*/
+static inline BYTE _BitScanReverse64(
+	_Out_ PDWORD    pdwIndex,
+	_In_  ULONGLONG qwMask
+) {
+	if (qwMask == 0)
+		return 0;
+	*pdwIndex = 63 - static_cast<DWORD>(__builtin_clzll(qwMask));
+	return 1;
+}
+
+#endif // !__BENCH_INTRIN_H
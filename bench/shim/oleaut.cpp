@@ -0,0 +1,290 @@
+/**
+* @file         oleaut.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Minimal OLE Automation definition for the Linux benchmark build.
+* @details      BSTRs have the same layout as on Windows: a 32-bit byte length followed by the characters and a NUL
+*               terminator. VariantChangeType only converts between the numeric types and VT_BOOL, which is what the
+*               marshalling plans coerce to. The code page conversions only know UTF-8 and Latin-1.
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <cstdlib>
+
+/**
+ * @brief Allocate a BSTR from a NUL-terminated string.
+*/
+BSTR SysAllocString(
+	_In_ const OLECHAR* psz
+) {
+	if (psz == nullptr)
+		return nullptr;
+	return ::SysAllocStringLen(psz, static_cast<UINT>(::wcslen(psz)));
+}
+
+/**
+ * @brief Allocate a BSTR of a given number of characters.
+*/
+BSTR SysAllocStringLen(
+	_In_ const OLECHAR* pch,
+	_In_ UINT           cch
+) {
+	PBYTE lpBlock = reinterpret_cast<PBYTE>(::malloc(sizeof(DWORD) + (static_cast<SIZE_T>(cch) + 1) * sizeof(OLECHAR)));
+	if (lpBlock == nullptr)
+		return nullptr;
+
+	*reinterpret_cast<PDWORD>(lpBlock) = cch * sizeof(OLECHAR);
+	BSTR bstr = reinterpret_cast<BSTR>(lpBlock + sizeof(DWORD));
+	if (pch != nullptr)
+		::memcpy(bstr, pch, cch * sizeof(OLECHAR));
+	bstr[cch] = L'\0';
+	return bstr;
+}
+
+/**
+ * @brief Free a BSTR.
+*/
+VOID SysFreeString(
+	_In_ BSTR bstr
+) {
+	if (bstr != nullptr)
+		::free(reinterpret_cast<PBYTE>(bstr) - sizeof(DWORD));
+}
+
+/**
+ * @brief Number of characters of a BSTR.
+*/
+UINT SysStringLen(
+	_In_ BSTR bstr
+) {
+	if (bstr == nullptr)
+		return 0;
+	return *reinterpret_cast<PDWORD>(reinterpret_cast<PBYTE>(bstr) - sizeof(DWORD)) / sizeof(OLECHAR);
+}
+
+/**
+ * @brief Increment the lock count of an array.
+*/
+HRESULT SafeArrayLock(
+	_Inout_ SAFEARRAY* psa
+) {
+	psa->cLocks++;
+	return S_OK;
+}
+
+/**
+ * @brief Decrement the lock count of an array.
+*/
+HRESULT SafeArrayUnlock(
+	_Inout_ SAFEARRAY* psa
+) {
+	if (psa->cLocks == 0)
+		return E_UNEXPECTED;
+	psa->cLocks--;
+	return S_OK;
+}
+
+/**
+ * @brief Initialise a VARIANT.
+*/
+VOID VariantInit(
+	_Out_ VARIANTARG* pvarg
+) {
+	pvarg->vt = VT_EMPTY;
+	pvarg->wReserved1 = pvarg->wReserved2 = pvarg->wReserved3 = 0;
+	pvarg->ullVal = 0;
+}
+
+/**
+ * @brief Release the content of a VARIANT.
+*/
+HRESULT VariantClear(
+	_Inout_ VARIANTARG* pvarg
+) {
+	if (pvarg->vt == VT_BSTR)
+		::SysFreeString(pvarg->bstrVal);
+	::VariantInit(pvarg);
+	return S_OK;
+}
+
+/**
+ * @brief Copy a VARIANT, following references to fixed-width values and to VARIANTs.
+*/
+HRESULT VariantCopyInd(
+	_Out_ VARIANT*          pvarDest,
+	_In_  const VARIANTARG* pvargSrc
+) {
+	if (pvargSrc->vt == (VT_VARIANT | VT_BYREF))
+		pvargSrc = pvargSrc->pvarVal;
+	if ((pvargSrc->vt & VT_BYREF) == 0) {
+		if (pvargSrc->vt == VT_BSTR || (pvargSrc->vt & VT_ARRAY) != 0)
+			return DISP_E_BADVARTYPE;
+		*pvarDest = *pvargSrc;
+		return S_OK;
+	}
+
+	// References to plain data, the value is at the start of the union
+	VARIANT var;
+	::VariantInit(&var);
+	var.vt = static_cast<VARTYPE>(pvargSrc->vt & ~VT_BYREF);
+	switch (var.vt) {
+	case VT_I1:
+	case VT_UI1:  ::memcpy(&var.llVal, pvargSrc->byref, 1); break;
+	case VT_I2:
+	case VT_UI2:
+	case VT_BOOL: ::memcpy(&var.llVal, pvargSrc->byref, 2); break;
+	case VT_I4:
+	case VT_UI4:
+	case VT_INT:
+	case VT_UINT:
+	case VT_R4:   ::memcpy(&var.llVal, pvargSrc->byref, 4); break;
+	case VT_I8:
+	case VT_UI8:
+	case VT_R8:   ::memcpy(&var.llVal, pvargSrc->byref, 8); break;
+	default:      return DISP_E_BADVARTYPE;
+	}
+	*pvarDest = var;
+	return S_OK;
+}
+
+/**
+ * @brief Convert a VARIANT between numeric types.
+*/
+HRESULT VariantChangeType(
+	_Out_ VARIANTARG*       pvargDest,
+	_In_  const VARIANTARG* pvarSrc,
+	_In_  USHORT            wFlags,
+	_In_  VARTYPE           vt
+) {
+	(void)wFlags;
+
+	// Read the source as the widest type of its family
+	BOOL bFloat = FALSE;
+	LONGLONG llValue = 0;
+	DOUBLE dbValue = 0;
+	switch (pvarSrc->vt) {
+	case VT_EMPTY: break;
+	case VT_I1:    llValue = pvarSrc->cVal; break;
+	case VT_UI1:   llValue = pvarSrc->bVal; break;
+	case VT_I2:    llValue = pvarSrc->iVal; break;
+	case VT_UI2:   llValue = pvarSrc->uiVal; break;
+	case VT_I4:
+	case VT_INT:   llValue = pvarSrc->lVal; break;
+	case VT_UI4:
+	case VT_UINT:  llValue = pvarSrc->ulVal; break;
+	case VT_I8:    llValue = pvarSrc->llVal; break;
+	case VT_UI8:   llValue = static_cast<LONGLONG>(pvarSrc->ullVal); break;
+	case VT_BOOL:  llValue = pvarSrc->boolVal; break;
+	case VT_R4:    bFloat = TRUE; dbValue = pvarSrc->fltVal; break;
+	case VT_R8:    bFloat = TRUE; dbValue = pvarSrc->dblVal; break;
+	default:       return DISP_E_TYPEMISMATCH;
+	}
+	if (bFloat)
+		llValue = static_cast<LONGLONG>(dbValue < 0 ? dbValue - 0.5 : dbValue + 0.5);
+	else
+		dbValue = static_cast<DOUBLE>(llValue);
+
+	VARIANT var;
+	::VariantInit(&var);
+	var.vt = vt;
+	switch (vt) {
+	case VT_I2:   var.iVal = static_cast<SHORT>(llValue); break;
+	case VT_I4:   var.lVal = static_cast<LONG>(llValue); break;
+	case VT_UI4:  var.ulVal = static_cast<ULONG>(llValue); break;
+	case VT_I8:   var.llVal = llValue; break;
+	case VT_UI8:  var.ullVal = static_cast<ULONGLONG>(llValue); break;
+	case VT_R4:   var.fltVal = static_cast<FLOAT>(dbValue); break;
+	case VT_R8:   var.dblVal = dbValue; break;
+	case VT_BOOL: var.boolVal = (bFloat ? dbValue != 0 : llValue != 0) ? VARIANT_TRUE : VARIANT_FALSE; break;
+	default:      return DISP_E_BADVARTYPE;
+	}
+
+	*pvargDest = var;
+	return S_OK;
+}
+
+/**
+ * @brief Convert UTF-32 characters into UTF-8 or Latin-1 bytes. Only the size is returned if lpMultiByteStr is NULL.
+*/
+int WideCharToMultiByte(
+	_In_      UINT    CodePage,
+	_In_      DWORD   dwFlags,
+	_In_      LPCWSTR lpWideCharStr,
+	_In_      int     cchWideChar,
+	_Out_opt_ LPSTR   lpMultiByteStr,
+	_In_      int     cbMultiByte,
+	_In_opt_  LPCSTR  lpDefaultChar,
+	_Out_opt_ BOOL*   lpUsedDefaultChar
+) {
+	(void)dwFlags, (void)lpDefaultChar, (void)lpUsedDefaultChar;
+
+	int cb = 0;
+	for (int cx = 0; cx < cchWideChar; cx++) {
+		DWORD dwChar = static_cast<DWORD>(lpWideCharStr[cx]);
+		BYTE aBytes[4] = { static_cast<BYTE>(dwChar) };
+		int cbChar = 1;
+		if (CodePage != CP_UTF8) {
+			aBytes[0] = dwChar < 0x100 ? static_cast<BYTE>(dwChar) : '?';
+		}
+		else if (dwChar >= 0x10000) {
+			aBytes[0] = static_cast<BYTE>(0xF0 | (dwChar >> 18));
+			aBytes[1] = static_cast<BYTE>(0x80 | ((dwChar >> 12) & 0x3F));
+			aBytes[2] = static_cast<BYTE>(0x80 | ((dwChar >> 6) & 0x3F));
+			aBytes[3] = static_cast<BYTE>(0x80 | (dwChar & 0x3F));
+			cbChar = 4;
+		}
+		else if (dwChar >= 0x800) {
+			aBytes[0] = static_cast<BYTE>(0xE0 | (dwChar >> 12));
+			aBytes[1] = static_cast<BYTE>(0x80 | ((dwChar >> 6) & 0x3F));
+			aBytes[2] = static_cast<BYTE>(0x80 | (dwChar & 0x3F));
+			cbChar = 3;
+		}
+		else if (dwChar >= 0x80) {
+			aBytes[0] = static_cast<BYTE>(0xC0 | (dwChar >> 6));
+			aBytes[1] = static_cast<BYTE>(0x80 | (dwChar & 0x3F));
+			cbChar = 2;
+		}
+
+		if (lpMultiByteStr != nullptr) {
+			if (cb + cbChar > cbMultiByte)
+				return 0;
+			::memcpy(lpMultiByteStr + cb, aBytes, cbChar);
+		}
+		cb += cbChar;
+	}
+	return cb;
+}
+
+/**
+ * @brief Convert UTF-8 or Latin-1 bytes into UTF-32 characters. Only the size is returned if lpWideCharStr is NULL.
+*/
+int MultiByteToWideChar(
+	_In_      UINT   CodePage,
+	_In_      DWORD  dwFlags,
+	_In_      LPCSTR lpMultiByteStr,
+	_In_      int    cbMultiByte,
+	_Out_opt_ LPWSTR lpWideCharStr,
+	_In_      int    cchWideChar
+) {
+	(void)dwFlags;
+
+	int cch = 0;
+	for (int cx = 0; cx < cbMultiByte; cch++) {
+		DWORD dwChar = static_cast<BYTE>(lpMultiByteStr[cx++]);
+		if (CodePage == CP_UTF8 && dwChar >= 0x80) {
+			int cbTrail = dwChar >= 0xF0 ? 3 : dwChar >= 0xE0 ? 2 : 1;
+			dwChar &= 0x3F >> cbTrail;
+			for (; cbTrail > 0 && cx < cbMultiByte; cbTrail--)
+				dwChar = (dwChar << 6) | (static_cast<BYTE>(lpMultiByteStr[cx++]) & 0x3F);
+		}
+
+		if (lpWideCharStr != nullptr) {
+			if (cch >= cchWideChar)
+				return 0;
+			lpWideCharStr[cch] = static_cast<WCHAR>(dwChar);
+		}
+	}
+	return cch;
+}
@@ -0,0 +1,232 @@
+/**
+* @file         windows.h
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Minimal Windows and OLE Automation declarations for the Linux benchmark build.
+* @details      Only what the benchmarked translation units use is declared. Sizes and layouts match the x64 Windows ABI
+*               (LLP64), except WCHAR which is the native wchar_t so that wide string literals can be used unchanged.
+*               The OLE Automation functions are implemented in oleaut.cpp.
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+
+#ifndef __BENCH_WINDOWS_H
+#define __BENCH_WINDOWS_H
+
+// SAL annotations
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+
+// Calling conventions, the benchmarked code is called from C++ only
+#define STDMETHODCALLTYPE
+#define WINAPI
+
+#define VOID  void
+#define CONST const
+#define TRUE  1
+#define FALSE 0
+
+#define ARRAYSIZE(A) (sizeof(A) / sizeof((A)[0]))
+
+// Integer types, LLP64
+typedef int                BOOL;
+typedef unsigned char      BYTE, *PBYTE, *LPBYTE;
+typedef unsigned short     WORD, USHORT;
+typedef short              SHORT;
+typedef unsigned int       DWORD, *PDWORD, *LPDWORD, UINT, ULONG;
+typedef int                INT, LONG;
+typedef int64_t            LONGLONG;
+typedef uint64_t           ULONGLONG, DWORD64;
+typedef uintptr_t          SIZE_T, ULONG_PTR;
+typedef intptr_t           LONG_PTR;
+typedef char               CHAR;
+typedef float              FLOAT;
+typedef double             DOUBLE;
+typedef void*              PVOID, *LPVOID;
+typedef const void*        LPCVOID;
+typedef const CHAR*        LPCSTR;
+typedef CHAR*              LPSTR;
+typedef wchar_t            WCHAR, OLECHAR;
+typedef WCHAR*             LPWSTR, *LPOLESTR, *BSTR;
+typedef const WCHAR*       LPCWSTR, *LPCOLESTR;
+
+// COM types
+typedef LONG               HRESULT, SCODE;
+typedef LONG               DISPID;
+typedef DWORD              LCID;
+typedef unsigned short     VARTYPE;
+typedef short              VARIANT_BOOL;
+typedef double             DATE;
+
+#define S_OK                  ((HRESULT)0x00000000L)
+#define S_FALSE               ((HRESULT)0x00000001L)
+#define E_NOTIMPL             ((HRESULT)0x80004001L)
+#define E_POINTER             ((HRESULT)0x80004003L)
+#define E_UNEXPECTED          ((HRESULT)0x8000FFFFL)
+#define E_FAIL                ((HRESULT)0x80004005L)
+#define E_OUTOFMEMORY         ((HRESULT)0x8007000EL)
+#define E_INVALIDARG          ((HRESULT)0x80070057L)
+#define DISP_E_MEMBERNOTFOUND ((HRESULT)0x80020003L)
+#define DISP_E_TYPEMISMATCH   ((HRESULT)0x80020005L)
+#define DISP_E_UNKNOWNNAME    ((HRESULT)0x80020006L)
+#define DISP_E_BADVARTYPE     ((HRESULT)0x80020008L)
+#define DISP_E_OVERFLOW       ((HRESULT)0x8002000AL)
+#define DISP_E_BADPARAMCOUNT  ((HRESULT)0x8002000EL)
+
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr)    (((HRESULT)(hr)) < 0)
+
+#define DISPID_UNKNOWN (-1)
+
+#define VARIANT_TRUE  ((VARIANT_BOOL)-1)
+#define VARIANT_FALSE ((VARIANT_BOOL)0)
+
+enum VARENUM {
+	VT_EMPTY   = 0,
+	VT_NULL    = 1,
+	VT_I2      = 2,
+	VT_I4      = 3,
+	VT_R4      = 4,
+	VT_R8      = 5,
+	VT_CY      = 6,
+	VT_DATE    = 7,
+	VT_BSTR    = 8,
+	VT_DISPATCH = 9,
+	VT_ERROR   = 10,
+	VT_BOOL    = 11,
+	VT_VARIANT = 12,
+	VT_UNKNOWN = 13,
+	VT_DECIMAL = 14,
+	VT_I1      = 16,
+	VT_UI1     = 17,
+	VT_UI2     = 18,
+	VT_UI4     = 19,
+	VT_I8      = 20,
+	VT_UI8     = 21,
+	VT_INT     = 22,
+	VT_UINT    = 23,
+	VT_VOID    = 24,
+	VT_PTR     = 26,
+	VT_TYPEMASK = 0xFFF,
+	VT_ARRAY   = 0x2000,
+	VT_BYREF   = 0x4000
+};
+
+struct IUnknown;
+struct IDispatch;
+struct IRecordInfo;
+
+typedef struct tagSAFEARRAYBOUND {
+	ULONG cElements;
+	LONG  lLbound;
+} SAFEARRAYBOUND;
+
+typedef struct tagSAFEARRAY {
+	USHORT         cDims;
+	USHORT         fFeatures;
+	ULONG          cbElements;
+	ULONG          cLocks;
+	PVOID          pvData;
+	SAFEARRAYBOUND rgsabound[1];
+} SAFEARRAY;
+
+typedef struct tagDEC {
+	USHORT    wReserved;
+	BYTE      scale;
+	BYTE      sign;
+	ULONG     Hi32;
+	ULONGLONG Lo64;
+} DECIMAL;
+
+typedef struct tagVARIANT VARIANT, VARIANTARG, *LPVARIANT;
+struct tagVARIANT {
+	union {
+		struct {
+			VARTYPE vt;
+			WORD    wReserved1;
+			WORD    wReserved2;
+			WORD    wReserved3;
+			union {
+				LONGLONG      llVal;
+				LONG          lVal;
+				BYTE          bVal;
+				SHORT         iVal;
+				FLOAT         fltVal;
+				DOUBLE        dblVal;
+				VARIANT_BOOL  boolVal;
+				SCODE         scode;
+				DATE          date;
+				BSTR          bstrVal;
+				IUnknown*     punkVal;
+				IDispatch*    pdispVal;
+				SAFEARRAY*    parray;
+				SAFEARRAY**   pparray;
+				BSTR*         pbstrVal;
+				VARIANT*      pvarVal;
+				PVOID         byref;
+				CHAR          cVal;
+				USHORT        uiVal;
+				ULONG         ulVal;
+				ULONGLONG     ullVal;
+				INT           intVal;
+				UINT          uintVal;
+				struct {
+					PVOID        pvRecord;
+					IRecordInfo* pRecInfo;
+				};
+			};
+		};
+		DECIMAL decVal;
+	};
+};
+
+#define V_VT(X)         ((X)->vt)
+#define V_I2(X)         ((X)->iVal)
+#define V_I4(X)         ((X)->lVal)
+#define V_UI4(X)        ((X)->ulVal)
+#define V_I8(X)         ((X)->llVal)
+#define V_UI8(X)        ((X)->ullVal)
+#define V_R4(X)         ((X)->fltVal)
+#define V_R8(X)         ((X)->dblVal)
+#define V_BOOL(X)       ((X)->boolVal)
+#define V_BSTR(X)       ((X)->bstrVal)
+#define V_ARRAY(X)      ((X)->parray)
+#define V_VARIANTREF(X) ((X)->pvarVal)
+#define V_BYREF(X)      ((X)->byref)
+
+typedef struct tagDISPPARAMS {
+	VARIANTARG* rgvarg;
+	DISPID*     rgdispidNamedArgs;
+	UINT        cArgs;
+	UINT        cNamedArgs;
+} DISPPARAMS;
+
+// OLE Automation, see oleaut.cpp
+BSTR    SysAllocString(const OLECHAR* psz);
+BSTR    SysAllocStringLen(const OLECHAR* pch, UINT cch);
+VOID    SysFreeString(BSTR bstr);
+UINT    SysStringLen(BSTR bstr);
+HRESULT SafeArrayLock(SAFEARRAY* psa);
+HRESULT SafeArrayUnlock(SAFEARRAY* psa);
+VOID    VariantInit(VARIANTARG* pvarg);
+HRESULT VariantClear(VARIANTARG* pvarg);
+HRESULT VariantCopyInd(VARIANT* pvarDest, const VARIANTARG* pvargSrc);
+HRESULT VariantChangeType(VARIANTARG* pvargDest, const VARIANTARG* pvarSrc, USHORT wFlags, VARTYPE vt);
+
+// Code pages, see oleaut.cpp. The active code page is Latin-1
+#define CP_ACP  0
+#define CP_UTF8 65001
+int WideCharToMultiByte(UINT CodePage, DWORD dwFlags, LPCWSTR lpWideCharStr, int cchWideChar, LPSTR lpMultiByteStr, int cbMultiByte, LPCSTR lpDefaultChar, BOOL* lpUsedDefaultChar);
+int MultiByteToWideChar(UINT CodePage, DWORD dwFlags, LPCSTR lpMultiByteStr, int cbMultiByte, LPWSTR lpWideCharStr, int cchWideChar);
+
+#endif // !__BENCH_WINDOWS_H
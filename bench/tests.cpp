@@ -0,0 +1,837 @@
+/**
+* @file         tests.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Tests of the code generation, marshalling and call pipeline.
+* @details      Builds on Linux with GCC or Clang against the shim in bench/shim, as the benchmarks, target functions use the
+*               Microsoft x64 calling convention. Every failed check is reported to stderr, and the program exits with a
+*               non-zero status if any check failed. Run with --help for the options.
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <memory>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "types.hpp"
+#include "CodeEmitter.hpp"
+#include "CallThunk.hpp"
+#include "DynamicMethod.hpp"
+#include "MethodTable.hpp"
+#include "NameIndex.hpp"
+#include "StructLayout.hpp"
+#include "ThreadArena.hpp"
+
+#define TEST_RETURN_KINDS 3                  /* Integer, double and float return values */
+#define TEST_POISON       0xDEADBEEFDEADBEEF /* Value of the arguments a target has not received */
+#define TEST_WARMUP_CALLS 1000               /* Calls made before allocations are counted */
+#define TEST_STEADY_CALLS 1000000            /* Calls made while allocations are counted */
+#define TEST_STRESS_METHODS 20000            /* Methods registered while they are looked up and called */
+#define TEST_STRESS_READERS 4                /* Threads looking up and calling the methods being registered */
+
+// Sanitizers replace the allocator themselves, allocations are then only counted by the arenas
+#if defined(__SANITIZE_THREAD__) || defined(__SANITIZE_ADDRESS__)
+#define TEST_SANITIZER
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer) || __has_feature(address_sanitizer)
+#define TEST_SANITIZER
+#endif
+#endif
+
+/**
+ * @brief Kind of an argument or return value of a target.
+*/
+typedef enum _TestKind {
+	TestKindInteger, /* 64-bit integer */
+	TestKindDouble,  /* Double precision */
+	TestKindFloat    /* Single precision */
+} TestKind;
+
+/**
+ * @brief Test suite.
+*/
+typedef struct _TestSuite {
+	LPCSTR szName;        /* Name of the suite, as given to --filter */
+	VOID(*lpRun)(VOID);   /* Run the checks of the suite */
+} TestSuite;
+
+/**
+ * @brief Number of checks that failed.
+*/
+static DWORD s_dwFailures = 0;
+
+/**
+ * @brief Arguments received by the last target called, as raw 64-bit values.
+*/
+static DWORD64 s_aReceived[THUNK_MAX_ARGUMENTS]{};
+
+/**
+ * @brief Number of arguments received by the last target called.
+*/
+static DWORD s_dwReceived = 0;
+
+/**
+ * @brief Whether heap allocations are counted.
+*/
+static std::atomic<BOOL> s_bCountAllocations{ FALSE };
+
+/**
+ * @brief Number of heap allocations made while they were counted.
+*/
+static std::atomic<ULONGLONG> s_qwAllocations{ 0 };
+
+/**
+ * @brief Count a heap allocation.
+*/
+static inline VOID CountAllocation(VOID) {
+	if (s_bCountAllocations.load(std::memory_order_relaxed))
+		s_qwAllocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+#ifndef TEST_SANITIZER
+#define TEST_COUNT_ALLOCATIONS
+
+/**
+ * @brief Replacements of the allocation functions of the C++ runtime, counting every allocation.
+*/
+void* operator new(std::size_t dwSize) {
+	CountAllocation();
+	void* lpMemory = std::malloc(dwSize != 0 ? dwSize : 1);
+	if (lpMemory == nullptr)
+		throw std::bad_alloc();
+	return lpMemory;
+}
+
+void* operator new[](std::size_t dwSize) {
+	return ::operator new(dwSize);
+}
+
+void* operator new(std::size_t dwSize, const std::nothrow_t&) noexcept {
+	CountAllocation();
+	return std::malloc(dwSize != 0 ? dwSize : 1);
+}
+
+void* operator new[](std::size_t dwSize, const std::nothrow_t& tag) noexcept {
+	return ::operator new(dwSize, tag);
+}
+
+void operator delete(void* lpMemory) noexcept { std::free(lpMemory); }
+void operator delete[](void* lpMemory) noexcept { std::free(lpMemory); }
+void operator delete(void* lpMemory, std::size_t) noexcept { std::free(lpMemory); }
+void operator delete[](void* lpMemory, std::size_t) noexcept { std::free(lpMemory); }
+
+#ifdef __GLIBC__
+extern "C" void* __libc_malloc(std::size_t dwSize);
+extern "C" void* __libc_calloc(std::size_t dwCount, std::size_t dwSize);
+extern "C" void* __libc_realloc(void* lpMemory, std::size_t dwSize);
+
+/**
+ * @brief Replacements of the allocation functions of the C runtime, counting every allocation.
+*/
+extern "C" void* malloc(std::size_t dwSize) {
+	CountAllocation();
+	return __libc_malloc(dwSize);
+}
+
+extern "C" void* calloc(std::size_t dwCount, std::size_t dwSize) {
+	CountAllocation();
+	return __libc_calloc(dwCount, dwSize);
+}
+
+extern "C" void* realloc(void* lpMemory, std::size_t dwSize) {
+	CountAllocation();
+	return __libc_realloc(lpMemory, dwSize);
+}
+#endif
+#endif
+
+#ifndef BENCH_DYNAMICCALL
+/**
+ * @brief Stand-in for the NASM routine when it is not built. Only thunks are tested then.
+*/
+extern "C" BOOL THUNKCALLTYPE DynamicCall(
+	_In_  PArgumentTable lpTable,
+	_In_  LPVOID         lpFunction,
+	_Out_ PRESULT        lpResut,
+	_In_  DWORD          dwReturnFlag
+) {
+	(VOID)lpTable, (VOID)lpFunction, (VOID)dwReturnFlag;
+	lpResut->int64 = 0;
+	return FALSE;
+}
+#endif
+
+/**
+ * @brief Report a check.
+ * @param bCondition Whether the check passed.
+ * @param szCondition The condition checked.
+ * @param szContext The context of the check, e.g. the signature under test.
+ * @param iLine The line of the check.
+ * @return Whether the check passed.
+*/
+static BOOL Check(
+	_In_ BOOL               bCondition,
+	_In_ LPCSTR             szCondition,
+	_In_ const std::string& szContext,
+	_In_ int                iLine
+) {
+	if (!bCondition) {
+		std::fprintf(stderr, "tests.cpp:%d: %s failed (%s)\n", iLine, szCondition, szContext.c_str());
+		s_dwFailures++;
+	}
+	return bCondition;
+}
+
+#define CHECK(condition, context) Check((condition) ? TRUE : FALSE, #condition, (context), __LINE__)
+
+/**
+ * @brief Kind of the argument N of a target: the register arguments whose bit is set in the floating point mask are
+ *        alternately double and float, the stack arguments cycle through every kind.
+*/
+static constexpr DWORD TargetKind(
+	_In_ DWORD dwFloatMask,
+	_In_ DWORD dwIndex
+) {
+	return dwIndex < THUNK_REGISTERS
+		? (((dwFloatMask >> dwIndex) & 1) ? (dwIndex % 2 ? TestKindFloat : TestKindDouble) : TestKindInteger)
+		: dwIndex % 3;
+}
+
+/**
+ * @brief Native type of a kind.
+*/
+template<DWORD dwKind> struct KindType { typedef DWORD64 Type; };
+template<> struct KindType<TestKindDouble> { typedef DOUBLE Type; };
+template<> struct KindType<TestKindFloat> { typedef FLOAT Type; };
+
+/**
+ * @brief Raw 64-bit value passed as the argument N, distinct for every argument and using every bit of the type.
+*/
+static DWORD64 ArgumentValue(
+	_In_ DWORD dwKind,
+	_In_ DWORD dwIndex
+) {
+	DWORD64 qwValue = 0;
+	if (dwKind == TestKindDouble) {
+		DOUBLE dbValue = 1.5 + dwIndex;
+		std::memcpy(&qwValue, &dbValue, sizeof(dbValue));
+	}
+	else if (dwKind == TestKindFloat) {
+		FLOAT flValue = 0.25f + dwIndex;
+		std::memcpy(&qwValue, &flValue, sizeof(flValue));
+	}
+	else {
+		qwValue = 0x8000000000000000 | (static_cast<DWORD64>(dwIndex + 1) << 32) | (0xA5 + dwIndex);
+	}
+	return qwValue;
+}
+
+/**
+ * @brief Value returned by the targets of a given arity.
+*/
+template<DWORD dwKind>
+static typename KindType<dwKind>::Type ReturnValue(
+	_In_ DWORD dwArguments
+) {
+	if constexpr (dwKind == TestKindDouble)
+		return -2.5 - dwArguments;
+	else if constexpr (dwKind == TestKindFloat)
+		return 0.75f + dwArguments;
+	else
+		return 0xFEDCBA9876543210 ^ dwArguments;
+}
+
+/**
+ * @brief Record an argument received by a target.
+*/
+template<typename TValue>
+static VOID Receive(
+	_In_ SIZE_T dwIndex,
+	_In_ TValue Value
+) {
+	DWORD64 qwValue = 0;
+	std::memcpy(&qwValue, &Value, sizeof(Value));
+	s_aReceived[dwIndex] = qwValue;
+}
+
+/**
+ * @brief Target of the calls, recording the arguments it receives with their native type.
+*/
+template<DWORD dwReturn, DWORD dwFloatMask, SIZE_T... aIndexes>
+__attribute__((noinline)) static typename KindType<dwReturn>::Type THUNKCALLTYPE Target(
+	typename KindType<TargetKind(dwFloatMask, aIndexes)>::Type... aArguments
+) {
+	(Receive(aIndexes, aArguments), ...);
+	s_dwReceived = sizeof...(aIndexes);
+	return ReturnValue<dwReturn>(sizeof...(aIndexes));
+}
+
+/**
+ * @brief Address of the target of a signature.
+*/
+template<DWORD dwReturn, DWORD dwFloatMask, SIZE_T... aIndexes>
+static LPVOID TargetAddress(
+	_In_ std::index_sequence<aIndexes...>
+) {
+	return reinterpret_cast<LPVOID>(&Target<dwReturn, dwFloatMask, aIndexes...>);
+}
+
+/**
+ * @brief Fill the table of targets, indexed by arity, floating point mask and return kind.
+*/
+template<SIZE_T... aKeys>
+static VOID TargetTable(
+	_Out_ LPVOID* aTargets,
+	_In_  std::index_sequence<aKeys...>
+) {
+	((aTargets[aKeys] = TargetAddress<aKeys % TEST_RETURN_KINDS, (aKeys / TEST_RETURN_KINDS) % (1 << THUNK_REGISTERS)>(
+		std::make_index_sequence<aKeys / (TEST_RETURN_KINDS << THUNK_REGISTERS)>{})), ...);
+}
+
+/**
+ * @brief Call a target of every arity up to THUNK_MAX_ARGUMENTS, every floating point mask of the register arguments
+ *        and every kind of return value through a call thunk, or DynamicCall, and check the arguments it receives and
+ *        the value it returns.
+*/
+static VOID TestCalls(
+	_In_ BOOL bDynamicCall
+) {
+	CONST DWORD dwTargets = (THUNK_MAX_ARGUMENTS + 1) * (TEST_RETURN_KINDS << THUNK_REGISTERS);
+	static LPVOID aTargets[dwTargets]{};
+	TargetTable(aTargets, std::make_index_sequence<dwTargets>{});
+
+	for (DWORD dwArguments = 0; dwArguments <= THUNK_MAX_ARGUMENTS; dwArguments++) {
+		DWORD dwMasks = 1 << (dwArguments < THUNK_REGISTERS ? dwArguments : THUNK_REGISTERS);
+		for (DWORD dwFloatMask = 0; dwFloatMask < dwMasks; dwFloatMask++) {
+			for (DWORD dwReturn = 0; dwReturn < TEST_RETURN_KINDS; dwReturn++) {
+				std::string Context = std::string(bDynamicCall ? "dynamiccall" : "thunk") + " arity " + std::to_string(dwArguments)
+					+ ", mask " + std::to_string(dwFloatMask) + ", return " + std::to_string(dwReturn);
+
+				Argument aArguments[THUNK_MAX_ARGUMENTS + 1]{};
+				for (DWORD cx = 0; cx < dwArguments; cx++) {
+					DWORD dwKind = TargetKind(dwFloatMask, cx);
+					aArguments[cx].qwValue = ArgumentValue(dwKind, cx);
+					aArguments[cx].dwFlag = dwKind != TestKindInteger ? ARGUMENT_FLT : ARGUMENT_STD;
+				}
+				DWORD dwReturnFlag = dwReturn != TestKindInteger ? RETURN_FLT : RETURN_STD;
+				LPVOID lpTarget = aTargets[(dwArguments * (1 << THUNK_REGISTERS) + dwFloatMask) * TEST_RETURN_KINDS + dwReturn];
+
+				for (DWORD64& qwReceived : s_aReceived)
+					qwReceived = TEST_POISON;
+				s_dwReceived = 0;
+				RESULT res;
+				res.int64 = static_cast<LONGLONG>(TEST_POISON);
+
+				if (bDynamicCall) {
+					ArgumentTable Table = { aArguments, dwArguments };
+					if (!CHECK(DynamicCall(&Table, lpTarget, &res, dwReturnFlag) != FALSE, Context))
+						continue;
+				}
+				else {
+					CallThunk lpThunk = CallThunkCache::Instance().Get(dwArguments, CallThunkCache::FloatMask(aArguments, dwArguments), dwReturnFlag);
+					if (!CHECK(lpThunk != NULL, Context))
+						continue;
+					lpThunk(aArguments, lpTarget, &res);
+				}
+
+				CHECK(s_dwReceived == dwArguments, Context);
+				for (DWORD cx = 0; cx < dwArguments; cx++)
+					CHECK(s_aReceived[cx] == aArguments[cx].qwValue, Context + ", argument " + std::to_string(cx));
+
+				if (dwReturn == TestKindDouble)
+					CHECK(res.dbValue == ReturnValue<TestKindDouble>(dwArguments), Context);
+				else if (dwReturn == TestKindFloat)
+					CHECK(res.flValue == ReturnValue<TestKindFloat>(dwArguments), Context);
+				else
+					CHECK(static_cast<DWORD64>(res.int64) == ReturnValue<TestKindInteger>(dwArguments), Context);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Arguments and return values through the call thunks.
+*/
+static VOID TestThunk(VOID) {
+	TestCalls(FALSE);
+
+	// Signatures thunks cannot handle
+	CHECK(CallThunkCache::Instance().Get(THUNK_MAX_ARGUMENTS + 1, 0, RETURN_STD) == NULL, "too many arguments");
+	CHECK(CallThunkCache::Instance().Get(2, 1 << 2, RETURN_STD) == NULL, "mask beyond the arguments");
+
+#ifdef BENCH_DYNAMICCALL
+	TestCalls(TRUE);
+#endif
+}
+
+/**
+ * @brief Read a little-endian 32-bit value.
+*/
+static DWORD ReadDword(
+	_In_ const BYTE* lpData
+) {
+	return static_cast<DWORD>(lpData[0]) | (static_cast<DWORD>(lpData[1]) << 8) | (static_cast<DWORD>(lpData[2]) << 16) | (static_cast<DWORD>(lpData[3]) << 24);
+}
+
+/**
+ * @brief Unwind data of the generated code: UNWIND_CODE slots of the prologues, and layout of the UNWIND_INFO and
+ *        RUNTIME_FUNCTION entries committed with the code.
+*/
+static VOID TestUnwind(VOID) {
+	// Thunk of 5 arguments: push rbx, then sub rsp, 0x30 described by UWOP_ALLOC_SMALL
+	CodeEmitter emitter{};
+	CallThunkCache::Emit(&emitter, 5, 0, RETURN_STD);
+	emitter.Align(0x10);
+	DWORD dwThunkEnd = static_cast<DWORD>(emitter.Size());
+
+	// Frame described by UWOP_ALLOC_LARGE
+	emitter.BeginFunction();
+	emitter.SubRsp(0x1000);
+	emitter.EndPrologue();
+	emitter.AddRsp(0x1000);
+	emitter.Ret();
+	emitter.EndFunction();
+
+	const std::vector<CodeFunction>& aFunctions = emitter.Functions();
+	if (!CHECK(aFunctions.size() == 2, "functions"))
+		return;
+
+	CHECK(aFunctions[0].dwBegin == 0, "thunk");
+	CHECK(aFunctions[0].dwPrologue == 8, "thunk");
+	CHECK(aFunctions[0].dwEnd <= dwThunkEnd && emitter.Data()[aFunctions[0].dwEnd - 1] == 0xC3, "thunk");
+	CHECK(aFunctions[0].aUnwindCodes == std::vector<WORD>({ 0x5208, 0x3001 }), "thunk");
+
+	CHECK(aFunctions[1].dwBegin == dwThunkEnd, "large frame");
+	CHECK(aFunctions[1].dwPrologue == 7, "large frame");
+	CHECK(aFunctions[1].dwEnd == emitter.Size(), "large frame");
+	CHECK(aFunctions[1].aUnwindCodes == std::vector<WORD>({ 0x0107, 0x0200 }), "large frame");
+
+	// Image: code, then UNWIND_INFO, then RUNTIME_FUNCTION, every entry DWORD-aligned
+	std::vector<BYTE> image{};
+	DWORD dwTable = 0;
+	CodePool::Layout(&emitter, &image, &dwTable);
+	CHECK(std::memcmp(image.data(), emitter.Data(), emitter.Size()) == 0, "image");
+	if (!CHECK(dwTable % sizeof(DWORD) == 0 && image.size() == dwTable + 2 * 3 * sizeof(DWORD), "image"))
+		return;
+
+	for (DWORD cx = 0; cx < 2; cx++) {
+		const BYTE* lpEntry = image.data() + dwTable + cx * 3 * sizeof(DWORD);
+		std::string Context = "runtime function " + std::to_string(cx);
+		CHECK(ReadDword(lpEntry) == aFunctions[cx].dwBegin, Context);
+		CHECK(ReadDword(lpEntry + 4) == aFunctions[cx].dwEnd, Context);
+
+		DWORD dwUnwindInfo = ReadDword(lpEntry + 8);
+		if (!CHECK(dwUnwindInfo % sizeof(DWORD) == 0 && dwUnwindInfo >= emitter.Size() && dwUnwindInfo + 8 <= dwTable, Context))
+			continue;
+		const BYTE* lpInfo = image.data() + dwUnwindInfo;
+		CHECK(lpInfo[0] == 1 && lpInfo[1] == aFunctions[cx].dwPrologue && lpInfo[2] == 2 && lpInfo[3] == 0, Context);
+		CHECK((lpInfo[4] | (lpInfo[5] << 8)) == aFunctions[cx].aUnwindCodes[0], Context);
+		CHECK((lpInfo[6] | (lpInfo[7] << 8)) == aFunctions[cx].aUnwindCodes[1], Context);
+	}
+
+	// The committed code runs
+	CallThunk lpThunk = reinterpret_cast<CallThunk>(CodePool::Instance().Commit(&emitter));
+	if (CHECK(lpThunk != NULL, "commit")) {
+		Argument aArguments[5]{};
+		RESULT res{ 0 };
+		lpThunk(aArguments, reinterpret_cast<LPVOID>(&Target<TestKindInteger, 0, 0, 1, 2, 3, 4>), &res);
+		CHECK(static_cast<DWORD64>(res.int64) == ReturnValue<TestKindInteger>(5), "commit");
+	}
+}
+
+/**
+ * @brief Target of the calls of dynamic methods, ignoring its arguments.
+*/
+__attribute__((noinline)) static ULONGLONG THUNKCALLTYPE IgnoreArguments(VOID) {
+	__asm__ __volatile__("");
+	return 1;
+}
+
+/**
+ * @brief Build a string parameter.
+*/
+static VARIANT StringParameter(
+	_In_ LPCWSTR wszString
+) {
+	VARIANT var;
+	V_VT(&var) = VT_BSTR;
+	V_BSTR(&var) = ::SysAllocString(wszString);
+	return var;
+}
+
+/**
+ * @brief Steady-state calls of dynamic methods: once warmed up, a million calls of every path of DynamicMethod::Invoke
+ *        neither allocate a block of arena nor touch the heap.
+*/
+static VOID TestAllocations(VOID) {
+	LPVOID lpFunction = reinterpret_cast<LPVOID>(&IgnoreArguments);
+	VARIANT Variable;
+	V_VT(&Variable) = VT_I4;
+	V_I4(&Variable) = 7;
+
+	// Parameters in the order of the signature, reversed below as in DISPPARAMS
+	std::vector<VARIANT> aSmall(4), aLarge(12), aReference(2), aGeneric(3), aWide(10);
+	for (VARIANT& var : aSmall) { V_VT(&var) = VT_I4; V_I4(&var) = 1; }
+	V_VT(&aSmall[2]) = VT_R8;
+	V_R8(&aSmall[2]) = 1.5;
+	V_VT(&aSmall[3]) = VT_I8;
+	V_I8(&aSmall[3]) = -1;
+
+	for (VARIANT& var : aLarge) { V_VT(&var) = VT_I4; V_I4(&var) = 2; }
+	aLarge[10] = StringParameter(L"ansi string converted into the arena");
+	aLarge[11] = StringParameter(L"utf-8 string converted into the arena \u00e9");
+
+	V_VT(&aReference[0]) = VT_VARIANT | VT_BYREF;
+	V_VARIANTREF(&aReference[0]) = &Variable;
+	V_VT(&aReference[1]) = VT_I4;
+	V_I4(&aReference[1]) = 3;
+
+	V_VT(&aGeneric[0]) = VT_I4;
+	V_I4(&aGeneric[0]) = 4;
+	V_VT(&aGeneric[1]) = VT_R8;
+	V_R8(&aGeneric[1]) = 2.5;
+	aGeneric[2] = StringParameter(L"utf-16 string passed in place");
+
+	for (VARIANT& var : aWide) { V_VT(&var) = VT_I4; V_I4(&var) = 5; }
+
+	for (std::vector<VARIANT>* pParameters : { &aSmall, &aLarge, &aReference, &aGeneric, &aWide })
+		std::reverse(pParameters->begin(), pParameters->end());
+
+	std::unique_ptr<MarshalPlan> pSmall{}, pLarge{}, pReference{};
+	if (!CHECK(SUCCEEDED(MarshalPlan::Compile(L"iidl=i", &pSmall)), "inline")
+		|| !CHECK(SUCCEEDED(MarshalPlan::Compile(L"iiiiiiiiiiau=i", &pLarge)), "arena")
+		|| !CHECK(SUCCEEDED(MarshalPlan::Compile(L"&ii=i", &pReference)), "reference"))
+		return;
+	TypeFeedback Feedback{}, WideFeedback{};
+
+	// Inline and arena argument storage, with and without signature, with and without feedback
+	const std::tuple<LPCSTR, const MarshalPlan*, TypeFeedback*, std::vector<VARIANT>*> aCases[] = {
+		{ "inline", pSmall.get(), nullptr, &aSmall },
+		{ "arena", pLarge.get(), nullptr, &aLarge },
+		{ "reference", pReference.get(), nullptr, &aReference },
+		{ "generic", nullptr, nullptr, &aGeneric },
+		{ "feedback", nullptr, &Feedback, &aGeneric },
+		{ "feedback arena", nullptr, &WideFeedback, &aWide }
+	};
+
+#ifdef TEST_COUNT_ALLOCATIONS
+	// The hooks see allocations
+	s_bCountAllocations.store(TRUE);
+	delete new (std::nothrow) DWORD64;
+	s_bCountAllocations.store(FALSE);
+	CHECK(s_qwAllocations.exchange(0) != 0, "allocation hooks");
+#endif
+
+	for (auto& Case : aCases) {
+		std::string Context = std::get<0>(Case);
+		DynamicMethod Method(lpFunction, std::get<1>(Case), std::get<2>(Case));
+		std::vector<VARIANT>& aParameters = *std::get<3>(Case);
+		DISPPARAMS DispParams = { aParameters.data(), NULL, static_cast<UINT>(aParameters.size()), 0 };
+		VARIANT VarResult;
+		HRESULT hr = S_OK;
+
+		for (DWORD cx = 0; cx < TEST_WARMUP_CALLS && SUCCEEDED(hr); cx++)
+			hr = Method.Invoke(&DispParams, &VarResult, NULL);
+		if (!CHECK(SUCCEEDED(hr), Context))
+			continue;
+
+		ULONGLONG qwArenaBlocks = ThreadArena::HeapAllocations();
+		s_qwAllocations.store(0);
+		s_bCountAllocations.store(TRUE);
+		for (DWORD cx = 0; cx < TEST_STEADY_CALLS && SUCCEEDED(hr); cx++)
+			hr = Method.Invoke(&DispParams, &VarResult, NULL);
+		s_bCountAllocations.store(FALSE);
+
+		CHECK(SUCCEEDED(hr), Context);
+		CHECK(ThreadArena::HeapAllocations() == qwArenaBlocks, Context);
+		CHECK(s_qwAllocations.load() == 0, Context + ", " + std::to_string(s_qwAllocations.load()) + " allocations");
+	}
+
+	for (std::vector<VARIANT>* pParameters : { &aLarge, &aGeneric }) {
+		for (VARIANT& var : *pParameters)
+			::VariantClear(&var);
+	}
+}
+
+/**
+ * @brief Target of the calls of the stress suite, returning its argument.
+*/
+__attribute__((noinline)) static ULONGLONG THUNKCALLTYPE ReturnArgument(
+	_In_ ULONGLONG qwValue
+) {
+	return qwValue;
+}
+
+/**
+ * @brief Registration racing lookups and calls: one thread appends methods and inserts their names, serialised as done
+ *        by AutomationFactory, while other threads look up the names and call the methods already published. Build
+ *        with -DDWEX_SANITIZE=thread to run it under ThreadSanitizer.
+*/
+static VOID TestStress(VOID) {
+	LPVOID lpFunction = reinterpret_cast<LPVOID>(&ReturnArgument);
+	std::vector<std::wstring> aNames(TEST_STRESS_METHODS);
+	for (DWORD cx = 0; cx < TEST_STRESS_METHODS; cx++)
+		aNames[cx] = L"Method" + std::to_wstring(cx);
+
+	MethodTable Methods{};
+	NameIndex Names{};
+	std::atomic<DWORD> dwNamed{ 0 };
+	std::atomic<BOOL> bDone{ FALSE };
+	std::vector<DWORD> aErrors(TEST_STRESS_READERS, 0);
+	std::vector<ULONGLONG> aCalls(TEST_STRESS_READERS, 0);
+
+	// Every published name maps to its method, every published method can be called
+	auto Reader = [&](DWORD dwReader) {
+		ULONGLONG qwState = dwReader + 1;
+		BOOL bLast = FALSE;
+		while (!bLast) {
+			bLast = bDone.load();
+			qwState ^= qwState << 13;
+			qwState ^= qwState >> 7;
+			qwState ^= qwState << 17;
+
+			// A name being inserted may not be found yet, but never maps to another method
+			DWORD dwNamedCount = dwNamed.load(std::memory_order_acquire);
+			DISPID lDispId = DISPID_UNKNOWN;
+			if (dwNamedCount != 0) {
+				DWORD cx = static_cast<DWORD>(qwState % dwNamedCount);
+				if (FAILED(Names.Find(aNames[cx].c_str(), &lDispId)) || lDispId != static_cast<DISPID>(cx))
+					aErrors[dwReader]++;
+			}
+			if (dwNamedCount < TEST_STRESS_METHODS && SUCCEEDED(Names.Find(aNames[dwNamedCount].c_str(), &lDispId))
+				&& lDispId != static_cast<DISPID>(dwNamedCount))
+				aErrors[dwReader]++;
+
+			// The last method published, whose name may not be inserted yet, and any other one
+			DWORD dwSize = Methods.Size();
+			if (dwSize == 0)
+				continue;
+			for (DWORD cx : { dwSize - 1, static_cast<DWORD>(qwState % dwSize) }) {
+				const DynamicMethod* pMethod = Methods.Get(cx);
+				const DynamicMethodInfo* pInfo = Methods.GetInfo(cx);
+				VARIANT Parameter;
+				V_VT(&Parameter) = VT_I4;
+				V_I4(&Parameter) = static_cast<LONG>(cx);
+				DISPPARAMS DispParams = { &Parameter, NULL, 1, 0 };
+				VARIANT VarResult;
+				V_VT(&VarResult) = VT_EMPTY;
+				if (pMethod == nullptr || pInfo == nullptr || pInfo->wsFunctionName != aNames[cx]
+					|| FAILED(pMethod->Invoke(&DispParams, &VarResult, NULL)) || V_I4(&VarResult) != static_cast<LONG>(cx))
+					aErrors[dwReader]++;
+				aCalls[dwReader]++;
+			}
+		}
+	};
+
+	std::vector<std::thread> aReaders{};
+	for (DWORD cx = 0; cx < TEST_STRESS_READERS; cx++)
+		aReaders.emplace_back(Reader, cx);
+
+	// Methods with a signature go through their plan, the others through the generic path and type feedback
+	std::thread Writer([&]() {
+		for (DWORD cx = 0; cx < TEST_STRESS_METHODS; cx++) {
+			DynamicMethodInfo info{};
+			info.wsFunctionName = aNames[cx];
+			if (cx % 2 == 0 && FAILED(MarshalPlan::Compile(L"i=i", &info.pPlan)))
+				break;
+
+			// Publish the method before its name
+			DWORD dwIndex = 0;
+			if (FAILED(Methods.Append(lpFunction, &info, &dwIndex)) || dwIndex != cx
+				|| FAILED(Names.Insert(aNames[cx].c_str(), static_cast<DISPID>(dwIndex), NULL)))
+				break;
+			dwNamed.store(cx + 1, std::memory_order_release);
+		}
+		bDone.store(TRUE);
+	});
+
+	Writer.join();
+	for (std::thread& Thread : aReaders)
+		Thread.join();
+
+	CHECK(dwNamed.load() == TEST_STRESS_METHODS && Methods.Size() == TEST_STRESS_METHODS, "registration");
+	for (DWORD cx = 0; cx < TEST_STRESS_READERS; cx++) {
+		std::string Context = "reader " + std::to_string(cx) + ", " + std::to_string(aCalls[cx]) + " calls";
+		CHECK(aCalls[cx] != 0, Context);
+		CHECK(aErrors[cx] == 0, Context + ", " + std::to_string(aErrors[cx]) + " errors");
+	}
+}
+
+/**
+ * @brief Equivalent of STARTUPINFOW, laid out by the compiler.
+*/
+typedef struct _TestStartupInfo {
+	DWORD  cb;
+	LPVOID lpReserved;
+	LPVOID lpDesktop;
+	LPVOID lpTitle;
+	DWORD  dwX;
+	DWORD  dwY;
+	DWORD  dwXSize;
+	DWORD  dwYSize;
+	DWORD  dwXCountChars;
+	DWORD  dwYCountChars;
+	DWORD  dwFillAttribute;
+	DWORD  dwFlags;
+	WORD   wShowWindow;
+	WORD   cbReserved2;
+	LPVOID lpReserved2;
+	LPVOID hStdInput;
+	LPVOID hStdOutput;
+	LPVOID hStdError;
+} TestStartupInfo;
+
+/**
+ * @brief Structure with narrow fields, arrays and padding, laid out by the compiler.
+*/
+typedef struct _TestPadded {
+	CHAR     c;
+	DOUBLE   d;
+	SHORT    h[3];
+	LONG     i;
+	CHAR     a[5];
+	LONGLONG l;
+	BYTE     b;
+} TestPadded;
+
+/**
+ * @brief Compiled structure layouts against the compiler: size, alignment and offset of every field, values packed
+ *        into the structure read through the fields of the compiler, and values unpacked from it.
+*/
+static VOID TestStruct(VOID) {
+	// Definition, size, alignment and offset of every field as laid out by the compiler
+	const std::pair<LPCSTR, LPCWSTR> aCases[] = {
+		{ "startupinfo", L"cb:i; lpReserved:p; lpDesktop:p; lpTitle:p; dwX:i; dwY:i; dwXSize:i; dwYSize:i; dwXCountChars:i;"
+			L"dwYCountChars:i; dwFillAttribute:i; dwFlags:i; wShowWindow:h; cbReserved2:h; lpReserved2:p; hStdInput:p;"
+			L"hStdOutput:p; hStdError:p" },
+		{ "padded", L"c:c; d:d; h:h[3]; i:i; a:c[5]; l:l; b:c" }
+	};
+	const std::vector<SIZE_T> aOffsets[] = {
+		{
+			offsetof(TestStartupInfo, cb), offsetof(TestStartupInfo, lpReserved), offsetof(TestStartupInfo, lpDesktop),
+			offsetof(TestStartupInfo, lpTitle), offsetof(TestStartupInfo, dwX), offsetof(TestStartupInfo, dwY),
+			offsetof(TestStartupInfo, dwXSize), offsetof(TestStartupInfo, dwYSize), offsetof(TestStartupInfo, dwXCountChars),
+			offsetof(TestStartupInfo, dwYCountChars), offsetof(TestStartupInfo, dwFillAttribute), offsetof(TestStartupInfo, dwFlags),
+			offsetof(TestStartupInfo, wShowWindow), offsetof(TestStartupInfo, cbReserved2), offsetof(TestStartupInfo, lpReserved2),
+			offsetof(TestStartupInfo, hStdInput), offsetof(TestStartupInfo, hStdOutput), offsetof(TestStartupInfo, hStdError)
+		},
+		{
+			offsetof(TestPadded, c), offsetof(TestPadded, d), offsetof(TestPadded, h), offsetof(TestPadded, i),
+			offsetof(TestPadded, a), offsetof(TestPadded, l), offsetof(TestPadded, b)
+		}
+	};
+	const SIZE_T aSizes[][2] = {
+		{ sizeof(TestStartupInfo), alignof(TestStartupInfo) },
+		{ sizeof(TestPadded), alignof(TestPadded) }
+	};
+
+	for (DWORD dwCase = 0; dwCase < ARRAYSIZE(aCases); dwCase++) {
+		std::string Context = aCases[dwCase].first;
+		std::unique_ptr<StructLayout> pLayout{};
+		if (!CHECK(SUCCEEDED(StructLayout::Compile(aCases[dwCase].second, &pLayout)), Context))
+			continue;
+
+		CHECK(pLayout->m_dwSize == aSizes[dwCase][0], Context + ", size " + std::to_string(pLayout->m_dwSize));
+		CHECK(pLayout->m_dwAlignment == aSizes[dwCase][1], Context + ", alignment " + std::to_string(pLayout->m_dwAlignment));
+		if (!CHECK(pLayout->m_aFields.size() == aOffsets[dwCase].size(), Context))
+			continue;
+		for (SIZE_T cx = 0; cx < pLayout->m_aFields.size(); cx++)
+			CHECK(pLayout->m_aFields[cx].dwOffset == aOffsets[dwCase][cx], Context + ", field " + std::to_string(cx));
+
+		// Every element is its index plus one, valid for every kind
+		std::vector<VARIANT> aValues(pLayout->m_dwElements);
+		for (DWORD cx = 0; cx < pLayout->m_dwElements; cx++) {
+			V_VT(&aValues[cx]) = VT_I4;
+			V_I4(&aValues[cx]) = static_cast<LONG>(cx + 1);
+		}
+		std::vector<BYTE> Buffer(pLayout->m_dwSize, 0xCC);
+		DWORD dwFailed = 0;
+		if (!CHECK(SUCCEEDED(pLayout->Pack(Buffer.data(), aValues.data(), &dwFailed)), Context))
+			continue;
+
+		std::vector<VARIANT> aFields(pLayout->m_dwElements);
+		pLayout->Unpack(Buffer.data(), aFields.data());
+		for (DWORD cx = 0; cx < pLayout->m_dwElements; cx++) {
+			VARIANT Value;
+			BOOL bValue = SUCCEEDED(::VariantChangeType(&Value, &aFields[cx], 0, VT_I8)) && V_I8(&Value) == cx + 1;
+			CHECK(bValue, Context + ", element " + std::to_string(cx));
+		}
+	}
+
+	// Packed values, read by the compiler
+	std::unique_ptr<StructLayout> pLayout{};
+	if (!CHECK(SUCCEEDED(StructLayout::Compile(aCases[1].second, &pLayout)), "padded"))
+		return;
+	std::vector<VARIANT> aValues(pLayout->m_dwElements);
+	for (DWORD cx = 0; cx < pLayout->m_dwElements; cx++) {
+		V_VT(&aValues[cx]) = VT_I4;
+		V_I4(&aValues[cx]) = static_cast<LONG>(cx + 1);
+	}
+	TestPadded Padded;
+	std::memset(&Padded, 0xCC, sizeof(Padded));
+	DWORD dwFailed = 0;
+	if (CHECK(sizeof(Padded) == pLayout->m_dwSize && SUCCEEDED(pLayout->Pack(&Padded, aValues.data(), &dwFailed)), "padded")) {
+		CHECK(Padded.c == 1 && Padded.d == 2.0 && Padded.h[0] == 3 && Padded.h[1] == 4 && Padded.h[2] == 5, "padded");
+		CHECK(Padded.i == 6 && Padded.a[0] == 7 && Padded.a[4] == 11 && Padded.l == 12 && Padded.b == 13, "padded");
+	}
+}
+
+/**
+ * @brief Suites, in the order they run.
+*/
+static CONST TestSuite g_aSuites[] = {
+	{ "thunk", &TestThunk },
+	{ "unwind", &TestUnwind },
+	{ "allocations", &TestAllocations },
+	{ "stress", &TestStress },
+	{ "struct", &TestStruct }
+};
+
+/**
+ * @brief Print the usage of the program.
+*/
+static VOID Usage(
+	_In_ LPCSTR szProgram
+) {
+	std::fprintf(stderr,
+		"Usage: %s [--filter SUITE]\n"
+		"  --filter    Only run the suites whose name contains the string, e.g. thunk\n",
+		szProgram);
+}
+
+int main(int argc, char** argv) {
+	std::string Filter{};
+	for (int cx = 1; cx < argc; cx++) {
+		std::string Argument = argv[cx];
+		if (Argument == "--filter" && cx + 1 < argc) {
+			Filter = argv[++cx];
+		}
+		else {
+			Usage(argv[0]);
+			return Argument == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	for (const TestSuite& suite : g_aSuites) {
+		if (!Filter.empty() && std::string(suite.szName).find(Filter) == std::string::npos)
+			continue;
+
+		DWORD dwFailures = s_dwFailures;
+		suite.lpRun();
+		std::printf("%s %s\n", s_dwFailures == dwFailures ? "PASS" : "FAIL", suite.szName);
+	}
+	return s_dwFailures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
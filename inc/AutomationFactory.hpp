@@ -4,16 +4,22 @@
 * @author       Paul Laine (@am0nsec)
 * @version      1.0
 * @brief        COM Automation Factory declaration.
-* @details
+* @details      The dynamic methods are owned by the process-wide catalog (see MethodCatalog.hpp). An object only sees the
+*               methods it registered, in registration order, and keeps its own names and dispatch IDs. Registering a
+*               method already resolved by another object reuses the method of the catalog without resolving it again.
 * @link         https://github.com/am0nsec/DynamicWrapperEx
 * @copyright    This project has been released under the GNU Public License v3 license.
 */
 #pragma once
 #include <windows.h>
+#include <atomic>
 #include <memory>
 #include <vector>
 
 #include "DynamicMethod.hpp"
+#include "MethodCatalog.hpp"
+#include "MethodTable.hpp"
+#include "NameIndex.hpp"
 
 #ifndef __AUTOMATIONFACTORY_HPP
 #define __AUTOMATIONFACTORY_HPP
@@ -31,7 +37,11 @@ public:
 	~AutomationFactory();
 
 	/**
-	 * @brief Register a new dynamic method.
+	 * @brief Register a new dynamic method, or a batch of them.
+	 * @details Parameters are the module name, the function name and an optional signature string (see MarshalPlan.hpp).
+	 *          The dispatch ID of the method is returned. Registering a name twice returns the existing dispatch ID.
+	 *          The function name can also be an array of names, in which case an array of dispatch IDs is returned. Each
+	 *          element is either a name, optionally followed by ':' and its own signature, or an ordinal.
 	 * @param pDispParams List of parameters supplied by the client.
 	 * @param pVarResult Return value expected by the client, if not NULL.
 	 * @return Whether the function executed successfully.
@@ -42,9 +52,97 @@ public:
 	);
 
 	/**
-	 * @brief Number of dynamic method that have been registered.
+	 * @brief Get the call statistics of the dynamic methods.
+	 * @details No parameter is expected. A JSON string is returned, for example:
+	 *          {"enabled":true,"unit":"tsc","methods":[{"dispid":6,"name":"MessageBoxW","calls":2,"marshal":310,"native":9120,"histogram":[0,0,1,1]}]}
+	 *          Bucket N of the histogram counts calls that took from 2^N to 2^(N+1) ticks. Trailing empty buckets are omitted.
+	 *          Methods are shared by the objects of the process, hence count the calls made through any of them.
+	 *          Statistics are only collected if DWEX_ENABLE_STATS was defined at build time, "enabled" is false otherwise.
+	 * @param pDispParams List of parameters supplied by the client.
+	 * @param pVarResult Return value expected by the client, if not NULL.
+	 * @return Whether the function executed successfully.
+	*/
+	HRESULT STDMETHODCALLTYPE Stats(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult
+	);
+
+	/**
+	 * @brief Register the dynamic methods recorded in a binding cache file (see BindingCache.hpp).
+	 * @details The path of the file is expected. The file is mapped read-only and the identity of every module is checked
+	 *          against the module loaded. Methods of an unchanged module are registered at their recorded RVA, methods of
+	 *          a module that changed are resolved again. The number of methods resolved again is returned, -1 if the
+	 *          file is missing or not valid. The cache is trusted as much as the script, since it names the functions
+	 *          to execute.
+	 * @param pDispParams List of parameters supplied by the client.
+	 * @param pVarResult Return value expected by the client, if not NULL.
+	 * @return Whether the function executed successfully.
+	*/
+	HRESULT STDMETHODCALLTYPE LoadCache(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult
+	);
+
+	/**
+	 * @brief Save the dynamic methods registered so far in a binding cache file (see BindingCache.hpp).
+	 * @details The path of the file is expected. The number of methods saved is returned. Methods whose function lies
+	 *          outside of the module they were registered from, i.e. forwarded exports, are not saved.
+	 * @param pDispParams List of parameters supplied by the client.
+	 * @param pVarResult Return value expected by the client, if not NULL.
+	 * @return Whether the function executed successfully.
+	*/
+	HRESULT STDMETHODCALLTYPE SaveCache(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult
+	);
+
+	/**
+	 * @brief Get the type information of the object, describing the internal methods and every registered method.
+	 * @details The type information is a dispinterface deriving from IDispatch, built on first use and rebuilt once
+	 *          methods have been registered. Type information obtained before a registration is left as it was.
+	 * @param ppTypeInfo The address of a variable that receives the type information, with a new reference.
+	 * @return Whether the type information has been built.
+	*/
+	HRESULT STDMETHODCALLTYPE GetTypeInfo(
+		_Out_ ITypeInfo** ppTypeInfo
+	);
+
+	/**
+	 * @brief Get a dynamic method. Safe to call while another thread registers a method.
+	 * @param lDispId The dispatch ID of the method.
+	 * @return The method, or NULL if the dispatch ID does not refer to a dynamic method.
+	*/
+	const DynamicMethod* GetMethod(
+		_In_ DISPID lDispId
+	) const;
+
+	/**
+	 * @brief Get the index in the catalog of a dynamic method (see MethodCatalog.hpp).
+	 * @param lDispId The dispatch ID of the method, for which GetMethod returned a method.
 	*/
-	DWORD m_dwDynamicMethods{ 0 };
+	DWORD GetCatalogIndex(
+		_In_ DISPID lDispId
+	) const {
+		return this->CatalogIndex(static_cast<DWORD>(lDispId) - this->m_dwInternalMethods);
+	}
+
+	/**
+	 * @brief Find the dispatch ID of a method by name: internal methods first, then dynamic methods. Safe to call while
+	 *        another thread registers a method.
+	 * @param wszName The case-insensitive name of the method.
+	 * @param plDispId The address of a variable that receives the dispatch ID.
+	 * @return Whether the name has been found.
+	*/
+	HRESULT STDMETHODCALLTYPE FindName(
+		_In_  LPCWSTR wszName,
+		_Out_ DISPID* plDispId
+	) const;
+
+	/**
+	 * @brief Reset the object to the state of a new one, without any dynamic method. The object must not be used by any
+	 *        other thread.
+	*/
+	VOID Reset(VOID);
 
 	/**
 	 * @brief Number of internal methods.
@@ -52,25 +150,151 @@ public:
 	DWORD m_dwInternalMethods{ 0 };
 
 	/**
-	 * @brief Table of dynamic methods
+	 * @brief Internal methods, m_dwInternalMethods entries.
 	*/
-	std::vector<std::unique_ptr<DynamicMethod>> m_aDynamicMethods{};
+	const DispatchTableEntry* m_aInternalMethods{ nullptr };
 
 	/**
-	 * @brief List of Dispatch function.
+	 * @brief Index of the names of the internal methods, shared by every object.
 	*/
-	std::vector<DispatchTableEntry> m_aDispatchTable{};
+	const NameIndex* m_pInternalNames{ nullptr };
 private:
+	/**
+	 * @brief Number of dynamic methods registered by the object.
+	*/
+	DWORD Size(VOID) const;
+
+	/**
+	 * @brief Get the index in the catalog of a dynamic method.
+	 * @param dwIndex The index of the method, i.e. its dispatch ID minus the number of internal methods, below Size().
+	*/
+	DWORD CatalogIndex(
+		_In_ DWORD dwIndex
+	) const;
+
+	/**
+	 * @brief Give a method of the catalog a dispatch ID in the object, unless the object has a method of the same name.
+	 * @param dwCatalogIndex The index of the method in the catalog.
+	 * @param wszFunctionName The name of the method.
+	 * @param plDispId The address of a variable that receives the dispatch ID of the method.
+	 * @return Whether the method is visible to the object.
+	*/
+	HRESULT STDMETHODCALLTYPE Adopt(
+		_In_  DWORD   dwCatalogIndex,
+		_In_  LPCWSTR wszFunctionName,
+		_Out_ DISPID* plDispId
+	);
+
+	/**
+	 * @brief Process-wide catalog owning the dynamic methods.
+	*/
+	MethodCatalog& m_Catalog{ MethodCatalog::Instance() };
+
+	/**
+	 * @brief Index in the catalog of the methods registered by the object, in segments laid out as in MethodTable.
+	*/
+	std::atomic<PDWORD> m_aOwnSegments[METHODTABLE_SEGMENTS];
+
+	/**
+	 * @brief Number of methods registered by the object.
+	*/
+	std::atomic<DWORD> m_dwOwn{ 0 };
+
+	/**
+	 * @brief Index of the names of the methods registered by the object, NULL until the first registration.
+	*/
+	std::atomic<NameIndex*> m_pNames{ nullptr };
+
+	/**
+	 * @brief Serialise registrations.
+	*/
+	SRWLOCK m_RegisterLock = SRWLOCK_INIT;
+
+	/**
+	 * @brief Protect the type information.
+	*/
+	SRWLOCK m_TypeInfoLock = SRWLOCK_INIT;
+
+	/**
+	 * @brief Type information of the object, NULL until first requested.
+	*/
+	ITypeInfo* m_pTypeInfo{ NULL };
+
+	/**
+	 * @brief Number of dynamic methods described by the type information.
+	*/
+	DWORD m_dwTypeInfoMethods{ 0 };
+
+	/**
+	 * @brief Build the type information of the object. Registrations must be held off by the caller.
+	 * @param dwMethods The number of dynamic methods to describe.
+	 * @param ppTypeInfo The address of a variable that receives the type information.
+	 * @return Whether the type information has been built.
+	*/
+	HRESULT STDMETHODCALLTYPE BuildTypeInfo(
+		_In_  DWORD       dwMethods,
+		_Out_ ITypeInfo** ppTypeInfo
+	);
+
+	/**
+	 * @brief Register a batch of dynamic methods from the same module.
+	 * @param wszModuleName The name of the module (e.g. user32.dll).
+	 * @param pFunctionNames The array of names or ordinals supplied by the client.
+	 * @param wszSignature The signature of the elements without their own, or NULL.
+	 * @param pVarResult Return value expected by the client, if not NULL.
+	 * @return Whether all the methods have been registered.
+	*/
+	HRESULT STDMETHODCALLTYPE RegisterBatch(
+		_In_  LPCWSTR  wszModuleName,
+		_In_  VARIANT* pFunctionNames,
+		_In_  LPCWSTR  wszSignature,
+		_Out_ VARIANT* pVarResult
+	);
+
+	/**
+	 * @brief Register a single dynamic method.
+	 * @param wszModuleName The name of the module (e.g. user32.dll).
+	 * @param wszFunctionName The name of the function (e.g. MessageBoxW), or its ordinal prefixed with '#' (e.g. #12).
+	 * @param wszSignature The signature of the function, or NULL.
+	 * @param plDispId The address of a variable that receives the dispatch ID of the method.
+	 * @return Whether the method has been registered.
+	*/
+	HRESULT STDMETHODCALLTYPE RegisterMethod(
+		_In_     LPCWSTR wszModuleName,
+		_In_     LPCWSTR wszFunctionName,
+		_In_opt_ LPCWSTR wszSignature,
+		_Out_    DISPID* plDispId
+	);
+
+	/**
+	 * @brief Register a single dynamic method whose function has been resolved.
+	 * @param wszModuleName The name of the module (e.g. user32.dll).
+	 * @param wszFunctionName The name of the function (e.g. MessageBoxW), or its ordinal prefixed with '#' (e.g. #12).
+	 * @param wszSignature The signature of the function, or NULL.
+	 * @param pPlan The marshalling plan compiled from the signature, or NULL.
+	 * @param lpFunction The address of the function.
+	 * @param plDispId The address of a variable that receives the dispatch ID of the method.
+	 * @return Whether the method has been registered.
+	*/
+	HRESULT STDMETHODCALLTYPE RegisterFunction(
+		_In_     LPCWSTR                      wszModuleName,
+		_In_     LPCWSTR                      wszFunctionName,
+		_In_opt_ LPCWSTR                      wszSignature,
+		_In_opt_ std::unique_ptr<MarshalPlan> pPlan,
+		_In_     LPVOID                       lpFunction,
+		_Out_    DISPID*                      plDispId
+	);
+
 	/**
 	 * @brief Get the address of a function from a module.
-	 * @param pbstrModuleName The name of the module (e.g. user32.dll).
-	 * @param pbstrFunctionName The name of the function (e.g. MessageBoxW).
+	 * @param wszModuleName The name of the module (e.g. user32.dll).
+	 * @param wszFunctionName The name of the function (e.g. MessageBoxW), or its ordinal prefixed with '#' (e.g. #12).
 	 * @param ppFunction The address of pointer variable that receives the address of the function.
 	 * @return Whether the address of the function has been found.
 	*/
 	HRESULT STDMETHODCALLTYPE GetFunctionFromModule(
-		_In_  BSTR*   pbstrModuleName,
-		_In_  BSTR*   pbstrFunctionName,
+		_In_  LPCWSTR wszModuleName,
+		_In_  LPCWSTR wszFunctionName,
 		_Out_ LPVOID* ppFunction
 	);
 };
@@ -0,0 +1,134 @@
+/**
+* @file         BindingCache.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Binding cache file declaration.
+* @details      A binding cache records the dynamic methods registered by a script, hence the next run registers them from
+*               the cache instead of resolving every export again. Every module is recorded with its identity, read from
+*               its PE headers, and every method with the RVA of its function within the module and its signature, in
+*               registration order. Methods of a module whose identity changed are resolved again. Dispatch IDs are not
+*               recorded, they follow from the order in which the methods are registered again.
+*
+*               The file is little-endian and does not depend on the platform, hence can be read and written anywhere:
+*                 Header   magic, version, number of modules, number of methods, size of the strings, checksum
+*                 Modules  name, time stamp, checksum, size of image
+*                 Methods  module, name, signature, RVA
+*                 Strings  UTF-16 strings, NUL-terminated, referenced by their offset in bytes
+*               The checksum is the FNV-1a hash of everything after the header, hence truncated or corrupted files are
+*               rejected as a whole.
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <string>
+#include <vector>
+
+#ifndef __BINDINGCACHE_HPP
+#define __BINDINGCACHE_HPP
+
+#define BINDINGCACHE_MAGIC       0x43425744 /* "DWBC" */
+#define BINDINGCACHE_VERSION     2          /* Version of the file format */
+#define BINDINGCACHE_MAX_ENTRIES 0x100000   /* Sanity limit on the number of modules and methods */
+#define BINDINGCACHE_NO_STRING   0xFFFFFFFF /* Offset of a missing string, i.e. a method without signature */
+
+/**
+ * @brief Module recorded in a binding cache.
+*/
+typedef struct _BindingModule {
+	std::wstring wsName;           /* Normalised name of the module (see ModuleCache::Normalize) */
+	DWORD        dwTimeDateStamp;  /* Time stamp of the image, from the file header */
+	DWORD        dwCheckSum;       /* Checksum of the image, from the optional header */
+	DWORD        dwSizeOfImage;    /* Size of the image once mapped, from the optional header */
+} BindingModule, *PBindingModule;
+
+/**
+ * @brief Dynamic method recorded in a binding cache.
+*/
+typedef struct _BindingEntry {
+	DWORD        dwModule;         /* Index of the module exporting the function */
+	std::wstring wsFunctionName;   /* Name of the function, or its ordinal prefixed with '#' */
+	BOOL         bSignature;       /* Whether the method has been registered with a signature */
+	std::wstring wsSignature;      /* Signature of the function, empty if none */
+	DWORD        dwRva;            /* Address of the function, relative to the base of the module */
+} BindingEntry, *PBindingEntry;
+
+class BindingCache {
+public:
+	/**
+	 * @brief Parse a binding cache file. Every field is read with bounds checking, hence untrusted files can be parsed.
+	 * @param lpData The content of the file.
+	 * @param dwSize The size of the file, in bytes.
+	 * @return Whether the file has been parsed. Nothing is kept from a file that is not valid.
+	*/
+	HRESULT STDMETHODCALLTYPE Parse(
+		_In_ const BYTE* lpData,
+		_In_ SIZE_T      dwSize
+	);
+
+	/**
+	 * @brief Serialise the binding cache into the content of a file.
+	 * @param pData The address of a variable that receives the content of the file.
+	 * @return Whether the cache has been serialised.
+	*/
+	HRESULT STDMETHODCALLTYPE Serialize(
+		_Out_ std::vector<BYTE>* pData
+	) const;
+
+	/**
+	 * @brief Get the index of a module, adding it if not recorded yet.
+	 * @param pModule The module. Modules are matched by name.
+	 * @return The index of the module.
+	*/
+	DWORD AddModule(
+		_In_ const BindingModule* pModule
+	);
+
+	/**
+	 * @brief Modules recorded.
+	*/
+	std::vector<BindingModule> m_aModules{};
+
+	/**
+	 * @brief Methods recorded, in registration order.
+	*/
+	std::vector<BindingEntry> m_aEntries{};
+
+private:
+	/**
+	 * @brief Read a string from the strings of the file.
+	 * @param lpStrings The strings of the file.
+	 * @param dwStrings The size of the strings, in bytes.
+	 * @param dwOffset The offset of the string, in bytes.
+	 * @param pString The address of a variable that receives the string.
+	 * @return Whether the string is within the strings and NUL-terminated.
+	*/
+	static BOOL ReadString(
+		_In_  const BYTE*   lpStrings,
+		_In_  SIZE_T        dwStrings,
+		_In_  DWORD         dwOffset,
+		_Out_ std::wstring* pString
+	);
+
+	/**
+	 * @brief Append a string to the strings of the file.
+	 * @param wsString The string.
+	 * @param pStrings The strings of the file.
+	 * @return The offset of the string, in bytes.
+	*/
+	static DWORD WriteString(
+		_In_    const std::wstring& wsString,
+		_Inout_ std::vector<BYTE>*  pStrings
+	);
+
+	/**
+	 * @brief FNV-1a hash of the content of the file after the header.
+	*/
+	static DWORD Hash(
+		_In_ const BYTE* lpData,
+		_In_ SIZE_T      dwSize
+	);
+};
+
+#endif // !__BINDINGCACHE_HPP
@@ -37,6 +37,11 @@ public:
 	*/
 	virtual ~CDynamicWrapperEx();
 
+	/**
+	 * @brief Get the class factory of the process. References do not control its lifetime, locks on the server do.
+	*/
+	static CDynamicWrapperEx& Instance(VOID);
+
 	/**
 	 * @brief Queries a COM object for a pointer to one of its interface.
 	 * @param riid A reference to the interface identifier (IID) of the interface being queried for.
@@ -87,11 +92,6 @@ private:
 	 * @brief Number of reference to the object.
 	*/
 	DWORD m_dwReference{ 0 };
-
-	/**
-	 * @brief Unique pointer to an IDynamicWrapperEx COM Automation object.
-	*/
-	IDynamicWrapperEx* m_pIDynamicWrapperEx{ nullptr };
 };
 
 #endif // !__CDYNAMICWRAPPEREX_HPP
@@ -0,0 +1,156 @@
+/**
+* @file         CallStats.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Per-method call statistics declaration.
+* @details      Statistics are only collected when DWEX_ENABLE_STATS is defined. Otherwise the CALLSTATS_* macros expand
+*               to nothing and the dynamic methods are not instrumented at all.
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <intrin.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#ifndef __CALLSTATS_HPP
+#define __CALLSTATS_HPP
+
+#define CALLSTATS_BUCKETS   24 /* Buckets of the latency histogram, bucket N counts calls of [2^N, 2^(N+1)) ticks */
+#define CALLSTATS_ALIGNMENT 64 /* Size of a cache line */
+
+#ifdef DWEX_ENABLE_STATS
+#define CALLSTATS_ALLOCATE()                  CallStats::Instance().Allocate()
+#define CALLSTATS_TIMESTAMP(name)             ULONGLONG name = __rdtsc()
+#define CALLSTATS_RECORD(id, marshal, native) CallStats::Instance().Record(id, marshal, native)
+#define CALLSTATS_FEEDBACK(id, hit)           CallStats::Instance().RecordFeedback(id, hit)
+#else
+#define CALLSTATS_ALLOCATE()                  0
+#define CALLSTATS_TIMESTAMP(name)
+#define CALLSTATS_RECORD(id, marshal, native)
+#define CALLSTATS_FEEDBACK(id, hit)
+#endif
+
+/**
+ * @brief Statistics of a method, merged from all the threads.
+*/
+typedef struct _MethodStats {
+	ULONGLONG qwCalls;                        /* Number of calls */
+	ULONGLONG qwMarshalTicks;                 /* Time spent converting arguments and return values, in TSC ticks */
+	ULONGLONG qwNativeTicks;                  /* Time spent in the native function, in TSC ticks */
+	ULONGLONG aHistogram[CALLSTATS_BUCKETS];  /* Latency of the calls, marshalling included */
+	ULONGLONG qwFeedbackHits;                 /* Calls of a shape recorded by the type feedback (see TypeFeedback.hpp) */
+	ULONGLONG qwFeedbackMisses;               /* Calls without signature that went through the generic path */
+} MethodStats, *PMethodStats;
+
+/**
+ * @brief Statistics of a method collected by a single thread. Only written by the thread owning it.
+*/
+typedef struct alignas(CALLSTATS_ALIGNMENT) _ThreadMethodStats {
+	std::atomic<ULONGLONG> qwCalls;
+	std::atomic<ULONGLONG> qwMarshalTicks;
+	std::atomic<ULONGLONG> qwNativeTicks;
+	std::atomic<ULONGLONG> aHistogram[CALLSTATS_BUCKETS];
+	std::atomic<ULONGLONG> qwFeedbackHits;
+	std::atomic<ULONGLONG> qwFeedbackMisses;
+} ThreadMethodStats, *PThreadMethodStats;
+
+class ThreadStats;
+
+/**
+ * @brief Process-wide registry of the statistics of every thread.
+ * @details Every method of the catalog is given a unique statistics ID (see MethodCatalog.hpp). Methods are shared by the
+ *          COM Automation objects of the process, hence the counters of a method count the calls made through every
+ *          object that registered it. Each thread records its own calls into cache line aligned slots, without any lock
+ *          nor atomic read-modify-write. Slots of all the threads are only merged when statistics are collected.
+*/
+class CallStats {
+public:
+	/**
+	 * @brief Get the process-wide instance.
+	*/
+	static CallStats& Instance(VOID);
+
+	/**
+	 * @brief Allocate the statistics ID of a new method.
+	*/
+	DWORD Allocate(VOID);
+
+	/**
+	 * @brief Record a call made by the calling thread.
+	 * @param dwId The statistics ID of the method.
+	 * @param qwMarshalTicks The time spent converting arguments and return value.
+	 * @param qwNativeTicks The time spent in the native function.
+	*/
+	VOID Record(
+		_In_ DWORD     dwId,
+		_In_ ULONGLONG qwMarshalTicks,
+		_In_ ULONGLONG qwNativeTicks
+	);
+
+	/**
+	 * @brief Record whether a call made by the calling thread matched a shape recorded by the type feedback.
+	 * @param dwId The statistics ID of the method.
+	 * @param bHit Whether the shape of the call had been recorded.
+	*/
+	VOID RecordFeedback(
+		_In_ DWORD dwId,
+		_In_ BOOL  bHit
+	);
+
+	/**
+	 * @brief Merge the statistics of a method from all the threads, including the threads that have exited.
+	 * @param dwId The statistics ID of the method.
+	 * @param pStats The address of a variable that receives the statistics.
+	*/
+	VOID Collect(
+		_In_  DWORD        dwId,
+		_Out_ PMethodStats pStats
+	);
+
+private:
+	friend class ThreadStats;
+
+	/**
+	 * @brief Constructor.
+	*/
+	CallStats();
+
+	/**
+	 * @brief Destructor.
+	*/
+	~CallStats();
+
+	/**
+	 * @brief Add the slot of a thread to the statistics of a method.
+	*/
+	static VOID Merge(
+		_In_    const ThreadMethodStats* pSlot,
+		_Inout_ PMethodStats             pStats
+	);
+
+	/**
+	 * @brief Next statistics ID.
+	*/
+	std::atomic<DWORD> m_dwNextId{ 0 };
+
+	/**
+	 * @brief Protect the list of threads and the statistics of the threads that have exited.
+	*/
+	std::mutex m_Lock{};
+
+	/**
+	 * @brief Threads that have recorded at least one call.
+	*/
+	std::vector<ThreadStats*> m_aThreads{};
+
+	/**
+	 * @brief Statistics of the threads that have exited, indexed by statistics ID.
+	*/
+	std::vector<MethodStats> m_aRetired{};
+};
+
+#endif // !__CALLSTATS_HPP
@@ -0,0 +1,121 @@
+/**
+* @file         CallThunk.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Per-signature call thunks declaration.
+* @details      A thunk is a straight-line replacement of DynamicCall specialised for a given number of arguments,
+*               floating point mask of the register arguments and kind of return value.
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <atomic>
+#include <mutex>
+
+#include "types.hpp"
+#include "CodeEmitter.hpp"
+
+#ifndef __CALLTHUNK_HPP
+#define __CALLTHUNK_HPP
+
+// Thunks always follow the Microsoft x64 calling convention
+#ifdef _WIN32
+#define THUNKCALLTYPE
+#else
+#define THUNKCALLTYPE __attribute__((ms_abi))
+#endif
+
+#define THUNK_MAX_ARGUMENTS 16 /* Functions with more arguments go through DynamicCall */
+#define THUNK_REGISTERS     4  /* Number of arguments passed via registers */
+
+/**
+ * @brief Execute a function with a fixed signature.
+ * @param lpArguments The arguments to pass to the function.
+ * @param lpFunction The address of the function to execute.
+ * @param lpResult The address of the RESULT union to return.
+*/
+typedef VOID(THUNKCALLTYPE* CallThunk)(
+	_In_  PArgument lpArguments,
+	_In_  LPVOID    lpFunction,
+	_Out_ PRESULT   lpResult
+);
+
+/**
+ * @brief Process-wide cache of call thunks.
+ * @details All variants for a given number of arguments are generated together the first time one of them is requested,
+ *          so that the code can be sealed in a single commit to the code pool.
+*/
+class CallThunkCache {
+public:
+	/**
+	 * @brief Get the process-wide instance.
+	*/
+	static CallThunkCache& Instance(VOID);
+
+	/**
+	 * @brief Get the thunk for a signature, generating it on first use.
+	 * @param dwArguments The number of arguments.
+	 * @param dwFloatMask Bit N is set if the argument N, passed via register, is floating point data.
+	 * @param dwReturnFlag Whether scalar or floating point data is returned (RETURN_STD or RETURN_FLT).
+	 * @return The thunk, or NULL if the signature cannot be handled by a thunk.
+	*/
+	CallThunk Get(
+		_In_ DWORD dwArguments,
+		_In_ DWORD dwFloatMask,
+		_In_ DWORD dwReturnFlag
+	);
+
+	/**
+	 * @brief Emit the machine code of a thunk.
+	 * @param pEmitter The emitter receiving the code.
+	 * @param dwArguments The number of arguments.
+	 * @param dwFloatMask Bit N is set if the argument N, passed via register, is floating point data.
+	 * @param dwReturnFlag Whether scalar or floating point data is returned (RETURN_STD or RETURN_FLT).
+	*/
+	static VOID Emit(
+		_In_ CodeEmitter* pEmitter,
+		_In_ DWORD        dwArguments,
+		_In_ DWORD        dwFloatMask,
+		_In_ DWORD        dwReturnFlag
+	);
+
+	/**
+	 * @brief Compute the floating point mask of the register arguments.
+	 * @param lpArguments The arguments.
+	 * @param dwArguments The number of arguments.
+	 * @return Bit N is set if the argument N is floating point data.
+	*/
+	static DWORD FloatMask(
+		_In_ const Argument* lpArguments,
+		_In_ DWORD           dwArguments
+	);
+
+private:
+	/**
+	 * @brief Index of a signature within the cache.
+	*/
+	static DWORD Key(
+		_In_ DWORD dwArguments,
+		_In_ DWORD dwFloatMask,
+		_In_ DWORD dwReturnFlag
+	);
+
+	/**
+	 * @brief Generate and publish all variants for a given number of arguments.
+	*/
+	VOID Generate(_In_ DWORD dwArguments);
+
+	/**
+	 * @brief Serialise generation of thunks.
+	*/
+	std::mutex m_Lock{};
+
+	/**
+	 * @brief Published thunks, indexed by signature.
+	*/
+	std::atomic<CallThunk> m_aThunks[(THUNK_MAX_ARGUMENTS + 1) << (THUNK_REGISTERS + 1)]{};
+};
+
+#endif // !__CALLTHUNK_HPP
@@ -0,0 +1,237 @@
+/**
+* @file         CallTrace.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Call tracer of the dynamic methods declaration.
+* @details      Tracing is only available when DWEX_ENABLE_TRACE is defined, and only enabled between the calls to DwTrace
+*               starting and stopping it. Otherwise the dynamic methods are called as is, CALLTRACE_ENABLED() expanding to
+*               FALSE.
+*
+*               Every thread records its calls into its own ring of fixed-size records (see TraceFile.hpp), without any
+*               lock: the calling thread is the only producer and the flush thread the only consumer. The flush thread
+*               appends the records of every ring to the file every CALLTRACE_FLUSH_PERIOD milliseconds. Calls made while
+*               the ring of their thread is full are dropped and counted.
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "DynamicMethod.hpp"
+#include "TraceFile.hpp"
+
+#ifndef __CALLTRACE_HPP
+#define __CALLTRACE_HPP
+
+#define CALLTRACE_RING_SIZE    1024 /* Records per thread, must be a power of two */
+#define CALLTRACE_FLUSH_PERIOD 100  /* Time between two flushes, in milliseconds */
+#define CALLTRACE_ALIGNMENT    64   /* Size of a cache line */
+
+#ifdef DWEX_ENABLE_TRACE
+#define CALLTRACE_ENABLED() CallTrace::Instance().IsEnabled()
+#else
+#define CALLTRACE_ENABLED() FALSE
+#endif
+
+/**
+ * @brief Ring of the records of a thread.
+*/
+class TraceRing {
+public:
+	/**
+	 * @brief Append a record. Called by the owning thread only.
+	 * @return Whether the record has been appended, FALSE if the ring is full.
+	*/
+	BOOL Push(
+		_In_ const TraceRecord* pRecord
+	);
+
+	/**
+	 * @brief Move the records appended so far. Called by the consumer only.
+	 * @param pRecords The records, the moved ones are appended.
+	*/
+	VOID Drain(
+		_Inout_ std::vector<TraceRecord>* pRecords
+	);
+
+	/**
+	 * @brief Next record written by the owning thread.
+	*/
+	alignas(CALLTRACE_ALIGNMENT) std::atomic<ULONGLONG> m_qwHead{ 0 };
+
+	/**
+	 * @brief Records dropped since the ring was full, written by the owning thread.
+	*/
+	std::atomic<ULONGLONG> m_qwDropped{ 0 };
+
+	/**
+	 * @brief Next record read by the consumer.
+	*/
+	alignas(CALLTRACE_ALIGNMENT) std::atomic<ULONGLONG> m_qwTail{ 0 };
+
+	/**
+	 * @brief Whether the owning thread has exited, in which case the ring is reused once drained.
+	*/
+	std::atomic<BOOL> m_bRetired{ FALSE };
+
+	/**
+	 * @brief Records, indexed modulo CALLTRACE_RING_SIZE.
+	*/
+	alignas(CALLTRACE_ALIGNMENT) TraceRecord m_aRecords[CALLTRACE_RING_SIZE];
+};
+
+/**
+ * @brief Process-wide tracer of the calls of dynamic methods.
+*/
+class CallTrace {
+public:
+	/**
+	 * @brief Get the process-wide instance.
+	*/
+	static CallTrace& Instance(VOID);
+
+	/**
+	 * @brief Whether calls are being traced.
+	*/
+	BOOL IsEnabled(VOID) const {
+		return this->m_bEnabled.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * @brief Start tracing into a file, ending the trace in progress if any.
+	 * @param wszPath The path of the file, replaced if it exists.
+	 * @return Whether tracing has started, E_NOTIMPL if not built with DWEX_ENABLE_TRACE.
+	*/
+	HRESULT STDMETHODCALLTYPE Start(
+		_In_ LPCWSTR wszPath
+	);
+
+	/**
+	 * @brief Stop tracing, write the records left and the end block, then close the file.
+	 * @param pqwRecords The address of a variable that receives the number of records written.
+	 * @return S_OK if a trace has been ended, S_FALSE if calls were not being traced.
+	*/
+	HRESULT STDMETHODCALLTYPE Stop(
+		_Out_ ULONGLONG* pqwRecords
+	);
+
+	/**
+	 * @brief Execute a dynamic method and record the call.
+	 * @param pMethod The method.
+	 * @param dwMethod The index of the method in the catalog (see MethodCatalog.hpp).
+	 * @param lDispId The dispatch ID of the method.
+	 * @param pDispParams List of parameters provided by the client.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @param puArgErr The index within rgvarg of the first argument that has an error, if not NULL.
+	 * @return The result of the method.
+	*/
+	HRESULT STDMETHODCALLTYPE Invoke(
+		_In_      const DynamicMethod* pMethod,
+		_In_      DWORD                dwMethod,
+		_In_      DISPID               lDispId,
+		_In_      DISPPARAMS*          pDispParams,
+		_Out_     VARIANT*             pVarResult,
+		_Out_opt_ UINT*                puArgErr
+	);
+
+private:
+	friend class TraceRingOwner;
+
+	/**
+	 * @brief Constructor.
+	*/
+	CallTrace();
+
+	/**
+	 * @brief Destructor.
+	*/
+	~CallTrace();
+
+	/**
+	 * @brief End the trace in progress if any. The control lock must be held by the caller.
+	 * @param pqwRecords The address of a variable that receives the number of records written.
+	 * @return S_OK if a trace has been ended, S_FALSE if calls were not being traced.
+	*/
+	HRESULT STDMETHODCALLTYPE Close(
+		_Out_ ULONGLONG* pqwRecords
+	);
+
+	/**
+	 * @brief Get a ring for the calling thread, reusing the drained ring of a thread that has exited if any.
+	 * @return The ring, or NULL if out of memory.
+	*/
+	TraceRing* AcquireRing(VOID);
+
+	/**
+	 * @brief Append the records of every ring to the file. Called by the flush thread, or by Stop once it has exited.
+	*/
+	VOID Flush(VOID);
+
+	/**
+	 * @brief Entry point of the flush thread.
+	*/
+	static DWORD WINAPI FlushThread(
+		_In_ LPVOID lpParameter
+	);
+
+	/**
+	 * @brief Number of records dropped by every ring since their creation.
+	*/
+	ULONGLONG Dropped(VOID);
+
+	/**
+	 * @brief Whether calls are being traced.
+	*/
+	std::atomic<BOOL> m_bEnabled{ FALSE };
+
+	/**
+	 * @brief Serialise Start and Stop.
+	*/
+	std::mutex m_ControlLock{};
+
+	/**
+	 * @brief Protect the list of rings.
+	*/
+	std::mutex m_RingsLock{};
+
+	/**
+	 * @brief Rings of every thread that has traced a call, never freed.
+	*/
+	std::vector<TraceRing*> m_aRings{};
+
+	/**
+	 * @brief File of the trace in progress.
+	*/
+	HANDLE m_hFile{ INVALID_HANDLE_VALUE };
+
+	/**
+	 * @brief Flush thread of the trace in progress.
+	*/
+	HANDLE m_hThread{ NULL };
+
+	/**
+	 * @brief Signalled to stop the flush thread.
+	*/
+	HANDLE m_hStop{ NULL };
+
+	/**
+	 * @brief Whether every method has been described in the file, indexed by catalog index. Consumer only.
+	*/
+	std::vector<BOOL> m_aDescribed{};
+
+	/**
+	 * @brief Number of records written to the file. Consumer only.
+	*/
+	ULONGLONG m_qwRecords{ 0 };
+
+	/**
+	 * @brief Records dropped by every ring when the trace started.
+	*/
+	ULONGLONG m_qwDroppedBase{ 0 };
+};
+
+#endif // !__CALLTRACE_HPP
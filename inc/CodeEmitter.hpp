@@ -0,0 +1,287 @@
+/**
+* @file         CodeEmitter.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        x64 machine code emitter and executable code pool declaration.
+* @details      Only the handful of instructions required by the generated thunks are supported.
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <initializer_list>
+#include <mutex>
+#include <vector>
+
+#ifndef __CODEEMITTER_HPP
+#define __CODEEMITTER_HPP
+
+/**
+ * @brief x64 general purpose registers, numbered as in the instruction encoding.
+*/
+typedef enum _Register {
+	RegisterRax = 0, RegisterRcx = 1, RegisterRdx = 2, RegisterRbx = 3,
+	RegisterRsp = 4, RegisterRbp = 5, RegisterRsi = 6, RegisterRdi = 7,
+	RegisterR8  = 8, RegisterR9  = 9, RegisterR10 = 10, RegisterR11 = 11,
+	RegisterR12 = 12, RegisterR13 = 13, RegisterR14 = 14, RegisterR15 = 15
+} Register;
+
+/**
+ * @brief Function emitted into a buffer, with the unwind codes of its prologue.
+*/
+typedef struct _CodeFunction {
+	DWORD             dwBegin;       /* Offset of the first instruction within the buffer */
+	DWORD             dwEnd;         /* Offset following the last instruction */
+	DWORD             dwPrologue;    /* Size of the prologue, in bytes */
+	std::vector<WORD> aUnwindCodes;  /* UNWIND_CODE slots, from the last instruction of the prologue to the first */
+} CodeFunction;
+
+/**
+ * @brief Append x64 instructions to a buffer.
+*/
+class CodeEmitter {
+public:
+	/**
+	 * @brief Start a function. Push and SubRsp are recorded as unwind codes until the end of the prologue.
+	*/
+	VOID BeginFunction(VOID);
+
+	/**
+	 * @brief End the prologue of the current function.
+	*/
+	VOID EndPrologue(VOID);
+
+	/**
+	 * @brief End the current function, after its last instruction.
+	*/
+	VOID EndFunction(VOID);
+
+	/**
+	 * @brief push reg
+	*/
+	VOID Push(_In_ Register reg);
+
+	/**
+	 * @brief pop reg
+	*/
+	VOID Pop(_In_ Register reg);
+
+	/**
+	 * @brief mov dst, src
+	*/
+	VOID MovRegReg(_In_ Register dst, _In_ Register src);
+
+	/**
+	 * @brief mov dst, imm64
+	*/
+	VOID MovRegImm64(_In_ Register dst, _In_ DWORD64 qwImmediate);
+
+	/**
+	 * @brief mov dst, qword [base + disp32]
+	*/
+	VOID MovRegMem(_In_ Register dst, _In_ Register base, _In_ LONG lDisplacement);
+
+	/**
+	 * @brief mov qword [base + disp32], src
+	*/
+	VOID MovMemReg(_In_ Register base, _In_ LONG lDisplacement, _In_ Register src);
+
+	/**
+	 * @brief movsd xmm, qword [base + disp32]
+	*/
+	VOID MovsdXmmMem(_In_ DWORD dwXmm, _In_ Register base, _In_ LONG lDisplacement);
+
+	/**
+	 * @brief movsd qword [base + disp32], xmm
+	*/
+	VOID MovsdMemXmm(_In_ Register base, _In_ LONG lDisplacement, _In_ DWORD dwXmm);
+
+	/**
+	 * @brief lea dst, [base + disp32]
+	*/
+	VOID Lea(_In_ Register dst, _In_ Register base, _In_ LONG lDisplacement);
+
+	/**
+	 * @brief sub rsp, imm32
+	*/
+	VOID SubRsp(_In_ DWORD dwImmediate);
+
+	/**
+	 * @brief add rsp, imm32
+	*/
+	VOID AddRsp(_In_ DWORD dwImmediate);
+
+	/**
+	 * @brief call reg
+	*/
+	VOID Call(_In_ Register reg);
+
+	/**
+	 * @brief jmp reg
+	*/
+	VOID Jmp(_In_ Register reg);
+
+	/**
+	 * @brief ret
+	*/
+	VOID Ret(VOID);
+
+	/**
+	 * @brief Pad the buffer with int3 up to the given alignment.
+	*/
+	VOID Align(_In_ DWORD dwAlignment);
+
+	/**
+	 * @brief Current size of the buffer, in bytes.
+	*/
+	SIZE_T Size(VOID) const { return this->m_aCode.size(); }
+
+	/**
+	 * @brief Content of the buffer.
+	*/
+	const BYTE* Data(VOID) const { return this->m_aCode.data(); }
+
+	/**
+	 * @brief Functions emitted, in order.
+	*/
+	const std::vector<CodeFunction>& Functions(VOID) const { return this->m_aFunctions; }
+
+private:
+	/**
+	 * @brief Emit a REX prefix if required.
+	*/
+	VOID Rex(_In_ BOOL bWide, _In_ DWORD dwReg, _In_ DWORD dwBase);
+
+	/**
+	 * @brief Emit a ModRM byte addressing [base + disp32], with a SIB byte when base is rsp or r12.
+	*/
+	VOID ModRmDisp32(_In_ DWORD dwReg, _In_ Register base, _In_ LONG lDisplacement);
+
+	/**
+	 * @brief Emit a 32-bit little-endian value.
+	*/
+	VOID Dword(_In_ DWORD dwValue);
+
+	/**
+	 * @brief Record the unwind code of the instruction just emitted, if it is part of a prologue.
+	 * @param bOperation The unwind operation.
+	 * @param bInformation The operation information.
+	 * @param aSlots The additional slots of the operation.
+	*/
+	VOID Unwind(
+		_In_ BYTE                        bOperation,
+		_In_ BYTE                        bInformation,
+		_In_ std::initializer_list<WORD> aSlots
+	);
+
+	/**
+	 * @brief Machine code.
+	*/
+	std::vector<BYTE> m_aCode{};
+
+	/**
+	 * @brief Functions emitted.
+	*/
+	std::vector<CodeFunction> m_aFunctions{};
+
+	/**
+	 * @brief Whether the prologue of the last function is being emitted.
+	*/
+	BOOL m_bPrologue{ FALSE };
+};
+
+/**
+ * @brief Process-wide pool of executable memory.
+ * @details Code is copied into fresh pages that are sealed read-execute straight away. Pages holding code are never writable again.
+ *          The UNWIND_INFO and RUNTIME_FUNCTION entries of the functions follow the code in the same pages, and are
+ *          registered with RtlAddFunctionTable for as long as the pool lives.
+*/
+class CodePool {
+public:
+	/**
+	 * @brief Get the process-wide instance.
+	*/
+	static CodePool& Instance(VOID);
+
+	/**
+	 * @brief Copy the code of an emitter into executable memory and register the unwind data of its functions.
+	 * @param pEmitter The emitter holding the code.
+	 * @return The address of the executable copy, or NULL on failure.
+	*/
+	LPVOID Commit(
+		_In_ const CodeEmitter* pEmitter
+	);
+
+	/**
+	 * @brief Build the image committed for the code of an emitter: the code, then the UNWIND_INFO of every function, then
+	 *        the RUNTIME_FUNCTION of every function. Addresses are relative to the start of the image.
+	 * @param pEmitter The emitter holding the code.
+	 * @param pImage The address of a variable that receives the image.
+	 * @param pdwTable The address of a variable that receives the offset of the RUNTIME_FUNCTION entries.
+	*/
+	static VOID Layout(
+		_In_  const CodeEmitter* pEmitter,
+		_Out_ std::vector<BYTE>* pImage,
+		_Out_ PDWORD             pdwTable
+	);
+
+	/**
+	 * @brief Number of bytes committed to the pool.
+	*/
+	SIZE_T m_dwCommitted{ 0 };
+
+private:
+	/**
+	 * @brief Constructor.
+	*/
+	CodePool();
+
+	/**
+	 * @brief Destructor.
+	*/
+	~CodePool();
+
+	/**
+	 * @brief Copy an image into fresh executable pages. The lock must be held.
+	 * @param lpImage The image.
+	 * @param dwSize The size of the image, in bytes.
+	 * @return The address of the executable copy, or NULL on failure.
+	*/
+	PBYTE Copy(
+		_In_ const BYTE* lpImage,
+		_In_ SIZE_T      dwSize
+	);
+
+	/**
+	 * @brief Serialise commits.
+	*/
+	std::mutex m_Lock{};
+
+	/**
+	 * @brief Function tables registered, removed when the pool is destroyed.
+	*/
+	std::vector<LPVOID> m_aTables{};
+
+	/**
+	 * @brief Regions of reserved address space.
+	*/
+	std::vector<PBYTE> m_aRegions{};
+
+	/**
+	 * @brief Next unused page of the last region.
+	*/
+	PBYTE m_lpNext{ nullptr };
+
+	/**
+	 * @brief End of the last region.
+	*/
+	PBYTE m_lpEnd{ nullptr };
+
+	/**
+	 * @brief Size of a page.
+	*/
+	SIZE_T m_dwPageSize{ 0x1000 };
+};
+
+#endif // !__CODEEMITTER_HPP
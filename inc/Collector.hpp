@@ -0,0 +1,265 @@
+/**
+* @file         Collector.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Native callbacks collecting their arguments declaration.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <unknwn.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "CallThunk.hpp"
+#include "CodeEmitter.hpp"
+#include "MarshalPlan.hpp"
+
+#ifndef __COLLECTOR_HPP
+#define __COLLECTOR_HPP
+
+#define COLLECTOR_MAX_SLOTS 64 /* Largest number of collectors alive at once */
+
+class Collector;
+
+/**
+ * @brief {5B0A3C4E-8F61-4D27-A9B2-7E1C0D64F3A5}
+*/
+static CONST GUID IID_ICollector = { 0x5b0a3c4e, 0x8f61, 0x4d27, {0xa9, 0xb2, 0x7e, 0x1c, 0x0d, 0x64, 0xf3, 0xa5} };
+
+/**
+ * @brief Link between a native callback and the collector currently using it.
+ * @details The code of a callback is never freed, hence callbacks are bound to slots that are reused by later collectors.
+*/
+typedef struct _CollectorSlot {
+	SRWLOCK    Lock;       /* Shared while a callback runs, exclusive while the collector changes */
+	Collector* pCollector; /* Collector bound to the slot, or NULL */
+	LPVOID     lpCallback; /* Native callback bound to the slot */
+} CollectorSlot, *PCollectorSlot;
+
+/**
+ * @brief COM Automation object returned by DwCollector.
+ * @details Owns a native callback, exposed by the Address property, that can be passed to enumeration APIs such as
+ *          EnumWindows. Each call of the callback appends its arguments, converted as declared by the signature, to the
+ *          collector and returns a fixed value. Count returns the number of calls, Items returns the arguments of every
+ *          call and Clear discards them. Items is an array of values for callbacks of one argument, a two-dimensional
+ *          array with one row per call otherwise. Strings are copied during the call, strings whose address is below
+ *          0x10000 are collected as integers as done by MAKEINTRESOURCE. The callback never throws: a call whose
+ *          arguments cannot be stored, for lack of memory, is not collected and is counted by Dropped instead. The
+ *          callback must not be used once the collector has been released.
+*/
+class Collector : IDispatch {
+public:
+	/**
+	 * @brief Create a collector. The collector is created with one reference.
+	 * @param wszSignature The signature of the callback, see MarshalPlan.hpp. Floating point return values are not supported.
+	 * @param llReturn The value returned by the callback.
+	 * @param ppCollector The address of a variable that receives the collector.
+	 * @return Whether the collector has been created.
+	*/
+	static HRESULT STDMETHODCALLTYPE Create(
+		_In_  LPCWSTR     wszSignature,
+		_In_  LONGLONG    llReturn,
+		_Out_ Collector** ppCollector
+	);
+
+	/**
+	 * @brief Destructor.
+	*/
+	virtual ~Collector();
+
+	/**
+	 * @brief Get the IDispatch interface of the collector, with a new reference.
+	*/
+	IDispatch* GetDispatch(VOID);
+
+	/**
+	 * @brief Queries a COM object for a pointer to one of its interface.
+	 * @param riid A reference to the interface identifier (IID) of the interface being queried for.
+	 * @param ppvObject The address of a pointer to an interface with the IID specified in the riid parameter.
+	 * @return Whether an interface has been found.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE QueryInterface(
+		_In_  REFIID  riid,
+		_Out_ LPVOID* ppvObject
+	);
+
+	/**
+	 * @brief  Increment the number of references.
+	 * @return Number of remaining references.
+	*/
+	virtual ULONG STDMETHODCALLTYPE AddRef(VOID);
+
+	/**
+	 * @brief  Decrement the number of references, destroying the collector when none is left.
+	 * @return Number of remaining references.
+	*/
+	virtual ULONG STDMETHODCALLTYPE Release(VOID);
+
+	/**
+	 * @brief Retrieves the number of type information interfaces that an object provides (either 0 or 1).
+	 * @param pctinfo The number of type information interfaces provided by the object.
+	 * @return Whether the function executed successfully.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE GetTypeInfoCount(
+		_Out_ UINT* pctinfo
+	);
+
+	/**
+	 * @brief Retrieves the type information for an object.
+	 * @param iTInfo The type information to return.
+	 * @param lcid The locale identifier for the type information.
+	 * @param ppTInfo The requested type information object.
+	 * @return Method not implemented.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE GetTypeInfo(
+		_In_  UINT        iTInfo,
+		_In_  LCID        lcid,
+		_Out_ ITypeInfo** ppTInfo
+	);
+
+	/**
+	 * @brief Maps a single member to its DISPID.
+	 * @param riid Reserved for future use. Must be IID_NULL.
+	 * @param rgszNames The array of names to be mapped.
+	 * @param cNames The count of the names to be mapped.
+	 * @param lcid The locale context in which to interpret the names.
+	 * @param rgDispId Caller-allocated array that receives the DISPID of each name.
+	 * @return Whether the function executed successfully.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE GetIDsOfNames(
+		_In_  REFIID    riid,
+		_In_  LPOLESTR* rgszNames,
+		_In_  UINT      cNames,
+		_In_  LCID      lcid,
+		_Out_ DISPID*   rgDispId
+	);
+
+	/**
+	 * @brief Provides access to the methods of the collector. Methods can also be read as properties.
+	 * @param dispIdMember Identifies the member.
+	 * @param riid Reserved for future use. Must be IID_NULL.
+	 * @param lcid The locale context in which to interpret arguments.
+	 * @param wFlags Flags describing the context of the Invoke call.
+	 * @param pDispParams Pointer to a DISPPARAMS structure containing the arguments.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @param pExcepInfo Pointer to a structure that contains exception information.
+	 * @param puArgErr The index within rgvarg of the first argument that has an error.
+	 * @return Whether the function executed successfully.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE Invoke(
+		_In_  DISPID      dispIdMember,
+		_In_  REFIID      riid,
+		_In_  LCID        lcid,
+		_In_  WORD        wFlags,
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult,
+		_Out_ EXCEPINFO*  pExcepInfo,
+		_Out_ UINT*       puArgErr
+	);
+
+	/**
+	 * @brief Emit the machine code of a native callback.
+	 * @details The callback spills the register arguments into their home space, so that every integer argument is
+	 *          contiguous with the stack arguments, and the floating point register arguments into its own frame.
+	 * @param pEmitter The emitter receiving the code.
+	 * @param pSlot The slot bound to the callback.
+	*/
+	static VOID Emit(
+		_In_ CodeEmitter*   pEmitter,
+		_In_ PCollectorSlot pSlot
+	);
+
+private:
+	/**
+	 * @brief Constructor.
+	*/
+	Collector(
+		_In_ std::unique_ptr<MarshalPlan> pPlan,
+		_In_ LONGLONG                     llReturn
+	);
+
+	/**
+	 * @brief Entry point of the native callbacks.
+	 * @param pSlot The slot bound to the callback.
+	 * @param lpArguments The arguments, as raw 64-bit values in native order.
+	 * @param lpFloats The floating point register arguments.
+	 * @return The value returned by the callback.
+	*/
+	static LONGLONG THUNKCALLTYPE Collect(
+		_In_ PCollectorSlot pSlot,
+		_In_ const DWORD64* lpArguments,
+		_In_ const DWORD64* lpFloats
+	);
+
+	/**
+	 * @brief Generate the native callbacks of every slot.
+	 * @return Whether the callbacks have been generated.
+	*/
+	static BOOL Generate(VOID);
+
+	/**
+	 * @brief Make room for the arguments of a number of calls. The lock of the collector must be held or the collector
+	 *        must not be bound yet.
+	 * @param dwCalls The number of calls.
+	 * @return Whether the room has been made.
+	*/
+	BOOL Reserve(
+		_In_ DWORD dwCalls
+	);
+
+	/**
+	 * @brief Copy the arguments of every call into a new array.
+	 * @param ppsa The address of a variable that receives the array.
+	 * @return Whether the array has been created.
+	*/
+	HRESULT STDMETHODCALLTYPE GetItems(
+		_Out_ SAFEARRAY** ppsa
+	);
+
+	/**
+	 * @brief Number of reference to the object.
+	*/
+	DWORD m_dwReference{ 1 };
+
+	/**
+	 * @brief Signature of the callback.
+	*/
+	std::unique_ptr<MarshalPlan> m_pPlan;
+
+	/**
+	 * @brief Value returned by the callback.
+	*/
+	LONGLONG m_llReturn;
+
+	/**
+	 * @brief Slot bound to the collector, NULL until the collector has been bound.
+	*/
+	PCollectorSlot m_pSlot{ NULL };
+
+	/**
+	 * @brief Protect the collected arguments.
+	*/
+	SRWLOCK m_Lock = SRWLOCK_INIT;
+
+	/**
+	 * @brief Arguments of every call, m_pPlan->m_dwArguments per call.
+	*/
+	std::vector<VARIANT> m_aItems{};
+
+	/**
+	 * @brief Number of calls.
+	*/
+	DWORD m_dwCalls{ 0 };
+
+	/**
+	 * @brief Number of calls that could not be collected.
+	*/
+	DWORD m_dwDropped{ 0 };
+};
+
+#endif // !__COLLECTOR_HPP
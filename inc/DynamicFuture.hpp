@@ -0,0 +1,202 @@
+/**
+* @file         DynamicFuture.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Result of a dynamic method executed on the worker pool declaration.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <unknwn.h>
+#include <vector>
+
+#include "DynamicMethod.hpp"
+#include "WorkerPool.hpp"
+
+#ifndef __DYNAMICFUTURE_HPP
+#define __DYNAMICFUTURE_HPP
+
+/**
+ * @brief {062EFD39-E502-434E-9CAE-13A1FC06C1FB}
+*/
+static CONST GUID IID_IDynamicFuture = { 0x062efd39, 0xe502, 0x434e, {0x9c, 0xae, 0x13, 0xa1, 0xfc, 0x06, 0xc1, 0xfb} };
+
+/**
+ * @brief COM Automation object returned by DwInvokeAsync.
+ * @details Exposes IsDone(), Wait([milliseconds]) and Result(). The arguments are copied when the call is queued, hence the
+ *          client can release them straight away. The future keeps the object that owns the method alive until it is
+ *          released.
+*/
+class DynamicFuture : IDispatch, public WorkerTask {
+public:
+	/**
+	 * @brief Constructor. The future is created with one reference.
+	 * @param pOwner The object owning the method. Its reference is transferred to the future.
+	 * @param pMethod The method to execute.
+	*/
+	DynamicFuture(
+		_In_ IUnknown*            pOwner,
+		_In_ const DynamicMethod* pMethod
+	);
+
+	/**
+	 * @brief Destructor.
+	*/
+	virtual ~DynamicFuture();
+
+	/**
+	 * @brief Copy the arguments of the call.
+	 * @param rgvarg The arguments, in reverse order as in DISPPARAMS. References are followed.
+	 * @param dwArguments The number of arguments.
+	 * @return Whether the arguments have been copied.
+	*/
+	HRESULT STDMETHODCALLTYPE SetArguments(
+		_In_ VARIANT* rgvarg,
+		_In_ DWORD    dwArguments
+	);
+
+	/**
+	 * @brief Get the future behind an IDispatch interface.
+	 * @param pDispatch The interface provided by the client.
+	 * @return The future, with a new reference, or NULL if the interface is not one of a future.
+	*/
+	static DynamicFuture* FromDispatch(
+		_In_ IDispatch* pDispatch
+	);
+
+	/**
+	 * @brief Get the IDispatch interface of the future, with a new reference.
+	*/
+	IDispatch* GetDispatch(VOID);
+
+	/**
+	 * @brief Execute the method. Called once, on a worker thread.
+	*/
+	virtual VOID Execute(VOID);
+
+	/**
+	 * @brief Release the reference held by the worker pool.
+	*/
+	virtual VOID Detach(VOID);
+
+	/**
+	 * @brief Queries a COM object for a pointer to one of its interface.
+	 * @param riid A reference to the interface identifier (IID) of the interface being queried for.
+	 * @param ppvObject The address of a pointer to an interface with the IID specified in the riid parameter.
+	 * @return Whether an interface has been found.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE QueryInterface(
+		_In_  REFIID  riid,
+		_Out_ LPVOID* ppvObject
+	);
+
+	/**
+	 * @brief  Increment the number of references.
+	 * @return Number of remaining references.
+	*/
+	virtual ULONG STDMETHODCALLTYPE AddRef(VOID);
+
+	/**
+	 * @brief  Decrement the number of references, destroying the future when none is left.
+	 * @return Number of remaining references.
+	*/
+	virtual ULONG STDMETHODCALLTYPE Release(VOID);
+
+	/**
+	 * @brief Retrieves the number of type information interfaces that an object provides (either 0 or 1).
+	 * @param pctinfo The number of type information interfaces provided by the object.
+	 * @return Whether the function executed successfully.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE GetTypeInfoCount(
+		_Out_ UINT* pctinfo
+	);
+
+	/**
+	 * @brief Retrieves the type information for an object.
+	 * @param iTInfo The type information to return.
+	 * @param lcid The locale identifier for the type information.
+	 * @param ppTInfo The requested type information object.
+	 * @return Method not implemented.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE GetTypeInfo(
+		_In_  UINT        iTInfo,
+		_In_  LCID        lcid,
+		_Out_ ITypeInfo** ppTInfo
+	);
+
+	/**
+	 * @brief Maps a single member to its DISPID.
+	 * @param riid Reserved for future use. Must be IID_NULL.
+	 * @param rgszNames The array of names to be mapped.
+	 * @param cNames The count of the names to be mapped.
+	 * @param lcid The locale context in which to interpret the names.
+	 * @param rgDispId Caller-allocated array that receives the DISPID of each name.
+	 * @return Whether the function executed successfully.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE GetIDsOfNames(
+		_In_  REFIID    riid,
+		_In_  LPOLESTR* rgszNames,
+		_In_  UINT      cNames,
+		_In_  LCID      lcid,
+		_Out_ DISPID*   rgDispId
+	);
+
+	/**
+	 * @brief Provides access to the methods of the future. Methods can also be read as properties.
+	 * @param dispIdMember Identifies the member.
+	 * @param riid Reserved for future use. Must be IID_NULL.
+	 * @param lcid The locale context in which to interpret arguments.
+	 * @param wFlags Flags describing the context of the Invoke call.
+	 * @param pDispParams Pointer to a DISPPARAMS structure containing the arguments.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @param pExcepInfo Pointer to a structure that contains exception information.
+	 * @param puArgErr The index within rgvarg of the first argument that has an error.
+	 * @return Whether the function executed successfully.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE Invoke(
+		_In_  DISPID      dispIdMember,
+		_In_  REFIID      riid,
+		_In_  LCID        lcid,
+		_In_  WORD        wFlags,
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult,
+		_Out_ EXCEPINFO*  pExcepInfo,
+		_Out_ UINT*       puArgErr
+	);
+
+private:
+	/**
+	 * @brief Number of reference to the object.
+	*/
+	DWORD m_dwReference{ 1 };
+
+	/**
+	 * @brief Object owning the method, kept alive while the future exists.
+	*/
+	IUnknown* m_pOwner;
+
+	/**
+	 * @brief Method to execute.
+	*/
+	const DynamicMethod* m_pMethod;
+
+	/**
+	 * @brief Copy of the arguments, in reverse order as in DISPPARAMS.
+	*/
+	std::vector<VARIANT> m_aArguments{};
+
+	/**
+	 * @brief Value returned by the method, valid once the future is done.
+	*/
+	VARIANT m_Result;
+
+	/**
+	 * @brief Outcome of the call, valid once the future is done.
+	*/
+	HRESULT m_hr{ E_PENDING };
+};
+
+#endif // !__DYNAMICFUTURE_HPP
@@ -10,29 +10,42 @@
 */
 #pragma once
 #include <windows.h>
+#include <memory>
+#include <string>
 
-#include "Types.hpp"
+#include "types.hpp"
+#include "MarshalPlan.hpp"
+#include "CallThunk.hpp"
+#include "CallStats.hpp"
+#include "TypeFeedback.hpp"
 
 #ifndef __DYNAMICMETHOD_HPP
 #define __DYNAMICMETHOD_HPP
 
-#define ARGUMENT_STD 0x00000000 /* Standard data */
-#define ARGUMENT_FLT 0x00000002 /* Floating point data */
-#define RETURN_STD   0x00000000 /* Standard data */
-#define RETURN_FLT   0x00000002 /* Floating point data */
+#define ARGUMENT_INLINE_COUNT 8 /* Number of arguments marshalled without touching the arena */
 
-class DynamicMethod {
+#define DYNAMICMETHOD_ALIGNMENT 32 /* Size and alignment of a method, two per cache line */
+#define DYNAMICMETHOD_ANY_ARITY 0xFFFFFFFF /* Arity of the methods registered without signature */
+
+/**
+ * @brief Per-call state of a dynamic method.
+ * @details Methods are stored by value in a dense array indexed by dispatch ID (see MethodTable.hpp), hence a call only
+ *          touches the cache line holding its method. Anything not required to execute the call lives in DynamicMethodInfo.
+*/
+class alignas(DYNAMICMETHOD_ALIGNMENT) DynamicMethod {
 public:
 	/**
 	 * @brief Constructor.
-	 * @param dwDispatchId The dispatch ID that has been associated to this dynamic method.
-	 * @param bstrFunctionName The name of the function to execute.
 	 * @param lpFunction The address of the function to execute.
+	 * @param pPlan The marshalling plan compiled from the signature of the function, or NULL if the signature is unknown.
+	 *              Owned by the DynamicMethodInfo of the method.
+	 * @param pFeedback The type feedback of the function if the signature is unknown, or NULL to always go through the
+	 *                  generic path. Owned by the DynamicMethodInfo of the method.
 	*/
 	DynamicMethod(
-		_In_ DWORD  dwDispatchId,
-		_In_ BSTR   bstrFunctionName,
-		_In_ LPVOID lpFunction
+		_In_     LPVOID             lpFunction,
+		_In_opt_ const MarshalPlan* pPlan,
+		_In_opt_ TypeFeedback*      pFeedback
 	);
 
 	/**
@@ -44,29 +57,62 @@ public:
 	 * @brief Dynamically execute the function associated to this dynamic method.
 	 * @param pDispParams List of parameters provided by the client.
 	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @param puArgErr The index within rgvarg of the first argument that has an error, if not NULL.
 	 * @return Whether the function executed successfully.
 	*/
 	HRESULT STDMETHODCALLTYPE Invoke(
-		_In_  DISPPARAMS* pDispParams,
-		_Out_ VARIANT*    pVarResult
-	);
+		_In_      DISPPARAMS* pDispParams,
+		_Out_     VARIANT*    pVarResult,
+		_Out_opt_ UINT*       puArgErr
+	) const;
 
 	/**
-	 * @brief Dispatch ID associated to the dynamic method.
+	 * @brief Address of the function to execute.
 	*/
-	DWORD m_dwDispatchId;
+	LPVOID m_lpFunction;
+
+	union {
+		/**
+		 * @brief Call thunk matching the signature of the function, NULL if not supported by thunks. Methods with a
+		 *        signature only.
+		*/
+		CallThunk m_lpThunk{ NULL };
+
+		/**
+		 * @brief Type feedback of the function, or NULL. Methods without signature only.
+		*/
+		TypeFeedback* m_pFeedback;
+	};
 
 	/**
-	 * @brief Name of the function to execute.
+	 * @brief Marshalling plan of the function, NULL if the function has been registered without signature.
 	*/
-	BSTR m_bstrFunctionName;
+	const MarshalPlan* m_pPlan;
 
 	/**
-	 * @brief Address of the function to execute.
+	 * @brief Number of arguments expected by the function, DYNAMICMETHOD_ANY_ARITY if the signature is unknown.
 	*/
-	LPVOID m_lpFunction;
+	DWORD m_dwArguments;
+
+	/**
+	 * @brief Statistics ID of the method (see CallStats.hpp).
+	*/
+	DWORD m_dwStatsId;
 };
 
+static_assert(sizeof(DynamicMethod) == DYNAMICMETHOD_ALIGNMENT, "DynamicMethod must not straddle cache lines");
+
+/**
+ * @brief Metadata of a dynamic method, not required to execute it.
+*/
+typedef struct _DynamicMethodInfo {
+	std::wstring                  wsFunctionName;  /* Name of the function, or its ordinal prefixed with '#' */
+	std::unique_ptr<MarshalPlan>  pPlan;           /* Marshalling plan of the function, or NULL */
+	std::unique_ptr<TypeFeedback> pFeedback;       /* Type feedback of the function, NULL if it has a signature */
+	std::wstring                  wsModuleName;    /* Normalised name of the module exporting the function */
+	std::wstring                  wsSignature;     /* Signature of the function, only meaningful if pPlan is set */
+} DynamicMethodInfo, *PDynamicMethodInfo;
+
 /**
  * @brief Dynamically execute a function. Function has been written in NASM x64.
  * @param lpTable The address of the table that contains the argument to pass to the function.
@@ -75,7 +121,7 @@ public:
  * @param dwReturnFlag Whether scalar or non-scalar data is expected to be returned.
  * @return Whether the function executed successfully.
 */
-extern "C" BOOL DynamicCall(
+extern "C" BOOL THUNKCALLTYPE DynamicCall(
 	_In_  PArgumentTable lpTable, 
 	_In_  LPVOID         lpFunction, 
 	_Out_ PRESULT        lpResut,
@@ -0,0 +1,326 @@
+/**
+* @file         DynamicStruct.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Structure layout and structure record Automation objects declaration.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <unknwn.h>
+#include <memory>
+#include <vector>
+
+#include "StructLayout.hpp"
+
+#ifndef __DYNAMICSTRUCT_HPP
+#define __DYNAMICSTRUCT_HPP
+
+/**
+ * @brief {9E4D2B71-3C58-4A0F-B6E3-51D8A2C7F094}
+*/
+static CONST GUID IID_IStructRecord = { 0x9e4d2b71, 0x3c58, 0x4a0f, {0xb6, 0xe3, 0x51, 0xd8, 0xa2, 0xc7, 0xf0, 0x94} };
+
+class StructRecord;
+
+/**
+ * @brief COM Automation object returned by DwStruct.
+ * @details Exposes Size, Alignment, OffsetOf(field), SizeOf(field), Pack(address, values) and Unpack(address[, record]).
+ *          Values are an array holding one value per field in declaration order, array fields being arrays themselves,
+ *          or a record returned by Unpack. Unpack returns such an array, or a record if its second parameter is true.
+*/
+class DynamicStruct : IDispatch {
+public:
+	/**
+	 * @brief Constructor. The object is created with one reference.
+	 * @param pLayout The compiled layout.
+	*/
+	DynamicStruct(
+		_In_ std::unique_ptr<StructLayout> pLayout
+	);
+
+	/**
+	 * @brief Destructor.
+	*/
+	virtual ~DynamicStruct();
+
+	/**
+	 * @brief Get the IDispatch interface of the object, with a new reference.
+	*/
+	IDispatch* GetDispatch(VOID);
+
+	/**
+	 * @brief Compiled layout.
+	*/
+	const StructLayout* GetLayout(VOID) const { return this->m_pLayout.get(); }
+
+	/**
+	 * @brief Write a structure.
+	 * @param lpAddress The address of the structure.
+	 * @param pValues The array of values or the record provided by the client.
+	 * @return Whether every value has been converted.
+	*/
+	HRESULT STDMETHODCALLTYPE Pack(
+		_Out_ LPVOID   lpAddress,
+		_In_  VARIANT* pValues
+	);
+
+	/**
+	 * @brief Read a structure.
+	 * @param lpAddress The address of the structure.
+	 * @param aFields Array of one VARIANT per field that receives the values, array fields as arrays.
+	 * @return Whether the values have been read.
+	*/
+	HRESULT STDMETHODCALLTYPE Unpack(
+		_In_  LPCVOID  lpAddress,
+		_Out_ VARIANT* aFields
+	);
+
+	/**
+	 * @brief Queries a COM object for a pointer to one of its interface.
+	 * @param riid A reference to the interface identifier (IID) of the interface being queried for.
+	 * @param ppvObject The address of a pointer to an interface with the IID specified in the riid parameter.
+	 * @return Whether an interface has been found.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE QueryInterface(
+		_In_  REFIID  riid,
+		_Out_ LPVOID* ppvObject
+	);
+
+	/**
+	 * @brief  Increment the number of references.
+	 * @return Number of remaining references.
+	*/
+	virtual ULONG STDMETHODCALLTYPE AddRef(VOID);
+
+	/**
+	 * @brief  Decrement the number of references, destroying the object when none is left.
+	 * @return Number of remaining references.
+	*/
+	virtual ULONG STDMETHODCALLTYPE Release(VOID);
+
+	/**
+	 * @brief Retrieves the number of type information interfaces that an object provides (either 0 or 1).
+	 * @param pctinfo The number of type information interfaces provided by the object.
+	 * @return Whether the function executed successfully.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE GetTypeInfoCount(
+		_Out_ UINT* pctinfo
+	);
+
+	/**
+	 * @brief Retrieves the type information for an object.
+	 * @param iTInfo The type information to return.
+	 * @param lcid The locale identifier for the type information.
+	 * @param ppTInfo The requested type information object.
+	 * @return Method not implemented.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE GetTypeInfo(
+		_In_  UINT        iTInfo,
+		_In_  LCID        lcid,
+		_Out_ ITypeInfo** ppTInfo
+	);
+
+	/**
+	 * @brief Maps a single member to its DISPID.
+	 * @param riid Reserved for future use. Must be IID_NULL.
+	 * @param rgszNames The array of names to be mapped.
+	 * @param cNames The count of the names to be mapped.
+	 * @param lcid The locale context in which to interpret the names.
+	 * @param rgDispId Caller-allocated array that receives the DISPID of each name.
+	 * @return Whether the function executed successfully.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE GetIDsOfNames(
+		_In_  REFIID    riid,
+		_In_  LPOLESTR* rgszNames,
+		_In_  UINT      cNames,
+		_In_  LCID      lcid,
+		_Out_ DISPID*   rgDispId
+	);
+
+	/**
+	 * @brief Provides access to the methods of the object. Methods without parameters can also be read as properties.
+	 * @param dispIdMember Identifies the member.
+	 * @param riid Reserved for future use. Must be IID_NULL.
+	 * @param lcid The locale context in which to interpret arguments.
+	 * @param wFlags Flags describing the context of the Invoke call.
+	 * @param pDispParams Pointer to a DISPPARAMS structure containing the arguments.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @param pExcepInfo Pointer to a structure that contains exception information.
+	 * @param puArgErr The index within rgvarg of the first argument that has an error.
+	 * @return Whether the function executed successfully.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE Invoke(
+		_In_  DISPID      dispIdMember,
+		_In_  REFIID      riid,
+		_In_  LCID        lcid,
+		_In_  WORD        wFlags,
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult,
+		_Out_ EXCEPINFO*  pExcepInfo,
+		_Out_ UINT*       puArgErr
+	);
+
+private:
+	/**
+	 * @brief Get a field provided by name by the client.
+	 * @param pName The name of the field.
+	 * @param ppField The address of a variable that receives the field.
+	 * @return Whether the field has been found.
+	*/
+	HRESULT STDMETHODCALLTYPE GetField(
+		_In_  VARIANT*            pName,
+		_Out_ const StructField** ppField
+	);
+
+	/**
+	 * @brief Number of reference to the object.
+	*/
+	DWORD m_dwReference{ 1 };
+
+	/**
+	 * @brief Compiled layout.
+	*/
+	std::unique_ptr<StructLayout> m_pLayout;
+};
+
+/**
+ * @brief COM Automation object returned by DwStruct(...).Unpack(address, true).
+ * @details Exposes one read-write property per field of the structure, array fields as arrays. Can be passed back to
+ *          Pack of the same structure.
+*/
+class StructRecord : IDispatch {
+public:
+	/**
+	 * @brief Constructor. The record is created with one reference and every field empty.
+	 * @param pStruct The structure of the record, referenced while the record exists.
+	*/
+	StructRecord(
+		_In_ DynamicStruct* pStruct
+	);
+
+	/**
+	 * @brief Destructor.
+	*/
+	virtual ~StructRecord();
+
+	/**
+	 * @brief Get the record behind an IDispatch interface.
+	 * @param pDispatch The interface provided by the client.
+	 * @return The record, with a new reference, or NULL if the interface is not one of a record.
+	*/
+	static StructRecord* FromDispatch(
+		_In_ IDispatch* pDispatch
+	);
+
+	/**
+	 * @brief Get the IDispatch interface of the record, with a new reference.
+	*/
+	IDispatch* GetDispatch(VOID);
+
+	/**
+	 * @brief Queries a COM object for a pointer to one of its interface.
+	 * @param riid A reference to the interface identifier (IID) of the interface being queried for.
+	 * @param ppvObject The address of a pointer to an interface with the IID specified in the riid parameter.
+	 * @return Whether an interface has been found.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE QueryInterface(
+		_In_  REFIID  riid,
+		_Out_ LPVOID* ppvObject
+	);
+
+	/**
+	 * @brief  Increment the number of references.
+	 * @return Number of remaining references.
+	*/
+	virtual ULONG STDMETHODCALLTYPE AddRef(VOID);
+
+	/**
+	 * @brief  Decrement the number of references, destroying the record when none is left.
+	 * @return Number of remaining references.
+	*/
+	virtual ULONG STDMETHODCALLTYPE Release(VOID);
+
+	/**
+	 * @brief Retrieves the number of type information interfaces that an object provides (either 0 or 1).
+	 * @param pctinfo The number of type information interfaces provided by the object.
+	 * @return Whether the function executed successfully.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE GetTypeInfoCount(
+		_Out_ UINT* pctinfo
+	);
+
+	/**
+	 * @brief Retrieves the type information for an object.
+	 * @param iTInfo The type information to return.
+	 * @param lcid The locale identifier for the type information.
+	 * @param ppTInfo The requested type information object.
+	 * @return Method not implemented.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE GetTypeInfo(
+		_In_  UINT        iTInfo,
+		_In_  LCID        lcid,
+		_Out_ ITypeInfo** ppTInfo
+	);
+
+	/**
+	 * @brief Maps a single field name to its DISPID, the index of the field.
+	 * @param riid Reserved for future use. Must be IID_NULL.
+	 * @param rgszNames The array of names to be mapped.
+	 * @param cNames The count of the names to be mapped.
+	 * @param lcid The locale context in which to interpret the names.
+	 * @param rgDispId Caller-allocated array that receives the DISPID of each name.
+	 * @return Whether the function executed successfully.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE GetIDsOfNames(
+		_In_  REFIID    riid,
+		_In_  LPOLESTR* rgszNames,
+		_In_  UINT      cNames,
+		_In_  LCID      lcid,
+		_Out_ DISPID*   rgDispId
+	);
+
+	/**
+	 * @brief Read or write a field of the record.
+	 * @param dispIdMember Identifies the field.
+	 * @param riid Reserved for future use. Must be IID_NULL.
+	 * @param lcid The locale context in which to interpret arguments.
+	 * @param wFlags Flags describing the context of the Invoke call.
+	 * @param pDispParams Pointer to a DISPPARAMS structure containing the arguments.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @param pExcepInfo Pointer to a structure that contains exception information.
+	 * @param puArgErr The index within rgvarg of the first argument that has an error.
+	 * @return Whether the function executed successfully.
+	*/
+	virtual HRESULT STDMETHODCALLTYPE Invoke(
+		_In_  DISPID      dispIdMember,
+		_In_  REFIID      riid,
+		_In_  LCID        lcid,
+		_In_  WORD        wFlags,
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult,
+		_Out_ EXCEPINFO*  pExcepInfo,
+		_Out_ UINT*       puArgErr
+	);
+
+	/**
+	 * @brief Structure of the record.
+	*/
+	DynamicStruct* m_pStruct;
+
+	/**
+	 * @brief Value of every field, in declaration order.
+	*/
+	std::vector<VARIANT> m_aFields{};
+
+private:
+	/**
+	 * @brief Number of reference to the object.
+	*/
+	DWORD m_dwReference{ 1 };
+};
+
+#endif // !__DYNAMICSTRUCT_HPP
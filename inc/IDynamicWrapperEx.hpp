@@ -19,6 +19,8 @@
 #ifndef __IDYNAMICWRAPPEREX_H
 #define __IDYNAMICWRAPPEREX_H
 
+#define IDYNAMICWRAPPEREX_POOL 16 /* Number of released objects kept for the next instances */
+
 /**
  * @brief {F757F2EC-62D8-4BAE-8BE0-0A61CF36A541}
 */
@@ -30,7 +32,7 @@ static CONST GUID IID_IDynamicWrapperEx = { 0xf757f2ec , 0x62d8, 0x4bae , {0x8b,
 class IDynamicWrapperEx : IDispatch {
 public:
 	/**
-	 * @brief Constructor.
+	 * @brief Constructor. The object is created with one reference.
 	*/
 	IDynamicWrapperEx();
 
@@ -39,6 +41,18 @@ public:
 	*/
 	virtual ~IDynamicWrapperEx();
 
+	/**
+	 * @brief Create an object, reusing a released one if any. The object is created with one reference and holds a
+	 *        lock on the server until released.
+	 * @return The object, or NULL if out of memory.
+	*/
+	static IDynamicWrapperEx* Create(VOID);
+
+	/**
+	 * @brief Delete the released objects kept for the next instances.
+	*/
+	static VOID DrainPool(VOID);
+
 	/**
 	 * @brief Queries a COM object for a pointer to one of its interface.
 	 * @param riid A reference to the interface identifier (IID) of the interface being queried for.
@@ -65,7 +79,7 @@ public:
 	/**
 	 * @brief Retrieves the number of type information interfaces that an object provides (either 0 or 1).
 	 * @param pctinfo The number of type information interfaces provided by the object.
-	 * @return Method not implemented.
+	 * @return Whether the function executed successfully.
 	*/
 	virtual HRESULT STDMETHODCALLTYPE GetTypeInfoCount(
 		_Out_ UINT* pctinfo
@@ -75,7 +89,7 @@ public:
 	 * @brief Retrieves the type information for an object, which can then be used to get the type information for an interface.
 	 * @param iTInfo The type information to return. Pass 0 to retrieve type information for the IDispatch implementation.
 	 * @param lcid The locale identifier for the type information.
-	 * @param ppTInfo The requested type information object.
+	 * @param ppTInfo The requested type information object, describing the methods registered so far.
 	 * @return Whether the function executed successfully.
 	*/
 	virtual HRESULT STDMETHODCALLTYPE GetTypeInfo(
@@ -125,10 +139,169 @@ public:
 	);
 
 private:
+	/**
+	 * @brief Execute a method of the object, either internal or dynamic.
+	 * @param dispIdMember Identifies the member.
+	 * @param pDispParams List of parameters provided by the client.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @param puArgErr The index within rgvarg of the first argument that has an error.
+	 * @return Whether the function executed successfully.
+	*/
+	HRESULT STDMETHODCALLTYPE Dispatch(
+		_In_  DISPID      dispIdMember,
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult,
+		_Out_ UINT*       puArgErr
+	);
+
+	/**
+	 * @brief Execute a sequence of calls in a single Invoke.
+	 * @details The only parameter is an array of calls. Each call is an array holding the dispatch ID or the name of the
+	 *          method followed by its arguments. An argument "@n" is replaced by the result of the call n of the same batch,
+	 *          which must come first. A leading "@@" is replaced by "@" to pass a literal string. An array of the results of
+	 *          every call is returned. The batch stops at the first call that fails.
+	 * @param pDispParams List of parameters provided by the client.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @param puArgErr The index of the call that has failed, if any.
+	 * @return Whether all the calls executed successfully.
+	*/
+	HRESULT STDMETHODCALLTYPE Batch(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult,
+		_Out_ UINT*       puArgErr
+	);
+
+	/**
+	 * @brief Execute a single call of a batch.
+	 * @param pCall The array describing the call.
+	 * @param dwCall The index of the call within the batch.
+	 * @param aResults The results of the previous calls of the batch. Receives the result of the call at index dwCall.
+	 * @return Whether the call executed successfully.
+	*/
+	HRESULT STDMETHODCALLTYPE BatchCall(
+		_In_    VARIANT* pCall,
+		_In_    DWORD    dwCall,
+		_Inout_ VARIANT* aResults
+	);
+
+	/**
+	 * @brief Execute a dynamic method on the worker pool.
+	 * @details Parameters are the dispatch ID or the name of the method followed by its arguments. The arguments are copied
+	 *          and a future object is returned straight away, see DynamicFuture.hpp.
+	 * @param pDispParams List of parameters provided by the client.
+	 * @param pVarResult Pointer to the location where the future is to be stored, or NULL if the caller expects no result.
+	 * @return Whether the call has been queued.
+	*/
+	HRESULT STDMETHODCALLTYPE InvokeAsync(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult
+	);
+
+	/**
+	 * @brief Wait until one of the futures is done.
+	 * @details Parameters are an array of futures and an optional time-out interval in milliseconds, infinite by default.
+	 *          The index of the first future done is returned, or -1 if the time-out interval elapsed.
+	 * @param pDispParams List of parameters provided by the client.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @return Whether the function executed successfully.
+	*/
+	HRESULT STDMETHODCALLTYPE WaitAny(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult
+	);
+
+	/**
+	 * @brief Execute a dynamic method once per argument tuple, optionally on several threads.
+	 * @details Parameters are the dispatch ID or the name of the method, the argument tuples and an optional number of
+	 *          threads. Tuples are either the rows of a two-dimensional array or the elements of an array, each one being an
+	 *          array of arguments or, for methods of one argument, the argument itself. The number of threads is 1 by
+	 *          default, which executes the calls on the client thread, and true or a negative number uses every processor.
+	 *          An array of the results is returned, in input order.
+	 * @param pDispParams List of parameters provided by the client.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @param puArgErr The index of the tuple that is invalid or of the first call that has failed, if any.
+	 * @return Whether all the calls executed successfully.
+	*/
+	HRESULT STDMETHODCALLTYPE Map(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult,
+		_Out_ UINT*       puArgErr
+	);
+
+	/**
+	 * @brief Flatten the argument tuples of a map.
+	 * @param pTuples The argument tuples provided by the client.
+	 * @param dwMethodArity The number of arguments of the method, DYNAMICMETHOD_ANY_ARITY if unknown.
+	 * @param aArguments Receives the arguments, each tuple in reverse order as in DISPPARAMS. Must be cleared by the caller.
+	 * @param pdwArity The address of a variable that receives the number of arguments per tuple.
+	 * @param pdwCalls The address of a variable that receives the number of tuples.
+	 * @param puArgErr The index of the tuple that is invalid, if any.
+	 * @return Whether the tuples are valid.
+	*/
+	HRESULT STDMETHODCALLTYPE MapArguments(
+		_In_    VARIANT*              pTuples,
+		_In_    DWORD                 dwMethodArity,
+		_Inout_ std::vector<VARIANT>& aArguments,
+		_Out_   PDWORD                pdwArity,
+		_Out_   PDWORD                pdwCalls,
+		_Out_   UINT*                 puArgErr
+	);
+
+	/**
+	 * @brief Create a native callback collecting its arguments.
+	 * @details Parameters are the signature of the callback, see MarshalPlan.hpp, and an optional value returned by the
+	 *          callback, 1 by default. A collector object is returned, see Collector.hpp.
+	 * @param pDispParams List of parameters provided by the client.
+	 * @param pVarResult Pointer to the location where the collector is to be stored, or NULL if the caller expects no result.
+	 * @return Whether the collector has been created.
+	*/
+	HRESULT STDMETHODCALLTYPE CreateCollector(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult
+	);
+
+	/**
+	 * @brief Compile a structure layout.
+	 * @details The only parameter is the definition of the structure, see StructLayout.hpp. A structure object is
+	 *          returned, see DynamicStruct.hpp.
+	 * @param pDispParams List of parameters provided by the client.
+	 * @param pVarResult Pointer to the location where the structure is to be stored, or NULL if the caller expects no result.
+	 * @return Whether the definition is valid.
+	*/
+	HRESULT STDMETHODCALLTYPE CreateStruct(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult
+	);
+
+	/**
+	 * @brief Start or stop tracing the calls of dynamic methods, see CallTrace.hpp.
+	 * @details With the path of a file, tracing starts into it, ending the trace in progress if any, and whether it has
+	 *          started is returned. It never starts if DWEX_ENABLE_TRACE was not defined at build time. Without parameter,
+	 *          tracing stops and the number of calls written to the file is returned.
+	 * @param pDispParams List of parameters provided by the client.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @return Whether the function executed successfully.
+	*/
+	HRESULT STDMETHODCALLTYPE Trace(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult
+	);
+
+	/**
+	 * @brief Get the dispatch ID of a method, provided by dispatch ID or by name.
+	 * @param pMember The dispatch ID or the name of the method.
+	 * @param plDispId The address of a variable that receives the dispatch ID.
+	 * @return Whether the method has been found.
+	*/
+	HRESULT STDMETHODCALLTYPE ResolveMember(
+		_In_  VARIANT* pMember,
+		_Out_ DISPID*  plDispId
+	);
+
 	/**
 	* @brief Number of reference to the object.
 	*/
-	DWORD m_dwReference{ 0 };
+	DWORD m_dwReference{ 1 };
 
 	/**
 	 * @brief Unique pointer to an AutomationFactory class.
@@ -0,0 +1,226 @@
+/**
+* @file         MarshalPlan.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Precompiled argument marshalling plan declaration.
+* @details      A plan is compiled once from a signature string when a dynamic method is registered.
+*               The signature lists one character per argument, optionally followed by '=' and the return kind:
+*                 i: 32-bit integer    l: 64-bit integer    p: pointer    b: boolean
+*                 f: float             d: double            s: UTF-16 string
+*                 a: ANSI string       u: UTF-8 string
+*               The return kind can also be v (void). For example MessageBoxW is "psspi=i" and MessageBoxA is "paapi=i".
+*               UTF-16 strings are passed in place. ANSI and UTF-8 strings are converted into the arena of the calling
+*               thread and released when the native function returns. Pointers can be provided as arrays of fixed-width
+*               elements, e.g. bytes, in which case the data of the array is passed in place.
+*               A kind other than a string preceded by '&' is a pointer to a value of that kind, e.g. DWORD* is "&i".
+*               Variables passed by reference by the client are copied into a slot of the call whose address is passed,
+*               and the slot is written back into the variable once the function returned. Other values are passed as
+*               pointers, e.g. 0 for NULL. For example ReadFile is "ppi&ip=b".
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <memory>
+#include <vector>
+
+#include "types.hpp"
+#include "ThreadArena.hpp"
+
+#ifndef __MARSHALPLAN_HPP
+#define __MARSHALPLAN_HPP
+
+/**
+ * @brief Kind of argument or return value declared in a signature.
+*/
+typedef enum _ArgumentKind {
+	ArgumentKindInt32   = L'i',
+	ArgumentKindInt64   = L'l',
+	ArgumentKindPointer = L'p',
+	ArgumentKindBool    = L'b',
+	ArgumentKindFloat   = L'f',
+	ArgumentKindDouble  = L'd',
+	ArgumentKindString  = L's',
+	ArgumentKindAnsi    = L'a',
+	ArgumentKindUtf8    = L'u',
+	ArgumentKindVoid    = L'v',
+	ArgumentKindInt8    = L'c', /* Structure fields only */
+	ArgumentKindInt16   = L'h'  /* Structure fields only */
+} ArgumentKind;
+
+/**
+ * @brief Convert a VARIANT into the argument expected by the native function.
+ * @param pVariant The VARIANT provided by the client.
+ * @param pArgument The argument to pass to the native function.
+ * @param pScope Scratch memory of the call, released when the native function returns. NULL if the argument must not
+ *               be converted into scratch memory.
+ * @return Whether the VARIANT could be converted.
+*/
+typedef HRESULT(*ArgumentConverter)(
+	_In_        VARIANT*    pVariant,
+	_Out_       PArgument   pArgument,
+	_Inout_opt_ ArenaScope* pScope
+);
+
+class MarshalPlan {
+public:
+	/**
+	 * @brief Compile a signature string into a marshalling plan.
+	 * @param wszSignature The signature string.
+	 * @param ppPlan The address of a variable that receives the plan.
+	 * @return Whether the signature is valid.
+	*/
+	static HRESULT STDMETHODCALLTYPE Compile(
+		_In_  LPCWSTR                       wszSignature,
+		_Out_ std::unique_ptr<MarshalPlan>* ppPlan
+	);
+
+	/**
+	 * @brief Convert the parameters provided by the client into native arguments.
+	 * @param pDispParams List of parameters provided by the client. Must contain exactly m_dwArguments elements.
+	 * @param pArguments Array of m_dwArguments arguments, in native order.
+	 * @param pScope Scratch memory of the call, must not be released before the native function returns.
+	 * @param puArgErr The index within rgvarg of the first argument that has an error, if not NULL.
+	 * @return Whether all arguments have been converted.
+	*/
+	HRESULT STDMETHODCALLTYPE Marshal(
+		_In_      DISPPARAMS* pDispParams,
+		_Out_     PArgument   pArguments,
+		_Inout_   ArenaScope* pScope,
+		_Out_opt_ UINT*       puArgErr
+	) const;
+
+	/**
+	 * @brief Write the arguments passed by reference back into the variables of the client.
+	 * @param pDispParams List of parameters provided by the client, as given to Marshal.
+	 * @param pArguments Array of m_dwArguments arguments, as filled by Marshal.
+	*/
+	VOID STDMETHODCALLTYPE WriteBack(
+		_Inout_ DISPPARAMS*     pDispParams,
+		_In_    const Argument* pArguments
+	) const;
+
+	/**
+	 * @brief Convert the value returned by the native function into a VARIANT.
+	 * @param pResult The value returned by the native function.
+	 * @param pVarResult Pointer to the location where the result is to be stored.
+	*/
+	VOID STDMETHODCALLTYPE Unmarshal(
+		_In_  PRESULT  pResult,
+		_Out_ VARIANT* pVarResult
+	) const;
+
+	/**
+	 * @brief Get the converter associated to a kind of argument.
+	 * @param eKind The kind of argument.
+	 * @return The converter, or NULL if the kind is not valid for an argument.
+	*/
+	static ArgumentConverter GetConverter(
+		_In_ ArgumentKind eKind
+	);
+
+	/**
+	 * @brief Get the size of a type whose values are plain data of a fixed width, which native functions can use in place.
+	 * @param vt The type.
+	 * @return The size in bytes, or 0 if the values of the type are not plain data.
+	*/
+	static ULONG GetFixedWidth(
+		_In_ VARTYPE vt
+	);
+
+	/**
+	 * @brief Get the data of an array of fixed-width elements, locked until the scope of the call is destroyed.
+	 * @param pVariant The VARIANT provided by the client.
+	 * @param pScope Scratch memory of the call.
+	 * @param ppvData The address of a variable that receives the address of the first element.
+	 * @return S_OK if the data is locked, S_FALSE if the VARIANT is not an array of fixed-width elements.
+	*/
+	static HRESULT STDMETHODCALLTYPE LockArray(
+		_In_    VARIANT*    pVariant,
+		_Inout_ ArenaScope* pScope,
+		_Out_   LPVOID*     ppvData
+	);
+
+	/**
+	 * @brief Copy a value passed by reference into a slot of the call, whose address is passed to the native function.
+	 * @param pReference The VARIANT provided by the client, VT_BYREF.
+	 * @param eKind The kind of the value pointed to by the native argument.
+	 * @param pScope Scratch memory of the call, which holds the slot.
+	 * @param pArgument The argument to pass to the native function.
+	 * @return Whether the value could be converted.
+	*/
+	static HRESULT STDMETHODCALLTYPE LoadReference(
+		_In_    VARIANT*     pReference,
+		_In_    ArgumentKind eKind,
+		_Inout_ ArenaScope*  pScope,
+		_Out_   PArgument    pArgument
+	);
+
+	/**
+	 * @brief Write a slot filled by the native function back into the value passed by reference.
+	 * @param pReference The VARIANT provided by the client, VT_BYREF. Variables receive a value of the kind, typed
+	 *                   references keep their type.
+	 * @param eKind The kind of the value pointed to by the native argument.
+	 * @param lpSlot The slot.
+	*/
+	static VOID STDMETHODCALLTYPE StoreReference(
+		_Inout_ VARIANT*       pReference,
+		_In_    ArgumentKind   eKind,
+		_In_    const DWORD64* lpSlot
+	);
+
+	/**
+	 * @brief Convert a native value into a VARIANT.
+	 * @param eKind The kind of the value.
+	 * @param pValue The native value.
+	 * @param pVariant Pointer to the location where the VARIANT is to be stored.
+	*/
+	static VOID STDMETHODCALLTYPE ToVariant(
+		_In_  ArgumentKind eKind,
+		_In_  PRESULT      pValue,
+		_Out_ VARIANT*     pVariant
+	);
+
+	/**
+	 * @brief Number of arguments expected by the native function.
+	*/
+	DWORD m_dwArguments{ 0 };
+
+	/**
+	 * @brief Kind of the return value.
+	*/
+	ArgumentKind m_eReturn{ ArgumentKindPointer };
+
+	/**
+	 * @brief Whether scalar or floating point data is returned (RETURN_STD or RETURN_FLT).
+	*/
+	DWORD m_dwReturnFlag{ RETURN_STD };
+
+	/**
+	 * @brief Bit N is set if the argument N is floating point data. Only the register arguments are recorded.
+	*/
+	DWORD m_dwFloatMask{ 0 };
+
+	/**
+	 * @brief Kind of each argument, in native order.
+	*/
+	std::vector<ArgumentKind> m_aKinds{};
+
+	/**
+	 * @brief Converter of each argument, in native order.
+	*/
+	std::vector<ArgumentConverter> m_aConverters{};
+
+	/**
+	 * @brief Kind of the value pointed to by each argument passed by reference, ArgumentKindVoid for the others.
+	*/
+	std::vector<ArgumentKind> m_aReferences{};
+
+	/**
+	 * @brief Number of arguments passed by reference.
+	*/
+	DWORD m_dwReferences{ 0 };
+};
+
+#endif // !__MARSHALPLAN_HPP
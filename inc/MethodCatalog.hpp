@@ -0,0 +1,138 @@
+/**
+* @file         MethodCatalog.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Process-wide catalog of dynamic methods declaration.
+* @details      Every method registered by any COM Automation object of the process is published once into the catalog,
+*               which owns it until the process exits. Objects do not copy methods: each object keeps its own names and
+*               the index in the catalog of the methods it registered (see AutomationFactory.hpp), and never sees the
+*               methods of the others. Registering a method already resolved by another object, i.e. the same module,
+*               function and signature, returns the published method without resolving it again.
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "DynamicMethod.hpp"
+#include "MethodTable.hpp"
+
+#ifndef __METHODCATALOG_HPP
+#define __METHODCATALOG_HPP
+
+class MethodCatalog {
+public:
+	/**
+	 * @brief Get the process-wide instance.
+	*/
+	static MethodCatalog& Instance(VOID);
+
+	/**
+	 * @brief Find a method already published.
+	 * @param wszModuleName The normalised name of the module (see ModuleCache::Normalize).
+	 * @param wszFunctionName The name of the function, or its ordinal prefixed with '#'.
+	 * @param wszSignature The signature of the function, or NULL.
+	 * @param pdwIndex The address of a variable that receives the index of the method.
+	 * @return Whether the method has been published.
+	*/
+	HRESULT STDMETHODCALLTYPE Find(
+		_In_     LPCWSTR wszModuleName,
+		_In_     LPCWSTR wszFunctionName,
+		_In_opt_ LPCWSTR wszSignature,
+		_Out_    PDWORD  pdwIndex
+	);
+
+	/**
+	 * @brief Publish a method, unless the same one has already been published.
+	 * @param wszModuleName The normalised name of the module (see ModuleCache::Normalize).
+	 * @param wszFunctionName The name of the function, or its ordinal prefixed with '#'.
+	 * @param wszSignature The signature of the function, or NULL.
+	 * @param pPlan The marshalling plan compiled from the signature, or NULL.
+	 * @param lpFunction The address of the function.
+	 * @param pdwIndex The address of a variable that receives the index of the method.
+	 * @return Whether the method has been published.
+	*/
+	HRESULT STDMETHODCALLTYPE Publish(
+		_In_     LPCWSTR                      wszModuleName,
+		_In_     LPCWSTR                      wszFunctionName,
+		_In_opt_ LPCWSTR                      wszSignature,
+		_In_opt_ std::unique_ptr<MarshalPlan> pPlan,
+		_In_     LPVOID                       lpFunction,
+		_Out_    PDWORD                       pdwIndex
+	);
+
+	/**
+	 * @brief Get a method. Safe to call while another method is published.
+	 * @param dwIndex The index of the method.
+	 * @return The method, or NULL if the index is out of range.
+	*/
+	const DynamicMethod* Get(
+		_In_ DWORD dwIndex
+	) const {
+		return this->m_Methods.Get(dwIndex);
+	}
+
+	/**
+	 * @brief Get the metadata of a method. Immutable once published.
+	 * @param dwIndex The index of the method.
+	 * @return The metadata, or NULL if the index is out of range.
+	*/
+	const DynamicMethodInfo* GetInfo(
+		_In_ DWORD dwIndex
+	) const {
+		return this->m_Methods.GetInfo(dwIndex);
+	}
+
+	/**
+	 * @brief Number of methods published.
+	*/
+	DWORD Size(VOID) const {
+		return this->m_Methods.Size();
+	}
+
+private:
+	/**
+	 * @brief Constructor.
+	*/
+	MethodCatalog();
+
+	/**
+	 * @brief Destructor.
+	*/
+	~MethodCatalog();
+
+	/**
+	 * @brief Build the key of a method: module and function separated by '!', then the signature if any.
+	*/
+	static std::wstring Key(
+		_In_     LPCWSTR wszModuleName,
+		_In_     LPCWSTR wszFunctionName,
+		_In_opt_ LPCWSTR wszSignature
+	);
+
+	/**
+	 * @brief Serialise publications.
+	*/
+	SRWLOCK m_Lock = SRWLOCK_INIT;
+
+	/**
+	 * @brief Methods published.
+	*/
+	MethodTable m_Methods{};
+
+	/**
+	 * @brief Index of the methods, by key.
+	*/
+	typedef std::unordered_map<std::wstring, DWORD> KeyIndex;
+
+	/**
+	 * @brief Index of every method, by key.
+	*/
+	KeyIndex m_Keys{};
+};
+
+#endif // !__METHODCATALOG_HPP
@@ -0,0 +1,110 @@
+/**
+* @file         MethodTable.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Append-only table of dynamic methods declaration.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <atomic>
+#include <memory>
+
+#include "DynamicMethod.hpp"
+
+#ifndef __METHODTABLE_HPP
+#define __METHODTABLE_HPP
+
+#define METHODTABLE_FIRST_SEGMENT 64 /* Number of methods in the first segment, must be a power of two */
+#define METHODTABLE_SEGMENTS      24 /* Number of segments, each one twice as large as the previous one */
+#define METHODTABLE_ALIGNMENT     64 /* Alignment of the segments of methods, size of a cache line */
+
+/**
+ * @brief Append-only table of dynamic methods, indexed from 0.
+ * @details Methods are stored by value in segments that are never moved nor freed until the table is destroyed, hence a
+ *          method can be looked up without taking a lock while another one is appended. Appends must be serialised by the
+ *          caller. A method is published by a release store of the size of the table, once its slot has been written.
+ *          Segments of methods are cache line aligned and only hold the per-call state. The metadata of the methods is
+ *          stored in a parallel set of segments.
+*/
+class MethodTable {
+public:
+	/**
+	 * @brief Constructor.
+	*/
+	MethodTable();
+
+	/**
+	 * @brief Destructor.
+	*/
+	~MethodTable();
+
+	/**
+	 * @brief Append a method to the table. Never throws.
+	 * @param lpFunction The address of the function to execute.
+	 * @param pInfo The metadata of the method, moved into the table once appended. The type feedback is created by the
+	 *        table for methods without marshalling plan.
+	 * @param pdwIndex The address of a variable that receives the index of the method, if not NULL.
+	 * @return Whether the method has been appended.
+	*/
+	HRESULT STDMETHODCALLTYPE Append(
+		_In_      LPVOID             lpFunction,
+		_Inout_   PDynamicMethodInfo pInfo,
+		_Out_opt_ PDWORD             pdwIndex
+	);
+
+	/**
+	 * @brief Get a method.
+	 * @param dwIndex The index of the method.
+	 * @return The method, or NULL if the index is out of range.
+	*/
+	const DynamicMethod* Get(
+		_In_ DWORD dwIndex
+	) const;
+
+	/**
+	 * @brief Get the metadata of a method.
+	 * @param dwIndex The index of the method.
+	 * @return The metadata, or NULL if the index is out of range.
+	*/
+	DynamicMethodInfo* GetInfo(
+		_In_ DWORD dwIndex
+	) const;
+
+	/**
+	 * @brief Number of methods published.
+	*/
+	DWORD Size(VOID) const;
+
+	/**
+	 * @brief Find the segment storing a method. Also used by other tables sharing the same layout.
+	 * @param dwIndex The index of the method.
+	 * @param pdwOffset The address of a variable that receives the index of the method within the segment.
+	 * @return The index of the segment.
+	*/
+	static DWORD Segment(
+		_In_  DWORD  dwIndex,
+		_Out_ PDWORD pdwOffset
+	);
+
+private:
+	/**
+	 * @brief Segments of methods, allocated on demand.
+	*/
+	std::atomic<DynamicMethod*> m_aSegments[METHODTABLE_SEGMENTS];
+
+	/**
+	 * @brief Segments of metadata, allocated along with the segments of methods.
+	*/
+	std::atomic<PDynamicMethodInfo> m_aInfoSegments[METHODTABLE_SEGMENTS];
+
+	/**
+	 * @brief Number of methods published.
+	*/
+	std::atomic<DWORD> m_dwSize{ 0 };
+};
+
+#endif // !__METHODTABLE_HPP
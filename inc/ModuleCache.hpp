@@ -0,0 +1,124 @@
+/**
+* @file         ModuleCache.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Process-wide module and export resolution cache declaration.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "PeExportIndex.hpp"
+
+#ifndef __MODULECACHE_HPP
+#define __MODULECACHE_HPP
+
+/**
+ * @brief Cache of loaded modules and resolved exports shared by all the COM Automation objects of the process.
+ * @details Every module is loaded once, hence the loader reference count is only incremented once per module.
+ *          Exports are resolved from an index of the export directory of the module, built on first use. Forwarded exports
+ *          are followed to their final target, hence calls do not go through the forwarding stub.
+*/
+class ModuleCache {
+public:
+	/**
+	 * @brief Get the process-wide instance.
+	*/
+	static ModuleCache& Instance(VOID);
+
+	/**
+	 * @brief Get a module, loading it on first use.
+	 * @param wszModuleName The name of the module (e.g. user32.dll).
+	 * @param phModule The address of a variable that receives the module handle.
+	 * @return Whether the module has been loaded.
+	*/
+	HRESULT STDMETHODCALLTYPE GetModule(
+		_In_  LPCWSTR  wszModuleName,
+		_Out_ HMODULE* phModule
+	);
+
+	/**
+	 * @brief Get the address of an exported function, resolving it on first use.
+	 * @param wszModuleName The name of the module (e.g. user32.dll).
+	 * @param wszFunctionName The name of the function (e.g. MessageBoxW), or its ordinal prefixed with '#' (e.g. #12).
+	 * @param ppFunction The address of pointer variable that receives the address of the function.
+	 * @return Whether the address of the function has been found.
+	*/
+	HRESULT STDMETHODCALLTYPE GetExport(
+		_In_  LPCWSTR wszModuleName,
+		_In_  LPCWSTR wszFunctionName,
+		_Out_ LPVOID* ppFunction
+	);
+
+	/**
+	 * @brief Normalise a module name: lower case, with the default ".dll" extension if none is provided.
+	 * @param wszModuleName The name of the module.
+	 * @return The normalised name.
+	*/
+	static std::wstring Normalize(
+		_In_ LPCWSTR wszModuleName
+	);
+
+private:
+	/**
+	 * @brief Constructor.
+	*/
+	ModuleCache();
+
+	/**
+	 * @brief Destructor.
+	*/
+	~ModuleCache();
+
+	/**
+	 * @brief Resolve an export of a loaded module, following forwarders.
+	 * @param hModule The handle of the module.
+	 * @param szFunctionName The name of the function, or its ordinal prefixed with '#'.
+	 * @param dwDepth Number of forwarders already followed.
+	 * @param ppFunction The address of pointer variable that receives the address of the function.
+	 * @return Whether the address of the function has been found.
+	*/
+	HRESULT STDMETHODCALLTYPE Resolve(
+		_In_  HMODULE hModule,
+		_In_  LPCSTR  szFunctionName,
+		_In_  DWORD   dwDepth,
+		_Out_ LPVOID* ppFunction
+	);
+
+	/**
+	 * @brief Get the export index of a loaded module, building it on first use.
+	 * @param hModule The handle of the module.
+	 * @return The index, or NULL if the export directory could not be parsed.
+	*/
+	const PeExportIndex* GetIndex(
+		_In_ HMODULE hModule
+	);
+
+	/**
+	 * @brief Protect the maps.
+	*/
+	SRWLOCK m_Lock = SRWLOCK_INIT;
+
+	/**
+	 * @brief Loaded modules, indexed by normalised name.
+	*/
+	std::unordered_map<std::wstring, HMODULE> m_Modules{};
+
+	/**
+	 * @brief Resolved exports, indexed by normalised module name and function name separated by '!'.
+	*/
+	std::unordered_map<std::wstring, LPVOID> m_Exports{};
+
+	/**
+	 * @brief Export indexes of the loaded modules.
+	*/
+	std::unordered_map<HMODULE, std::unique_ptr<PeExportIndex>> m_Indexes{};
+};
+
+#endif // !__MODULECACHE_HPP
@@ -0,0 +1,159 @@
+/**
+* @file         NameIndex.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Interned name to dispatch ID hash index declaration.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#ifndef __NAMEINDEX_HPP
+#define __NAMEINDEX_HPP
+
+/**
+ * @brief Case-insensitive hash index mapping method names to dispatch IDs.
+ * @details Names are interned into storage owned by the index, hence callers can release their own copy once inserted.
+ *          Lookups never take a lock and can run concurrently with an insertion. Insertions must be serialised by the caller.
+ *          Entries are published by a release store of their name, and the table is swapped as a whole when it grows.
+ *          Tables replaced by a larger one are retired but kept until the index is destroyed, as a lookup may still be
+ *          probing them. Their total size never exceeds the size of the current table.
+*/
+class NameIndex {
+public:
+	/**
+	 * @brief Constructor. The first table is allocated by the first insertion.
+	*/
+	NameIndex();
+
+	/**
+	 * @brief Destructor.
+	*/
+	~NameIndex();
+
+	/**
+	 * @brief Insert a new name into the index.
+	 * @param wszName The name to insert.
+	 * @param lDispId The dispatch ID associated to the name.
+	 * @param ppwszInterned The address of a pointer variable that receives the interned copy of the name, if not NULL.
+	 * @return S_OK if inserted, S_FALSE if the name was already present, error otherwise.
+	*/
+	HRESULT STDMETHODCALLTYPE Insert(
+		_In_      LPCWSTR  wszName,
+		_In_      DISPID   lDispId,
+		_Out_opt_ LPCWSTR* ppwszInterned
+	);
+
+	/**
+	 * @brief Find the dispatch ID associated to a name.
+	 * @param wszName The name to look for.
+	 * @param plDispId The address of a variable that receives the dispatch ID.
+	 * @return Whether the name has been found.
+	*/
+	HRESULT STDMETHODCALLTYPE Find(
+		_In_  LPCWSTR wszName,
+		_Out_ DISPID* plDispId
+	) const;
+
+	/**
+	 * @brief Number of names in the index.
+	*/
+	DWORD m_dwEntries{ 0 };
+
+private:
+	/**
+	 * @brief Entry of the open addressing table. An entry without name is free.
+	*/
+	typedef struct _NameIndexEntry {
+		DWORD                dwHash;
+		DISPID               lDispId;
+		std::atomic<LPCWSTR> wszName;
+	} NameIndexEntry, *PNameIndexEntry;
+
+	/**
+	 * @brief Open addressing table. Size is always a power of two.
+	*/
+	typedef struct _NameIndexTable {
+		SIZE_T                            dwMask;
+		std::unique_ptr<NameIndexEntry[]> aEntries;
+	} NameIndexTable, *PNameIndexTable;
+
+	/**
+	 * @brief Allocate an empty table.
+	 * @param dwSize The number of entries, must be a power of two.
+	 * @return The table, or NULL on failure.
+	*/
+	static std::unique_ptr<NameIndexTable> CreateTable(
+		_In_ SIZE_T dwSize
+	);
+
+	/**
+	 * @brief Compute the case-insensitive hash of a name.
+	 * @param wszName The name to hash.
+	 * @param pdwLength The address of a variable that receives the length of the name, in characters.
+	 * @return The FNV-1a hash of the case-folded name.
+	*/
+	static DWORD Hash(
+		_In_  LPCWSTR wszName,
+		_Out_ PDWORD  pdwLength
+	);
+
+	/**
+	 * @brief Case-insensitive comparison of two names.
+	 * @return Whether both names are equal.
+	*/
+	static BOOL Equals(
+		_In_ LPCWSTR wszLeft,
+		_In_ LPCWSTR wszRight
+	);
+
+	/**
+	 * @brief Copy a name into the storage owned by the index.
+	 * @param wszName The name to copy.
+	 * @param dwLength The length of the name, in characters.
+	 * @return The interned copy of the name, or NULL on failure.
+	*/
+	LPCWSTR Intern(
+		_In_ LPCWSTR wszName,
+		_In_ DWORD   dwLength
+	);
+
+	/**
+	 * @brief Double the size of the table, or allocate the first one, re-insert all entries and publish the new table.
+	 * @return Whether the table has grown.
+	*/
+	BOOL Grow(VOID);
+
+	/**
+	 * @brief Table used by lookups.
+	*/
+	std::atomic<PNameIndexTable> m_pTable{ nullptr };
+
+	/**
+	 * @brief Current table, last, and retired tables.
+	*/
+	std::vector<std::unique_ptr<NameIndexTable>> m_aTables{};
+
+	/**
+	 * @brief Blocks of memory storing the interned names.
+	*/
+	std::vector<std::unique_ptr<WCHAR[]>> m_aBlocks{};
+
+	/**
+	 * @brief Number of characters of the last block.
+	*/
+	DWORD m_dwBlockSize{ 0 };
+
+	/**
+	 * @brief Number of characters still available in the last block.
+	*/
+	DWORD m_dwBlockAvailable{ 0 };
+};
+
+#endif // !__NAMEINDEX_HPP
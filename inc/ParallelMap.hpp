@@ -0,0 +1,193 @@
+/**
+* @file         ParallelMap.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Execution of a dynamic method over many argument tuples declaration.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <atomic>
+#include <memory>
+
+#include "DynamicMethod.hpp"
+#include "WorkerPool.hpp"
+
+#ifndef __PARALLELMAP_HPP
+#define __PARALLELMAP_HPP
+
+#define PARALLELMAP_MAX_PARTICIPANTS 16 /* Largest number of threads working on a single map */
+#define PARALLELMAP_MIN_CALLS        64 /* Smallest number of calls worth a thread */
+#define PARALLELMAP_MAX_GRAIN        64 /* Largest number of calls taken at once by a thread */
+
+/**
+ * @brief Range of calls owned by a thread, begin in the low 32 bits and end in the high 32 bits.
+ * @details One range per cache line, as every thread updates its own range for each grain of calls.
+*/
+typedef struct alignas(64) _MapRange {
+	std::atomic<ULONGLONG> qwRange;
+} MapRange, *PMapRange;
+
+/**
+ * @brief Execute a dynamic method once per argument tuple, sequentially or on several threads.
+ * @details Calls are split evenly between the threads. Each thread takes grains of calls from the front of its own range
+ *          and, once it is empty, steals the back half of the range of another thread. The calling thread takes part,
+ *          the other threads come from the worker pool; helpers that only start once all calls are done exit straight away.
+ *          The state shared with the helpers is reference counted, hence the call returns as soon as every call is done.
+*/
+class ParallelMap {
+public:
+	/**
+	 * @brief Execute the calls.
+	 * @param pMethod The method to execute.
+	 * @param aArguments The arguments, dwArity per call, each tuple in reverse order as in DISPPARAMS.
+	 * @param dwArity The number of arguments per call.
+	 * @param dwCalls The number of calls.
+	 * @param aResults Array of dwCalls VARIANTs that receives the results, in input order.
+	 * @param dwThreads The largest number of threads to use, 1 to execute the calls sequentially on the calling thread.
+	 * @param pdwFailed The address of a variable that receives the index of the first call that failed, if any.
+	 * @return Whether all calls executed successfully. Calls are abandoned after the first failure.
+	*/
+	static HRESULT STDMETHODCALLTYPE Run(
+		_In_  const DynamicMethod* pMethod,
+		_In_  VARIANT*             aArguments,
+		_In_  DWORD                dwArity,
+		_In_  DWORD                dwCalls,
+		_Out_ VARIANT*             aResults,
+		_In_  DWORD                dwThreads,
+		_Out_ PDWORD               pdwFailed
+	);
+
+private:
+	/**
+	 * @brief Task of the worker pool running one of the threads of the map.
+	*/
+	class Helper : public WorkerTask {
+	public:
+		virtual VOID Execute(VOID);
+		virtual VOID Detach(VOID);
+
+		ParallelMap* m_pMap{ nullptr };
+		DWORD        m_dwParticipant{ 0 };
+	};
+
+	/**
+	 * @brief Constructor.
+	*/
+	ParallelMap(
+		_In_ const DynamicMethod* pMethod,
+		_In_ VARIANT*             aArguments,
+		_In_ DWORD                dwArity,
+		_In_ VARIANT*             aResults,
+		_In_ DWORD                dwCalls,
+		_In_ DWORD                dwParticipants
+	);
+
+	/**
+	 * @brief Release a reference, destroying the map when none is left.
+	*/
+	VOID Release(VOID);
+
+	/**
+	 * @brief Execute calls until none is left to take or to steal.
+	 * @param dwParticipant The index of the range of the thread.
+	*/
+	VOID Work(
+		_In_ DWORD dwParticipant
+	);
+
+	/**
+	 * @brief Take a grain of calls from the front of a range.
+	 * @return Whether calls have been taken.
+	*/
+	BOOL Pop(
+		_In_  DWORD  dwParticipant,
+		_Out_ PDWORD pdwBegin,
+		_Out_ PDWORD pdwEnd
+	);
+
+	/**
+	 * @brief Move the back half of the range of another thread into the range of the thread.
+	 * @return Whether calls have been stolen.
+	*/
+	BOOL Steal(
+		_In_ DWORD dwParticipant
+	);
+
+	/**
+	 * @brief Execute a range of calls and account for them.
+	*/
+	VOID Execute(
+		_In_ DWORD dwBegin,
+		_In_ DWORD dwEnd
+	);
+
+	/**
+	 * @brief Wait until every call is done.
+	*/
+	VOID Wait(VOID);
+
+	/**
+	 * @brief Number of references: the calling thread and every helper.
+	*/
+	std::atomic<LONG> m_lReferences{ 1 };
+
+	/**
+	 * @brief Method to execute and its arguments.
+	*/
+	const DynamicMethod* m_pMethod;
+	VARIANT*             m_aArguments;
+	DWORD                m_dwArity;
+
+	/**
+	 * @brief Results, in input order.
+	*/
+	VARIANT* m_aResults;
+
+	/**
+	 * @brief Number of threads, and of ranges.
+	*/
+	DWORD m_dwParticipants;
+
+	/**
+	 * @brief Number of calls taken at once.
+	*/
+	DWORD m_dwGrain;
+
+	/**
+	 * @brief Range of each thread.
+	*/
+	std::unique_ptr<MapRange[]> m_aRanges{};
+
+	/**
+	 * @brief Helpers running on the worker pool.
+	*/
+	std::unique_ptr<Helper[]> m_aHelpers{};
+
+	/**
+	 * @brief Number of calls not accounted for yet.
+	*/
+	std::atomic<LONG> m_lPending;
+
+	/**
+	 * @brief Set after the first failure, remaining calls are skipped.
+	*/
+	std::atomic<BOOL> m_bFailed{ FALSE };
+
+	/**
+	 * @brief Protect the first failure and signal the completion.
+	*/
+	SRWLOCK m_Lock = SRWLOCK_INIT;
+	CONDITION_VARIABLE m_Done = CONDITION_VARIABLE_INIT;
+
+	/**
+	 * @brief First call that failed, and its outcome.
+	*/
+	DWORD   m_dwFailed{ MAXDWORD };
+	HRESULT m_hr{ S_OK };
+};
+
+#endif // !__PARALLELMAP_HPP
@@ -0,0 +1,206 @@
+/**
+* @file         PeExportIndex.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        PE export directory index declaration.
+* @details      Parses the export directory of a PE32 or PE32+ image, either mapped by the loader or as raw file bytes.
+*               Every field is read with bounds checking, hence untrusted files can be parsed.
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <vector>
+
+#ifndef __PEEXPORTINDEX_HPP
+#define __PEEXPORTINDEX_HPP
+
+/**
+ * @brief Export found in the index.
+*/
+typedef struct _PeExport {
+	DWORD dwRva;         /* Address of the export, relative to the image base */
+	DWORD dwOrdinal;     /* Biased ordinal of the export */
+	LPCSTR szForwarder;  /* Forwarder string (e.g. "NTDLL.RtlAllocateHeap"), NULL if not forwarded */
+} PeExport, *PPeExport;
+
+class PeExportIndex {
+public:
+	/**
+	 * @brief Parse the headers and the export directory of an image.
+	 * @param lpBase The address of the image. Must stay valid as long as the index is used.
+	 * @param dwSize The size of the image, in bytes.
+	 * @param bMapped TRUE if the image has been mapped by the loader, FALSE for raw file bytes.
+	 * @return Whether the image has been parsed.
+	*/
+	HRESULT STDMETHODCALLTYPE Parse(
+		_In_ const BYTE* lpBase,
+		_In_ SIZE_T      dwSize,
+		_In_ BOOL        bMapped
+	);
+
+	/**
+	 * @brief Find an export by name.
+	 * @param szName The name of the export, case-sensitive.
+	 * @param pExport The address of a variable that receives the export.
+	 * @return Whether the export has been found.
+	*/
+	HRESULT STDMETHODCALLTYPE FindName(
+		_In_  LPCSTR    szName,
+		_Out_ PPeExport pExport
+	) const;
+
+	/**
+	 * @brief Find an export by ordinal.
+	 * @param dwOrdinal The biased ordinal of the export.
+	 * @param pExport The address of a variable that receives the export.
+	 * @return Whether the export has been found.
+	*/
+	HRESULT STDMETHODCALLTYPE FindOrdinal(
+		_In_  DWORD     dwOrdinal,
+		_Out_ PPeExport pExport
+	) const;
+
+	/**
+	 * @brief Get the size of an image mapped by the loader, read from its headers.
+	 * @param lpBase The address of the image.
+	 * @return The size of the image, or 0 if the headers are not valid.
+	*/
+	static SIZE_T ImageSize(
+		_In_ const BYTE* lpBase
+	);
+
+	/**
+	 * @brief Get the identity of an image mapped by the loader, read from its headers without parsing its exports.
+	 * @param lpBase The address of the image.
+	 * @param pdwTimeDateStamp The address of a variable that receives the time stamp of the image.
+	 * @param pdwCheckSum The address of a variable that receives the checksum of the image.
+	 * @param pdwSizeOfImage The address of a variable that receives the size of the image once mapped.
+	 * @return Whether the headers are valid.
+	*/
+	static HRESULT STDMETHODCALLTYPE Identity(
+		_In_  const BYTE* lpBase,
+		_Out_ PDWORD      pdwTimeDateStamp,
+		_Out_ PDWORD      pdwCheckSum,
+		_Out_ PDWORD      pdwSizeOfImage
+	);
+
+	/**
+	 * @brief Time stamp of the image, from the file header.
+	*/
+	DWORD m_dwTimeDateStamp{ 0 };
+
+	/**
+	 * @brief Checksum of the image, from the optional header.
+	*/
+	DWORD m_dwCheckSum{ 0 };
+
+	/**
+	 * @brief Size of the image once mapped, from the optional header.
+	*/
+	DWORD m_dwSizeOfImage{ 0 };
+
+	/**
+	 * @brief Number of named exports.
+	*/
+	DWORD m_dwNames{ 0 };
+
+private:
+	/**
+	 * @brief Entry of the open addressing table of names. An entry without name is free.
+	*/
+	typedef struct _PeNameEntry {
+		DWORD  dwHash;
+		DWORD  dwFunction;
+		LPCSTR szName;
+	} PeNameEntry;
+
+	/**
+	 * @brief Translate an RVA into a pointer within the image.
+	 * @param dwRva The address of the data, relative to the image base.
+	 * @param pdwAvailable The address of a variable that receives the number of bytes readable from the pointer.
+	 * @return The address of the data, or NULL if out of bounds.
+	*/
+	const BYTE* Translate(
+		_In_  DWORD   dwRva,
+		_Out_ SIZE_T* pdwAvailable
+	) const;
+
+	/**
+	 * @brief Get a pointer to data within the image.
+	 * @param dwRva The address of the data, relative to the image base.
+	 * @param dwSize The number of bytes that must be readable.
+	 * @return The address of the data, or NULL if out of bounds.
+	*/
+	const BYTE* At(
+		_In_ DWORD  dwRva,
+		_In_ SIZE_T dwSize
+	) const;
+
+	/**
+	 * @brief Get a NUL-terminated string within the image.
+	 * @return The string, or NULL if not terminated within the image.
+	*/
+	LPCSTR StringAt(
+		_In_ DWORD dwRva
+	) const;
+
+	/**
+	 * @brief Build an export from the index of a function.
+	*/
+	VOID MakeExport(
+		_In_  DWORD     dwFunction,
+		_Out_ PPeExport pExport
+	) const;
+
+	/**
+	 * @brief FNV-1a hash of a name.
+	*/
+	static DWORD Hash(
+		_In_ LPCSTR szName
+	);
+
+	/**
+	 * @brief Address of the image.
+	*/
+	const BYTE* m_lpBase{ nullptr };
+
+	/**
+	 * @brief Size of the image, in bytes.
+	*/
+	SIZE_T m_dwSize{ 0 };
+
+	/**
+	 * @brief Whether the image has been mapped by the loader.
+	*/
+	BOOL m_bMapped{ FALSE };
+
+	/**
+	 * @brief Section headers, used to translate RVAs into file offsets: virtual address, virtual size, raw offset, raw size.
+	*/
+	std::vector<DWORD> m_aSections{};
+
+	/**
+	 * @brief Range of the export directory. Exports pointing inside it are forwarders.
+	*/
+	DWORD m_dwExportRva{ 0 };
+	DWORD m_dwExportSize{ 0 };
+
+	/**
+	 * @brief Ordinal base of the export directory.
+	*/
+	DWORD m_dwOrdinalBase{ 0 };
+
+	/**
+	 * @brief Address of each function, indexed by unbiased ordinal.
+	*/
+	std::vector<DWORD> m_aFunctions{};
+
+	/**
+	 * @brief Hashed index of the names. Size is always a power of two.
+	*/
+	std::vector<PeNameEntry> m_aNames{};
+};
+
+#endif // !__PEEXPORTINDEX_HPP
@@ -0,0 +1,43 @@
+/**
+* @file         ServerLock.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Lock count of the COM server declaration.
+* @details      Every object handed out to a client, and every call to IClassFactory::LockServer, holds a lock on the
+*               server. The module can only be unloaded once no lock is held (see DllCanUnloadNow).
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <atomic>
+
+#ifndef __SERVERLOCK_HPP
+#define __SERVERLOCK_HPP
+
+class ServerLock {
+public:
+	/**
+	 * @brief Take a lock on the server.
+	*/
+	static VOID Lock(VOID);
+
+	/**
+	 * @brief Release a lock on the server.
+	*/
+	static VOID Unlock(VOID);
+
+	/**
+	 * @brief Whether no lock is held on the server.
+	*/
+	static BOOL CanUnload(VOID);
+
+private:
+	/**
+	 * @brief Number of locks held on the server.
+	*/
+	static std::atomic<LONG> s_lLocks;
+};
+
+#endif // !__SERVERLOCK_HPP
@@ -0,0 +1,141 @@
+/**
+* @file         StructLayout.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Compiled structure layout declaration.
+* @details      A layout is compiled once from a definition listing the fields of the structure, separated by ';'. Each field
+*               is a name, ':' and a kind, optionally followed by a number of elements between brackets. Kinds are the ones
+*               of the signatures (see MarshalPlan.hpp) plus c (8-bit integer) and h (16-bit integer). Fields are placed
+*               at their natural alignment, as done by MSVC x64 without #pragma pack. For example OVERLAPPED is
+*               "Internal:p; InternalHigh:p; Offset:i; OffsetHigh:i; hEvent:p".
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <memory>
+#include <vector>
+
+#include "MarshalPlan.hpp"
+#include "NameIndex.hpp"
+
+#ifndef __STRUCTLAYOUT_HPP
+#define __STRUCTLAYOUT_HPP
+
+#define STRUCTLAYOUT_MAX_SIZE 0x100000 /* Largest size of a structure, 1MB */
+
+/**
+ * @brief Field of a structure.
+*/
+typedef struct _StructField {
+	LPCWSTR      wszName;   /* Name of the field, owned by the name index of the layout */
+	ArgumentKind eKind;     /* Kind of the elements */
+	DWORD        dwOffset;  /* Offset of the field from the start of the structure */
+	DWORD        dwSize;    /* Size of an element, which is also its alignment */
+	DWORD        dwCount;   /* Number of elements, 1 unless the field is an array */
+	DWORD        dwElement; /* Index of the first element of the field among the elements of the structure */
+} StructField, *PStructField;
+
+class StructLayout {
+public:
+	/**
+	 * @brief Compile a definition into a layout.
+	 * @param wszDefinition The definition of the structure.
+	 * @param ppLayout The address of a variable that receives the layout.
+	 * @return Whether the definition is valid.
+	*/
+	static HRESULT STDMETHODCALLTYPE Compile(
+		_In_  LPCWSTR                        wszDefinition,
+		_Out_ std::unique_ptr<StructLayout>* ppLayout
+	);
+
+	/**
+	 * @brief Get a field by name.
+	 * @param wszName The case-insensitive name of the field.
+	 * @return The field, or NULL if the structure has no such field.
+	*/
+	const StructField* Find(
+		_In_ LPCWSTR wszName
+	) const;
+
+	/**
+	 * @brief Write a structure. Padding is zeroed.
+	 * @param lpBuffer The address of the structure, m_dwSize bytes.
+	 * @param aValues The value of every element, m_dwElements values in field order.
+	 * @param pdwFailed The address of a variable that receives the index of the element that could not be converted.
+	 * @return Whether every element has been converted.
+	*/
+	HRESULT STDMETHODCALLTYPE Pack(
+		_Out_ LPVOID   lpBuffer,
+		_In_  VARIANT* aValues,
+		_Out_ PDWORD   pdwFailed
+	) const;
+
+	/**
+	 * @brief Read a structure.
+	 * @param lpBuffer The address of the structure, m_dwSize bytes.
+	 * @param aValues Array of m_dwElements VARIANTs that receives the value of every element in field order.
+	*/
+	VOID STDMETHODCALLTYPE Unpack(
+		_In_  LPCVOID  lpBuffer,
+		_Out_ VARIANT* aValues
+	) const;
+
+	/**
+	 * @brief Write an element of a field.
+	 * @param pField The field.
+	 * @param dwIndex The index of the element within the field.
+	 * @param pValue The value of the element. Strings are written as pointers, hence must be provided as addresses.
+	 * @param lpBuffer The address of the structure.
+	 * @return Whether the value could be converted.
+	*/
+	static HRESULT STDMETHODCALLTYPE PackElement(
+		_In_ const StructField* pField,
+		_In_ DWORD              dwIndex,
+		_In_ VARIANT*           pValue,
+		_In_ PBYTE              lpBuffer
+	);
+
+	/**
+	 * @brief Read an element of a field.
+	 * @param pField The field.
+	 * @param dwIndex The index of the element within the field.
+	 * @param lpBuffer The address of the structure.
+	 * @param pValue Pointer to the location where the value is to be stored.
+	*/
+	static VOID STDMETHODCALLTYPE UnpackElement(
+		_In_  const StructField* pField,
+		_In_  DWORD              dwIndex,
+		_In_  const BYTE*        lpBuffer,
+		_Out_ VARIANT*           pValue
+	);
+
+	/**
+	 * @brief Size of the structure, including the trailing padding.
+	*/
+	DWORD m_dwSize{ 0 };
+
+	/**
+	 * @brief Alignment of the structure.
+	*/
+	DWORD m_dwAlignment{ 1 };
+
+	/**
+	 * @brief Number of elements of all fields.
+	*/
+	DWORD m_dwElements{ 0 };
+
+	/**
+	 * @brief Fields, in declaration order.
+	*/
+	std::vector<StructField> m_aFields{};
+
+private:
+	/**
+	 * @brief Index of the fields by name.
+	*/
+	NameIndex m_Names{};
+};
+
+#endif // !__STRUCTLAYOUT_HPP
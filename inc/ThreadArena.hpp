@@ -0,0 +1,180 @@
+/**
+* @file         ThreadArena.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Per-thread bump allocator declaration.
+* @details      Scratch memory needed for the duration of a single call. Blocks are kept for the lifetime of the thread,
+*               hence the steady-state call path does not touch the heap.
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#ifndef __THREADARENA_HPP
+#define __THREADARENA_HPP
+
+#define ARENA_BLOCK_SIZE 0x10000 /* Default size of a block, 64KB */
+
+/**
+ * @brief Position within an arena, used to release everything allocated after it.
+*/
+typedef struct _ArenaMark {
+	SIZE_T dwBlock;
+	SIZE_T dwOffset;
+} ArenaMark, *PArenaMark;
+
+class ThreadArena {
+public:
+	/**
+	 * @brief Get the arena of the calling thread.
+	*/
+	static ThreadArena& Current(VOID);
+
+	/**
+	 * @brief Allocate memory from the arena.
+	 * @param dwSize The number of bytes to allocate.
+	 * @return The address of the memory, 16-byte aligned, or NULL on failure.
+	*/
+	LPVOID Allocate(
+		_In_ SIZE_T dwSize
+	);
+
+	/**
+	 * @brief Get the current position in the arena.
+	*/
+	ArenaMark Mark(VOID) const;
+
+	/**
+	 * @brief Release everything allocated since a given position.
+	*/
+	VOID Release(
+		_In_ ArenaMark Mark
+	);
+
+	/**
+	 * @brief Number of blocks allocated from the heap by all the arenas of the process.
+	*/
+	static ULONGLONG HeapAllocations(VOID);
+
+private:
+	/**
+	 * @brief Block of memory owned by the arena.
+	*/
+	typedef struct _ArenaBlock {
+		std::unique_ptr<BYTE[]> lpBase;
+		SIZE_T                  dwSize;
+	} ArenaBlock;
+
+	/**
+	 * @brief Blocks of memory, never released before the thread exits.
+	*/
+	std::vector<ArenaBlock> m_aBlocks{};
+
+	/**
+	 * @brief Index of the block currently used.
+	*/
+	SIZE_T m_dwBlock{ 0 };
+
+	/**
+	 * @brief Offset of the next allocation within the current block.
+	*/
+	SIZE_T m_dwOffset{ 0 };
+
+	/**
+	 * @brief Number of blocks allocated from the heap by all the arenas of the process.
+	*/
+	static std::atomic<ULONGLONG> s_qwHeapAllocations;
+};
+
+/**
+ * @brief Scratch allocations of a single call. Everything is released when the scope is destroyed.
+ * @details The arena of the thread is only looked up when memory is actually requested. Arrays whose data is passed
+ *          to the native function are locked until the scope is destroyed as well.
+*/
+class ArenaScope {
+public:
+	/**
+	 * @brief Constructor.
+	*/
+	ArenaScope() { }
+
+	/**
+	 * @brief Destructor.
+	*/
+	~ArenaScope() {
+		for (LockedArray* pLocked = this->m_pLocked; pLocked != nullptr; pLocked = pLocked->pNext)
+			::SafeArrayUnlock(pLocked->psa);
+		if (this->m_pArena)
+			this->m_pArena->Release(this->m_Mark);
+	}
+
+	/**
+	 * @brief Allocate memory from the arena of the calling thread.
+	 * @param dwSize The number of bytes to allocate.
+	 * @return The address of the memory, 16-byte aligned, or NULL on failure.
+	*/
+	LPVOID Allocate(
+		_In_ SIZE_T dwSize
+	) {
+		if (this->m_pArena == nullptr) {
+			this->m_pArena = &ThreadArena::Current();
+			this->m_Mark = this->m_pArena->Mark();
+		}
+		return this->m_pArena->Allocate(dwSize);
+	}
+
+	/**
+	 * @brief Lock an array until the scope is destroyed, so that its data can neither move nor be released.
+	 * @param psa The array.
+	 * @return Whether the array has been locked.
+	*/
+	HRESULT LockArray(
+		_In_ SAFEARRAY* psa
+	) {
+		LockedArray* pLocked = reinterpret_cast<LockedArray*>(this->Allocate(sizeof(LockedArray)));
+		if (pLocked == nullptr)
+			return E_OUTOFMEMORY;
+		HRESULT hr = ::SafeArrayLock(psa);
+		if (FAILED(hr))
+			return hr;
+
+		pLocked->psa = psa;
+		pLocked->pNext = this->m_pLocked;
+		this->m_pLocked = pLocked;
+		return S_OK;
+	}
+
+	ArenaScope(const ArenaScope&) = delete;
+	ArenaScope& operator=(const ArenaScope&) = delete;
+
+private:
+	/**
+	 * @brief Array locked by the scope, allocated from the arena.
+	*/
+	typedef struct _LockedArray {
+		SAFEARRAY*           psa;
+		struct _LockedArray* pNext;
+	} LockedArray;
+
+	/**
+	 * @brief Arena of the calling thread, NULL until the first allocation.
+	*/
+	ThreadArena* m_pArena{ nullptr };
+
+	/**
+	 * @brief Position in the arena when the scope started using it.
+	*/
+	ArenaMark m_Mark{ 0, 0 };
+
+	/**
+	 * @brief Arrays locked by the scope, most recent first.
+	*/
+	LockedArray* m_pLocked{ nullptr };
+};
+
+#endif // !__THREADARENA_HPP
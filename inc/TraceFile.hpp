@@ -0,0 +1,176 @@
+/**
+* @file         TraceFile.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Call trace file declaration.
+* @details      A call trace records the calls of dynamic methods made while tracing is enabled (see CallTrace.hpp), one
+*               fixed-size record per call. Methods are described once, before the first record referencing them.
+*
+*               The file is little-endian and does not depend on the platform, hence can be decoded anywhere:
+*                 Header   magic, version, size of a record, reserved
+*                 Blocks   tag, size of the content in bytes, content
+*               Blocks are appended as the trace is flushed, hence a trace cut short by the end of the process keeps every
+*               block written before. The end block is only written once tracing is stopped. Unknown blocks are skipped.
+*                 Method   index of the method, whether it has a signature, module, name and signature as UTF-16 strings
+*                          prefixed by their length in characters
+*                 Records  number of records, then the records
+*                 End      number of records written, number of records dropped since the ring of the thread was full
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <string>
+#include <vector>
+
+#ifndef __TRACEFILE_HPP
+#define __TRACEFILE_HPP
+
+#define TRACEFILE_MAGIC       0x52545744 /* "DWTR" */
+#define TRACEFILE_VERSION     1          /* Version of the file format */
+#define TRACEFILE_ARGUMENTS   8          /* Arguments recorded per call, further ones are only counted */
+#define TRACEFILE_RECORD_SIZE 128        /* Size of a record, in memory as in the file */
+
+#define TRACEFILE_BLOCK_METHOD  1 /* Description of a method */
+#define TRACEFILE_BLOCK_RECORDS 2 /* Records of calls */
+#define TRACEFILE_BLOCK_END     3 /* Totals, written when tracing is stopped */
+
+/**
+ * @brief Call of a dynamic method.
+ * @details Arguments are in the order of the signature, i.e. the reverse of DISPPARAMS. The word of an argument is the
+ *          value of its VARIANT, except strings which are recorded by their length in characters and references and
+ *          arrays which are recorded as zero, since addresses mean nothing outside of the process.
+*/
+typedef struct _TraceRecord {
+	ULONGLONG qwTimestamp;                     /* Time stamp counter at the start of the call */
+	ULONGLONG qwDuration;                      /* Time spent in the call, marshalling included, in TSC ticks */
+	ULONGLONG qwReturn;                        /* Value returned to the client, as a VARIANT word */
+	DWORD     dwThreadId;                      /* Thread making the call */
+	DISPID    lDispId;                         /* Dispatch ID of the method, in the object making the call */
+	DWORD     dwMethod;                        /* Index of the method in the catalog (see MethodCatalog.hpp) */
+	HRESULT   hr;                              /* Result of the call */
+	WORD      wArguments;                      /* Number of arguments provided by the client */
+	VARTYPE   vtReturn;                        /* Type of the value returned, VT_EMPTY if none was expected */
+	VARTYPE   aTypes[TRACEFILE_ARGUMENTS];     /* Type of the arguments, references followed */
+	DWORD     dwReserved;
+	ULONGLONG aWords[TRACEFILE_ARGUMENTS];     /* Value of the arguments */
+} TraceRecord, *PTraceRecord;
+
+static_assert(sizeof(TraceRecord) == TRACEFILE_RECORD_SIZE, "TraceRecord must match the size of a record in the file");
+
+/**
+ * @brief Dynamic method described in a call trace.
+*/
+typedef struct _TraceMethod {
+	DWORD        dwMethod;         /* Index of the method in the catalog */
+	std::wstring wsModuleName;     /* Normalised name of the module (see ModuleCache::Normalize) */
+	std::wstring wsFunctionName;   /* Name of the function, or its ordinal prefixed with '#' */
+	BOOL         bSignature;       /* Whether the method has been registered with a signature */
+	std::wstring wsSignature;      /* Signature of the function, empty if none */
+} TraceMethod, *PTraceMethod;
+
+class TraceFile {
+public:
+	/**
+	 * @brief Append the header of a file.
+	 * @param pData The content of the file.
+	*/
+	static VOID WriteHeader(
+		_Inout_ std::vector<BYTE>* pData
+	);
+
+	/**
+	 * @brief Append the description of a method.
+	 * @param pMethod The method.
+	 * @param pData The content of the file.
+	*/
+	static VOID WriteMethod(
+		_In_    const TraceMethod* pMethod,
+		_Inout_ std::vector<BYTE>* pData
+	);
+
+	/**
+	 * @brief Append a block of records.
+	 * @param aRecords The records.
+	 * @param dwRecords The number of records.
+	 * @param pData The content of the file.
+	*/
+	static VOID WriteRecords(
+		_In_    const TraceRecord* aRecords,
+		_In_    DWORD              dwRecords,
+		_Inout_ std::vector<BYTE>* pData
+	);
+
+	/**
+	 * @brief Append the end block.
+	 * @param qwRecords The number of records written.
+	 * @param qwDropped The number of records dropped.
+	 * @param pData The content of the file.
+	*/
+	static VOID WriteEnd(
+		_In_    ULONGLONG          qwRecords,
+		_In_    ULONGLONG          qwDropped,
+		_Inout_ std::vector<BYTE>* pData
+	);
+
+	/**
+	 * @brief Parse a call trace file. Every field is read with bounds checking, hence untrusted files can be parsed.
+	 * @param lpData The content of the file.
+	 * @param dwSize The size of the file, in bytes.
+	 * @return S_OK if the trace is complete, S_FALSE if it has been cut short, in which case the blocks before the cut are
+	 *         kept, or an error if the file is not a call trace.
+	*/
+	HRESULT STDMETHODCALLTYPE Parse(
+		_In_ const BYTE* lpData,
+		_In_ SIZE_T      dwSize
+	);
+
+	/**
+	 * @brief Find the description of a method.
+	 * @param dwMethod The index of the method in the catalog.
+	 * @return The method, or NULL if it has not been described.
+	*/
+	const TraceMethod* FindMethod(
+		_In_ DWORD dwMethod
+	) const;
+
+	/**
+	 * @brief Methods described, in the order of the file.
+	*/
+	std::vector<TraceMethod> m_aMethods{};
+
+	/**
+	 * @brief Records, in the order of the file. Records of different threads are not sorted by time stamp.
+	*/
+	std::vector<TraceRecord> m_aRecords{};
+
+	/**
+	 * @brief Whether the end block has been read.
+	*/
+	BOOL m_bComplete{ FALSE };
+
+	/**
+	 * @brief Number of records dropped, from the end block.
+	*/
+	ULONGLONG m_qwDropped{ 0 };
+
+private:
+	/**
+	 * @brief Parse the content of a method block.
+	*/
+	BOOL ParseMethod(
+		_In_ const BYTE* lpBlock,
+		_In_ SIZE_T      dwSize
+	);
+
+	/**
+	 * @brief Parse the content of a records block.
+	*/
+	BOOL ParseRecords(
+		_In_ const BYTE* lpBlock,
+		_In_ SIZE_T      dwSize
+	);
+};
+
+#endif // !__TRACEFILE_HPP
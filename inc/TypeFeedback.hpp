@@ -0,0 +1,142 @@
+/**
+* @file         TypeFeedback.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Type feedback of the dynamic methods declaration.
+* @details      Call sites almost always pass the same types to a given function. A method without signature records the
+*               VARTYPE of the arguments of its calls, its shape, along with the conversion of every argument and the
+*               thunk matching them. Calls of a known shape skip the classification of the arguments, the lookup of the
+*               thunk and the write back of references. A method caches up to TYPEFEEDBACK_SHAPES shapes, calls of any
+*               other shape go through the generic path.
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <atomic>
+
+#include "types.hpp"
+#include "CallThunk.hpp"
+
+#ifndef __TYPEFEEDBACK_HPP
+#define __TYPEFEEDBACK_HPP
+
+#define TYPEFEEDBACK_SHAPES    4                  /* Shapes cached by a method, further shapes go through the generic path */
+#define TYPEFEEDBACK_ARGUMENTS 8                  /* Largest number of arguments of a shape, one byte of the key each */
+#define TYPEFEEDBACK_NO_KEY    0xFFFFFFFFFFFFFFFF /* Key of the calls that cannot be cached */
+
+/**
+ * @brief Conversion of an argument provided without signature, as done by the generic path.
+*/
+typedef enum _FeedbackOperation : BYTE {
+	FeedbackCopy = 0,   /* 64-bit value copied as is */
+	FeedbackCopyFloat,  /* 64-bit value copied as is, floating point data */
+	FeedbackShort,      /* 16-bit integer, sign-extended */
+	FeedbackInt,        /* 32-bit integer, sign-extended */
+	FeedbackZero        /* NULL */
+} FeedbackOperation;
+
+/**
+ * @brief Shape of the calls of a method, immutable once published.
+*/
+typedef struct _FeedbackShape {
+	ULONGLONG         qwKey;                                /* VARTYPE of every argument, one byte each from the first */
+	DWORD             dwArguments;                          /* Number of arguments */
+	CallThunk         lpThunk;                              /* Thunk matching the arguments, or NULL */
+	FeedbackOperation aOperations[TYPEFEEDBACK_ARGUMENTS];  /* Conversion of every argument, in rgvarg order */
+} FeedbackShape, *PFeedbackShape;
+
+class TypeFeedback {
+public:
+	/**
+	 * @brief Constructor.
+	*/
+	TypeFeedback();
+
+	/**
+	 * @brief Destructor.
+	*/
+	~TypeFeedback();
+
+	/**
+	 * @brief Get the conversion of a value. Values that are neither references nor arrays are classified as done by
+	 *        the generic path.
+	 * @param vt The type of the value.
+	*/
+	static FeedbackOperation GetOperation(
+		_In_ VARTYPE vt
+	) {
+		switch (vt) {
+		case VT_R4:
+		case VT_R8:
+		case VT_DECIMAL:
+			return FeedbackCopyFloat;
+		case VT_I2:
+		case VT_UI2:
+			return FeedbackShort;
+		case VT_INT:
+		case VT_UINT:
+		case VT_I4:
+		case VT_UI4:
+			return FeedbackInt;
+		case VT_NULL:
+		case VT_VOID:
+			return FeedbackZero;
+		default:
+			return FeedbackCopy;
+		}
+	}
+
+	/**
+	 * @brief Compute the key of the arguments provided by the client.
+	 * @param pDispParams List of parameters provided by the client.
+	 * @return The key, or TYPEFEEDBACK_NO_KEY if there are too many arguments or some of them are references or arrays.
+	*/
+	static ULONGLONG Key(
+		_In_ const DISPPARAMS* pDispParams
+	);
+
+	/**
+	 * @brief Get the shape of a call.
+	 * @param qwKey The key of the arguments.
+	 * @param dwArguments The number of arguments.
+	 * @return The shape, or NULL if it has not been recorded.
+	*/
+	const FeedbackShape* Find(
+		_In_ ULONGLONG qwKey,
+		_In_ DWORD     dwArguments
+	) const {
+		for (const std::atomic<const FeedbackShape*>& slot : this->m_aShapes) {
+			const FeedbackShape* pShape = slot.load(std::memory_order_acquire);
+			if (pShape == nullptr)
+				return nullptr;
+			if (pShape->qwKey == qwKey && pShape->dwArguments == dwArguments)
+				return pShape;
+		}
+		return nullptr;
+	}
+
+	/**
+	 * @brief Record the shape of a call that went through the generic path. Nothing is recorded once every slot is used.
+	 * @param pDispParams List of parameters provided by the client.
+	 * @param qwKey The key of the arguments, not TYPEFEEDBACK_NO_KEY.
+	*/
+	VOID Record(
+		_In_ const DISPPARAMS* pDispParams,
+		_In_ ULONGLONG         qwKey
+	);
+
+	/**
+	 * @brief Number of shapes recorded.
+	*/
+	DWORD Size(VOID) const;
+
+private:
+	/**
+	 * @brief Shapes recorded, filled in order and never replaced.
+	*/
+	std::atomic<const FeedbackShape*> m_aShapes[TYPEFEEDBACK_SHAPES];
+};
+
+#endif // !__TYPEFEEDBACK_HPP
@@ -39,6 +39,103 @@ public:
 		_In_  DISPPARAMS* pDispParams,
 		_Out_ VARIANT*    pVarResult
 	);
+
+	/**
+	 * @brief Write a buffer at a given location.
+	 * @details Parameters are the data (array of bytes or BSTR), the address and the offset. The number of bytes written is returned.
+	 * @param pDispParams Pointer to a DISPPARAMS structure containing an array of arguments provided by the client.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @return Whether the function executed successfully.
+	*/
+	static HRESULT STDMETHODCALLTYPE WriteBytes(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult
+	);
+
+	/**
+	 * @brief Read a buffer from a given location.
+	 * @details Parameters are the address, the offset and the number of bytes. An array of bytes is returned.
+	 * @param pDispParams Pointer to a DISPPARAMS structure containing an array of arguments provided by the client.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @return Whether the function executed successfully.
+	*/
+	static HRESULT STDMETHODCALLTYPE ReadBytes(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult
+	);
+
+	/**
+	 * @brief Copy memory from one location to another. Both locations may overlap.
+	 * @details Parameters are the destination, the source and the number of bytes.
+	 * @param pDispParams Pointer to a DISPPARAMS structure containing an array of arguments provided by the client.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @return Whether the function executed successfully.
+	*/
+	static HRESULT STDMETHODCALLTYPE CopyBytes(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult
+	);
+
+	/**
+	 * @brief Fill memory with a byte.
+	 * @details Parameters are the destination, the byte and the number of bytes.
+	 * @param pDispParams Pointer to a DISPPARAMS structure containing an array of arguments provided by the client.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @return Whether the function executed successfully.
+	*/
+	static HRESULT STDMETHODCALLTYPE FillBytes(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult
+	);
+
+	/**
+	 * @brief Create an array aliasing native memory, without copying it.
+	 * @details Parameters are the address, the number of elements and optionally the type of the elements, VT_UI1 by
+	 *          default. The memory must outlive the array. Copies of the array made by the script engine are regular arrays.
+	 * @param pDispParams Pointer to a DISPPARAMS structure containing an array of arguments provided by the client.
+	 * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+	 * @return Whether the function executed successfully.
+	*/
+	static HRESULT STDMETHODCALLTYPE CreateView(
+		_In_  DISPPARAMS* pDispParams,
+		_Out_ VARIANT*    pVarResult
+	);
+
+	/**
+	 * @brief Get the integer value of a VARIANT, e.g. an address or a size.
+	 * @param pVariant The VARIANT provided by the client. References are followed.
+	 * @param pqwValue The address of a variable that receives the value.
+	 * @return Whether the VARIANT could be converted.
+	*/
+	static HRESULT STDMETHODCALLTYPE GetInteger(
+		_In_  VARIANT*   pVariant,
+		_Out_ ULONGLONG* pqwValue
+	);
+
+	/**
+	 * @brief Get the number of elements of an array provided by the client.
+	 * @details Both one-dimensional SAFEARRAY and script array objects, through their "length" property, are supported.
+	 * @param pArray The VARIANT provided by the client. References are followed.
+	 * @param plLength The address of a variable that receives the number of elements.
+	 * @return Whether the VARIANT is an array.
+	*/
+	static HRESULT STDMETHODCALLTYPE GetArrayLength(
+		_In_  VARIANT* pArray,
+		_Out_ LONG*    plLength
+	);
+
+	/**
+	 * @brief Get an element of an array provided by the client.
+	 * @param pArray The VARIANT provided by the client. References are followed.
+	 * @param lIndex The zero-based index of the element.
+	 * @param pElement The address of a VARIANT that receives a copy of the element. Must be cleared by the caller.
+	 * @return Whether the element has been retrieved.
+	*/
+	static HRESULT STDMETHODCALLTYPE GetArrayElement(
+		_In_  VARIANT* pArray,
+		_In_  LONG     lIndex,
+		_Out_ VARIANT* pElement
+	);
 };
 
 #endif // !__UTIL_HPP
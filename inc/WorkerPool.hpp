@@ -0,0 +1,144 @@
+/**
+* @file         WorkerPool.hpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Process-wide pool of native worker threads declaration.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#pragma once
+#include <windows.h>
+#include <atomic>
+#include <deque>
+
+#ifndef __WORKERPOOL_HPP
+#define __WORKERPOOL_HPP
+
+#define WORKERPOOL_MAX_THREADS  32    /* Largest number of worker threads, hence of calls in progress at once */
+#define WORKERPOOL_IDLE_TIMEOUT 30000 /* Time after which an idle worker exits, in milliseconds */
+
+/**
+ * @brief Unit of work executed by the pool.
+*/
+class WorkerTask {
+public:
+	/**
+	 * @brief Destructor.
+	*/
+	virtual ~WorkerTask() { }
+
+	/**
+	 * @brief Execute the task. Called once, on a worker thread.
+	*/
+	virtual VOID Execute(VOID) = 0;
+
+	/**
+	 * @brief Release the reference held by the pool, once the task is done.
+	*/
+	virtual VOID Detach(VOID) = 0;
+
+	/**
+	 * @brief Whether the task has been executed.
+	*/
+	BOOL IsDone(VOID) const {
+		return this->m_bDone.load(std::memory_order_acquire);
+	}
+
+private:
+	friend class WorkerPool;
+
+	/**
+	 * @brief Set by the pool once Execute has returned.
+	*/
+	std::atomic<BOOL> m_bDone{ FALSE };
+};
+
+/**
+ * @brief Pool of native threads executing tasks in submission order.
+ * @details Threads are created on demand, as long as every thread is busy and fewer than WORKERPOOL_MAX_THREADS exist,
+ *          and exit after WORKERPOOL_IDLE_TIMEOUT without work. Every thread holds a reference to the module, hence the
+ *          module cannot be unloaded while a task is in progress. Tasks run on threads that have their own ThreadArena.
+*/
+class WorkerPool {
+public:
+	/**
+	 * @brief Get the process-wide instance.
+	*/
+	static WorkerPool& Instance(VOID);
+
+	/**
+	 * @brief Queue a task.
+	 * @param pTask The task. Detach is called once the task has been executed.
+	 * @return Whether the task has been queued.
+	*/
+	HRESULT STDMETHODCALLTYPE Submit(
+		_In_ WorkerTask* pTask
+	);
+
+	/**
+	 * @brief Wait until one of the tasks has been executed.
+	 * @param apTasks The tasks.
+	 * @param dwTasks The number of tasks.
+	 * @param dwMilliseconds The time-out interval, in milliseconds, or INFINITE.
+	 * @param pdwIndex The address of a variable that receives the index of the first task done.
+	 * @return S_OK if a task is done, S_FALSE if the time-out interval elapsed.
+	*/
+	HRESULT STDMETHODCALLTYPE WaitAny(
+		_In_  WorkerTask* const* apTasks,
+		_In_  DWORD              dwTasks,
+		_In_  DWORD              dwMilliseconds,
+		_Out_ PDWORD             pdwIndex
+	);
+
+private:
+	/**
+	 * @brief Constructor.
+	*/
+	WorkerPool();
+
+	/**
+	 * @brief Entry point of the worker threads.
+	*/
+	static DWORD WINAPI WorkerThread(
+		_In_ LPVOID lpParameter
+	);
+
+	/**
+	 * @brief Execute tasks until the thread has been idle for too long.
+	*/
+	VOID Work(VOID);
+
+	/**
+	 * @brief Protect the queue and the counters.
+	*/
+	SRWLOCK m_Lock = SRWLOCK_INIT;
+
+	/**
+	 * @brief Signalled when a task is queued.
+	*/
+	CONDITION_VARIABLE m_TaskQueued = CONDITION_VARIABLE_INIT;
+
+	/**
+	 * @brief Signalled when a task is done.
+	*/
+	CONDITION_VARIABLE m_TaskDone = CONDITION_VARIABLE_INIT;
+
+	/**
+	 * @brief Tasks not yet picked by a worker.
+	*/
+	std::deque<WorkerTask*> m_Queue{};
+
+	/**
+	 * @brief Number of worker threads.
+	*/
+	DWORD m_dwThreads{ 0 };
+
+	/**
+	 * @brief Number of worker threads waiting for a task.
+	*/
+	DWORD m_dwIdle{ 0 };
+};
+
+#endif // !__WORKERPOOL_HPP
@@ -14,32 +14,43 @@
 #ifndef __TYPES_HPP
 #define __TYPES_HPP
 
+#define ARGUMENT_STD 0x00000000 /* Standard data */
+#define ARGUMENT_FLT 0x00000002 /* Floating point data */
+#define RETURN_STD   0x00000000 /* Standard data */
+#define RETURN_FLT   0x00000002 /* Floating point data */
+
+/**
+ * @brief Name and dispatch ID of a method exposed by the COM Automation object.
+*/
 typedef struct _DispatchTableEntry {
 	DISPID  lDispId;
-	LPWSTR  wszName;
+	LPCWSTR wszName;
 } DispatchTableEntry, *PDispatchTableEntry;
 
 #pragma pack(push)
 #pragma pack(1)
 /**
  * @brief Argument to pass to the function. Pack(1) to be used in NASM x64.
+ * @details The value comes first so that it can be loaded as is into both an integer and a floating point register,
+ *          and arguments are 16 bytes apart.
 */
 typedef struct _Argument {
-	DWORD dwFlag;
-	DWORD dwSize;
 	union {
 		DWORD64 qwValue;
 		LPVOID  lpValue;
 		DOUBLE  rlValue;
+		FLOAT   flValue;
 	};
+	DWORD dwFlag;
+	DWORD dwReserved;
 } Argument, *PArgument;
 
 /**
  * @brief Table of argument to pass to the function. Pack(1) to be used in NASM x64.
 */
 typedef struct _ArgumentTable {
-	DWORD     dwArguments;
 	Argument* lpArguments;
+	DWORD     dwArguments;
 } ArgumentTable, * PArgumentTable;
 
 /**
@@ -9,30 +9,113 @@
 * @copyright    This project has been released under the GNU Public License v3 license.
 */
 #include <windows.h>
-#include <comutil.h>
-#include <string>
+#include <climits>
+#include <atomic>
 #include <memory>
+#include <new>
+#include <string>
 #include <vector>
 
 #include "AutomationFactory.hpp"
+#include "BindingCache.hpp"
+#include "CallStats.hpp"
 #include "DynamicMethod.hpp"
+#include "MethodCatalog.hpp"
+#include "MethodTable.hpp"
+#include "ModuleCache.hpp"
+#include "PeExportIndex.hpp"
 #include "Util.hpp"
 
 /**
  * @brief Constructor
 */
-AutomationFactory::AutomationFactory() { };
+AutomationFactory::AutomationFactory() {
+	for (auto& segment : this->m_aOwnSegments)
+		segment.store(nullptr, std::memory_order_relaxed);
+};
 
 /**
  * @brief Destructor
 */
 AutomationFactory::~AutomationFactory() {
-	this->m_aDynamicMethods.clear();
-	this->m_aDispatchTable.clear();
+	this->Reset();
+}
+
+/**
+ * @brief Reset the object to the state of a new one, without any dynamic method. The object must not be used by any
+ *        other thread.
+*/
+VOID AutomationFactory::Reset(VOID) {
+	if (this->m_pTypeInfo)
+		this->m_pTypeInfo->Release();
+	this->m_pTypeInfo = NULL;
+	this->m_dwTypeInfoMethods = 0;
+
+	// Methods stay in the catalog, only the list of the object is freed
+	for (auto& segment : this->m_aOwnSegments)
+		delete[] segment.exchange(nullptr, std::memory_order_relaxed);
+	delete this->m_pNames.exchange(nullptr, std::memory_order_relaxed);
+	this->m_dwOwn.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Describe a method in a type information being built.
+ * @param pCreateInfo The type information being built.
+ * @param uIndex The index of the method within the type information.
+ * @param lDispId The dispatch ID of the method.
+ * @param wszName The name of the method.
+ * @param dwArguments The number of arguments, DYNAMICMETHOD_ANY_ARITY if the method takes any number of arguments.
+ * @return Whether the method has been added.
+*/
+static HRESULT AddMethodDescription(
+	_In_ ICreateTypeInfo* pCreateInfo,
+	_In_ UINT             uIndex,
+	_In_ DISPID           lDispId,
+	_In_ LPCWSTR          wszName,
+	_In_ DWORD            dwArguments
+) {
+	// Parameters are VARIANTs, methods without fixed arity take a vararg SAFEARRAY(VARIANT)
+	static TYPEDESC s_tdVariant = { { NULL }, VT_VARIANT };
+	BOOL bVarArg = dwArguments == DYNAMICMETHOD_ANY_ARITY || dwArguments > SHRT_MAX;
+	UINT cParams = bVarArg ? 1 : dwArguments;
+
+	std::vector<ELEMDESC> aParameters(cParams);
+	std::vector<std::wstring> aNames{ wszName };
+	for (UINT cx = 0; cx < cParams; cx++) {
+		aParameters[cx].tdesc.vt = VT_VARIANT;
+		aParameters[cx].paramdesc.wParamFlags = PARAMFLAG_FIN;
+		aNames.push_back(bVarArg ? std::wstring(L"args") : L"arg" + std::to_wstring(cx + 1));
+	}
+	if (bVarArg) {
+		aParameters[0].tdesc.vt = VT_SAFEARRAY;
+		aParameters[0].tdesc.lptdesc = &s_tdVariant;
+	}
+
+	FUNCDESC desc{};
+	desc.memid = lDispId;
+	desc.funckind = FUNC_DISPATCH;
+	desc.invkind = INVOKE_FUNC;
+	desc.callconv = CC_STDCALL;
+	desc.cParams = static_cast<SHORT>(cParams);
+	desc.cParamsOpt = bVarArg ? -1 : 0;
+	desc.lprgelemdescParam = aParameters.data();
+	desc.elemdescFunc.tdesc.vt = VT_VARIANT;
+	HRESULT hr = pCreateInfo->AddFuncDesc(uIndex, &desc);
+	if (FAILED(hr))
+		return hr;
+
+	std::vector<LPOLESTR> aNamePointers{};
+	for (std::wstring& name : aNames)
+		aNamePointers.push_back(&name[0]);
+	return pCreateInfo->SetFuncAndParamNames(uIndex, aNamePointers.data(), static_cast<UINT>(aNamePointers.size()));
 }
 
 /**
- * @brief Register a new dynamic method.
+ * @brief Register a new dynamic method, or a batch of them.
+ * @details Parameters are the module name, the function name and an optional signature string (see MarshalPlan.hpp).
+ *          The dispatch ID of the method is returned. Registering a name twice returns the existing dispatch ID.
+ *          The function name can also be an array of names, in which case an array of dispatch IDs is returned. Each
+ *          element is either a name, optionally followed by ':' and its own signature, or an ordinal.
  * @param pDispParams List of parameters supplied by the client.
  * @param pVarResult Return value expected by the client, if not NULL.
  * @return Whether the function executed successfully.
@@ -42,61 +125,698 @@ HRESULT STDMETHODCALLTYPE AutomationFactory::Register(
 	_Out_ VARIANT*    pVarResult
 ) {
 	// Check number of arguments
-	if (pDispParams->cArgs != 2)
+	if (pDispParams->cArgs != 2 && pDispParams->cArgs != 3)
 		return E_FAIL;
 
 	// Get parameters
-	BSTR* pbstrFunctionName = &pDispParams->rgvarg[0].bstrVal;
-	BSTR* pbstrModuleName = &pDispParams->rgvarg[1].bstrVal;
+	VARIANT* pModuleName = &pDispParams->rgvarg[pDispParams->cArgs - 1];
+	VARIANT* pFunctionName = &pDispParams->rgvarg[pDispParams->cArgs - 2];
+	if (V_VT(pFunctionName) == (VT_VARIANT | VT_BYREF))
+		pFunctionName = V_VARIANTREF(pFunctionName);
+	if (V_VT(pModuleName) != VT_BSTR)
+		return DISP_E_TYPEMISMATCH;
+
+	LPCWSTR wszSignature = nullptr;
+	if (pDispParams->cArgs == 3) {
+		if (V_VT(&pDispParams->rgvarg[0]) != VT_BSTR)
+			return E_INVALIDARG;
+		wszSignature = V_BSTR(&pDispParams->rgvarg[0]);
+	}
+
+	// Batch of functions from the same module
+	if (V_VT(pFunctionName) != VT_BSTR)
+		return this->RegisterBatch(V_BSTR(pModuleName), pFunctionName, wszSignature, pVarResult);
+
+	DISPID lDispId = DISPID_UNKNOWN;
+	HRESULT hr = this->RegisterMethod(V_BSTR(pModuleName), V_BSTR(pFunctionName), wszSignature, &lDispId);
+	if (FAILED(hr))
+		return hr;
+
+	if (pVarResult) {
+		V_VT(pVarResult) = VT_I4;
+		V_I4(pVarResult) = lDispId;
+	}
+	return S_OK;
+}
+
+/**
+ * @brief Register a batch of dynamic methods from the same module.
+ * @param wszModuleName The name of the module (e.g. user32.dll).
+ * @param pFunctionNames The array of names or ordinals supplied by the client.
+ * @param wszSignature The signature of the elements without their own, or NULL.
+ * @param pVarResult Return value expected by the client, if not NULL.
+ * @return Whether all the methods have been registered.
+*/
+HRESULT STDMETHODCALLTYPE AutomationFactory::RegisterBatch(
+	_In_  LPCWSTR  wszModuleName,
+	_In_  VARIANT* pFunctionNames,
+	_In_  LPCWSTR  wszSignature,
+	_Out_ VARIANT* pVarResult
+) {
+	LONG lElements = 0;
+	HRESULT hr = Util::GetArrayLength(pFunctionNames, &lElements);
+	if (FAILED(hr))
+		return hr;
+
+	std::vector<DISPID> aDispIds(static_cast<SIZE_T>(lElements), DISPID_UNKNOWN);
+	for (LONG cx = 0; cx < lElements; cx++) {
+		VARIANT var;
+		hr = Util::GetArrayElement(pFunctionNames, cx, &var);
+		if (FAILED(hr))
+			return hr;
+
+		// Either "Name", "Name:signature" or an ordinal
+		std::wstring wsFunctionName{};
+		LPCWSTR wszElementSignature = wszSignature;
+		ULONGLONG qwOrdinal = 0;
+		if (V_VT(&var) == VT_BSTR && V_BSTR(&var) != NULL) {
+			wsFunctionName.assign(V_BSTR(&var));
+			SIZE_T dwSeparator = wsFunctionName.find(L':');
+			if (dwSeparator != std::wstring::npos) {
+				wszElementSignature = V_BSTR(&var) + dwSeparator + 1;
+				wsFunctionName.resize(dwSeparator);
+			}
+		}
+		else if (SUCCEEDED(Util::GetInteger(&var, &qwOrdinal)) && qwOrdinal <= 0xFFFF) {
+			wsFunctionName = L"#" + std::to_wstring(qwOrdinal);
+		}
+		else {
+			::VariantClear(&var);
+			return DISP_E_TYPEMISMATCH;
+		}
+
+		hr = this->RegisterMethod(wszModuleName, wsFunctionName.c_str(), wszElementSignature, &aDispIds[cx]);
+		::VariantClear(&var);
+		if (FAILED(hr))
+			return hr;
+	}
+
+	if (pVarResult == NULL)
+		return S_OK;
+
+	// Return the dispatch IDs in the same order
+	SAFEARRAY* psa = ::SafeArrayCreateVector(VT_VARIANT, 0, static_cast<ULONG>(lElements));
+	if (psa == NULL)
+		return E_OUTOFMEMORY;
+
+	VARIANT* pData = NULL;
+	if (FAILED(::SafeArrayAccessData(psa, reinterpret_cast<LPVOID*>(&pData)))) {
+		::SafeArrayDestroy(psa);
+		return E_FAIL;
+	}
+	for (LONG cx = 0; cx < lElements; cx++) {
+		V_VT(&pData[cx]) = VT_I4;
+		V_I4(&pData[cx]) = aDispIds[cx];
+	}
+	::SafeArrayUnaccessData(psa);
+
+	V_VT(pVarResult) = VT_ARRAY | VT_VARIANT;
+	V_ARRAY(pVarResult) = psa;
+	return S_OK;
+}
+
+/**
+ * @brief Register a single dynamic method.
+ * @param wszModuleName The name of the module (e.g. user32.dll).
+ * @param wszFunctionName The name of the function (e.g. MessageBoxW), or its ordinal prefixed with '#' (e.g. #12).
+ * @param wszSignature The signature of the function, or NULL.
+ * @param plDispId The address of a variable that receives the dispatch ID of the method.
+ * @return Whether the method has been registered.
+*/
+HRESULT STDMETHODCALLTYPE AutomationFactory::RegisterMethod(
+	_In_     LPCWSTR wszModuleName,
+	_In_     LPCWSTR wszFunctionName,
+	_In_opt_ LPCWSTR wszSignature,
+	_Out_    DISPID* plDispId
+) {
+	// Already registered by the object
+	*plDispId = DISPID_UNKNOWN;
+	if (SUCCEEDED(this->FindName(wszFunctionName, plDispId)))
+		return static_cast<DWORD>(*plDispId) < this->m_dwInternalMethods ? E_INVALIDARG : S_OK;
+	if (wszModuleName == NULL || *wszModuleName == L'\0')
+		return E_FAIL;
+
+	// Already resolved by another object of the process
+	DWORD dwIndex = 0;
+	if (SUCCEEDED(this->m_Catalog.Find(ModuleCache::Normalize(wszModuleName).c_str(), wszFunctionName, wszSignature, &dwIndex)))
+		return this->Adopt(dwIndex, wszFunctionName, plDispId);
+
+	// Compile the optional signature
+	std::unique_ptr<MarshalPlan> plan{};
+	if (wszSignature != nullptr && FAILED(MarshalPlan::Compile(wszSignature, &plan)))
+		return E_INVALIDARG;
 
 	// Get function address
 	LPVOID lpFunction = NULL;
-	if (this->GetFunctionFromModule(pbstrModuleName, pbstrFunctionName, &lpFunction) != S_OK || lpFunction == NULL)
+	if (this->GetFunctionFromModule(wszModuleName, wszFunctionName, &lpFunction) != S_OK || lpFunction == NULL)
+		return E_FAIL;
+
+	return this->RegisterFunction(wszModuleName, wszFunctionName, wszSignature, std::move(plan), lpFunction, plDispId);
+}
+
+/**
+ * @brief Register a single dynamic method whose function has been resolved.
+ * @param wszModuleName The name of the module (e.g. user32.dll).
+ * @param wszFunctionName The name of the function (e.g. MessageBoxW), or its ordinal prefixed with '#' (e.g. #12).
+ * @param wszSignature The signature of the function, or NULL.
+ * @param pPlan The marshalling plan compiled from the signature, or NULL.
+ * @param lpFunction The address of the function.
+ * @param plDispId The address of a variable that receives the dispatch ID of the method.
+ * @return Whether the method has been registered.
+*/
+HRESULT STDMETHODCALLTYPE AutomationFactory::RegisterFunction(
+	_In_     LPCWSTR                      wszModuleName,
+	_In_     LPCWSTR                      wszFunctionName,
+	_In_opt_ LPCWSTR                      wszSignature,
+	_In_opt_ std::unique_ptr<MarshalPlan> pPlan,
+	_In_     LPVOID                       lpFunction,
+	_Out_    DISPID*                      plDispId
+) {
+	*plDispId = DISPID_UNKNOWN;
+	DWORD dwIndex = 0;
+	if (FAILED(this->m_Catalog.Publish(ModuleCache::Normalize(wszModuleName).c_str(), wszFunctionName, wszSignature, std::move(pPlan), lpFunction, &dwIndex)))
 		return E_FAIL;
+	return this->Adopt(dwIndex, wszFunctionName, plDispId);
+}
+
+/**
+ * @brief Give a method of the catalog a dispatch ID in the object, unless the object has a method of the same name.
+ * @param dwCatalogIndex The index of the method in the catalog.
+ * @param wszFunctionName The name of the method.
+ * @param plDispId The address of a variable that receives the dispatch ID of the method.
+ * @return Whether the method is visible to the object.
+*/
+HRESULT STDMETHODCALLTYPE AutomationFactory::Adopt(
+	_In_  DWORD   dwCatalogIndex,
+	_In_  LPCWSTR wszFunctionName,
+	_Out_ DISPID* plDispId
+) {
+	// Registrations are serialised, lookups and calls are not
+	::AcquireSRWLockExclusive(&this->m_RegisterLock);
+	HRESULT hr = this->FindName(wszFunctionName, plDispId);
+	if (SUCCEEDED(hr)) {
+		::ReleaseSRWLockExclusive(&this->m_RegisterLock);
+		return static_cast<DWORD>(*plDispId) < this->m_dwInternalMethods ? E_INVALIDARG : S_OK;
+	}
+
+	// Allocate the index of the names and the segment on first use
+	NameIndex* pNames = this->m_pNames.load(std::memory_order_relaxed);
+	if (pNames == nullptr) {
+		pNames = new (std::nothrow) NameIndex();
+		this->m_pNames.store(pNames, std::memory_order_release);
+	}
+
+	DWORD dwIndex = this->m_dwOwn.load(std::memory_order_relaxed);
+	DWORD dwOffset = 0;
+	DWORD dwSegment = MethodTable::Segment(dwIndex, &dwOffset);
+	PDWORD aIndexes = dwSegment < METHODTABLE_SEGMENTS ? this->m_aOwnSegments[dwSegment].load(std::memory_order_relaxed) : nullptr;
+	if (aIndexes == nullptr && dwSegment < METHODTABLE_SEGMENTS) {
+		aIndexes = new (std::nothrow) DWORD[static_cast<SIZE_T>(METHODTABLE_FIRST_SEGMENT) << dwSegment];
+		this->m_aOwnSegments[dwSegment].store(aIndexes, std::memory_order_release);
+	}
+	if (pNames == nullptr || aIndexes == nullptr) {
+		::ReleaseSRWLockExclusive(&this->m_RegisterLock);
+		return E_OUTOFMEMORY;
+	}
+
+	// Publish the method before its name, hence a dispatch ID found by name always refers to a method
+	aIndexes[dwOffset] = dwCatalogIndex;
+	this->m_dwOwn.store(dwIndex + 1, std::memory_order_release);
+
+	// A method whose name cannot be inserted is withdrawn, its dispatch ID was never returned
+	DISPID lDispId = static_cast<DISPID>(dwIndex + this->m_dwInternalMethods);
+	hr = pNames->Insert(wszFunctionName, lDispId, NULL);
+	if (SUCCEEDED(hr))
+		*plDispId = lDispId;
+	else
+		this->m_dwOwn.store(dwIndex, std::memory_order_release);
+
+	::ReleaseSRWLockExclusive(&this->m_RegisterLock);
+	return FAILED(hr) ? hr : S_OK;
+}
+
+/**
+ * @brief Read a binding cache file through a read-only mapping.
+ * @param wszPath The path of the file.
+ * @param pCache The binding cache that receives the content of the file.
+ * @return Whether the file exists and is valid.
+*/
+static HRESULT ReadBindingCache(
+	_In_  LPCWSTR       wszPath,
+	_Out_ BindingCache* pCache
+) {
+	HANDLE hFile = ::CreateFileW(wszPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return HRESULT_FROM_WIN32(::GetLastError());
+
+	HRESULT hr = E_INVALIDARG;
+	LARGE_INTEGER liSize = {};
+	if (::GetFileSizeEx(hFile, &liSize) && liSize.QuadPart > 0 && liSize.QuadPart <= MAXDWORD) {
+		HANDLE hMapping = ::CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMapping != NULL) {
+			LPVOID lpView = ::MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+			if (lpView != NULL) {
+				hr = pCache->Parse(reinterpret_cast<const BYTE*>(lpView), static_cast<SIZE_T>(liSize.QuadPart));
+				::UnmapViewOfFile(lpView);
+			}
+			::CloseHandle(hMapping);
+		}
+	}
+	::CloseHandle(hFile);
+	return hr;
+}
+
+/**
+ * @brief Get the path of a binding cache file from the parameters supplied by the client.
+ * @return The path, or NULL if the parameters are not valid.
+*/
+static LPCWSTR GetCachePath(
+	_In_ DISPPARAMS* pDispParams
+) {
+	if (pDispParams->cArgs != 1)
+		return NULL;
+
+	VARIANT* pPath = &pDispParams->rgvarg[0];
+	if (V_VT(pPath) == (VT_VARIANT | VT_BYREF))
+		pPath = V_VARIANTREF(pPath);
+	if (V_VT(pPath) != VT_BSTR || V_BSTR(pPath) == NULL || *V_BSTR(pPath) == L'\0')
+		return NULL;
+	return V_BSTR(pPath);
+}
+
+/**
+ * @brief Register the dynamic methods recorded in a binding cache file (see BindingCache.hpp).
+ * @details The path of the file is expected. The file is mapped read-only and the identity of every module is checked
+ *          against the module loaded. Methods of an unchanged module are registered at their recorded RVA, methods of
+ *          a module that changed, or whose RVA lies outside of the image, are resolved again. The number of methods
+ *          resolved again is returned, -1 if the file is missing or not valid. The cache is trusted as much as the script, since it names the functions
+ *          to execute.
+ * @param pDispParams List of parameters supplied by the client.
+ * @param pVarResult Return value expected by the client, if not NULL.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE AutomationFactory::LoadCache(
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult
+) {
+	LPCWSTR wszPath = GetCachePath(pDispParams);
+	if (wszPath == NULL)
+		return pDispParams->cArgs != 1 ? DISP_E_BADPARAMCOUNT : DISP_E_TYPEMISMATCH;
+
+	// A missing or invalid file is not an error, the script registers its methods and saves the cache again
+	BindingCache cache{};
+	LONG lStale = -1;
+	if (SUCCEEDED(ReadBindingCache(wszPath, &cache))) {
+		lStale = 0;
 
-	// Create new dynamic method
-	std::unique_ptr<DynamicMethod> dm = std::make_unique<DynamicMethod>(this->m_dwDynamicMethods, *pbstrFunctionName, lpFunction);
-	this->m_aDynamicMethods.push_back(std::move(dm));
-	this->m_aDispatchTable.push_back({ static_cast<DISPID>(this->m_dwDynamicMethods + this->m_dwInternalMethods), *pbstrFunctionName });
-	this->m_dwDynamicMethods++;
+		// Base of every module whose identity did not change, NULL otherwise
+		std::vector<LPBYTE> aBases(cache.m_aModules.size(), nullptr);
+		for (SIZE_T cx = 0; cx < cache.m_aModules.size(); cx++) {
+			const BindingModule& module = cache.m_aModules[cx];
+			HMODULE hModule = NULL;
+			DWORD dwTimeDateStamp = 0, dwCheckSum = 0, dwSizeOfImage = 0;
+			if (FAILED(ModuleCache::Instance().GetModule(module.wsName.c_str(), &hModule)))
+				continue;
+			if (FAILED(PeExportIndex::Identity(reinterpret_cast<const BYTE*>(hModule), &dwTimeDateStamp, &dwCheckSum, &dwSizeOfImage)))
+				continue;
+			if (dwTimeDateStamp == module.dwTimeDateStamp && dwCheckSum == module.dwCheckSum && dwSizeOfImage == module.dwSizeOfImage)
+				aBases[cx] = reinterpret_cast<LPBYTE>(hModule);
+		}
+
+		// Same order as when saved, hence an object without any method registered yet gets the same dispatch IDs
+		for (const BindingEntry& entry : cache.m_aEntries) {
+			LPCWSTR wszModuleName = cache.m_aModules[entry.dwModule].wsName.c_str();
+			LPCWSTR wszFunctionName = entry.wsFunctionName.c_str();
+			LPCWSTR wszSignature = entry.bSignature ? entry.wsSignature.c_str() : nullptr;
+			DISPID lDispId = DISPID_UNKNOWN;
+
+			// Failures are left to the registrations of the script, which report them. A function must lie within the
+			// image of its module, which is only known to be the one recorded by its identity
+			std::unique_ptr<MarshalPlan> plan{};
+			if (aBases[entry.dwModule] == nullptr || entry.dwRva >= cache.m_aModules[entry.dwModule].dwSizeOfImage) {
+				lStale++;
+				this->RegisterMethod(wszModuleName, wszFunctionName, wszSignature, &lDispId);
+			}
+			else if (FAILED(this->FindName(wszFunctionName, &lDispId)) && (wszSignature == nullptr || SUCCEEDED(MarshalPlan::Compile(wszSignature, &plan)))) {
+				this->RegisterFunction(wszModuleName, wszFunctionName, wszSignature, std::move(plan), aBases[entry.dwModule] + entry.dwRva, &lDispId);
+			}
+		}
+	}
+
+	if (pVarResult) {
+		V_VT(pVarResult) = VT_I4;
+		V_I4(pVarResult) = lStale;
+	}
+	return S_OK;
+}
+
+/**
+ * @brief Save the dynamic methods registered so far in a binding cache file (see BindingCache.hpp).
+ * @details The path of the file is expected. The number of methods saved is returned. Methods whose function lies
+ *          outside of the module they were registered from, i.e. forwarded exports, are not saved.
+ * @param pDispParams List of parameters supplied by the client.
+ * @param pVarResult Return value expected by the client, if not NULL.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE AutomationFactory::SaveCache(
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult
+) {
+	LPCWSTR wszPath = GetCachePath(pDispParams);
+	if (wszPath == NULL)
+		return pDispParams->cArgs != 1 ? DISP_E_BADPARAMCOUNT : DISP_E_TYPEMISMATCH;
+
+	// Names are set once registered, hence registrations are held off
+	BindingCache cache{};
+	::AcquireSRWLockShared(&this->m_RegisterLock);
+	DWORD dwMethods = this->Size();
+	for (DWORD cx = 0; cx < dwMethods; cx++) {
+		const DynamicMethodInfo* pInfo = this->m_Catalog.GetInfo(this->CatalogIndex(cx));
+		if (pInfo->wsFunctionName.empty() || pInfo->wsModuleName.empty())
+			continue;
+
+		BindingModule module{ pInfo->wsModuleName, 0, 0, 0 };
+		HMODULE hModule = NULL;
+		if (FAILED(ModuleCache::Instance().GetModule(module.wsName.c_str(), &hModule)))
+			continue;
+		if (FAILED(PeExportIndex::Identity(reinterpret_cast<const BYTE*>(hModule), &module.dwTimeDateStamp, &module.dwCheckSum, &module.dwSizeOfImage)))
+			continue;
+
+		// Forwarded exports lie in another module, they are resolved on every run
+		ULONG_PTR lpBase = reinterpret_cast<ULONG_PTR>(hModule);
+		ULONG_PTR lpFunction = reinterpret_cast<ULONG_PTR>(this->m_Catalog.Get(this->CatalogIndex(cx))->m_lpFunction);
+		if (lpFunction < lpBase || lpFunction - lpBase >= module.dwSizeOfImage)
+			continue;
+
+		BindingEntry entry{ cache.AddModule(&module), pInfo->wsFunctionName, pInfo->pPlan != nullptr, pInfo->wsSignature, static_cast<DWORD>(lpFunction - lpBase) };
+		cache.m_aEntries.push_back(std::move(entry));
+	}
+	::ReleaseSRWLockShared(&this->m_RegisterLock);
+
+	std::vector<BYTE> data{};
+	HRESULT hr = cache.Serialize(&data);
+	if (FAILED(hr))
+		return hr;
+
+	// The checksum rejects a file left incomplete
+	HANDLE hFile = ::CreateFileW(wszPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return HRESULT_FROM_WIN32(::GetLastError());
+	DWORD dwWritten = 0;
+	BOOL bWritten = ::WriteFile(hFile, data.data(), static_cast<DWORD>(data.size()), &dwWritten, NULL) && dwWritten == data.size();
+	hr = bWritten ? S_OK : HRESULT_FROM_WIN32(::GetLastError());
+	::CloseHandle(hFile);
+	if (FAILED(hr))
+		return hr;
 
 	if (pVarResult) {
-		V_VT(pVarResult) = VT_BOOL;
-		V_BOOL(pVarResult) = TRUE;
+		V_VT(pVarResult) = VT_I4;
+		V_I4(pVarResult) = static_cast<LONG>(cache.m_aEntries.size());
 	}
 	return S_OK;
 }
 
+/**
+ * @brief Append a string to a JSON document, quoted and escaped.
+*/
+static VOID AppendJsonString(
+	_Inout_ std::wstring& wsJson,
+	_In_    LPCWSTR       wszValue
+) {
+	static CONST WCHAR wszHex[] = L"0123456789abcdef";
+
+	wsJson.push_back(L'"');
+	for (; wszValue != nullptr && *wszValue != L'\0'; wszValue++) {
+		if (*wszValue == L'"' || *wszValue == L'\\') {
+			wsJson.push_back(L'\\');
+			wsJson.push_back(*wszValue);
+		}
+		else if (*wszValue < 0x20) {
+			wsJson.append(L"\\u00");
+			wsJson.push_back(wszHex[*wszValue >> 4]);
+			wsJson.push_back(wszHex[*wszValue & 0xF]);
+		}
+		else {
+			wsJson.push_back(*wszValue);
+		}
+	}
+	wsJson.push_back(L'"');
+}
+
+/**
+ * @brief Get the call statistics of the dynamic methods.
+ * @details No parameter is expected. A JSON string is returned, for example:
+ *          {"enabled":true,"unit":"tsc","methods":[{"dispid":6,"name":"MessageBoxW","calls":2,"marshal":310,"native":9120,"histogram":[0,0,1,1],"shapes":1,"hits":1,"misses":1}]}
+ *          Bucket N of the histogram counts calls that took from 2^N to 2^(N+1) ticks. Trailing empty buckets are omitted.
+ *          Methods registered without signature also report the number of shapes recorded by their type feedback and the
+ *          number of calls that matched one of them or went through the generic path (see TypeFeedback.hpp).
+ *          Statistics are only collected if DWEX_ENABLE_STATS was defined at build time, "enabled" is false otherwise.
+ * @param pDispParams List of parameters supplied by the client.
+ * @param pVarResult Return value expected by the client, if not NULL.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE AutomationFactory::Stats(
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult
+) {
+	if (pDispParams->cArgs != 0)
+		return DISP_E_BADPARAMCOUNT;
+	if (pVarResult == NULL)
+		return S_OK;
+
+#ifdef DWEX_ENABLE_STATS
+	std::wstring wsJson(L"{\"enabled\":true,\"unit\":\"tsc\",\"methods\":[");
+
+	// Names are set once registered, hence registrations are held off
+	::AcquireSRWLockShared(&this->m_RegisterLock);
+	DWORD dwMethods = this->Size();
+	for (DWORD cx = 0; cx < dwMethods; cx++) {
+		DWORD dwCatalogIndex = this->CatalogIndex(cx);
+		MethodStats stats{};
+		CallStats::Instance().Collect(this->m_Catalog.Get(dwCatalogIndex)->m_dwStatsId, &stats);
+
+		if (cx != 0)
+			wsJson.push_back(L',');
+		wsJson.append(L"{\"dispid\":").append(std::to_wstring(cx + this->m_dwInternalMethods));
+		wsJson.append(L",\"name\":");
+		AppendJsonString(wsJson, this->m_Catalog.GetInfo(dwCatalogIndex)->wsFunctionName.c_str());
+		wsJson.append(L",\"calls\":").append(std::to_wstring(stats.qwCalls));
+		wsJson.append(L",\"marshal\":").append(std::to_wstring(stats.qwMarshalTicks));
+		wsJson.append(L",\"native\":").append(std::to_wstring(stats.qwNativeTicks));
+		wsJson.append(L",\"histogram\":[");
+
+		DWORD dwBuckets = CALLSTATS_BUCKETS;
+		while (dwBuckets > 0 && stats.aHistogram[dwBuckets - 1] == 0)
+			dwBuckets--;
+		for (DWORD dwBucket = 0; dwBucket < dwBuckets; dwBucket++) {
+			if (dwBucket != 0)
+				wsJson.push_back(L',');
+			wsJson.append(std::to_wstring(stats.aHistogram[dwBucket]));
+		}
+		wsJson.push_back(L']');
+
+		const TypeFeedback* pFeedback = this->m_Catalog.GetInfo(dwCatalogIndex)->pFeedback.get();
+		if (pFeedback != nullptr) {
+			wsJson.append(L",\"shapes\":").append(std::to_wstring(pFeedback->Size()));
+			wsJson.append(L",\"hits\":").append(std::to_wstring(stats.qwFeedbackHits));
+			wsJson.append(L",\"misses\":").append(std::to_wstring(stats.qwFeedbackMisses));
+		}
+		wsJson.push_back(L'}');
+	}
+	::ReleaseSRWLockShared(&this->m_RegisterLock);
+	wsJson.append(L"]}");
+#else
+	std::wstring wsJson(L"{\"enabled\":false,\"unit\":\"tsc\",\"methods\":[]}");
+#endif
+
+	V_VT(pVarResult) = VT_BSTR;
+	V_BSTR(pVarResult) = ::SysAllocStringLen(wsJson.c_str(), static_cast<UINT>(wsJson.size()));
+	return V_BSTR(pVarResult) != NULL ? S_OK : E_OUTOFMEMORY;
+}
+
+/**
+ * @brief Get the type information of the object, describing the internal methods and every registered method.
+ * @details The type information is a dispinterface deriving from IDispatch, built on first use and rebuilt once
+ *          methods have been registered. Type information obtained before a registration is left as it was.
+ * @param ppTypeInfo The address of a variable that receives the type information, with a new reference.
+ * @return Whether the type information has been built.
+*/
+HRESULT STDMETHODCALLTYPE AutomationFactory::GetTypeInfo(
+	_Out_ ITypeInfo** ppTypeInfo
+) {
+	*ppTypeInfo = NULL;
+
+	// Names are set once registered, hence registrations are held off
+	::AcquireSRWLockShared(&this->m_RegisterLock);
+	::AcquireSRWLockExclusive(&this->m_TypeInfoLock);
+
+	HRESULT hr = S_OK;
+	DWORD dwMethods = this->Size();
+	if (this->m_pTypeInfo == NULL || this->m_dwTypeInfoMethods != dwMethods) {
+		ITypeInfo* pTypeInfo = NULL;
+		hr = this->BuildTypeInfo(dwMethods, &pTypeInfo);
+		if (SUCCEEDED(hr)) {
+			if (this->m_pTypeInfo)
+				this->m_pTypeInfo->Release();
+			this->m_pTypeInfo = pTypeInfo;
+			this->m_dwTypeInfoMethods = dwMethods;
+		}
+	}
+	if (SUCCEEDED(hr)) {
+		this->m_pTypeInfo->AddRef();
+		*ppTypeInfo = this->m_pTypeInfo;
+	}
+
+	::ReleaseSRWLockExclusive(&this->m_TypeInfoLock);
+	::ReleaseSRWLockShared(&this->m_RegisterLock);
+	return hr;
+}
+
+/**
+ * @brief Build the type information of the object. Registrations must be held off by the caller.
+ * @details Every build has its own GUID, so that hosts caching type descriptions by GUID never see a stale set of methods.
+ * @param dwMethods The number of dynamic methods to describe.
+ * @param ppTypeInfo The address of a variable that receives the type information.
+ * @return Whether the type information has been built.
+*/
+HRESULT STDMETHODCALLTYPE AutomationFactory::BuildTypeInfo(
+	_In_  DWORD       dwMethods,
+	_Out_ ITypeInfo** ppTypeInfo
+) {
+	*ppTypeInfo = NULL;
+
+	// IDispatch, from the OLE Automation type library
+	ITypeLib* pStdOle = NULL;
+	ITypeInfo* pDispatchInfo = NULL;
+	HRESULT hr = ::LoadRegTypeLib(IID_StdOle, STDOLE2_MAJORVERNUM, STDOLE2_MINORVERNUM, STDOLE2_LCID, &pStdOle);
+	if (FAILED(hr))
+		return hr;
+	hr = pStdOle->GetTypeInfoOfGuid(IID_IDispatch, &pDispatchInfo);
+	pStdOle->Release();
+	if (FAILED(hr))
+		return hr;
+
+	// Library only kept in memory, never saved
+	ICreateTypeLib2* pCreateLib = NULL;
+	ICreateTypeInfo* pCreateInfo = NULL;
+	HREFTYPE hRefDispatch = 0;
+	GUID guid{};
+	hr = ::CreateTypeLib2(SYS_WIN64, L"DynamicWrapperEx.tlb", &pCreateLib);
+	if (SUCCEEDED(hr))
+		hr = pCreateLib->CreateTypeInfo(const_cast<LPOLESTR>(L"IDynamicWrapperEx"), TKIND_DISPATCH, &pCreateInfo);
+	if (SUCCEEDED(hr))
+		hr = ::CoCreateGuid(&guid);
+	if (SUCCEEDED(hr))
+		hr = pCreateInfo->SetGuid(guid);
+	if (SUCCEEDED(hr))
+		hr = pCreateInfo->AddRefTypeInfo(pDispatchInfo, &hRefDispatch);
+	if (SUCCEEDED(hr))
+		hr = pCreateInfo->AddImplType(0, hRefDispatch);
+
+	// Internal methods, then dynamic methods in dispatch ID order
+	UINT uIndex = 0;
+	for (DWORD cx = 0; SUCCEEDED(hr) && cx < this->m_dwInternalMethods; cx++) {
+		const DispatchTableEntry& entry = this->m_aInternalMethods[cx];
+		hr = AddMethodDescription(pCreateInfo, uIndex++, entry.lDispId, entry.wszName, DYNAMICMETHOD_ANY_ARITY);
+	}
+	for (DWORD cx = 0; SUCCEEDED(hr) && cx < dwMethods; cx++) {
+		DWORD dwCatalogIndex = this->CatalogIndex(cx);
+		const std::wstring& wsName = this->m_Catalog.GetInfo(dwCatalogIndex)->wsFunctionName;
+		DISPID lDispId = static_cast<DISPID>(cx + this->m_dwInternalMethods);
+		if (!wsName.empty())
+			hr = AddMethodDescription(pCreateInfo, uIndex++, lDispId, wsName.c_str(), this->m_Catalog.Get(dwCatalogIndex)->m_dwArguments);
+	}
+
+	if (SUCCEEDED(hr))
+		hr = pCreateInfo->LayOut();
+	if (SUCCEEDED(hr))
+		hr = pCreateInfo->QueryInterface(IID_ITypeInfo, reinterpret_cast<LPVOID*>(ppTypeInfo));
+
+	if (pCreateInfo)
+		pCreateInfo->Release();
+	if (pCreateLib)
+		pCreateLib->Release();
+	pDispatchInfo->Release();
+	return hr;
+}
+
+/**
+ * @brief Get a dynamic method.
+ * @param lDispId The dispatch ID of the method.
+ * @return The method, or NULL if the dispatch ID does not refer to a dynamic method.
+*/
+const DynamicMethod* AutomationFactory::GetMethod(
+	_In_ DISPID lDispId
+) const {
+	if (static_cast<DWORD>(lDispId) < this->m_dwInternalMethods)
+		return nullptr;
+
+	DWORD dwIndex = static_cast<DWORD>(lDispId) - this->m_dwInternalMethods;
+	if (dwIndex >= this->m_dwOwn.load(std::memory_order_acquire))
+		return nullptr;
+	return this->m_Catalog.Get(this->CatalogIndex(dwIndex));
+}
+
+/**
+ * @brief Find the dispatch ID of a method by name: internal methods first, then dynamic methods. Safe to call while
+ *        another thread registers a method.
+ * @param wszName The case-insensitive name of the method.
+ * @param plDispId The address of a variable that receives the dispatch ID.
+ * @return Whether the name has been found.
+*/
+HRESULT STDMETHODCALLTYPE AutomationFactory::FindName(
+	_In_  LPCWSTR wszName,
+	_Out_ DISPID* plDispId
+) const {
+	if (this->m_pInternalNames != nullptr && SUCCEEDED(this->m_pInternalNames->Find(wszName, plDispId)))
+		return S_OK;
+
+	// Methods registered by the object
+	const NameIndex* pNames = this->m_pNames.load(std::memory_order_acquire);
+	if (pNames != nullptr && SUCCEEDED(pNames->Find(wszName, plDispId)))
+		return S_OK;
+
+	*plDispId = DISPID_UNKNOWN;
+	return DISP_E_UNKNOWNNAME;
+}
+
+/**
+ * @brief Number of dynamic methods registered by the object.
+*/
+DWORD AutomationFactory::Size(VOID) const {
+	return this->m_dwOwn.load(std::memory_order_acquire);
+}
+
+/**
+ * @brief Get the index in the catalog of a dynamic method.
+ * @param dwIndex The index of the method, i.e. its dispatch ID minus the number of internal methods, below Size().
+*/
+DWORD AutomationFactory::CatalogIndex(
+	_In_ DWORD dwIndex
+) const {
+	DWORD dwOffset = 0;
+	DWORD dwSegment = MethodTable::Segment(dwIndex, &dwOffset);
+	return this->m_aOwnSegments[dwSegment].load(std::memory_order_acquire)[dwOffset];
+}
+
 /**
  * @brief Get the address of a function from a module.
- * @param pbstrModuleName The name of the module (e.g. user32.dll).
- * @param pbstrFunctionName The name of the function (e.g. MessageBoxW).
+ * @param wszModuleName The name of the module (e.g. user32.dll).
+ * @param wszFunctionName The name of the function (e.g. MessageBoxW), or its ordinal prefixed with '#' (e.g. #12).
  * @param ppFunction The address of pointer variable that receives the address of the function.
  * @return Whether the address of the function has been found.
 */
 HRESULT STDMETHODCALLTYPE AutomationFactory::GetFunctionFromModule(
-	_In_  BSTR*   pbstrModuleName,
-	_In_  BSTR*   pbstrFunctionName,
+	_In_  LPCWSTR wszModuleName,
+	_In_  LPCWSTR wszFunctionName,
 	_Out_ LPVOID* ppFunction
 ) {
 	*ppFunction = NULL;
 
 	// Check if values are empty
-	if (::SysStringLen(*pbstrModuleName) == 0 || ::SysStringLen(*pbstrFunctionName) == 0)
+	if (wszModuleName == NULL || *wszModuleName == L'\0' || wszFunctionName == NULL || *wszFunctionName == L'\0')
 		return E_FAIL;
 
-	// Check if the module has been already loaded
-	HMODULE hModule = NULL;
-	hModule = ::LoadLibraryW(*pbstrModuleName);
-	if (hModule == NULL)
-		return E_FAIL;
-
-	// Convert string name into ASCII
-	std::string szFunctionName = static_cast<std::string>(_bstr_t(*pbstrFunctionName));
-	FARPROC lpProcAddress = ::GetProcAddress(hModule, szFunctionName.c_str());
-	if (lpProcAddress == nullptr)
-		return E_FAIL;
-
-	*ppFunction = reinterpret_cast<LPVOID>(lpProcAddress);
-	return S_OK;
-}
\ No newline at end of file
+	// Modules and exports are resolved once per process
+	return ModuleCache::Instance().GetExport(wszModuleName, wszFunctionName, ppFunction);
+}
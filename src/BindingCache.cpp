@@ -0,0 +1,226 @@
+/**
+* @file         BindingCache.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Binding cache file definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <string>
+#include <vector>
+
+#include "BindingCache.hpp"
+
+#define BINDINGCACHE_HEADER_SIZE 24 /* Magic, version, modules, methods, size of the strings, checksum */
+#define BINDINGCACHE_MODULE_SIZE 16 /* Name, time stamp, checksum, size of image */
+#define BINDINGCACHE_ENTRY_SIZE  16 /* Module, name, signature, RVA */
+
+/**
+ * @brief Read a little-endian 32-bit value.
+*/
+static inline DWORD ReadDword(_In_ const BYTE* lpData) {
+	return static_cast<DWORD>(lpData[0]) | (static_cast<DWORD>(lpData[1]) << 8) | (static_cast<DWORD>(lpData[2]) << 16) | (static_cast<DWORD>(lpData[3]) << 24);
+}
+
+/**
+ * @brief Append a little-endian 32-bit value.
+*/
+static inline VOID WriteDword(_Inout_ std::vector<BYTE>* pData, _In_ DWORD dwValue) {
+	for (DWORD cx = 0; cx < sizeof(DWORD); cx++)
+		pData->push_back(static_cast<BYTE>(dwValue >> (cx * 8)));
+}
+
+/**
+ * @brief Parse a binding cache file. Every field is read with bounds checking, hence untrusted files can be parsed.
+ * @param lpData The content of the file.
+ * @param dwSize The size of the file, in bytes.
+ * @return Whether the file has been parsed. Nothing is kept from a file that is not valid.
+*/
+HRESULT STDMETHODCALLTYPE BindingCache::Parse(
+	_In_ const BYTE* lpData,
+	_In_ SIZE_T      dwSize
+) {
+	this->m_aModules.clear();
+	this->m_aEntries.clear();
+
+	// Header
+	if (lpData == nullptr || dwSize < BINDINGCACHE_HEADER_SIZE || ReadDword(lpData) != BINDINGCACHE_MAGIC)
+		return E_INVALIDARG;
+	if (ReadDword(lpData + 4) != BINDINGCACHE_VERSION)
+		return E_INVALIDARG;
+
+	DWORD dwModules = ReadDword(lpData + 8);
+	DWORD dwEntries = ReadDword(lpData + 12);
+	DWORD dwStrings = ReadDword(lpData + 16);
+	if (dwModules > BINDINGCACHE_MAX_ENTRIES || dwEntries > BINDINGCACHE_MAX_ENTRIES)
+		return E_INVALIDARG;
+
+	SIZE_T dwModuleTable = BINDINGCACHE_HEADER_SIZE;
+	SIZE_T dwEntryTable = dwModuleTable + static_cast<SIZE_T>(dwModules) * BINDINGCACHE_MODULE_SIZE;
+	SIZE_T dwStringTable = dwEntryTable + static_cast<SIZE_T>(dwEntries) * BINDINGCACHE_ENTRY_SIZE;
+	if (dwStringTable > dwSize || dwSize - dwStringTable != dwStrings)
+		return E_INVALIDARG;
+	if (BindingCache::Hash(lpData + BINDINGCACHE_HEADER_SIZE, dwSize - BINDINGCACHE_HEADER_SIZE) != ReadDword(lpData + 20))
+		return E_INVALIDARG;
+
+	// Modules
+	const BYTE* lpStrings = lpData + dwStringTable;
+	std::vector<BindingModule> aModules(dwModules);
+	for (DWORD cx = 0; cx < dwModules; cx++) {
+		const BYTE* lpModule = lpData + dwModuleTable + cx * BINDINGCACHE_MODULE_SIZE;
+		if (!BindingCache::ReadString(lpStrings, dwStrings, ReadDword(lpModule), &aModules[cx].wsName))
+			return E_INVALIDARG;
+		aModules[cx].dwTimeDateStamp = ReadDword(lpModule + 4);
+		aModules[cx].dwCheckSum = ReadDword(lpModule + 8);
+		aModules[cx].dwSizeOfImage = ReadDword(lpModule + 12);
+	}
+
+	// Methods
+	std::vector<BindingEntry> aEntries(dwEntries);
+	for (DWORD cx = 0; cx < dwEntries; cx++) {
+		const BYTE* lpEntry = lpData + dwEntryTable + cx * BINDINGCACHE_ENTRY_SIZE;
+		BindingEntry& entry = aEntries[cx];
+		entry.dwModule = ReadDword(lpEntry);
+		if (entry.dwModule >= dwModules || !BindingCache::ReadString(lpStrings, dwStrings, ReadDword(lpEntry + 4), &entry.wsFunctionName))
+			return E_INVALIDARG;
+
+		DWORD dwSignature = ReadDword(lpEntry + 8);
+		entry.bSignature = dwSignature != BINDINGCACHE_NO_STRING;
+		if (entry.bSignature && !BindingCache::ReadString(lpStrings, dwStrings, dwSignature, &entry.wsSignature))
+			return E_INVALIDARG;
+
+		entry.dwRva = ReadDword(lpEntry + 12);
+		if (entry.wsFunctionName.empty() || entry.dwRva >= aModules[entry.dwModule].dwSizeOfImage)
+			return E_INVALIDARG;
+	}
+
+	this->m_aModules = std::move(aModules);
+	this->m_aEntries = std::move(aEntries);
+	return S_OK;
+}
+
+/**
+ * @brief Serialise the binding cache into the content of a file.
+ * @param pData The address of a variable that receives the content of the file.
+ * @return Whether the cache has been serialised.
+*/
+HRESULT STDMETHODCALLTYPE BindingCache::Serialize(
+	_Out_ std::vector<BYTE>* pData
+) const {
+	pData->clear();
+	if (this->m_aModules.size() > BINDINGCACHE_MAX_ENTRIES || this->m_aEntries.size() > BINDINGCACHE_MAX_ENTRIES)
+		return E_INVALIDARG;
+
+	std::vector<BYTE> strings{};
+	std::vector<BYTE> tables{};
+	for (const BindingModule& module : this->m_aModules) {
+		WriteDword(&tables, BindingCache::WriteString(module.wsName, &strings));
+		WriteDword(&tables, module.dwTimeDateStamp);
+		WriteDword(&tables, module.dwCheckSum);
+		WriteDword(&tables, module.dwSizeOfImage);
+	}
+	for (const BindingEntry& entry : this->m_aEntries) {
+		if (entry.dwModule >= this->m_aModules.size())
+			return E_INVALIDARG;
+		WriteDword(&tables, entry.dwModule);
+		WriteDword(&tables, BindingCache::WriteString(entry.wsFunctionName, &strings));
+		WriteDword(&tables, entry.bSignature ? BindingCache::WriteString(entry.wsSignature, &strings) : BINDINGCACHE_NO_STRING);
+		WriteDword(&tables, entry.dwRva);
+	}
+	if (strings.size() >= BINDINGCACHE_NO_STRING)
+		return E_INVALIDARG;
+	tables.insert(tables.end(), strings.begin(), strings.end());
+
+	WriteDword(pData, BINDINGCACHE_MAGIC);
+	WriteDword(pData, BINDINGCACHE_VERSION);
+	WriteDword(pData, static_cast<DWORD>(this->m_aModules.size()));
+	WriteDword(pData, static_cast<DWORD>(this->m_aEntries.size()));
+	WriteDword(pData, static_cast<DWORD>(strings.size()));
+	WriteDword(pData, BindingCache::Hash(tables.data(), tables.size()));
+	pData->insert(pData->end(), tables.begin(), tables.end());
+	return S_OK;
+}
+
+/**
+ * @brief Get the index of a module, adding it if not recorded yet.
+ * @param pModule The module. Modules are matched by name.
+ * @return The index of the module.
+*/
+DWORD BindingCache::AddModule(
+	_In_ const BindingModule* pModule
+) {
+	for (SIZE_T cx = 0; cx < this->m_aModules.size(); cx++) {
+		if (this->m_aModules[cx].wsName == pModule->wsName)
+			return static_cast<DWORD>(cx);
+	}
+	this->m_aModules.push_back(*pModule);
+	return static_cast<DWORD>(this->m_aModules.size() - 1);
+}
+
+/**
+ * @brief Read a string from the strings of the file.
+ * @param lpStrings The strings of the file.
+ * @param dwStrings The size of the strings, in bytes.
+ * @param dwOffset The offset of the string, in bytes.
+ * @param pString The address of a variable that receives the string.
+ * @return Whether the string is within the strings and NUL-terminated.
+*/
+BOOL BindingCache::ReadString(
+	_In_  const BYTE*   lpStrings,
+	_In_  SIZE_T        dwStrings,
+	_In_  DWORD         dwOffset,
+	_Out_ std::wstring* pString
+) {
+	pString->clear();
+
+	// Length first, hence the string is allocated once
+	SIZE_T dwEnd = dwOffset;
+	while (dwEnd + 1 < dwStrings && (lpStrings[dwEnd] | lpStrings[dwEnd + 1]) != 0)
+		dwEnd += 2;
+	if (dwEnd + 1 >= dwStrings)
+		return FALSE;
+
+	pString->resize((dwEnd - dwOffset) / 2);
+	for (SIZE_T cx = 0; cx < pString->size(); cx++)
+		(*pString)[cx] = static_cast<WCHAR>(lpStrings[dwOffset + cx * 2] | (lpStrings[dwOffset + cx * 2 + 1] << 8));
+	return TRUE;
+}
+
+/**
+ * @brief Append a string to the strings of the file.
+ * @param wsString The string.
+ * @param pStrings The strings of the file.
+ * @return The offset of the string, in bytes.
+*/
+DWORD BindingCache::WriteString(
+	_In_    const std::wstring& wsString,
+	_Inout_ std::vector<BYTE>*  pStrings
+) {
+	// Strings are UTF-16 whatever the size of WCHAR
+	DWORD dwOffset = static_cast<DWORD>(pStrings->size());
+	for (WCHAR wc : wsString) {
+		pStrings->push_back(static_cast<BYTE>(wc & 0xFF));
+		pStrings->push_back(static_cast<BYTE>((wc >> 8) & 0xFF));
+	}
+	pStrings->push_back(0);
+	pStrings->push_back(0);
+	return dwOffset;
+}
+
+/**
+ * @brief FNV-1a hash of the content of the file after the header.
+*/
+DWORD BindingCache::Hash(
+	_In_ const BYTE* lpData,
+	_In_ SIZE_T      dwSize
+) {
+	DWORD dwHash = 0x811C9DC5;
+	for (SIZE_T cx = 0; cx < dwSize; cx++) {
+		dwHash ^= lpData[cx];
+		dwHash *= 0x01000193;
+	}
+	return dwHash;
+}
@@ -13,6 +13,7 @@
 
 #include "IDynamicWrapperEx.hpp"
 #include "CDynamicWrapperEx.hpp"
+#include "ServerLock.hpp"
 
 /**
  * @brief Constructor.
@@ -24,6 +25,14 @@ CDynamicWrapperEx::CDynamicWrapperEx() { }
 */
 CDynamicWrapperEx::~CDynamicWrapperEx() { }
 
+/**
+ * @brief Get the class factory of the process. References do not control its lifetime, locks on the server do.
+*/
+CDynamicWrapperEx& CDynamicWrapperEx::Instance(VOID) {
+    static CDynamicWrapperEx factory;
+    return factory;
+}
+
 /**
  * @brief Queries a COM object for a pointer to one of its interface.
  * @param riid A reference to the interface identifier (IID) of the interface being queried for.
@@ -75,12 +84,14 @@ HRESULT STDMETHODCALLTYPE CDynamicWrapperEx::CreateInstance(
     if (pUnkOuter != NULL)
         return CLASS_E_NOAGGREGATION;
 
-    IDynamicWrapperEx* pIDynamicWrapperEx = new IDynamicWrapperEx();
+    // Released objects are reused, see IDynamicWrapperEx::Create
+    *ppvObject = NULL;
+    IDynamicWrapperEx* pIDynamicWrapperEx = IDynamicWrapperEx::Create();
     if (pIDynamicWrapperEx == nullptr)
         return E_OUTOFMEMORY;
-    
+
+    // The object is released if the interface is not supported
     HRESULT hr = pIDynamicWrapperEx->QueryInterface(riid, ppvObject);
-    this->m_pIDynamicWrapperEx = reinterpret_cast<IDynamicWrapperEx*>(ppvObject);
     pIDynamicWrapperEx->Release();
     return hr;
 }
@@ -93,5 +104,9 @@ HRESULT STDMETHODCALLTYPE CDynamicWrapperEx::CreateInstance(
 HRESULT STDMETHODCALLTYPE CDynamicWrapperEx::LockServer(
     _In_ BOOL fLock
 ) {
-    return ::CoLockObjectExternal(this, fLock, TRUE);
+    if (fLock)
+        ServerLock::Lock();
+    else
+        ServerLock::Unlock();
+    return S_OK;
 }
\ No newline at end of file
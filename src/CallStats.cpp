@@ -0,0 +1,228 @@
+/**
+* @file         CallStats.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Per-method call statistics definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <intrin.h>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "CallStats.hpp"
+#include "MethodTable.hpp"
+
+/**
+ * @brief Slots of the calling thread, indexed by statistics ID.
+ * @details Segments are laid out as in MethodTable and allocated by the owning thread on first use. Other threads only
+ *          read them while holding the lock of the registry, which the owning thread also takes before freeing them.
+*/
+class ThreadStats {
+public:
+	/**
+	 * @brief Get the slots of the calling thread.
+	*/
+	static ThreadStats& Current(VOID) {
+		thread_local ThreadStats stats;
+		return stats;
+	}
+
+	/**
+	 * @brief Get the slot of a method, allocating its segment on first use.
+	 * @return The slot, or NULL on failure.
+	*/
+	PThreadMethodStats Get(
+		_In_ DWORD dwId
+	) {
+		DWORD dwOffset = 0;
+		DWORD dwSegment = MethodTable::Segment(dwId, &dwOffset);
+		if (dwSegment >= METHODTABLE_SEGMENTS)
+			return nullptr;
+
+		PThreadMethodStats aSlots = this->m_aSegments[dwSegment].load(std::memory_order_relaxed);
+		if (aSlots == nullptr) {
+			SIZE_T dwCount = static_cast<SIZE_T>(METHODTABLE_FIRST_SEGMENT) << dwSegment;
+			aSlots = static_cast<PThreadMethodStats>(::operator new(dwCount * sizeof(ThreadMethodStats), std::align_val_t(CALLSTATS_ALIGNMENT), std::nothrow));
+			if (aSlots == nullptr)
+				return nullptr;
+			::memset(static_cast<LPVOID>(aSlots), 0, dwCount * sizeof(ThreadMethodStats));
+			this->m_aSegments[dwSegment].store(aSlots, std::memory_order_release);
+		}
+		return &aSlots[dwOffset];
+	}
+
+	/**
+	 * @brief Get the slot of a method if it has been allocated.
+	 * @return The slot, or NULL if the thread never recorded a call in its segment.
+	*/
+	const ThreadMethodStats* Find(
+		_In_ DWORD dwId
+	) const {
+		DWORD dwOffset = 0;
+		DWORD dwSegment = MethodTable::Segment(dwId, &dwOffset);
+		if (dwSegment >= METHODTABLE_SEGMENTS)
+			return nullptr;
+
+		const ThreadMethodStats* aSlots = this->m_aSegments[dwSegment].load(std::memory_order_acquire);
+		return aSlots != nullptr ? &aSlots[dwOffset] : nullptr;
+	}
+
+private:
+	/**
+	 * @brief Constructor. Register the thread.
+	*/
+	ThreadStats() {
+		for (auto& segment : this->m_aSegments)
+			segment.store(nullptr, std::memory_order_relaxed);
+
+		CallStats& registry = CallStats::Instance();
+		std::lock_guard<std::mutex> guard(registry.m_Lock);
+		registry.m_aThreads.push_back(this);
+	}
+
+	/**
+	 * @brief Destructor. Fold the statistics of the thread into the registry and unregister it.
+	*/
+	~ThreadStats() {
+		CallStats& registry = CallStats::Instance();
+		std::lock_guard<std::mutex> guard(registry.m_Lock);
+
+		DWORD dwIds = registry.m_dwNextId.load(std::memory_order_relaxed);
+		if (registry.m_aRetired.size() < dwIds)
+			registry.m_aRetired.resize(dwIds, MethodStats{});
+		for (DWORD cx = 0; cx < dwIds; cx++) {
+			const ThreadMethodStats* pSlot = this->Find(cx);
+			if (pSlot != nullptr)
+				CallStats::Merge(pSlot, &registry.m_aRetired[cx]);
+		}
+
+		for (auto it = registry.m_aThreads.begin(); it != registry.m_aThreads.end(); it++) {
+			if (*it == this) {
+				registry.m_aThreads.erase(it);
+				break;
+			}
+		}
+
+		for (auto& segment : this->m_aSegments) {
+			PThreadMethodStats aSlots = segment.load(std::memory_order_relaxed);
+			if (aSlots != nullptr)
+				::operator delete(aSlots, std::align_val_t(CALLSTATS_ALIGNMENT));
+		}
+	}
+
+	/**
+	 * @brief Segments of slots.
+	*/
+	std::atomic<PThreadMethodStats> m_aSegments[METHODTABLE_SEGMENTS];
+};
+
+/**
+ * @brief Get the process-wide instance.
+*/
+CallStats& CallStats::Instance(VOID) {
+	static CallStats stats;
+	return stats;
+}
+
+/**
+ * @brief Constructor.
+*/
+CallStats::CallStats() { }
+
+/**
+ * @brief Destructor.
+*/
+CallStats::~CallStats() { }
+
+/**
+ * @brief Allocate the statistics ID of a new method.
+*/
+DWORD CallStats::Allocate(VOID) {
+	return this->m_dwNextId.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Record a call made by the calling thread.
+ * @param dwId The statistics ID of the method.
+ * @param qwMarshalTicks The time spent converting arguments and return value.
+ * @param qwNativeTicks The time spent in the native function.
+*/
+VOID CallStats::Record(
+	_In_ DWORD     dwId,
+	_In_ ULONGLONG qwMarshalTicks,
+	_In_ ULONGLONG qwNativeTicks
+) {
+	PThreadMethodStats pSlot = ThreadStats::Current().Get(dwId);
+	if (pSlot == nullptr)
+		return;
+
+	// Only this thread writes the slot, plain loads and stores are enough
+	ULONGLONG qwTicks = qwMarshalTicks + qwNativeTicks;
+	DWORD dwBucket = 0;
+	if (_BitScanReverse64(&dwBucket, qwTicks) && dwBucket >= CALLSTATS_BUCKETS)
+		dwBucket = CALLSTATS_BUCKETS - 1;
+
+	pSlot->qwCalls.store(pSlot->qwCalls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	pSlot->qwMarshalTicks.store(pSlot->qwMarshalTicks.load(std::memory_order_relaxed) + qwMarshalTicks, std::memory_order_relaxed);
+	pSlot->qwNativeTicks.store(pSlot->qwNativeTicks.load(std::memory_order_relaxed) + qwNativeTicks, std::memory_order_relaxed);
+	pSlot->aHistogram[dwBucket].store(pSlot->aHistogram[dwBucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Record whether a call made by the calling thread matched a shape recorded by the type feedback.
+ * @param dwId The statistics ID of the method.
+ * @param bHit Whether the shape of the call had been recorded.
+*/
+VOID CallStats::RecordFeedback(
+	_In_ DWORD dwId,
+	_In_ BOOL  bHit
+) {
+	PThreadMethodStats pSlot = ThreadStats::Current().Get(dwId);
+	if (pSlot == nullptr)
+		return;
+
+	std::atomic<ULONGLONG>& qwCounter = bHit ? pSlot->qwFeedbackHits : pSlot->qwFeedbackMisses;
+	qwCounter.store(qwCounter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Merge the statistics of a method from all the threads, including the threads that have exited.
+ * @param dwId The statistics ID of the method.
+ * @param pStats The address of a variable that receives the statistics.
+*/
+VOID CallStats::Collect(
+	_In_  DWORD        dwId,
+	_Out_ PMethodStats pStats
+) {
+	std::lock_guard<std::mutex> guard(this->m_Lock);
+	*pStats = dwId < this->m_aRetired.size() ? this->m_aRetired[dwId] : MethodStats{};
+
+	for (const ThreadStats* pThread : this->m_aThreads) {
+		const ThreadMethodStats* pSlot = pThread->Find(dwId);
+		if (pSlot != nullptr)
+			CallStats::Merge(pSlot, pStats);
+	}
+}
+
+/**
+ * @brief Add the slot of a thread to the statistics of a method.
+*/
+VOID CallStats::Merge(
+	_In_    const ThreadMethodStats* pSlot,
+	_Inout_ PMethodStats             pStats
+) {
+	pStats->qwCalls += pSlot->qwCalls.load(std::memory_order_relaxed);
+	pStats->qwMarshalTicks += pSlot->qwMarshalTicks.load(std::memory_order_relaxed);
+	pStats->qwNativeTicks += pSlot->qwNativeTicks.load(std::memory_order_relaxed);
+	for (DWORD cx = 0; cx < CALLSTATS_BUCKETS; cx++)
+		pStats->aHistogram[cx] += pSlot->aHistogram[cx].load(std::memory_order_relaxed);
+	pStats->qwFeedbackHits += pSlot->qwFeedbackHits.load(std::memory_order_relaxed);
+	pStats->qwFeedbackMisses += pSlot->qwFeedbackMisses.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,180 @@
+/**
+* @file         CallThunk.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Per-signature call thunks definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+
+#include "CallThunk.hpp"
+
+#define THUNK_SHADOW_SPACE 0x20 /* Home space of the register arguments */
+
+/**
+ * @brief Registers used to pass integer arguments, in order.
+*/
+static CONST Register g_aIntegerRegisters[THUNK_REGISTERS] = { RegisterRcx, RegisterRdx, RegisterR8, RegisterR9 };
+
+/**
+ * @brief Get the process-wide instance.
+*/
+CallThunkCache& CallThunkCache::Instance(VOID) {
+	static CallThunkCache cache;
+	return cache;
+}
+
+/**
+ * @brief Get the thunk for a signature, generating it on first use.
+ * @param dwArguments The number of arguments.
+ * @param dwFloatMask Bit N is set if the argument N, passed via register, is floating point data.
+ * @param dwReturnFlag Whether scalar or floating point data is returned (RETURN_STD or RETURN_FLT).
+ * @return The thunk, or NULL if the signature cannot be handled by a thunk.
+*/
+CallThunk CallThunkCache::Get(
+	_In_ DWORD dwArguments,
+	_In_ DWORD dwFloatMask,
+	_In_ DWORD dwReturnFlag
+) {
+	if (dwArguments > THUNK_MAX_ARGUMENTS || (dwFloatMask >> (dwArguments < THUNK_REGISTERS ? dwArguments : THUNK_REGISTERS)) != 0)
+		return NULL;
+
+	std::atomic<CallThunk>& thunk = this->m_aThunks[CallThunkCache::Key(dwArguments, dwFloatMask, dwReturnFlag)];
+	CallThunk lpThunk = thunk.load(std::memory_order_acquire);
+	if (lpThunk != NULL)
+		return lpThunk;
+
+	// First time this number of arguments is seen
+	std::lock_guard<std::mutex> lock(this->m_Lock);
+	lpThunk = thunk.load(std::memory_order_acquire);
+	if (lpThunk == NULL) {
+		this->Generate(dwArguments);
+		lpThunk = thunk.load(std::memory_order_acquire);
+	}
+	return lpThunk;
+}
+
+/**
+ * @brief Emit the machine code of a thunk.
+ * @param pEmitter The emitter receiving the code.
+ * @param dwArguments The number of arguments.
+ * @param dwFloatMask Bit N is set if the argument N, passed via register, is floating point data.
+ * @param dwReturnFlag Whether scalar or floating point data is returned (RETURN_STD or RETURN_FLT).
+*/
+VOID CallThunkCache::Emit(
+	_In_ CodeEmitter* pEmitter,
+	_In_ DWORD        dwArguments,
+	_In_ DWORD        dwFloatMask,
+	_In_ DWORD        dwReturnFlag
+) {
+	CONST LONG lStride = sizeof(Argument);
+	CONST LONG lValue = offsetof(Argument, qwValue);
+
+	// Outgoing arguments area, rsp is 16-byte aligned after the push of rbx
+	DWORD dwStack = THUNK_SHADOW_SPACE;
+	if (dwArguments > THUNK_REGISTERS)
+		dwStack += (dwArguments - THUNK_REGISTERS) * sizeof(DWORD64);
+	dwStack = (dwStack + 0xF) & ~0xF;
+
+	// Prologue
+	pEmitter->BeginFunction();
+	pEmitter->Push(RegisterRbx);
+	pEmitter->SubRsp(dwStack);
+	pEmitter->EndPrologue();
+	pEmitter->MovRegReg(RegisterRbx, RegisterR8);   // lpResult
+	pEmitter->MovRegReg(RegisterRax, RegisterRdx);  // lpFunction
+	pEmitter->MovRegReg(RegisterR10, RegisterRcx);  // lpArguments
+
+	// Stack arguments are copied as raw 64-bit values whatever their type
+	for (DWORD cx = THUNK_REGISTERS; cx < dwArguments; cx++) {
+		pEmitter->MovRegMem(RegisterR11, RegisterR10, static_cast<LONG>(cx) * lStride + lValue);
+		pEmitter->MovMemReg(RegisterRsp, static_cast<LONG>(THUNK_SHADOW_SPACE + (cx - THUNK_REGISTERS) * sizeof(DWORD64)), RegisterR11);
+	}
+
+	// Register arguments
+	for (DWORD cx = 0; cx < dwArguments && cx < THUNK_REGISTERS; cx++) {
+		if (dwFloatMask & (1 << cx))
+			pEmitter->MovsdXmmMem(cx, RegisterR10, static_cast<LONG>(cx) * lStride + lValue);
+		else
+			pEmitter->MovRegMem(g_aIntegerRegisters[cx], RegisterR10, static_cast<LONG>(cx) * lStride + lValue);
+	}
+
+	// Call and store the result
+	pEmitter->Call(RegisterRax);
+	if (dwReturnFlag & RETURN_FLT)
+		pEmitter->MovsdMemXmm(RegisterRbx, 0, 0);
+	else
+		pEmitter->MovMemReg(RegisterRbx, 0, RegisterRax);
+
+	// Epilogue
+	pEmitter->AddRsp(dwStack);
+	pEmitter->Pop(RegisterRbx);
+	pEmitter->Ret();
+	pEmitter->EndFunction();
+}
+
+/**
+ * @brief Compute the floating point mask of the register arguments.
+ * @param lpArguments The arguments.
+ * @param dwArguments The number of arguments.
+ * @return Bit N is set if the argument N is floating point data.
+*/
+DWORD CallThunkCache::FloatMask(
+	_In_ const Argument* lpArguments,
+	_In_ DWORD           dwArguments
+) {
+	DWORD dwFloatMask = 0;
+	for (DWORD cx = 0; cx < dwArguments && cx < THUNK_REGISTERS; cx++) {
+		if (lpArguments[cx].dwFlag & ARGUMENT_FLT)
+			dwFloatMask |= 1 << cx;
+	}
+	return dwFloatMask;
+}
+
+/**
+ * @brief Index of a signature within the cache.
+*/
+DWORD CallThunkCache::Key(
+	_In_ DWORD dwArguments,
+	_In_ DWORD dwFloatMask,
+	_In_ DWORD dwReturnFlag
+) {
+	return (dwArguments << (THUNK_REGISTERS + 1)) | (dwFloatMask << 1) | ((dwReturnFlag & RETURN_FLT) ? 1 : 0);
+}
+
+/**
+ * @brief Generate and publish all variants for a given number of arguments.
+*/
+VOID CallThunkCache::Generate(_In_ DWORD dwArguments) {
+	CONST DWORD dwMasks = 1 << (dwArguments < THUNK_REGISTERS ? dwArguments : THUNK_REGISTERS);
+	CONST DWORD aReturnFlags[] = { RETURN_STD, RETURN_FLT };
+
+	// Emit every variant back to back
+	CodeEmitter emitter{};
+	SIZE_T aOffsets[2][1 << THUNK_REGISTERS]{};
+	for (DWORD dwReturn = 0; dwReturn < ARRAYSIZE(aReturnFlags); dwReturn++) {
+		for (DWORD dwFloatMask = 0; dwFloatMask < dwMasks; dwFloatMask++) {
+			aOffsets[dwReturn][dwFloatMask] = emitter.Size();
+			CallThunkCache::Emit(&emitter, dwArguments, dwFloatMask, aReturnFlags[dwReturn]);
+			emitter.Align(0x10);
+		}
+	}
+
+	PBYTE lpCode = reinterpret_cast<PBYTE>(CodePool::Instance().Commit(&emitter));
+	if (lpCode == NULL)
+		return;
+
+	// Publish
+	for (DWORD dwReturn = 0; dwReturn < ARRAYSIZE(aReturnFlags); dwReturn++) {
+		for (DWORD dwFloatMask = 0; dwFloatMask < dwMasks; dwFloatMask++) {
+			CallThunk lpThunk = reinterpret_cast<CallThunk>(lpCode + aOffsets[dwReturn][dwFloatMask]);
+			this->m_aThunks[CallThunkCache::Key(dwArguments, dwFloatMask, aReturnFlags[dwReturn])].store(lpThunk, std::memory_order_release);
+		}
+	}
+}
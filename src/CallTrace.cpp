@@ -0,0 +1,353 @@
+/**
+* @file         CallTrace.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Call tracer of the dynamic methods definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <intrin.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "CallTrace.hpp"
+#include "MethodCatalog.hpp"
+#include "ServerLock.hpp"
+
+/**
+ * @brief Ring of the calling thread, handed back to the tracer when the thread exits.
+*/
+class TraceRingOwner {
+public:
+	/**
+	 * @brief Get the ring of the calling thread, acquired on first use.
+	 * @return The ring, or NULL if out of memory.
+	*/
+	static TraceRing* Current(VOID) {
+		thread_local TraceRingOwner owner;
+		if (owner.m_pRing == nullptr)
+			owner.m_pRing = CallTrace::Instance().AcquireRing();
+		return owner.m_pRing;
+	}
+
+private:
+	/**
+	 * @brief Destructor. The records left are flushed before the ring is reused.
+	*/
+	~TraceRingOwner() {
+		if (this->m_pRing != nullptr)
+			this->m_pRing->m_bRetired.store(TRUE, std::memory_order_release);
+	}
+
+	/**
+	 * @brief Ring of the thread.
+	*/
+	TraceRing* m_pRing{ nullptr };
+};
+
+/**
+ * @brief Append a record. Called by the owning thread only.
+ * @return Whether the record has been appended, FALSE if the ring is full.
+*/
+BOOL TraceRing::Push(
+	_In_ const TraceRecord* pRecord
+) {
+	ULONGLONG qwHead = this->m_qwHead.load(std::memory_order_relaxed);
+	if (qwHead - this->m_qwTail.load(std::memory_order_acquire) >= CALLTRACE_RING_SIZE) {
+		this->m_qwDropped.store(this->m_qwDropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return FALSE;
+	}
+
+	// The record is visible to the consumer once the head has moved past it
+	this->m_aRecords[qwHead & (CALLTRACE_RING_SIZE - 1)] = *pRecord;
+	this->m_qwHead.store(qwHead + 1, std::memory_order_release);
+	return TRUE;
+}
+
+/**
+ * @brief Move the records appended so far. Called by the consumer only.
+ * @param pRecords The records, the moved ones are appended.
+*/
+VOID TraceRing::Drain(
+	_Inout_ std::vector<TraceRecord>* pRecords
+) {
+	ULONGLONG qwTail = this->m_qwTail.load(std::memory_order_relaxed);
+	ULONGLONG qwHead = this->m_qwHead.load(std::memory_order_acquire);
+	for (; qwTail != qwHead; qwTail++)
+		pRecords->push_back(this->m_aRecords[qwTail & (CALLTRACE_RING_SIZE - 1)]);
+
+	// Slots can be written again once the tail has moved past them
+	this->m_qwTail.store(qwTail, std::memory_order_release);
+}
+
+/**
+ * @brief Get the process-wide instance.
+*/
+CallTrace& CallTrace::Instance(VOID) {
+	static CallTrace trace;
+	return trace;
+}
+
+/**
+ * @brief Constructor.
+*/
+CallTrace::CallTrace() { }
+
+/**
+ * @brief Destructor. Rings are left to the process, threads may still hold them.
+*/
+CallTrace::~CallTrace() { }
+
+/**
+ * @brief Start tracing into a file, ending the trace in progress if any.
+ * @param wszPath The path of the file, replaced if it exists.
+ * @return Whether tracing has started, E_NOTIMPL if not built with DWEX_ENABLE_TRACE.
+*/
+HRESULT STDMETHODCALLTYPE CallTrace::Start(
+	_In_ LPCWSTR wszPath
+) {
+#ifndef DWEX_ENABLE_TRACE
+	UNREFERENCED_PARAMETER(wszPath);
+	return E_NOTIMPL;
+#else
+	std::lock_guard<std::mutex> guard(this->m_ControlLock);
+	ULONGLONG qwRecords = 0;
+	this->Close(&qwRecords);
+
+	HANDLE hFile = ::CreateFileW(wszPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return HRESULT_FROM_WIN32(::GetLastError());
+
+	std::vector<BYTE> header{};
+	TraceFile::WriteHeader(&header);
+	DWORD dwWritten = 0;
+	HANDLE hStop = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (hStop == NULL || !::WriteFile(hFile, header.data(), static_cast<DWORD>(header.size()), &dwWritten, NULL)) {
+		HRESULT hr = HRESULT_FROM_WIN32(::GetLastError());
+		if (hStop != NULL)
+			::CloseHandle(hStop);
+		::CloseHandle(hFile);
+		return hr;
+	}
+
+	// Records left from a previous trace are discarded, nothing else consumes the rings until the flush thread starts
+	{
+		std::lock_guard<std::mutex> rings(this->m_RingsLock);
+		for (TraceRing* pRing : this->m_aRings)
+			pRing->m_qwTail.store(pRing->m_qwHead.load(std::memory_order_acquire), std::memory_order_release);
+	}
+	this->m_aDescribed.clear();
+	this->m_qwRecords = 0;
+	this->m_qwDroppedBase = this->Dropped();
+	this->m_hFile = hFile;
+	this->m_hStop = hStop;
+
+	// The module cannot be unloaded while the flush thread runs
+	ServerLock::Lock();
+	this->m_bEnabled.store(TRUE, std::memory_order_release);
+	this->m_hThread = ::CreateThread(NULL, 0, &CallTrace::FlushThread, this, 0, NULL);
+	if (this->m_hThread == NULL) {
+		HRESULT hr = HRESULT_FROM_WIN32(::GetLastError());
+		this->m_bEnabled.store(FALSE, std::memory_order_release);
+		ServerLock::Unlock();
+		::CloseHandle(this->m_hStop);
+		::CloseHandle(this->m_hFile);
+		this->m_hStop = NULL;
+		this->m_hFile = INVALID_HANDLE_VALUE;
+		return hr;
+	}
+	return S_OK;
+#endif
+}
+
+/**
+ * @brief Stop tracing, write the records left and the end block, then close the file.
+ * @param pqwRecords The address of a variable that receives the number of records written.
+ * @return S_OK if a trace has been ended, S_FALSE if calls were not being traced.
+*/
+HRESULT STDMETHODCALLTYPE CallTrace::Stop(
+	_Out_ ULONGLONG* pqwRecords
+) {
+	std::lock_guard<std::mutex> guard(this->m_ControlLock);
+	return this->Close(pqwRecords);
+}
+
+/**
+ * @brief End the trace in progress if any. The control lock must be held by the caller.
+ * @param pqwRecords The address of a variable that receives the number of records written.
+ * @return S_OK if a trace has been ended, S_FALSE if calls were not being traced.
+*/
+HRESULT STDMETHODCALLTYPE CallTrace::Close(
+	_Out_ ULONGLONG* pqwRecords
+) {
+	*pqwRecords = 0;
+	if (this->m_hThread == NULL)
+		return S_FALSE;
+
+	// Calls in progress may still push their record, which the last flush picks up if already visible
+	this->m_bEnabled.store(FALSE, std::memory_order_release);
+	::SetEvent(this->m_hStop);
+	::WaitForSingleObject(this->m_hThread, INFINITE);
+	::CloseHandle(this->m_hThread);
+	::CloseHandle(this->m_hStop);
+	this->m_hThread = NULL;
+	this->m_hStop = NULL;
+	this->Flush();
+
+	std::vector<BYTE> end{};
+	TraceFile::WriteEnd(this->m_qwRecords, this->Dropped() - this->m_qwDroppedBase, &end);
+	DWORD dwWritten = 0;
+	::WriteFile(this->m_hFile, end.data(), static_cast<DWORD>(end.size()), &dwWritten, NULL);
+	::CloseHandle(this->m_hFile);
+	this->m_hFile = INVALID_HANDLE_VALUE;
+
+	ServerLock::Unlock();
+	*pqwRecords = this->m_qwRecords;
+	return S_OK;
+}
+
+/**
+ * @brief Execute a dynamic method and record the call.
+ * @param pMethod The method.
+ * @param dwMethod The index of the method in the catalog (see MethodCatalog.hpp).
+ * @param lDispId The dispatch ID of the method.
+ * @param pDispParams List of parameters provided by the client.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @param puArgErr The index within rgvarg of the first argument that has an error, if not NULL.
+ * @return The result of the method.
+*/
+HRESULT STDMETHODCALLTYPE CallTrace::Invoke(
+	_In_      const DynamicMethod* pMethod,
+	_In_      DWORD                dwMethod,
+	_In_      DISPID               lDispId,
+	_In_      DISPPARAMS*          pDispParams,
+	_Out_     VARIANT*             pVarResult,
+	_Out_opt_ UINT*                puArgErr
+) {
+	TraceRecord record{};
+	record.dwThreadId = ::GetCurrentThreadId();
+	record.lDispId = lDispId;
+	record.dwMethod = dwMethod;
+	record.wArguments = static_cast<WORD>(pDispParams->cArgs > 0xFFFF ? 0xFFFF : pDispParams->cArgs);
+
+	// Arguments before the call, references may be written back. Addresses are not recorded, see TraceRecord
+	for (UINT cx = 0; cx < pDispParams->cArgs && cx < TRACEFILE_ARGUMENTS; cx++) {
+		const VARIANT* pVariant = &pDispParams->rgvarg[pDispParams->cArgs - cx - 1];
+		if (V_VT(pVariant) == (VT_VARIANT | VT_BYREF))
+			pVariant = V_VARIANTREF(pVariant);
+
+		record.aTypes[cx] = V_VT(pVariant);
+		if (V_VT(pVariant) == VT_BSTR)
+			record.aWords[cx] = ::SysStringLen(V_BSTR(pVariant));
+		else if ((V_VT(pVariant) & (VT_BYREF | VT_ARRAY)) == 0 && V_VT(pVariant) != VT_DISPATCH && V_VT(pVariant) != VT_UNKNOWN)
+			record.aWords[cx] = V_UI8(pVariant);
+	}
+
+	record.qwTimestamp = __rdtsc();
+	record.hr = pMethod->Invoke(pDispParams, pVarResult, puArgErr);
+	record.qwDuration = __rdtsc() - record.qwTimestamp;
+	if (pVarResult != NULL && SUCCEEDED(record.hr)) {
+		record.vtReturn = V_VT(pVarResult);
+		record.qwReturn = V_VT(pVarResult) == VT_BSTR ? ::SysStringLen(V_BSTR(pVarResult)) : V_UI8(pVarResult);
+	}
+
+	TraceRing* pRing = TraceRingOwner::Current();
+	if (pRing != nullptr)
+		pRing->Push(&record);
+	return record.hr;
+}
+
+/**
+ * @brief Get a ring for the calling thread, reusing the drained ring of a thread that has exited if any.
+ * @return The ring, or NULL if out of memory.
+*/
+TraceRing* CallTrace::AcquireRing(VOID) {
+	std::lock_guard<std::mutex> guard(this->m_RingsLock);
+	for (TraceRing* pRing : this->m_aRings) {
+		if (!pRing->m_bRetired.load(std::memory_order_acquire))
+			continue;
+		if (pRing->m_qwTail.load(std::memory_order_acquire) != pRing->m_qwHead.load(std::memory_order_relaxed))
+			continue;
+		pRing->m_bRetired.store(FALSE, std::memory_order_relaxed);
+		return pRing;
+	}
+
+	TraceRing* pRing = new (std::nothrow) TraceRing();
+	if (pRing != nullptr)
+		this->m_aRings.push_back(pRing);
+	return pRing;
+}
+
+/**
+ * @brief Append the records of every ring to the file. Called by the flush thread, or by Stop once it has exited.
+*/
+VOID CallTrace::Flush(VOID) {
+	// Rings are never freed, hence can be drained outside of the lock
+	std::vector<TraceRing*> aRings{};
+	{
+		std::lock_guard<std::mutex> guard(this->m_RingsLock);
+		aRings = this->m_aRings;
+	}
+
+	std::vector<TraceRecord> aRecords{};
+	for (TraceRing* pRing : aRings)
+		pRing->Drain(&aRecords);
+	if (aRecords.empty())
+		return;
+
+	// Methods are described before the first record referencing them
+	std::vector<BYTE> data{};
+	MethodCatalog& catalog = MethodCatalog::Instance();
+	for (const TraceRecord& record : aRecords) {
+		if (record.dwMethod < this->m_aDescribed.size() && this->m_aDescribed[record.dwMethod])
+			continue;
+		if (record.dwMethod >= this->m_aDescribed.size())
+			this->m_aDescribed.resize(record.dwMethod + 1, FALSE);
+		this->m_aDescribed[record.dwMethod] = TRUE;
+
+		const DynamicMethodInfo* pInfo = catalog.GetInfo(record.dwMethod);
+		if (pInfo == nullptr)
+			continue;
+		TraceMethod method{};
+		method.dwMethod = record.dwMethod;
+		method.wsModuleName = pInfo->wsModuleName;
+		method.wsFunctionName = pInfo->wsFunctionName;
+		method.bSignature = pInfo->pPlan != nullptr;
+		if (method.bSignature)
+			method.wsSignature = pInfo->wsSignature;
+		TraceFile::WriteMethod(&method, &data);
+	}
+	TraceFile::WriteRecords(aRecords.data(), static_cast<DWORD>(aRecords.size()), &data);
+
+	DWORD dwWritten = 0;
+	if (::WriteFile(this->m_hFile, data.data(), static_cast<DWORD>(data.size()), &dwWritten, NULL))
+		this->m_qwRecords += aRecords.size();
+}
+
+/**
+ * @brief Entry point of the flush thread.
+*/
+DWORD WINAPI CallTrace::FlushThread(
+	_In_ LPVOID lpParameter
+) {
+	CallTrace* pTrace = static_cast<CallTrace*>(lpParameter);
+	while (::WaitForSingleObject(pTrace->m_hStop, CALLTRACE_FLUSH_PERIOD) == WAIT_TIMEOUT)
+		pTrace->Flush();
+	return 0;
+}
+
+/**
+ * @brief Number of records dropped by every ring since their creation.
+*/
+ULONGLONG CallTrace::Dropped(VOID) {
+	std::lock_guard<std::mutex> guard(this->m_RingsLock);
+	ULONGLONG qwDropped = 0;
+	for (const TraceRing* pRing : this->m_aRings)
+		qwDropped += pRing->m_qwDropped.load(std::memory_order_relaxed);
+	return qwDropped;
+}
@@ -0,0 +1,427 @@
+/**
+* @file         CodeEmitter.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        x64 machine code emitter and executable code pool definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <initializer_list>
+#include <mutex>
+#include <vector>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "CodeEmitter.hpp"
+
+#define CODEPOOL_REGION_SIZE 0x100000 /* Address space reserved at once, 1MB */
+
+#define UNWIND_VERSION        1   /* Version of UNWIND_INFO */
+#define UNWIND_PUSH_NONVOL    0   /* UWOP_PUSH_NONVOL: push of a non-volatile register */
+#define UNWIND_ALLOC_LARGE    1   /* UWOP_ALLOC_LARGE: allocation of up to 4GB on the stack */
+#define UNWIND_ALLOC_SMALL    2   /* UWOP_ALLOC_SMALL: allocation of 8 to 128 bytes on the stack */
+#define UNWIND_MAX_SMALL      128 /* Largest allocation described by UWOP_ALLOC_SMALL */
+#define RUNTIME_FUNCTION_SIZE 12  /* Begin, end and unwind data of a function */
+
+/**
+ * @brief Append a little-endian 32-bit value.
+*/
+static inline VOID WriteDword(_Inout_ std::vector<BYTE>* pData, _In_ DWORD dwValue) {
+	for (DWORD cx = 0; cx < sizeof(DWORD); cx++)
+		pData->push_back(static_cast<BYTE>(dwValue >> (cx * 8)));
+}
+
+/**
+ * @brief Start a function. Push and SubRsp are recorded as unwind codes until the end of the prologue.
+*/
+VOID CodeEmitter::BeginFunction(VOID) {
+	this->m_aFunctions.push_back({ static_cast<DWORD>(this->m_aCode.size()), 0, 0, {} });
+	this->m_bPrologue = TRUE;
+}
+
+/**
+ * @brief End the prologue of the current function.
+*/
+VOID CodeEmitter::EndPrologue(VOID) {
+	CodeFunction& function = this->m_aFunctions.back();
+	function.dwPrologue = static_cast<DWORD>(this->m_aCode.size()) - function.dwBegin;
+	this->m_bPrologue = FALSE;
+}
+
+/**
+ * @brief End the current function, after its last instruction.
+*/
+VOID CodeEmitter::EndFunction(VOID) {
+	this->m_aFunctions.back().dwEnd = static_cast<DWORD>(this->m_aCode.size());
+	this->m_bPrologue = FALSE;
+}
+
+/**
+ * @brief push reg
+*/
+VOID CodeEmitter::Push(_In_ Register reg) {
+	this->Rex(FALSE, 0, reg);
+	this->m_aCode.push_back(static_cast<BYTE>(0x50 | (reg & 7)));
+	this->Unwind(UNWIND_PUSH_NONVOL, static_cast<BYTE>(reg), {});
+}
+
+/**
+ * @brief pop reg
+*/
+VOID CodeEmitter::Pop(_In_ Register reg) {
+	this->Rex(FALSE, 0, reg);
+	this->m_aCode.push_back(static_cast<BYTE>(0x58 | (reg & 7)));
+}
+
+/**
+ * @brief mov dst, src
+*/
+VOID CodeEmitter::MovRegReg(_In_ Register dst, _In_ Register src) {
+	this->Rex(TRUE, src, dst);
+	this->m_aCode.push_back(0x89);
+	this->m_aCode.push_back(static_cast<BYTE>(0xC0 | ((src & 7) << 3) | (dst & 7)));
+}
+
+/**
+ * @brief mov dst, imm64
+*/
+VOID CodeEmitter::MovRegImm64(_In_ Register dst, _In_ DWORD64 qwImmediate) {
+	this->Rex(TRUE, 0, dst);
+	this->m_aCode.push_back(static_cast<BYTE>(0xB8 | (dst & 7)));
+	this->Dword(static_cast<DWORD>(qwImmediate));
+	this->Dword(static_cast<DWORD>(qwImmediate >> 32));
+}
+
+/**
+ * @brief mov dst, qword [base + disp32]
+*/
+VOID CodeEmitter::MovRegMem(_In_ Register dst, _In_ Register base, _In_ LONG lDisplacement) {
+	this->Rex(TRUE, dst, base);
+	this->m_aCode.push_back(0x8B);
+	this->ModRmDisp32(dst, base, lDisplacement);
+}
+
+/**
+ * @brief mov qword [base + disp32], src
+*/
+VOID CodeEmitter::MovMemReg(_In_ Register base, _In_ LONG lDisplacement, _In_ Register src) {
+	this->Rex(TRUE, src, base);
+	this->m_aCode.push_back(0x89);
+	this->ModRmDisp32(src, base, lDisplacement);
+}
+
+/**
+ * @brief movsd xmm, qword [base + disp32]
+*/
+VOID CodeEmitter::MovsdXmmMem(_In_ DWORD dwXmm, _In_ Register base, _In_ LONG lDisplacement) {
+	this->m_aCode.push_back(0xF2);
+	this->Rex(FALSE, dwXmm, base);
+	this->m_aCode.push_back(0x0F);
+	this->m_aCode.push_back(0x10);
+	this->ModRmDisp32(dwXmm, base, lDisplacement);
+}
+
+/**
+ * @brief movsd qword [base + disp32], xmm
+*/
+VOID CodeEmitter::MovsdMemXmm(_In_ Register base, _In_ LONG lDisplacement, _In_ DWORD dwXmm) {
+	this->m_aCode.push_back(0xF2);
+	this->Rex(FALSE, dwXmm, base);
+	this->m_aCode.push_back(0x0F);
+	this->m_aCode.push_back(0x11);
+	this->ModRmDisp32(dwXmm, base, lDisplacement);
+}
+
+/**
+ * @brief lea dst, [base + disp32]
+*/
+VOID CodeEmitter::Lea(_In_ Register dst, _In_ Register base, _In_ LONG lDisplacement) {
+	this->Rex(TRUE, dst, base);
+	this->m_aCode.push_back(0x8D);
+	this->ModRmDisp32(dst, base, lDisplacement);
+}
+
+/**
+ * @brief sub rsp, imm32
+*/
+VOID CodeEmitter::SubRsp(_In_ DWORD dwImmediate) {
+	this->m_aCode.insert(this->m_aCode.end(), { 0x48, 0x81, 0xEC });
+	this->Dword(dwImmediate);
+
+	// The size of the allocation is scaled by 8 when it fits in a slot, given in two slots otherwise
+	if (dwImmediate <= UNWIND_MAX_SMALL)
+		this->Unwind(UNWIND_ALLOC_SMALL, static_cast<BYTE>(dwImmediate / 8 - 1), {});
+	else if (dwImmediate / 8 <= 0xFFFF)
+		this->Unwind(UNWIND_ALLOC_LARGE, 0, { static_cast<WORD>(dwImmediate / 8) });
+	else
+		this->Unwind(UNWIND_ALLOC_LARGE, 1, { static_cast<WORD>(dwImmediate), static_cast<WORD>(dwImmediate >> 16) });
+}
+
+/**
+ * @brief add rsp, imm32
+*/
+VOID CodeEmitter::AddRsp(_In_ DWORD dwImmediate) {
+	this->m_aCode.insert(this->m_aCode.end(), { 0x48, 0x81, 0xC4 });
+	this->Dword(dwImmediate);
+}
+
+/**
+ * @brief call reg
+*/
+VOID CodeEmitter::Call(_In_ Register reg) {
+	this->Rex(FALSE, 0, reg);
+	this->m_aCode.push_back(0xFF);
+	this->m_aCode.push_back(static_cast<BYTE>(0xD0 | (reg & 7)));
+}
+
+/**
+ * @brief jmp reg
+*/
+VOID CodeEmitter::Jmp(_In_ Register reg) {
+	this->Rex(FALSE, 0, reg);
+	this->m_aCode.push_back(0xFF);
+	this->m_aCode.push_back(static_cast<BYTE>(0xE0 | (reg & 7)));
+}
+
+/**
+ * @brief ret
+*/
+VOID CodeEmitter::Ret(VOID) {
+	this->m_aCode.push_back(0xC3);
+}
+
+/**
+ * @brief Pad the buffer with int3 up to the given alignment.
+*/
+VOID CodeEmitter::Align(_In_ DWORD dwAlignment) {
+	while (this->m_aCode.size() % dwAlignment)
+		this->m_aCode.push_back(0xCC);
+}
+
+/**
+ * @brief Emit a REX prefix if required.
+*/
+VOID CodeEmitter::Rex(_In_ BOOL bWide, _In_ DWORD dwReg, _In_ DWORD dwBase) {
+	BYTE bRex = 0x40;
+	if (bWide)
+		bRex |= 0x08;
+	if (dwReg & 8)
+		bRex |= 0x04;
+	if (dwBase & 8)
+		bRex |= 0x01;
+
+	if (bRex != 0x40)
+		this->m_aCode.push_back(bRex);
+}
+
+/**
+ * @brief Emit a ModRM byte addressing [base + disp32], with a SIB byte when base is rsp or r12.
+*/
+VOID CodeEmitter::ModRmDisp32(_In_ DWORD dwReg, _In_ Register base, _In_ LONG lDisplacement) {
+	this->m_aCode.push_back(static_cast<BYTE>(0x80 | ((dwReg & 7) << 3) | (base & 7)));
+	if ((base & 7) == RegisterRsp)
+		this->m_aCode.push_back(0x24);
+	this->Dword(static_cast<DWORD>(lDisplacement));
+}
+
+/**
+ * @brief Emit a 32-bit little-endian value.
+*/
+VOID CodeEmitter::Dword(_In_ DWORD dwValue) {
+	for (DWORD cx = 0; cx < 4; cx++)
+		this->m_aCode.push_back(static_cast<BYTE>(dwValue >> (cx * 8)));
+}
+
+/**
+ * @brief Record the unwind code of the instruction just emitted, if it is part of a prologue.
+ * @param bOperation The unwind operation.
+ * @param bInformation The operation information.
+ * @param aSlots The additional slots of the operation.
+*/
+VOID CodeEmitter::Unwind(
+	_In_ BYTE                        bOperation,
+	_In_ BYTE                        bInformation,
+	_In_ std::initializer_list<WORD> aSlots
+) {
+	if (!this->m_bPrologue)
+		return;
+
+	// Codes are in reverse order of the prologue, each one with the offset of the end of its instruction
+	CodeFunction& function = this->m_aFunctions.back();
+	BYTE bOffset = static_cast<BYTE>(this->m_aCode.size() - function.dwBegin);
+	std::vector<WORD> aCodes = { static_cast<WORD>(bOffset | (bOperation << 8) | (bInformation << 12)) };
+	aCodes.insert(aCodes.end(), aSlots.begin(), aSlots.end());
+	function.aUnwindCodes.insert(function.aUnwindCodes.begin(), aCodes.begin(), aCodes.end());
+}
+
+/**
+ * @brief Get the process-wide instance.
+*/
+CodePool& CodePool::Instance(VOID) {
+	static CodePool pool;
+	return pool;
+}
+
+/**
+ * @brief Constructor.
+*/
+CodePool::CodePool() {
+#ifdef _WIN32
+	SYSTEM_INFO si{};
+	::GetSystemInfo(&si);
+	this->m_dwPageSize = si.dwPageSize;
+#else
+	this->m_dwPageSize = static_cast<SIZE_T>(::sysconf(_SC_PAGESIZE));
+#endif
+}
+
+/**
+ * @brief Destructor.
+*/
+CodePool::~CodePool() {
+#ifdef _WIN32
+	for (LPVOID lpTable : this->m_aTables)
+		::RtlDeleteFunctionTable(reinterpret_cast<PRUNTIME_FUNCTION>(lpTable));
+#endif
+	this->m_aTables.clear();
+
+	for (PBYTE lpRegion : this->m_aRegions) {
+#ifdef _WIN32
+		::VirtualFree(lpRegion, 0, MEM_RELEASE);
+#else
+		::munmap(lpRegion, CODEPOOL_REGION_SIZE);
+#endif
+	}
+	this->m_aRegions.clear();
+}
+
+/**
+ * @brief Copy the code of an emitter into executable memory and register the unwind data of its functions.
+ * @param pEmitter The emitter holding the code.
+ * @return The address of the executable copy, or NULL on failure.
+*/
+LPVOID CodePool::Commit(
+	_In_ const CodeEmitter* pEmitter
+) {
+	std::vector<BYTE> image{};
+	DWORD dwTable = 0;
+	CodePool::Layout(pEmitter, &image, &dwTable);
+
+	std::lock_guard<std::mutex> lock(this->m_Lock);
+	PBYTE lpImage = this->Copy(image.data(), image.size());
+	if (lpImage == NULL)
+		return NULL;
+
+#ifdef _WIN32
+	// Code that cannot be unwound through is never handed out
+	if (!pEmitter->Functions().empty()) {
+		PRUNTIME_FUNCTION lpTable = reinterpret_cast<PRUNTIME_FUNCTION>(lpImage + dwTable);
+		if (!::RtlAddFunctionTable(lpTable, static_cast<DWORD>(pEmitter->Functions().size()), reinterpret_cast<DWORD64>(lpImage)))
+			return NULL;
+		this->m_aTables.push_back(lpTable);
+	}
+#endif
+	return lpImage;
+}
+
+/**
+ * @brief Build the image committed for the code of an emitter: the code, then the UNWIND_INFO of every function, then
+ *        the RUNTIME_FUNCTION of every function. Addresses are relative to the start of the image.
+ * @param pEmitter The emitter holding the code.
+ * @param pImage The address of a variable that receives the image.
+ * @param pdwTable The address of a variable that receives the offset of the RUNTIME_FUNCTION entries.
+*/
+VOID CodePool::Layout(
+	_In_  const CodeEmitter* pEmitter,
+	_Out_ std::vector<BYTE>* pImage,
+	_Out_ PDWORD             pdwTable
+) {
+	pImage->assign(pEmitter->Data(), pEmitter->Data() + pEmitter->Size());
+
+	// UNWIND_INFO, DWORD-aligned, with an even number of slots
+	std::vector<DWORD> aUnwindInfo{};
+	for (const CodeFunction& function : pEmitter->Functions()) {
+		while (pImage->size() % sizeof(DWORD))
+			pImage->push_back(0xCC);
+		aUnwindInfo.push_back(static_cast<DWORD>(pImage->size()));
+
+		pImage->push_back(UNWIND_VERSION);
+		pImage->push_back(static_cast<BYTE>(function.dwPrologue));
+		pImage->push_back(static_cast<BYTE>(function.aUnwindCodes.size()));
+		pImage->push_back(0);
+		for (WORD wSlot : function.aUnwindCodes) {
+			pImage->push_back(static_cast<BYTE>(wSlot));
+			pImage->push_back(static_cast<BYTE>(wSlot >> 8));
+		}
+		if (function.aUnwindCodes.size() % 2)
+			pImage->insert(pImage->end(), { 0, 0 });
+	}
+
+	// RUNTIME_FUNCTION
+	*pdwTable = static_cast<DWORD>(pImage->size());
+	for (SIZE_T cx = 0; cx < pEmitter->Functions().size(); cx++) {
+		WriteDword(pImage, pEmitter->Functions()[cx].dwBegin);
+		WriteDword(pImage, pEmitter->Functions()[cx].dwEnd);
+		WriteDword(pImage, aUnwindInfo[cx]);
+	}
+}
+
+/**
+ * @brief Copy an image into fresh executable pages. The lock must be held.
+ * @param lpImage The image.
+ * @param dwSize The size of the image, in bytes.
+ * @return The address of the executable copy, or NULL on failure.
+*/
+PBYTE CodePool::Copy(
+	_In_ const BYTE* lpImage,
+	_In_ SIZE_T      dwSize
+) {
+	SIZE_T dwPages = (dwSize + this->m_dwPageSize - 1) & ~(this->m_dwPageSize - 1);
+	if (dwSize == 0 || dwPages > CODEPOOL_REGION_SIZE)
+		return NULL;
+
+	// Reserve a new region of address space
+	if (this->m_lpNext == nullptr || static_cast<SIZE_T>(this->m_lpEnd - this->m_lpNext) < dwPages) {
+#ifdef _WIN32
+		PBYTE lpRegion = reinterpret_cast<PBYTE>(::VirtualAlloc(NULL, CODEPOOL_REGION_SIZE, MEM_RESERVE, PAGE_NOACCESS));
+		if (lpRegion == NULL)
+			return NULL;
+#else
+		PBYTE lpRegion = reinterpret_cast<PBYTE>(::mmap(NULL, CODEPOOL_REGION_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+		if (lpRegion == MAP_FAILED)
+			return NULL;
+#endif
+		this->m_aRegions.push_back(lpRegion);
+		this->m_lpNext = lpRegion;
+		this->m_lpEnd = lpRegion + CODEPOOL_REGION_SIZE;
+	}
+
+	// Write the image and seal the pages
+	PBYTE lpPages = this->m_lpNext;
+#ifdef _WIN32
+	if (::VirtualAlloc(lpPages, dwPages, MEM_COMMIT, PAGE_READWRITE) == NULL)
+		return NULL;
+	::memcpy(lpPages, lpImage, dwSize);
+
+	DWORD dwOldProtect = 0;
+	if (!::VirtualProtect(lpPages, dwPages, PAGE_EXECUTE_READ, &dwOldProtect))
+		return NULL;
+	::FlushInstructionCache(::GetCurrentProcess(), lpPages, dwPages);
+#else
+	if (::mprotect(lpPages, dwPages, PROT_READ | PROT_WRITE) != 0)
+		return NULL;
+	::memcpy(lpPages, lpImage, dwSize);
+
+	if (::mprotect(lpPages, dwPages, PROT_READ | PROT_EXEC) != 0)
+		return NULL;
+#endif
+
+	this->m_lpNext += dwPages;
+	this->m_dwCommitted += dwPages;
+	return lpPages;
+}
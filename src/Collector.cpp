@@ -0,0 +1,506 @@
+/**
+* @file         Collector.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Native callbacks collecting their arguments definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <unknwn.h>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "Collector.hpp"
+#include "ServerLock.hpp"
+
+#define COLLECTOR_FRAME_SIZE 0x48 /* Shadow space, floating point register arguments and alignment */
+#define COLLECTOR_FLOATS     0x20 /* Offset of the floating point register arguments within the frame */
+#define COLLECTOR_CALLS      256  /* Calls collected before the storage of the items grows */
+
+/**
+ * @brief Methods of the collector.
+*/
+static CONST DispatchTableEntry g_aCollectorMethods[] = {
+	{ 0, L"Address" },
+	{ 1, L"Count" },
+	{ 2, L"Items" },
+	{ 3, L"Clear" },
+	{ 4, L"Dropped" }
+};
+
+/**
+ * @brief Registers used to pass integer arguments, in order.
+*/
+static CONST Register g_aIntegerRegisters[THUNK_REGISTERS] = { RegisterRcx, RegisterRdx, RegisterR8, RegisterR9 };
+
+/**
+ * @brief Slots binding the native callbacks to the collectors.
+*/
+static CollectorSlot g_aSlots[COLLECTOR_MAX_SLOTS]{};
+
+/**
+ * @brief Serialise the generation of the callbacks and the binding of the slots.
+*/
+static std::mutex g_SlotsLock{};
+
+/**
+ * @brief Create a collector. The collector is created with one reference.
+ * @param wszSignature The signature of the callback, see MarshalPlan.hpp. Floating point return values are not supported.
+ * @param llReturn The value returned by the callback.
+ * @param ppCollector The address of a variable that receives the collector.
+ * @return Whether the collector has been created.
+*/
+HRESULT STDMETHODCALLTYPE Collector::Create(
+	_In_  LPCWSTR     wszSignature,
+	_In_  LONGLONG    llReturn,
+	_Out_ Collector** ppCollector
+) {
+	*ppCollector = nullptr;
+
+	std::unique_ptr<MarshalPlan> pPlan{};
+	HRESULT hr = MarshalPlan::Compile(wszSignature, &pPlan);
+	if (FAILED(hr))
+		return hr;
+	if (pPlan->m_dwReturnFlag & RETURN_FLT)
+		return E_INVALIDARG;
+
+	std::lock_guard<std::mutex> lock(g_SlotsLock);
+	if (g_aSlots[0].lpCallback == NULL && !Collector::Generate())
+		return E_OUTOFMEMORY;
+
+	// Bind the first free slot
+	PCollectorSlot pSlot = NULL;
+	for (CollectorSlot& slot : g_aSlots) {
+		if (slot.pCollector == nullptr) {
+			pSlot = &slot;
+			break;
+		}
+	}
+	if (pSlot == NULL)
+		return E_OUTOFMEMORY;
+
+	Collector* pCollector = new (std::nothrow) Collector(std::move(pPlan), llReturn);
+	if (pCollector == nullptr)
+		return E_OUTOFMEMORY;
+	if (!pCollector->Reserve(COLLECTOR_CALLS)) {
+		delete pCollector;
+		return E_OUTOFMEMORY;
+	}
+
+	::AcquireSRWLockExclusive(&pSlot->Lock);
+	pSlot->pCollector = pCollector;
+	::ReleaseSRWLockExclusive(&pSlot->Lock);
+	pCollector->m_pSlot = pSlot;
+
+	*ppCollector = pCollector;
+	return S_OK;
+}
+
+/**
+ * @brief Constructor.
+*/
+Collector::Collector(
+	_In_ std::unique_ptr<MarshalPlan> pPlan,
+	_In_ LONGLONG                     llReturn
+) {
+	this->m_pPlan = std::move(pPlan);
+	this->m_llReturn = llReturn;
+	ServerLock::Lock();
+}
+
+/**
+ * @brief Destructor.
+*/
+Collector::~Collector() {
+	// Calls in progress hold the slot, hence none can be left once the slot is unbound
+	if (this->m_pSlot != NULL) {
+		std::lock_guard<std::mutex> lock(g_SlotsLock);
+		::AcquireSRWLockExclusive(&this->m_pSlot->Lock);
+		this->m_pSlot->pCollector = nullptr;
+		::ReleaseSRWLockExclusive(&this->m_pSlot->Lock);
+	}
+
+	for (VARIANT& var : this->m_aItems)
+		::VariantClear(&var);
+	ServerLock::Unlock();
+}
+
+/**
+ * @brief Get the IDispatch interface of the collector, with a new reference.
+*/
+IDispatch* Collector::GetDispatch(VOID) {
+	this->AddRef();
+	return this;
+}
+
+/**
+ * @brief Emit the machine code of a native callback.
+ * @details The callback spills the register arguments into their home space, so that every integer argument is
+ *          contiguous with the stack arguments, and the floating point register arguments into its own frame.
+ * @param pEmitter The emitter receiving the code.
+ * @param pSlot The slot bound to the callback.
+*/
+VOID Collector::Emit(
+	_In_ CodeEmitter*   pEmitter,
+	_In_ PCollectorSlot pSlot
+) {
+	// rsp is 16-byte aligned once the frame is allocated, the home space of the caller is right above the return address
+	CONST LONG lHome = COLLECTOR_FRAME_SIZE + sizeof(DWORD64);
+	pEmitter->BeginFunction();
+	pEmitter->SubRsp(COLLECTOR_FRAME_SIZE);
+	pEmitter->EndPrologue();
+
+	for (DWORD cx = 0; cx < THUNK_REGISTERS; cx++) {
+		pEmitter->MovMemReg(RegisterRsp, lHome + static_cast<LONG>(cx * sizeof(DWORD64)), g_aIntegerRegisters[cx]);
+		pEmitter->MovsdMemXmm(RegisterRsp, COLLECTOR_FLOATS + static_cast<LONG>(cx * sizeof(DWORD64)), cx);
+	}
+
+	// Collect(pSlot, lpArguments, lpFloats)
+	pEmitter->MovRegImm64(RegisterRcx, reinterpret_cast<DWORD64>(pSlot));
+	pEmitter->Lea(RegisterRdx, RegisterRsp, lHome);
+	pEmitter->Lea(RegisterR8, RegisterRsp, COLLECTOR_FLOATS);
+	pEmitter->MovRegImm64(RegisterRax, reinterpret_cast<DWORD64>(&Collector::Collect));
+	pEmitter->Call(RegisterRax);
+
+	pEmitter->AddRsp(COLLECTOR_FRAME_SIZE);
+	pEmitter->Ret();
+	pEmitter->EndFunction();
+}
+
+/**
+ * @brief Entry point of the native callbacks.
+ * @param pSlot The slot bound to the callback.
+ * @param lpArguments The arguments, as raw 64-bit values in native order.
+ * @param lpFloats The floating point register arguments.
+ * @return The value returned by the callback.
+*/
+LONGLONG THUNKCALLTYPE Collector::Collect(
+	_In_ PCollectorSlot pSlot,
+	_In_ const DWORD64* lpArguments,
+	_In_ const DWORD64* lpFloats
+) {
+	::AcquireSRWLockShared(&pSlot->Lock);
+	Collector* pCollector = pSlot->pCollector;
+	if (pCollector == nullptr) {
+		::ReleaseSRWLockShared(&pSlot->Lock);
+		return 0;
+	}
+
+	// Nothing may throw through the native caller: the storage only grows through Reserve, and a call that cannot be
+	// collected entirely is dropped
+	const MarshalPlan* pPlan = pCollector->m_pPlan.get();
+	::AcquireSRWLockExclusive(&pCollector->m_Lock);
+	SIZE_T dwItems = pCollector->m_aItems.size();
+	BOOL bCollected = dwItems + pPlan->m_dwArguments <= pCollector->m_aItems.capacity()
+		|| pCollector->Reserve((pCollector->m_dwCalls + 1) * 2);
+	for (DWORD cx = 0; cx < pPlan->m_dwArguments && bCollected; cx++) {
+		RESULT value;
+		value.int64 = static_cast<LONGLONG>((cx < THUNK_REGISTERS && (pPlan->m_dwFloatMask & (1 << cx))) ? lpFloats[cx] : lpArguments[cx]);
+
+		// Resource names and types can be integers
+		ArgumentKind eKind = pPlan->m_aKinds[cx];
+		BOOL bString = eKind == ArgumentKindString || eKind == ArgumentKindAnsi || eKind == ArgumentKindUtf8;
+		if (bString && reinterpret_cast<ULONG_PTR>(value.lpValue) < 0x10000)
+			eKind = ArgumentKindPointer;
+
+		// Strings that cannot be copied are NULL
+		VARIANT var;
+		MarshalPlan::ToVariant(eKind, &value, &var);
+		bCollected = V_VT(&var) != VT_BSTR || V_BSTR(&var) != NULL || value.lpValue == NULL;
+		if (bCollected)
+			pCollector->m_aItems.push_back(var);
+	}
+
+	if (bCollected) {
+		pCollector->m_dwCalls++;
+	}
+	else {
+		for (SIZE_T cx = dwItems; cx < pCollector->m_aItems.size(); cx++)
+			::VariantClear(&pCollector->m_aItems[cx]);
+		pCollector->m_aItems.resize(dwItems);
+		pCollector->m_dwDropped++;
+	}
+	LONGLONG llReturn = pCollector->m_llReturn;
+	::ReleaseSRWLockExclusive(&pCollector->m_Lock);
+
+	::ReleaseSRWLockShared(&pSlot->Lock);
+	return llReturn;
+}
+
+/**
+ * @brief Generate the native callbacks of every slot.
+ * @return Whether the callbacks have been generated.
+*/
+BOOL Collector::Generate(VOID) {
+	CodeEmitter emitter{};
+	SIZE_T aOffsets[COLLECTOR_MAX_SLOTS]{};
+	for (DWORD cx = 0; cx < COLLECTOR_MAX_SLOTS; cx++) {
+		aOffsets[cx] = emitter.Size();
+		Collector::Emit(&emitter, &g_aSlots[cx]);
+		emitter.Align(0x10);
+	}
+
+	PBYTE lpCode = reinterpret_cast<PBYTE>(CodePool::Instance().Commit(&emitter));
+	if (lpCode == NULL)
+		return FALSE;
+
+	for (DWORD cx = 0; cx < COLLECTOR_MAX_SLOTS; cx++)
+		g_aSlots[cx].lpCallback = lpCode + aOffsets[cx];
+	return TRUE;
+}
+
+/**
+ * @brief Make room for the arguments of a number of calls. The lock of the collector must be held or the collector
+ *        must not be bound yet.
+ * @param dwCalls The number of calls.
+ * @return Whether the room has been made.
+*/
+BOOL Collector::Reserve(
+	_In_ DWORD dwCalls
+) {
+	try {
+		this->m_aItems.reserve(static_cast<SIZE_T>(dwCalls) * this->m_pPlan->m_dwArguments);
+		return TRUE;
+	}
+	catch (...) {
+		return FALSE;
+	}
+}
+
+/**
+ * @brief Copy the arguments of every call into a new array.
+ * @param ppsa The address of a variable that receives the array.
+ * @return Whether the array has been created.
+*/
+HRESULT STDMETHODCALLTYPE Collector::GetItems(
+	_Out_ SAFEARRAY** ppsa
+) {
+	*ppsa = NULL;
+	::AcquireSRWLockShared(&this->m_Lock);
+
+	// One value per call, or one row per call
+	DWORD dwArity = this->m_pPlan->m_dwArguments;
+	DWORD dwCalls = this->m_dwCalls;
+	SAFEARRAY* psa = NULL;
+	if (dwArity <= 1) {
+		psa = ::SafeArrayCreateVector(VT_VARIANT, 0, dwCalls);
+	}
+	else {
+		SAFEARRAYBOUND aBounds[2] = { { dwCalls, 0 }, { dwArity, 0 } };
+		psa = ::SafeArrayCreate(VT_VARIANT, 2, aBounds);
+	}
+
+	VARIANT* aItems = NULL;
+	HRESULT hr = psa != NULL ? ::SafeArrayAccessData(psa, reinterpret_cast<LPVOID*>(&aItems)) : E_OUTOFMEMORY;
+	if (SUCCEEDED(hr)) {
+		// The left-most dimension is the contiguous one
+		for (DWORD dwCall = 0; dwCall < dwCalls && SUCCEEDED(hr); dwCall++) {
+			for (DWORD cx = 0; cx < dwArity && SUCCEEDED(hr); cx++)
+				hr = ::VariantCopy(&aItems[cx * dwCalls + dwCall], &this->m_aItems[dwCall * dwArity + cx]);
+		}
+		::SafeArrayUnaccessData(psa);
+	}
+	::ReleaseSRWLockShared(&this->m_Lock);
+
+	if (FAILED(hr)) {
+		if (psa != NULL)
+			::SafeArrayDestroy(psa);
+		return hr;
+	}
+
+	*ppsa = psa;
+	return S_OK;
+}
+
+/**
+ * @brief Queries a COM object for a pointer to one of its interface.
+ * @param riid A reference to the interface identifier (IID) of the interface being queried for.
+ * @param ppvObject The address of a pointer to an interface with the IID specified in the riid parameter.
+ * @return Whether an interface has been found.
+*/
+HRESULT STDMETHODCALLTYPE Collector::QueryInterface(
+	_In_  REFIID  riid,
+	_Out_ LPVOID* ppvObject
+) {
+	if (IsEqualGUID(riid, IID_ICollector) || IsEqualGUID(riid, IID_IDispatch) || IsEqualGUID(riid, IID_IUnknown)) {
+		*ppvObject = static_cast<IDispatch*>(this);
+		this->AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+/**
+ * @brief  Increment the number of references.
+ * @return Number of remaining references.
+*/
+ULONG STDMETHODCALLTYPE Collector::AddRef(VOID) {
+	return InterlockedIncrement(&this->m_dwReference);
+}
+
+/**
+ * @brief  Decrement the number of references, destroying the collector when none is left.
+ * @return Number of remaining references.
+*/
+ULONG STDMETHODCALLTYPE Collector::Release(VOID) {
+	ULONG ulReference = InterlockedDecrement(&this->m_dwReference);
+	if (ulReference == 0)
+		delete this;
+	return ulReference;
+}
+
+/**
+ * @brief Retrieves the number of type information interfaces that an object provides (either 0 or 1).
+ * @param pctinfo The number of type information interfaces provided by the object.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE Collector::GetTypeInfoCount(
+	_Out_ UINT* pctinfo
+) {
+	*pctinfo = 0;
+	return S_OK;
+}
+
+/**
+ * @brief Retrieves the type information for an object.
+ * @param iTInfo The type information to return.
+ * @param lcid The locale identifier for the type information.
+ * @param ppTInfo The requested type information object.
+ * @return Method not implemented.
+*/
+HRESULT STDMETHODCALLTYPE Collector::GetTypeInfo(
+	_In_  UINT        iTInfo,
+	_In_  LCID        lcid,
+	_Out_ ITypeInfo** ppTInfo
+) {
+	*ppTInfo = NULL;
+	return E_NOTIMPL;
+}
+
+/**
+ * @brief Maps a single member to its DISPID.
+ * @param riid Reserved for future use. Must be IID_NULL.
+ * @param rgszNames The array of names to be mapped.
+ * @param cNames The count of the names to be mapped.
+ * @param lcid The locale context in which to interpret the names.
+ * @param rgDispId Caller-allocated array that receives the DISPID of each name.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE Collector::GetIDsOfNames(
+	_In_  REFIID    riid,
+	_In_  LPOLESTR* rgszNames,
+	_In_  UINT      cNames,
+	_In_  LCID      lcid,
+	_Out_ DISPID*   rgDispId
+) {
+	if (riid != IID_NULL)
+		return DISP_E_UNKNOWNINTERFACE;
+	if (cNames == 0)
+		return E_INVALIDARG;
+
+	HRESULT hr = DISP_E_UNKNOWNNAME;
+	rgDispId[0] = DISPID_UNKNOWN;
+	for (auto& elem : g_aCollectorMethods) {
+		if (::lstrcmpiW(rgszNames[0], elem.wszName) == 0) {
+			rgDispId[0] = elem.lDispId;
+			hr = S_OK;
+			break;
+		}
+	}
+
+	// Named arguments are not supported
+	for (UINT cx = 1; cx < cNames; cx++) {
+		rgDispId[cx] = DISPID_UNKNOWN;
+		hr = DISP_E_UNKNOWNNAME;
+	}
+	return hr;
+}
+
+/**
+ * @brief Provides access to the methods of the collector. Methods can also be read as properties.
+ * @param dispIdMember Identifies the member.
+ * @param riid Reserved for future use. Must be IID_NULL.
+ * @param lcid The locale context in which to interpret arguments.
+ * @param wFlags Flags describing the context of the Invoke call.
+ * @param pDispParams Pointer to a DISPPARAMS structure containing the arguments.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @param pExcepInfo Pointer to a structure that contains exception information.
+ * @param puArgErr The index within rgvarg of the first argument that has an error.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE Collector::Invoke(
+	_In_  DISPID      dispIdMember,
+	_In_  REFIID      riid,
+	_In_  LCID        lcid,
+	_In_  WORD        wFlags,
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult,
+	_Out_ EXCEPINFO*  pExcepInfo,
+	_Out_ UINT*       puArgErr
+) {
+	if (riid != IID_NULL)
+		return DISP_E_UNKNOWNINTERFACE;
+	if ((wFlags & (DISPATCH_METHOD | DISPATCH_PROPERTYGET)) == 0)
+		return E_FAIL;
+	if (pDispParams->cArgs != 0)
+		return DISP_E_BADPARAMCOUNT;
+
+	switch (dispIdMember) {
+	case 0:
+		if (pVarResult) {
+			V_VT(pVarResult) = VT_UI8;
+			V_UI8(pVarResult) = reinterpret_cast<ULONGLONG>(this->m_pSlot->lpCallback);
+		}
+		return S_OK;
+
+	case 1:
+		if (pVarResult) {
+			::AcquireSRWLockShared(&this->m_Lock);
+			V_VT(pVarResult) = VT_I4;
+			V_I4(pVarResult) = static_cast<LONG>(this->m_dwCalls);
+			::ReleaseSRWLockShared(&this->m_Lock);
+		}
+		return S_OK;
+
+	case 2: {
+		if (pVarResult == NULL)
+			return S_OK;
+
+		SAFEARRAY* psa = NULL;
+		HRESULT hr = this->GetItems(&psa);
+		if (FAILED(hr))
+			return hr;
+		V_VT(pVarResult) = VT_ARRAY | VT_VARIANT;
+		V_ARRAY(pVarResult) = psa;
+		return S_OK;
+	}
+
+	case 3:
+		::AcquireSRWLockExclusive(&this->m_Lock);
+		for (VARIANT& var : this->m_aItems)
+			::VariantClear(&var);
+		this->m_aItems.clear();
+		this->m_dwCalls = 0;
+		this->m_dwDropped = 0;
+		::ReleaseSRWLockExclusive(&this->m_Lock);
+		return S_OK;
+
+	case 4:
+		if (pVarResult) {
+			::AcquireSRWLockShared(&this->m_Lock);
+			V_VT(pVarResult) = VT_I4;
+			V_I4(pVarResult) = static_cast<LONG>(this->m_dwDropped);
+			::ReleaseSRWLockShared(&this->m_Lock);
+		}
+		return S_OK;
+	}
+
+	return DISP_E_MEMBERNOTFOUND;
+}
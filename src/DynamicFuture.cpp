@@ -0,0 +1,298 @@
+/**
+* @file         DynamicFuture.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Result of a dynamic method executed on the worker pool definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <unknwn.h>
+#include <vector>
+
+#include "DynamicFuture.hpp"
+#include "Util.hpp"
+
+/**
+ * @brief Methods of the future.
+*/
+static CONST DispatchTableEntry g_aFutureMethods[] = {
+	{ 0, L"IsDone" },
+	{ 1, L"Wait" },
+	{ 2, L"Result" }
+};
+
+/**
+ * @brief Constructor. The future is created with one reference.
+ * @param pOwner The object owning the method. Its reference is transferred to the future.
+ * @param pMethod The method to execute.
+*/
+DynamicFuture::DynamicFuture(
+	_In_ IUnknown*            pOwner,
+	_In_ const DynamicMethod* pMethod
+) {
+	this->m_pOwner = pOwner;
+	this->m_pMethod = pMethod;
+	::VariantInit(&this->m_Result);
+}
+
+/**
+ * @brief Destructor.
+*/
+DynamicFuture::~DynamicFuture() {
+	for (VARIANT& var : this->m_aArguments)
+		::VariantClear(&var);
+	::VariantClear(&this->m_Result);
+
+	if (this->m_pOwner != nullptr)
+		this->m_pOwner->Release();
+}
+
+/**
+ * @brief Copy the arguments of the call.
+ * @param rgvarg The arguments, in reverse order as in DISPPARAMS. References are followed.
+ * @param dwArguments The number of arguments.
+ * @return Whether the arguments have been copied.
+*/
+HRESULT STDMETHODCALLTYPE DynamicFuture::SetArguments(
+	_In_ VARIANT* rgvarg,
+	_In_ DWORD    dwArguments
+) {
+	// Called within Invoke, hence a failure is reported rather than thrown
+	try {
+		this->m_aArguments.resize(dwArguments);
+	}
+	catch (...) {
+		return E_OUTOFMEMORY;
+	}
+	for (VARIANT& var : this->m_aArguments)
+		::VariantInit(&var);
+
+	// The client variables may be gone by the time the call is executed
+	for (DWORD cx = 0; cx < dwArguments; cx++) {
+		HRESULT hr = ::VariantCopyInd(&this->m_aArguments[cx], &rgvarg[cx]);
+		if (FAILED(hr))
+			return hr;
+	}
+	return S_OK;
+}
+
+/**
+ * @brief Get the future behind an IDispatch interface.
+ * @param pDispatch The interface provided by the client.
+ * @return The future, with a new reference, or NULL if the interface is not one of a future.
+*/
+DynamicFuture* DynamicFuture::FromDispatch(
+	_In_ IDispatch* pDispatch
+) {
+	DynamicFuture* pFuture = nullptr;
+	if (pDispatch == nullptr || FAILED(pDispatch->QueryInterface(IID_IDynamicFuture, reinterpret_cast<LPVOID*>(&pFuture))))
+		return nullptr;
+	return pFuture;
+}
+
+/**
+ * @brief Get the IDispatch interface of the future, with a new reference.
+*/
+IDispatch* DynamicFuture::GetDispatch(VOID) {
+	this->AddRef();
+	return this;
+}
+
+/**
+ * @brief Execute the method. Called once, on a worker thread.
+*/
+VOID DynamicFuture::Execute(VOID) {
+	UINT uArgErr = 0;
+	DISPPARAMS params = { this->m_aArguments.data(), NULL, static_cast<UINT>(this->m_aArguments.size()), 0 };
+	this->m_hr = this->m_pMethod->Invoke(&params, &this->m_Result, &uArgErr);
+}
+
+/**
+ * @brief Release the reference held by the worker pool.
+*/
+VOID DynamicFuture::Detach(VOID) {
+	this->Release();
+}
+
+/**
+ * @brief Queries a COM object for a pointer to one of its interface.
+ * @param riid A reference to the interface identifier (IID) of the interface being queried for.
+ * @param ppvObject The address of a pointer to an interface with the IID specified in the riid parameter.
+ * @return Whether an interface has been found.
+*/
+HRESULT STDMETHODCALLTYPE DynamicFuture::QueryInterface(
+	_In_  REFIID  riid,
+	_Out_ LPVOID* ppvObject
+) {
+	if (IsEqualGUID(riid, IID_IDynamicFuture)) {
+		*ppvObject = this;
+		this->AddRef();
+		return S_OK;
+	}
+	if (IsEqualGUID(riid, IID_IDispatch) || IsEqualGUID(riid, IID_IUnknown)) {
+		*ppvObject = static_cast<IDispatch*>(this);
+		this->AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+/**
+ * @brief  Increment the number of references.
+ * @return Number of remaining references.
+*/
+ULONG STDMETHODCALLTYPE DynamicFuture::AddRef(VOID) {
+	return InterlockedIncrement(&this->m_dwReference);
+}
+
+/**
+ * @brief  Decrement the number of references, destroying the future when none is left.
+ * @return Number of remaining references.
+*/
+ULONG STDMETHODCALLTYPE DynamicFuture::Release(VOID) {
+	ULONG ulReference = InterlockedDecrement(&this->m_dwReference);
+	if (ulReference == 0)
+		delete this;
+	return ulReference;
+}
+
+/**
+ * @brief Retrieves the number of type information interfaces that an object provides (either 0 or 1).
+ * @param pctinfo The number of type information interfaces provided by the object.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE DynamicFuture::GetTypeInfoCount(
+	_Out_ UINT* pctinfo
+) {
+	*pctinfo = 0;
+	return S_OK;
+}
+
+/**
+ * @brief Retrieves the type information for an object.
+ * @param iTInfo The type information to return.
+ * @param lcid The locale identifier for the type information.
+ * @param ppTInfo The requested type information object.
+ * @return Method not implemented.
+*/
+HRESULT STDMETHODCALLTYPE DynamicFuture::GetTypeInfo(
+	_In_  UINT        iTInfo,
+	_In_  LCID        lcid,
+	_Out_ ITypeInfo** ppTInfo
+) {
+	*ppTInfo = NULL;
+	return E_NOTIMPL;
+}
+
+/**
+ * @brief Maps a single member to its DISPID.
+ * @param riid Reserved for future use. Must be IID_NULL.
+ * @param rgszNames The array of names to be mapped.
+ * @param cNames The count of the names to be mapped.
+ * @param lcid The locale context in which to interpret the names.
+ * @param rgDispId Caller-allocated array that receives the DISPID of each name.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE DynamicFuture::GetIDsOfNames(
+	_In_  REFIID    riid,
+	_In_  LPOLESTR* rgszNames,
+	_In_  UINT      cNames,
+	_In_  LCID      lcid,
+	_Out_ DISPID*   rgDispId
+) {
+	if (riid != IID_NULL)
+		return DISP_E_UNKNOWNINTERFACE;
+	if (cNames == 0)
+		return E_INVALIDARG;
+
+	HRESULT hr = DISP_E_UNKNOWNNAME;
+	rgDispId[0] = DISPID_UNKNOWN;
+	for (auto& elem : g_aFutureMethods) {
+		if (::lstrcmpiW(rgszNames[0], elem.wszName) == 0) {
+			rgDispId[0] = elem.lDispId;
+			hr = S_OK;
+			break;
+		}
+	}
+
+	// Named arguments are not supported
+	for (UINT cx = 1; cx < cNames; cx++) {
+		rgDispId[cx] = DISPID_UNKNOWN;
+		hr = DISP_E_UNKNOWNNAME;
+	}
+	return hr;
+}
+
+/**
+ * @brief Provides access to the methods of the future. Methods can also be read as properties.
+ * @param dispIdMember Identifies the member.
+ * @param riid Reserved for future use. Must be IID_NULL.
+ * @param lcid The locale context in which to interpret arguments.
+ * @param wFlags Flags describing the context of the Invoke call.
+ * @param pDispParams Pointer to a DISPPARAMS structure containing the arguments.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @param pExcepInfo Pointer to a structure that contains exception information.
+ * @param puArgErr The index within rgvarg of the first argument that has an error.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE DynamicFuture::Invoke(
+	_In_  DISPID      dispIdMember,
+	_In_  REFIID      riid,
+	_In_  LCID        lcid,
+	_In_  WORD        wFlags,
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult,
+	_Out_ EXCEPINFO*  pExcepInfo,
+	_Out_ UINT*       puArgErr
+) {
+	if (riid != IID_NULL)
+		return DISP_E_UNKNOWNINTERFACE;
+	if ((wFlags & (DISPATCH_METHOD | DISPATCH_PROPERTYGET)) == 0)
+		return E_FAIL;
+
+	DWORD dwIndex = 0;
+	WorkerTask* pTask = this;
+	switch (dispIdMember) {
+	case 0:
+		if (pDispParams->cArgs != 0)
+			return DISP_E_BADPARAMCOUNT;
+		if (pVarResult) {
+			V_VT(pVarResult) = VT_BOOL;
+			V_BOOL(pVarResult) = this->IsDone() ? VARIANT_TRUE : VARIANT_FALSE;
+		}
+		return S_OK;
+
+	case 1: {
+		if (pDispParams->cArgs > 1)
+			return DISP_E_BADPARAMCOUNT;
+
+		// Wait forever by default
+		ULONGLONG qwMilliseconds = INFINITE;
+		if (pDispParams->cArgs == 1 && FAILED(Util::GetInteger(&pDispParams->rgvarg[0], &qwMilliseconds)))
+			return DISP_E_TYPEMISMATCH;
+
+		HRESULT hr = WorkerPool::Instance().WaitAny(&pTask, 1, static_cast<DWORD>(qwMilliseconds), &dwIndex);
+		if (pVarResult) {
+			V_VT(pVarResult) = VT_BOOL;
+			V_BOOL(pVarResult) = hr == S_OK ? VARIANT_TRUE : VARIANT_FALSE;
+		}
+		return S_OK;
+	}
+
+	case 2:
+		if (pDispParams->cArgs != 0)
+			return DISP_E_BADPARAMCOUNT;
+
+		WorkerPool::Instance().WaitAny(&pTask, 1, INFINITE, &dwIndex);
+		if (FAILED(this->m_hr))
+			return this->m_hr;
+		return pVarResult ? ::VariantCopy(pVarResult, &this->m_Result) : S_OK;
+	}
+
+	return DISP_E_MEMBERNOTFOUND;
+}
@@ -13,97 +13,241 @@
 #include <vector>
 
 #include "DynamicMethod.hpp"
+#include "ThreadArena.hpp"
+
+/**
+ * @brief Get the kind of a typed reference provided by the client to a method without signature, e.g. by VBA.
+ * @param pVariant The VARIANT provided by the client.
+ * @return The kind of the value, or ArgumentKindVoid if the VARIANT is not a reference to a fixed-width value.
+*/
+static ArgumentKind GetReferenceKind(
+	_In_ VARIANT* pVariant
+) {
+	if ((V_VT(pVariant) & (VT_BYREF | VT_ARRAY)) != VT_BYREF || MarshalPlan::GetFixedWidth(V_VT(pVariant) & VT_TYPEMASK) == 0)
+		return ArgumentKindVoid;
+
+	switch (V_VT(pVariant) & VT_TYPEMASK) {
+	case VT_R4: return ArgumentKindFloat;
+	case VT_R8: return ArgumentKindDouble;
+	default:    return ArgumentKindInt64;
+	}
+}
+
+/**
+ * @brief Convert a value provided by the client to a method without signature.
+ * @param eOperation The conversion of the value (see TypeFeedback::GetOperation).
+ * @param pVariant The value, neither a reference nor an array.
+ * @param pArgument The address of the argument that receives the value.
+*/
+static inline VOID ConvertValue(
+	_In_  FeedbackOperation eOperation,
+	_In_  const VARIANT*    pVariant,
+	_Out_ PArgument         pArgument
+) {
+	switch (eOperation) {
+	case FeedbackCopyFloat:
+		pArgument->dwFlag = ARGUMENT_FLT;
+		pArgument->rlValue = pVariant->dblVal;
+		break;
+
+	case FeedbackShort:
+		pArgument->dwFlag = ARGUMENT_STD;
+		pArgument->qwValue = pVariant->iVal;
+		break;
+
+	case FeedbackInt:
+		pArgument->dwFlag = ARGUMENT_STD;
+		pArgument->qwValue = pVariant->intVal;
+		break;
+
+	case FeedbackZero:
+		pArgument->dwFlag = ARGUMENT_STD;
+		pArgument->qwValue = 0;
+		break;
+
+	default:
+		pArgument->dwFlag = ARGUMENT_STD;
+		pArgument->lpValue = pVariant->pvRecord;
+		break;
+	}
+}
 
 /**
  * @brief Constructor.
- * @param dwDispatchId The dispatch ID that has been associated to this dynamic method.
- * @param bstrFunctionName The name of the function to execute.
  * @param lpFunction The address of the function to execute.
+ * @param pPlan The marshalling plan compiled from the signature of the function, or NULL if the signature is unknown.
+ *              Owned by the DynamicMethodInfo of the method.
+ * @param pFeedback The type feedback of the function if the signature is unknown, or NULL to always go through the
+ *                  generic path. Owned by the DynamicMethodInfo of the method.
 */
 DynamicMethod::DynamicMethod(
-	_In_ DWORD  dwDispatchId,
-	_In_ BSTR   bstrFunctionName,
-	_In_ LPVOID lpFunction
+	_In_     LPVOID             lpFunction,
+	_In_opt_ const MarshalPlan* pPlan,
+	_In_opt_ TypeFeedback*      pFeedback
 ) {
-	this->m_dwDispatchId = dwDispatchId;
-	this->m_bstrFunctionName = bstrFunctionName;
 	this->m_lpFunction = lpFunction;
+	this->m_pPlan = pPlan;
+	this->m_dwArguments = pPlan ? pPlan->m_dwArguments : DYNAMICMETHOD_ANY_ARITY;
+	this->m_dwStatsId = CALLSTATS_ALLOCATE();
+
+	// Resolve the thunk once for functions with a known signature
+	if (pPlan)
+		this->m_lpThunk = CallThunkCache::Instance().Get(pPlan->m_dwArguments, pPlan->m_dwFloatMask, pPlan->m_dwReturnFlag);
+	else
+		this->m_pFeedback = pFeedback;
 }
 
 /**
  * @brief Destructor.
 */
-DynamicMethod::~DynamicMethod() {
-	if (this->m_bstrFunctionName)
-		::SysFreeString(this->m_bstrFunctionName);
-}
+DynamicMethod::~DynamicMethod() { }
 
 /**
  * @brief Dynamically execute the function associated to this dynamic method.
  * @param pDispParams List of parameters provided by the client.
  * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @param puArgErr The index within rgvarg of the first argument that has an error, if not NULL.
  * @return Whether the function executed successfully.
 */
 HRESULT STDMETHODCALLTYPE DynamicMethod::Invoke(
-	_In_  DISPPARAMS* pDispParams,
-	_Out_ VARIANT*    pVarResult
-) {
-	// Continuous memory
-	Argument* args = (Argument*)::CoTaskMemAlloc(sizeof(Argument) * pDispParams->cArgs);
-
-	// Parse parameters
-	for (WORD cx = 0; cx < pDispParams->cArgs; cx++) {
-
-               	args[pDispParams->cArgs - cx - 1].dwFlag = ARGUMENT_STD;
-
-		switch (pDispParams->rgvarg[cx].vt) {
-			// non-scalar value
-		case VT_R4:
-		case VT_R8:
-		case VT_DECIMAL:
-			args[pDispParams->cArgs - cx - 1].dwFlag = ARGUMENT_FLT;
-			args[pDispParams->cArgs - cx - 1].rlValue = pDispParams->rgvarg[cx].dblVal;
-			break;
-
-		case VT_I2:
-		case VT_UI2:
-			args[pDispParams->cArgs - cx - 1].qwValue = pDispParams->rgvarg[cx].iVal;
-			break;
-
-		case VT_INT:
-		case VT_UINT:
-		case VT_I4:
-		case VT_UI4:
-			args[pDispParams->cArgs - cx - 1].qwValue = pDispParams->rgvarg[cx].intVal;
-			break;
-
-		case VT_PTR:
-		case VT_I8:
-		case VT_UI8:
-			args[pDispParams->cArgs - cx - 1].qwValue = pDispParams->rgvarg[cx].ullVal;
-			break;
-
-		case VT_NULL:
-		case VT_VOID:
-			args[pDispParams->cArgs - cx - 1].qwValue = 0;
-			break;
-
-		default:
-			args[pDispParams->cArgs - cx - 1].lpValue = pDispParams->rgvarg[cx].pvRecord;
-			break;
+	_In_      DISPPARAMS* pDispParams,
+	_Out_     VARIANT*    pVarResult,
+	_Out_opt_ UINT*       puArgErr
+) const {
+	// Reject wrong number of arguments before touching anything
+	if (this->m_dwArguments != DYNAMICMETHOD_ANY_ARITY && pDispParams->cArgs != this->m_dwArguments)
+		return DISP_E_BADPARAMCOUNT;
+
+	CALLSTATS_TIMESTAMP(qwStart);
+
+	// Continuous memory, on the stack for common arities and from the arena of the thread otherwise. Converted strings
+	// are allocated from the same scope, released once the function returned
+	Argument aInline[ARGUMENT_INLINE_COUNT];
+	ArenaScope scope{};
+	Argument* args = aInline;
+	if (pDispParams->cArgs > ARGUMENT_INLINE_COUNT) {
+		args = reinterpret_cast<Argument*>(scope.Allocate(sizeof(Argument) * pDispParams->cArgs));
+		if (args == NULL)
+			return E_OUTOFMEMORY;
+	}
+
+	// Signature known at registration time
+	const MarshalPlan* pPlan = this->m_pPlan;
+	if (pPlan) {
+		HRESULT hr = pPlan->Marshal(pDispParams, args, &scope, puArgErr);
+		if (FAILED(hr))
+			return hr;
+
+		CALLSTATS_TIMESTAMP(qwMarshalled);
+		RESULT res{ 0 };
+		if (this->m_lpThunk) {
+			this->m_lpThunk(args, this->m_lpFunction, &res);
+		}
+		else {
+			ArgumentTable Table = { args, pDispParams->cArgs };
+			DynamicCall(&Table, this->m_lpFunction, &res, pPlan->m_dwReturnFlag);
+		}
+		CALLSTATS_TIMESTAMP(qwReturned);
+
+		pPlan->WriteBack(pDispParams, args);
+		if (pVarResult)
+			pPlan->Unmarshal(&res, pVarResult);
+
+		CALLSTATS_TIMESTAMP(qwEnd);
+		CALLSTATS_RECORD(this->m_dwStatsId, (qwMarshalled - qwStart) + (qwEnd - qwReturned), qwReturned - qwMarshalled);
+		return S_OK;
+	}
+
+	// Shape of the arguments seen by a previous call, converted as recorded
+	ULONGLONG qwKey = TYPEFEEDBACK_NO_KEY;
+	const FeedbackShape* pShape = nullptr;
+	if (this->m_pFeedback) {
+		qwKey = TypeFeedback::Key(pDispParams);
+		pShape = this->m_pFeedback->Find(qwKey, pDispParams->cArgs);
+		CALLSTATS_FEEDBACK(this->m_dwStatsId, pShape != nullptr);
+	}
+
+	CallThunk lpThunk = NULL;
+	if (pShape) {
+		for (WORD cx = 0; cx < pDispParams->cArgs; cx++) {
+			const VARIANT* pVariant = &pDispParams->rgvarg[cx];
+			if (V_VT(pVariant) == (VT_VARIANT | VT_BYREF))
+				pVariant = V_VARIANTREF(pVariant);
+			ConvertValue(pShape->aOperations[cx], pVariant, &args[pDispParams->cArgs - cx - 1]);
 		}
+		lpThunk = pShape->lpThunk;
 	}
+	else {
+		// Parse parameters
+		for (WORD cx = 0; cx < pDispParams->cArgs; cx++) {
+			args[pDispParams->cArgs - cx - 1].dwFlag = ARGUMENT_STD;
+
+			// Follow arguments passed by reference, e.g. results referenced within a batch
+			VARIANT* pVariant = &pDispParams->rgvarg[cx];
+			if (V_VT(pVariant) == (VT_VARIANT | VT_BYREF))
+				pVariant = V_VARIANTREF(pVariant);
+
+			// Typed references are passed as the address of a slot, written back once the function returned
+			ArgumentKind eReference = GetReferenceKind(pVariant);
+			if (eReference != ArgumentKindVoid) {
+				HRESULT hr = MarshalPlan::LoadReference(pVariant, eReference, &scope, &args[pDispParams->cArgs - cx - 1]);
+				if (FAILED(hr)) {
+					if (puArgErr)
+						*puArgErr = cx;
+					return hr;
+				}
+				continue;
+			}
 
+			// Arrays of fixed-width elements are passed as their data, locked until the function returns
+			if (V_VT(pVariant) & VT_ARRAY) {
+				HRESULT hr = MarshalPlan::LockArray(pVariant, &scope, &args[pDispParams->cArgs - cx - 1].lpValue);
+				if (FAILED(hr))
+					return hr;
+				if (hr == S_OK)
+					continue;
+			}
 
-	// Execute function
+			ConvertValue(TypeFeedback::GetOperation(pVariant->vt), pVariant, &args[pDispParams->cArgs - cx - 1]);
+		}
+		lpThunk = CallThunkCache::Instance().Get(pDispParams->cArgs, CallThunkCache::FloatMask(args, pDispParams->cArgs), RETURN_STD);
+	}
+
+	// Execute function, through the thunk matching the arguments if possible
+	CALLSTATS_TIMESTAMP(qwMarshalled);
 	RESULT res{ 0 };
-	ArgumentTable Table = { pDispParams->cArgs, args };
-	DynamicCall(&Table, this->m_lpFunction, &res, RETURN_STD);
+	if (lpThunk) {
+		lpThunk(args, this->m_lpFunction, &res);
+	}
+	else {
+		ArgumentTable Table = { args, pDispParams->cArgs };
+		DynamicCall(&Table, this->m_lpFunction, &res, RETURN_STD);
+	}
+	CALLSTATS_TIMESTAMP(qwReturned);
+
+	// References, in the same order as above. Recorded shapes have none
+	if (pShape == nullptr) {
+		for (WORD cx = 0; cx < pDispParams->cArgs; cx++) {
+			VARIANT* pVariant = &pDispParams->rgvarg[cx];
+			if (V_VT(pVariant) == (VT_VARIANT | VT_BYREF))
+				pVariant = V_VARIANTREF(pVariant);
+
+			ArgumentKind eReference = GetReferenceKind(pVariant);
+			if (eReference != ArgumentKindVoid)
+				MarshalPlan::StoreReference(pVariant, eReference, reinterpret_cast<const DWORD64*>(args[pDispParams->cArgs - cx - 1].lpValue));
+		}
+
+		// Next calls of the same shape skip the generic path
+		if (qwKey != TYPEFEEDBACK_NO_KEY)
+			this->m_pFeedback->Record(pDispParams, qwKey);
+	}
 
 	// Return value 
 	if (pVarResult) {
 		pVarResult->ullVal = (ULONGLONG)res.lpValue;
 		pVarResult->vt = VT_UI8;
 	}
+
+	CALLSTATS_RECORD(this->m_dwStatsId, qwMarshalled - qwStart, qwReturned - qwMarshalled);
 	return S_OK;
 }
@@ -0,0 +1,616 @@
+/**
+* @file         DynamicStruct.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Structure layout and structure record Automation objects definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <unknwn.h>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "DynamicStruct.hpp"
+#include "ServerLock.hpp"
+#include "Util.hpp"
+
+/**
+ * @brief Methods of the structure.
+*/
+static CONST DispatchTableEntry g_aStructMethods[] = {
+	{ 0, L"Size" },
+	{ 1, L"Alignment" },
+	{ 2, L"OffsetOf" },
+	{ 3, L"SizeOf" },
+	{ 4, L"Pack" },
+	{ 5, L"Unpack" }
+};
+
+/**
+ * @brief Constructor. The object is created with one reference.
+ * @param pLayout The compiled layout.
+*/
+DynamicStruct::DynamicStruct(
+	_In_ std::unique_ptr<StructLayout> pLayout
+) {
+	this->m_pLayout = std::move(pLayout);
+	ServerLock::Lock();
+}
+
+/**
+ * @brief Destructor. Records hold a reference to their structure, hence are covered by its lock on the server.
+*/
+DynamicStruct::~DynamicStruct() {
+	ServerLock::Unlock();
+}
+
+/**
+ * @brief Get the IDispatch interface of the object, with a new reference.
+*/
+IDispatch* DynamicStruct::GetDispatch(VOID) {
+	this->AddRef();
+	return this;
+}
+
+/**
+ * @brief Write a structure.
+ * @param lpAddress The address of the structure.
+ * @param pValues The array of values or the record provided by the client.
+ * @return Whether every value has been converted.
+*/
+HRESULT STDMETHODCALLTYPE DynamicStruct::Pack(
+	_Out_ LPVOID   lpAddress,
+	_In_  VARIANT* pValues
+) {
+	const StructLayout* pLayout = this->m_pLayout.get();
+	DWORD dwFields = static_cast<DWORD>(pLayout->m_aFields.size());
+	if (V_VT(pValues) == (VT_VARIANT | VT_BYREF))
+		pValues = V_VARIANTREF(pValues);
+
+	// Records are only accepted by the structure they come from
+	StructRecord* pRecord = V_VT(pValues) == VT_DISPATCH ? StructRecord::FromDispatch(V_DISPATCH(pValues)) : nullptr;
+	if (pRecord != nullptr && pRecord->m_pStruct != this) {
+		pRecord->Release();
+		return DISP_E_TYPEMISMATCH;
+	}
+
+	HRESULT hr = S_OK;
+	if (pRecord == nullptr) {
+		LONG lValues = 0;
+		hr = Util::GetArrayLength(pValues, &lValues);
+		if (FAILED(hr))
+			return hr;
+		if (static_cast<DWORD>(lValues) != dwFields)
+			return DISP_E_BADPARAMCOUNT;
+	}
+
+	// Flatten array fields
+	std::vector<VARIANT> aElements(pLayout->m_dwElements);
+	for (DWORD cx = 0; cx < dwFields && SUCCEEDED(hr); cx++) {
+		const StructField& field = pLayout->m_aFields[cx];
+		VARIANT value;
+		::VariantInit(&value);
+		hr = pRecord != nullptr ? ::VariantCopy(&value, &pRecord->m_aFields[cx]) : Util::GetArrayElement(pValues, static_cast<LONG>(cx), &value);
+		if (FAILED(hr))
+			break;
+
+		if (field.dwCount == 1) {
+			aElements[field.dwElement] = value;
+			continue;
+		}
+
+		LONG lElements = 0;
+		hr = Util::GetArrayLength(&value, &lElements);
+		if (SUCCEEDED(hr) && static_cast<DWORD>(lElements) != field.dwCount)
+			hr = DISP_E_BADPARAMCOUNT;
+		for (DWORD dwElement = 0; dwElement < field.dwCount && SUCCEEDED(hr); dwElement++)
+			hr = Util::GetArrayElement(&value, static_cast<LONG>(dwElement), &aElements[field.dwElement + dwElement]);
+		::VariantClear(&value);
+	}
+	if (pRecord != nullptr)
+		pRecord->Release();
+
+	DWORD dwFailed = 0;
+	if (SUCCEEDED(hr))
+		hr = pLayout->Pack(lpAddress, aElements.data(), &dwFailed);
+
+	for (VARIANT& var : aElements)
+		::VariantClear(&var);
+	return hr;
+}
+
+/**
+ * @brief Read a structure.
+ * @param lpAddress The address of the structure.
+ * @param aFields Array of one VARIANT per field that receives the values, array fields as arrays.
+ * @return Whether the values have been read.
+*/
+HRESULT STDMETHODCALLTYPE DynamicStruct::Unpack(
+	_In_  LPCVOID  lpAddress,
+	_Out_ VARIANT* aFields
+) {
+	const StructLayout* pLayout = this->m_pLayout.get();
+	std::vector<VARIANT> aElements(pLayout->m_dwElements);
+	pLayout->Unpack(lpAddress, aElements.data());
+
+	// The elements of array fields are moved into their own array
+	HRESULT hr = S_OK;
+	DWORD cx = 0;
+	for (; cx < pLayout->m_aFields.size(); cx++) {
+		const StructField& field = pLayout->m_aFields[cx];
+		if (field.dwCount == 1) {
+			aFields[cx] = aElements[field.dwElement];
+			continue;
+		}
+
+		SAFEARRAY* psa = ::SafeArrayCreateVector(VT_VARIANT, 0, field.dwCount);
+		VARIANT* aData = NULL;
+		if (psa == NULL || FAILED(::SafeArrayAccessData(psa, reinterpret_cast<LPVOID*>(&aData)))) {
+			if (psa != NULL)
+				::SafeArrayDestroy(psa);
+			hr = E_OUTOFMEMORY;
+			break;
+		}
+		std::memcpy(aData, &aElements[field.dwElement], field.dwCount * sizeof(VARIANT));
+		::SafeArrayUnaccessData(psa);
+
+		V_VT(&aFields[cx]) = VT_ARRAY | VT_VARIANT;
+		V_ARRAY(&aFields[cx]) = psa;
+	}
+
+	if (FAILED(hr)) {
+		for (DWORD dwElement = pLayout->m_aFields[cx].dwElement; dwElement < pLayout->m_dwElements; dwElement++)
+			::VariantClear(&aElements[dwElement]);
+		while (cx-- > 0)
+			::VariantClear(&aFields[cx]);
+	}
+	return hr;
+}
+
+/**
+ * @brief Get a field provided by name by the client.
+ * @param pName The name of the field.
+ * @param ppField The address of a variable that receives the field.
+ * @return Whether the field has been found.
+*/
+HRESULT STDMETHODCALLTYPE DynamicStruct::GetField(
+	_In_  VARIANT*            pName,
+	_Out_ const StructField** ppField
+) {
+	if (V_VT(pName) == (VT_VARIANT | VT_BYREF))
+		pName = V_VARIANTREF(pName);
+	if (V_VT(pName) != VT_BSTR)
+		return DISP_E_TYPEMISMATCH;
+
+	*ppField = this->m_pLayout->Find(V_BSTR(pName));
+	return *ppField != NULL ? S_OK : E_INVALIDARG;
+}
+
+/**
+ * @brief Queries a COM object for a pointer to one of its interface.
+ * @param riid A reference to the interface identifier (IID) of the interface being queried for.
+ * @param ppvObject The address of a pointer to an interface with the IID specified in the riid parameter.
+ * @return Whether an interface has been found.
+*/
+HRESULT STDMETHODCALLTYPE DynamicStruct::QueryInterface(
+	_In_  REFIID  riid,
+	_Out_ LPVOID* ppvObject
+) {
+	if (IsEqualGUID(riid, IID_IDispatch) || IsEqualGUID(riid, IID_IUnknown)) {
+		*ppvObject = static_cast<IDispatch*>(this);
+		this->AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+/**
+ * @brief  Increment the number of references.
+ * @return Number of remaining references.
+*/
+ULONG STDMETHODCALLTYPE DynamicStruct::AddRef(VOID) {
+	return InterlockedIncrement(&this->m_dwReference);
+}
+
+/**
+ * @brief  Decrement the number of references, destroying the object when none is left.
+ * @return Number of remaining references.
+*/
+ULONG STDMETHODCALLTYPE DynamicStruct::Release(VOID) {
+	ULONG ulReference = InterlockedDecrement(&this->m_dwReference);
+	if (ulReference == 0)
+		delete this;
+	return ulReference;
+}
+
+/**
+ * @brief Retrieves the number of type information interfaces that an object provides (either 0 or 1).
+ * @param pctinfo The number of type information interfaces provided by the object.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE DynamicStruct::GetTypeInfoCount(
+	_Out_ UINT* pctinfo
+) {
+	*pctinfo = 0;
+	return S_OK;
+}
+
+/**
+ * @brief Retrieves the type information for an object.
+ * @param iTInfo The type information to return.
+ * @param lcid The locale identifier for the type information.
+ * @param ppTInfo The requested type information object.
+ * @return Method not implemented.
+*/
+HRESULT STDMETHODCALLTYPE DynamicStruct::GetTypeInfo(
+	_In_  UINT        iTInfo,
+	_In_  LCID        lcid,
+	_Out_ ITypeInfo** ppTInfo
+) {
+	*ppTInfo = NULL;
+	return E_NOTIMPL;
+}
+
+/**
+ * @brief Maps a single member to its DISPID.
+ * @param riid Reserved for future use. Must be IID_NULL.
+ * @param rgszNames The array of names to be mapped.
+ * @param cNames The count of the names to be mapped.
+ * @param lcid The locale context in which to interpret the names.
+ * @param rgDispId Caller-allocated array that receives the DISPID of each name.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE DynamicStruct::GetIDsOfNames(
+	_In_  REFIID    riid,
+	_In_  LPOLESTR* rgszNames,
+	_In_  UINT      cNames,
+	_In_  LCID      lcid,
+	_Out_ DISPID*   rgDispId
+) {
+	if (riid != IID_NULL)
+		return DISP_E_UNKNOWNINTERFACE;
+	if (cNames == 0)
+		return E_INVALIDARG;
+
+	HRESULT hr = DISP_E_UNKNOWNNAME;
+	rgDispId[0] = DISPID_UNKNOWN;
+	for (auto& elem : g_aStructMethods) {
+		if (::lstrcmpiW(rgszNames[0], elem.wszName) == 0) {
+			rgDispId[0] = elem.lDispId;
+			hr = S_OK;
+			break;
+		}
+	}
+
+	// Named arguments are not supported
+	for (UINT cx = 1; cx < cNames; cx++) {
+		rgDispId[cx] = DISPID_UNKNOWN;
+		hr = DISP_E_UNKNOWNNAME;
+	}
+	return hr;
+}
+
+/**
+ * @brief Provides access to the methods of the object. Methods without parameters can also be read as properties.
+ * @param dispIdMember Identifies the member.
+ * @param riid Reserved for future use. Must be IID_NULL.
+ * @param lcid The locale context in which to interpret arguments.
+ * @param wFlags Flags describing the context of the Invoke call.
+ * @param pDispParams Pointer to a DISPPARAMS structure containing the arguments.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @param pExcepInfo Pointer to a structure that contains exception information.
+ * @param puArgErr The index within rgvarg of the first argument that has an error.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE DynamicStruct::Invoke(
+	_In_  DISPID      dispIdMember,
+	_In_  REFIID      riid,
+	_In_  LCID        lcid,
+	_In_  WORD        wFlags,
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult,
+	_Out_ EXCEPINFO*  pExcepInfo,
+	_Out_ UINT*       puArgErr
+) {
+	if (riid != IID_NULL)
+		return DISP_E_UNKNOWNINTERFACE;
+	if ((wFlags & (DISPATCH_METHOD | DISPATCH_PROPERTYGET)) == 0)
+		return E_FAIL;
+
+	const StructLayout* pLayout = this->m_pLayout.get();
+	const StructField* pField = NULL;
+	ULONGLONG qwAddress = 0;
+	HRESULT hr = S_OK;
+	switch (dispIdMember) {
+	case 0:
+	case 1:
+		if (pDispParams->cArgs != 0)
+			return DISP_E_BADPARAMCOUNT;
+		if (pVarResult) {
+			V_VT(pVarResult) = VT_I4;
+			V_I4(pVarResult) = static_cast<LONG>(dispIdMember == 0 ? pLayout->m_dwSize : pLayout->m_dwAlignment);
+		}
+		return S_OK;
+
+	case 2:
+	case 3:
+		if (pDispParams->cArgs != 1)
+			return DISP_E_BADPARAMCOUNT;
+		hr = this->GetField(&pDispParams->rgvarg[0], &pField);
+		if (FAILED(hr))
+			return hr;
+		if (pVarResult) {
+			V_VT(pVarResult) = VT_I4;
+			V_I4(pVarResult) = static_cast<LONG>(dispIdMember == 2 ? pField->dwOffset : pField->dwSize * pField->dwCount);
+		}
+		return S_OK;
+
+	case 4:
+		if (pDispParams->cArgs != 2)
+			return DISP_E_BADPARAMCOUNT;
+		if (FAILED(Util::GetInteger(&pDispParams->rgvarg[1], &qwAddress)) || qwAddress == 0)
+			return DISP_E_TYPEMISMATCH;
+		return this->Pack(reinterpret_cast<LPVOID>(qwAddress), &pDispParams->rgvarg[0]);
+
+	case 5: {
+		if (pDispParams->cArgs < 1 || pDispParams->cArgs > 2)
+			return DISP_E_BADPARAMCOUNT;
+		if (FAILED(Util::GetInteger(&pDispParams->rgvarg[pDispParams->cArgs - 1], &qwAddress)) || qwAddress == 0)
+			return DISP_E_TYPEMISMATCH;
+		ULONGLONG qwRecord = 0;
+		if (pDispParams->cArgs == 2 && FAILED(Util::GetInteger(&pDispParams->rgvarg[0], &qwRecord)))
+			return DISP_E_TYPEMISMATCH;
+		if (pVarResult == NULL)
+			return S_OK;
+
+		if (qwRecord != 0) {
+			StructRecord* pRecord = new (std::nothrow) StructRecord(this);
+			if (pRecord == nullptr)
+				return E_OUTOFMEMORY;
+			try {
+				pRecord->m_aFields.resize(pLayout->m_aFields.size());
+			}
+			catch (...) {
+				pRecord->Release();
+				return E_OUTOFMEMORY;
+			}
+			hr = this->Unpack(reinterpret_cast<LPCVOID>(qwAddress), pRecord->m_aFields.data());
+			if (SUCCEEDED(hr)) {
+				V_VT(pVarResult) = VT_DISPATCH;
+				V_DISPATCH(pVarResult) = pRecord->GetDispatch();
+			}
+			pRecord->Release();
+			return hr;
+		}
+
+		SAFEARRAY* psa = ::SafeArrayCreateVector(VT_VARIANT, 0, static_cast<ULONG>(pLayout->m_aFields.size()));
+		VARIANT* aFields = NULL;
+		if (psa == NULL || FAILED(::SafeArrayAccessData(psa, reinterpret_cast<LPVOID*>(&aFields)))) {
+			if (psa != NULL)
+				::SafeArrayDestroy(psa);
+			return E_OUTOFMEMORY;
+		}
+		hr = this->Unpack(reinterpret_cast<LPCVOID>(qwAddress), aFields);
+		::SafeArrayUnaccessData(psa);
+		if (FAILED(hr)) {
+			::SafeArrayDestroy(psa);
+			return hr;
+		}
+
+		V_VT(pVarResult) = VT_ARRAY | VT_VARIANT;
+		V_ARRAY(pVarResult) = psa;
+		return S_OK;
+	}
+	}
+
+	return DISP_E_MEMBERNOTFOUND;
+}
+
+/**
+ * @brief Constructor. The record is created with one reference and every field empty.
+ * @param pStruct The structure of the record, referenced while the record exists.
+*/
+StructRecord::StructRecord(
+	_In_ DynamicStruct* pStruct
+) {
+	this->m_pStruct = pStruct;
+	this->m_pStruct->AddRef();
+}
+
+/**
+ * @brief Destructor.
+*/
+StructRecord::~StructRecord() {
+	for (VARIANT& var : this->m_aFields)
+		::VariantClear(&var);
+	this->m_pStruct->Release();
+}
+
+/**
+ * @brief Get the record behind an IDispatch interface.
+ * @param pDispatch The interface provided by the client.
+ * @return The record, with a new reference, or NULL if the interface is not one of a record.
+*/
+StructRecord* StructRecord::FromDispatch(
+	_In_ IDispatch* pDispatch
+) {
+	StructRecord* pRecord = nullptr;
+	if (pDispatch == nullptr || FAILED(pDispatch->QueryInterface(IID_IStructRecord, reinterpret_cast<LPVOID*>(&pRecord))))
+		return nullptr;
+	return pRecord;
+}
+
+/**
+ * @brief Get the IDispatch interface of the record, with a new reference.
+*/
+IDispatch* StructRecord::GetDispatch(VOID) {
+	this->AddRef();
+	return this;
+}
+
+/**
+ * @brief Queries a COM object for a pointer to one of its interface.
+ * @param riid A reference to the interface identifier (IID) of the interface being queried for.
+ * @param ppvObject The address of a pointer to an interface with the IID specified in the riid parameter.
+ * @return Whether an interface has been found.
+*/
+HRESULT STDMETHODCALLTYPE StructRecord::QueryInterface(
+	_In_  REFIID  riid,
+	_Out_ LPVOID* ppvObject
+) {
+	if (IsEqualGUID(riid, IID_IStructRecord)) {
+		*ppvObject = this;
+		this->AddRef();
+		return S_OK;
+	}
+	if (IsEqualGUID(riid, IID_IDispatch) || IsEqualGUID(riid, IID_IUnknown)) {
+		*ppvObject = static_cast<IDispatch*>(this);
+		this->AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+/**
+ * @brief  Increment the number of references.
+ * @return Number of remaining references.
+*/
+ULONG STDMETHODCALLTYPE StructRecord::AddRef(VOID) {
+	return InterlockedIncrement(&this->m_dwReference);
+}
+
+/**
+ * @brief  Decrement the number of references, destroying the record when none is left.
+ * @return Number of remaining references.
+*/
+ULONG STDMETHODCALLTYPE StructRecord::Release(VOID) {
+	ULONG ulReference = InterlockedDecrement(&this->m_dwReference);
+	if (ulReference == 0)
+		delete this;
+	return ulReference;
+}
+
+/**
+ * @brief Retrieves the number of type information interfaces that an object provides (either 0 or 1).
+ * @param pctinfo The number of type information interfaces provided by the object.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE StructRecord::GetTypeInfoCount(
+	_Out_ UINT* pctinfo
+) {
+	*pctinfo = 0;
+	return S_OK;
+}
+
+/**
+ * @brief Retrieves the type information for an object.
+ * @param iTInfo The type information to return.
+ * @param lcid The locale identifier for the type information.
+ * @param ppTInfo The requested type information object.
+ * @return Method not implemented.
+*/
+HRESULT STDMETHODCALLTYPE StructRecord::GetTypeInfo(
+	_In_  UINT        iTInfo,
+	_In_  LCID        lcid,
+	_Out_ ITypeInfo** ppTInfo
+) {
+	*ppTInfo = NULL;
+	return E_NOTIMPL;
+}
+
+/**
+ * @brief Maps a single field name to its DISPID, the index of the field.
+ * @param riid Reserved for future use. Must be IID_NULL.
+ * @param rgszNames The array of names to be mapped.
+ * @param cNames The count of the names to be mapped.
+ * @param lcid The locale context in which to interpret the names.
+ * @param rgDispId Caller-allocated array that receives the DISPID of each name.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE StructRecord::GetIDsOfNames(
+	_In_  REFIID    riid,
+	_In_  LPOLESTR* rgszNames,
+	_In_  UINT      cNames,
+	_In_  LCID      lcid,
+	_Out_ DISPID*   rgDispId
+) {
+	if (riid != IID_NULL)
+		return DISP_E_UNKNOWNINTERFACE;
+	if (cNames == 0)
+		return E_INVALIDARG;
+
+	HRESULT hr = DISP_E_UNKNOWNNAME;
+	rgDispId[0] = DISPID_UNKNOWN;
+	const StructLayout* pLayout = this->m_pStruct->GetLayout();
+	const StructField* pField = pLayout->Find(rgszNames[0]);
+	if (pField != NULL) {
+		rgDispId[0] = static_cast<DISPID>(pField - pLayout->m_aFields.data());
+		hr = S_OK;
+	}
+
+	// Named arguments are not supported
+	for (UINT cx = 1; cx < cNames; cx++) {
+		rgDispId[cx] = DISPID_UNKNOWN;
+		hr = DISP_E_UNKNOWNNAME;
+	}
+	return hr;
+}
+
+/**
+ * @brief Read or write a field of the record.
+ * @param dispIdMember Identifies the field.
+ * @param riid Reserved for future use. Must be IID_NULL.
+ * @param lcid The locale context in which to interpret arguments.
+ * @param wFlags Flags describing the context of the Invoke call.
+ * @param pDispParams Pointer to a DISPPARAMS structure containing the arguments.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @param pExcepInfo Pointer to a structure that contains exception information.
+ * @param puArgErr The index within rgvarg of the first argument that has an error.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE StructRecord::Invoke(
+	_In_  DISPID      dispIdMember,
+	_In_  REFIID      riid,
+	_In_  LCID        lcid,
+	_In_  WORD        wFlags,
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult,
+	_Out_ EXCEPINFO*  pExcepInfo,
+	_Out_ UINT*       puArgErr
+) {
+	if (riid != IID_NULL)
+		return DISP_E_UNKNOWNINTERFACE;
+	if (dispIdMember < 0 || static_cast<SIZE_T>(dispIdMember) >= this->m_aFields.size())
+		return DISP_E_MEMBERNOTFOUND;
+	VARIANT* pField = &this->m_aFields[static_cast<SIZE_T>(dispIdMember)];
+
+	if (wFlags & (DISPATCH_PROPERTYPUT | DISPATCH_PROPERTYPUTREF)) {
+		if (pDispParams->cArgs != 1)
+			return DISP_E_BADPARAMCOUNT;
+
+		VARIANT value;
+		::VariantInit(&value);
+		HRESULT hr = ::VariantCopyInd(&value, &pDispParams->rgvarg[0]);
+		if (FAILED(hr))
+			return hr;
+		::VariantClear(pField);
+		*pField = value;
+		return S_OK;
+	}
+
+	if (wFlags & (DISPATCH_METHOD | DISPATCH_PROPERTYGET)) {
+		if (pDispParams->cArgs != 0)
+			return DISP_E_BADPARAMCOUNT;
+		return pVarResult ? ::VariantCopy(pVarResult, pField) : S_OK;
+	}
+	return E_FAIL;
+}
@@ -10,20 +10,75 @@
 */
 #include <windows.h>
 #include <unknwn.h>
+#include <algorithm>
 #include <memory>
+#include <new>
+#include <vector>
 
 #include "IDynamicWrapperEx.hpp"
 #include "AutomationFactory.hpp"
+#include "CallTrace.hpp"
+#include "Collector.hpp"
+#include "DynamicFuture.hpp"
+#include "DynamicStruct.hpp"
+#include "ParallelMap.hpp"
+#include "ServerLock.hpp"
+#include "ThreadArena.hpp"
+#include "WorkerPool.hpp"
 #include "Util.hpp"
 
 /**
- * @brief Constructor.
+ * @brief Methods implemented by the COM Automation object itself.
 */
-IDynamicWrapperEx::IDynamicWrapperEx() {
-	this->m_pAutomationFactory->m_aDispatchTable.push_back({ 0, L"DwRegister"});
-	this->m_pAutomationFactory->m_aDispatchTable.push_back({ 1, L"WriteByte" });
+static CONST DispatchTableEntry g_aInternalMethods[] = {
+	{ 0, L"DwRegister" },
+	{ 1, L"WriteByte" },
+	{ 2, L"WriteBytes" },
+	{ 3, L"ReadBytes" },
+	{ 4, L"CopyBytes" },
+	{ 5, L"FillBytes" },
+	{ 6, L"DwBatch" },
+	{ 7, L"DwStats" },
+	{ 8, L"DwInvokeAsync" },
+	{ 9, L"DwWaitAny" },
+	{ 10, L"DwMap" },
+	{ 11, L"DwCollector" },
+	{ 12, L"DwStruct" },
+	{ 13, L"DwView" },
+	{ 14, L"DwLoadCache" },
+	{ 15, L"DwSaveCache" },
+	{ 16, L"DwTrace" }
+};
+
+#define DISPID_DWBATCH 6
 
-	this->m_pAutomationFactory->m_dwInternalMethods = this->m_pAutomationFactory->m_aDispatchTable.size();
+/**
+ * @brief Released objects kept for the next instances, protected by g_PoolLock.
+*/
+static SRWLOCK g_PoolLock = SRWLOCK_INIT;
+static IDynamicWrapperEx* g_aPool[IDYNAMICWRAPPEREX_POOL] = { };
+static DWORD g_dwPool = 0;
+
+/**
+ * @brief Get the index of the names of the internal methods, built once for every object.
+*/
+static const NameIndex* GetInternalNames(VOID) {
+	static const NameIndex* pNames = []() {
+		NameIndex* pIndex = new NameIndex();
+		for (auto& elem : g_aInternalMethods)
+			pIndex->Insert(elem.wszName, elem.lDispId, NULL);
+		return pIndex;
+	}();
+	return pNames;
+}
+
+/**
+ * @brief Constructor. The object is created with one reference.
+*/
+IDynamicWrapperEx::IDynamicWrapperEx() {
+	this->m_pAutomationFactory->m_dwInternalMethods = ARRAYSIZE(g_aInternalMethods);
+	this->m_pAutomationFactory->m_aInternalMethods = g_aInternalMethods;
+	this->m_pAutomationFactory->m_pInternalNames = GetInternalNames();
 }
 
 /**
@@ -31,6 +86,38 @@ IDynamicWrapperEx::IDynamicWrapperEx() {
 */
 IDynamicWrapperEx::~IDynamicWrapperEx() { }
 
+/**
+ * @brief Create an object, reusing a released one if any. The object is created with one reference and holds a
+ *        lock on the server until released.
+ * @return The object, or NULL if out of memory.
+*/
+IDynamicWrapperEx* IDynamicWrapperEx::Create(VOID) {
+	IDynamicWrapperEx* pObject = nullptr;
+	::AcquireSRWLockExclusive(&g_PoolLock);
+	if (g_dwPool != 0)
+		pObject = g_aPool[--g_dwPool];
+	::ReleaseSRWLockExclusive(&g_PoolLock);
+
+	// Released objects have been reset, only the reference is left to restore
+	if (pObject != nullptr)
+		pObject->m_dwReference = 1;
+	else
+		pObject = new (std::nothrow) IDynamicWrapperEx();
+	if (pObject != nullptr)
+		ServerLock::Lock();
+	return pObject;
+}
+
+/**
+ * @brief Delete the released objects kept for the next instances.
+*/
+VOID IDynamicWrapperEx::DrainPool(VOID) {
+	::AcquireSRWLockExclusive(&g_PoolLock);
+	while (g_dwPool != 0)
+		delete g_aPool[--g_dwPool];
+	::ReleaseSRWLockExclusive(&g_PoolLock);
+}
+
 /**
 *@brief Queries a COM object for a pointer to one of its interface.
 * @param riid A reference to the interface identifier(IID) of the interface being queried for.
@@ -65,19 +152,36 @@ ULONG STDMETHODCALLTYPE IDynamicWrapperEx::AddRef(VOID) {
 */
 ULONG STDMETHODCALLTYPE IDynamicWrapperEx::Release(VOID) {
 	ULONG ulReference = InterlockedDecrement(&this->m_dwReference);
-	return ulReference;
+	if (ulReference != 0)
+		return ulReference;
+
+	// The methods are owned by the catalog, hence the object only drops its own list before being reused
+	this->m_pAutomationFactory->Reset();
+
+	::AcquireSRWLockExclusive(&g_PoolLock);
+	BOOL bPooled = g_dwPool < IDYNAMICWRAPPEREX_POOL;
+	if (bPooled)
+		g_aPool[g_dwPool++] = this;
+	::ReleaseSRWLockExclusive(&g_PoolLock);
+
+	if (!bPooled)
+		delete this;
+
+	// Last, since the module may be unloaded from then on
+	ServerLock::Unlock();
+	return 0;
 }
 
 /**
  * @brief Retrieves the number of type information interfaces that an object provides (either 0 or 1).
  * @param pctinfo The number of type information interfaces provided by the object.
- * @return Method not implemented.
+ * @return Whether the function executed successfully.
 */
 HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::GetTypeInfoCount(
 	_Out_ UINT* pctinfo
 ) {
 	*pctinfo = 1;
-	return E_NOTIMPL;
+	return S_OK;
 }
 
 /**
@@ -93,7 +197,11 @@ HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::GetTypeInfo(
 	_Out_ ITypeInfo** ppTInfo
 ) {
 	*ppTInfo = NULL;
-        return E_NOTIMPL;
+	if (iTInfo != 0)
+		return DISP_E_BADINDEX;
+
+	// Describes the methods registered so far, see AutomationFactory::GetTypeInfo
+	return this->m_pAutomationFactory->GetTypeInfo(ppTInfo);
 }
 
 /**
@@ -114,16 +222,18 @@ HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::GetIDsOfNames(
 ) {
 	if (riid != IID_NULL)
 		return DISP_E_UNKNOWNINTERFACE;
+	if (cNames == 0)
+		return E_INVALIDARG;
 
-	for (auto& elem : this->m_pAutomationFactory->m_aDispatchTable) {
-		if (::wcscmp(elem.wszName, *rgszNames) == 0) {
-			*rgDispId = elem.lDispId;
-			return S_OK;
-		}
-	}
+	// Resolve the member name
+	HRESULT hr = this->m_pAutomationFactory->FindName(rgszNames[0], &rgDispId[0]);
 
-	*rgDispId = 0;
-	return E_FAIL;
+	// Named arguments are not supported
+	for (UINT cx = 1; cx < cNames; cx++) {
+		rgDispId[cx] = DISPID_UNKNOWN;
+		hr = DISP_E_UNKNOWNNAME;
+	}
+	return hr;
 }
 
 /**
@@ -154,13 +264,673 @@ HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::Invoke(
 	if ((wFlags & DISPATCH_METHOD) != DISPATCH_METHOD)
 		return E_FAIL;
 
+	if (dispIdMember == DISPID_DWBATCH)
+		return this->Batch(pDispParams, pVarResult, puArgErr);
+	return this->Dispatch(dispIdMember, pDispParams, pVarResult, puArgErr);
+}
+
+/**
+ * @brief Execute a method of the object, either internal or dynamic.
+ * @param dispIdMember Identifies the member.
+ * @param pDispParams List of parameters provided by the client.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @param puArgErr The index within rgvarg of the first argument that has an error.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::Dispatch(
+	_In_  DISPID      dispIdMember,
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult,
+	_Out_ UINT*       puArgErr
+) {
 	// Non-dynamic methods
-	if (dispIdMember == 0)
-		return this->m_pAutomationFactory->Register(pDispParams, pVarResult);
-	else if (dispIdMember == 1)
-		return Util::WriteByte(pDispParams, pVarResult);
+	switch (dispIdMember) {
+	case 0: return this->m_pAutomationFactory->Register(pDispParams, pVarResult);
+	case 1: return Util::WriteByte(pDispParams, pVarResult);
+	case 2: return Util::WriteBytes(pDispParams, pVarResult);
+	case 3: return Util::ReadBytes(pDispParams, pVarResult);
+	case 4: return Util::CopyBytes(pDispParams, pVarResult);
+	case 5: return Util::FillBytes(pDispParams, pVarResult);
+	case 7: return this->m_pAutomationFactory->Stats(pDispParams, pVarResult);
+	case 8: return this->InvokeAsync(pDispParams, pVarResult);
+	case 9: return this->WaitAny(pDispParams, pVarResult);
+	case 10: return this->Map(pDispParams, pVarResult, puArgErr);
+	case 11: return this->CreateCollector(pDispParams, pVarResult);
+	case 12: return this->CreateStruct(pDispParams, pVarResult);
+	case 13: return Util::CreateView(pDispParams, pVarResult);
+	case 14: return this->m_pAutomationFactory->LoadCache(pDispParams, pVarResult);
+	case 15: return this->m_pAutomationFactory->SaveCache(pDispParams, pVarResult);
+	case 16: return this->Trace(pDispParams, pVarResult);
+	}
 
 	// Execute dynamic method
-	HRESULT hr = this->m_pAutomationFactory->m_aDynamicMethods[dispIdMember - this->m_pAutomationFactory->m_dwInternalMethods]->Invoke(pDispParams, pVarResult);
+	const DynamicMethod* pMethod = this->m_pAutomationFactory->GetMethod(dispIdMember);
+	if (pMethod == nullptr)
+		return DISP_E_MEMBERNOTFOUND;
+	if (CALLTRACE_ENABLED())
+		return CallTrace::Instance().Invoke(pMethod, this->m_pAutomationFactory->GetCatalogIndex(dispIdMember), dispIdMember, pDispParams, pVarResult, puArgErr);
+	return pMethod->Invoke(pDispParams, pVarResult, puArgErr);
+}
+
+/**
+ * @brief Execute a sequence of calls in a single Invoke.
+ * @details The only parameter is an array of calls. Each call is an array holding the dispatch ID or the name of the
+ *          method followed by its arguments. An argument "@n" is replaced by the result of the call n of the same batch,
+ *          which must come first. A leading "@@" is replaced by "@" to pass a literal string. An array of the results of
+ *          every call is returned. The batch stops at the first call that fails.
+ * @param pDispParams List of parameters provided by the client.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @param puArgErr The index of the call that has failed, if any.
+ * @return Whether all the calls executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::Batch(
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult,
+	_Out_ UINT*       puArgErr
+) {
+	if (pDispParams->cArgs != 1)
+		return DISP_E_BADPARAMCOUNT;
+
+	LONG lCalls = 0;
+	HRESULT hr = Util::GetArrayLength(&pDispParams->rgvarg[0], &lCalls);
+	if (FAILED(hr))
+		return hr;
+
+	// Results are kept until the end of the batch, later calls may refer to them
+	SAFEARRAY* psa = ::SafeArrayCreateVector(VT_VARIANT, 0, static_cast<ULONG>(lCalls));
+	if (psa == NULL)
+		return E_OUTOFMEMORY;
+
+	VARIANT* aResults = NULL;
+	if (FAILED(::SafeArrayAccessData(psa, reinterpret_cast<LPVOID*>(&aResults)))) {
+		::SafeArrayDestroy(psa);
+		return E_FAIL;
+	}
+
+	// Calls of an array of VARIANTs, as built by VBScript, are read in place rather than copied one by one
+	VARIANT* pBatch = &pDispParams->rgvarg[0];
+	if (V_VT(pBatch) == (VT_VARIANT | VT_BYREF))
+		pBatch = V_VARIANTREF(pBatch);
+	SAFEARRAY* psaCalls = V_VT(pBatch) == (VT_ARRAY | VT_VARIANT) ? V_ARRAY(pBatch) : NULL;
+	VARIANT* aCalls = NULL;
+	if (psaCalls != NULL && FAILED(::SafeArrayAccessData(psaCalls, reinterpret_cast<LPVOID*>(&aCalls))))
+		aCalls = NULL;
+
+	for (LONG cx = 0; cx < lCalls && SUCCEEDED(hr); cx++) {
+		if (aCalls != NULL) {
+			hr = this->BatchCall(&aCalls[cx], static_cast<DWORD>(cx), aResults);
+		}
+		else {
+			VARIANT call;
+			hr = Util::GetArrayElement(pBatch, cx, &call);
+			if (SUCCEEDED(hr))
+				hr = this->BatchCall(&call, static_cast<DWORD>(cx), aResults);
+			::VariantClear(&call);
+		}
+
+		if (FAILED(hr) && puArgErr)
+			*puArgErr = static_cast<UINT>(cx);
+	}
+	if (aCalls != NULL)
+		::SafeArrayUnaccessData(psaCalls);
+	::SafeArrayUnaccessData(psa);
+
+	// The array owns the results
+	if (FAILED(hr) || pVarResult == NULL) {
+		::SafeArrayDestroy(psa);
+		return hr;
+	}
+
+	V_VT(pVarResult) = VT_ARRAY | VT_VARIANT;
+	V_ARRAY(pVarResult) = psa;
+	return S_OK;
+}
+
+/**
+ * @brief Execute a single call of a batch.
+ * @param pCall The array describing the call.
+ * @param dwCall The index of the call within the batch.
+ * @param aResults The results of the previous calls of the batch. Receives the result of the call at index dwCall.
+ * @return Whether the call executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::BatchCall(
+	_In_    VARIANT* pCall,
+	_In_    DWORD    dwCall,
+	_Inout_ VARIANT* aResults
+) {
+	LONG lElements = 0;
+	HRESULT hr = Util::GetArrayLength(pCall, &lElements);
+	if (FAILED(hr))
+		return hr;
+	if (lElements < 1)
+		return E_INVALIDARG;
+
+	// Resolve the member, by dispatch ID or by name
+	VARIANT member;
+	DISPID lDispId = DISPID_UNKNOWN;
+	hr = Util::GetArrayElement(pCall, 0, &member);
+	if (SUCCEEDED(hr))
+		hr = this->ResolveMember(&member, &lDispId);
+	::VariantClear(&member);
+	if (FAILED(hr))
+		return hr;
+	if (lDispId == DISPID_DWBATCH)
+		return E_INVALIDARG;
+
+	// Arguments are stored in reverse order, references to previous results are shallow copies. Storage comes from the
+	// arena of the thread and is released once the call returned
+	DWORD dwArguments = static_cast<DWORD>(lElements - 1);
+	ArenaScope scope{};
+	VARIANT* aArguments = NULL;
+	if (dwArguments != 0) {
+		aArguments = reinterpret_cast<VARIANT*>(scope.Allocate(sizeof(VARIANT) * dwArguments));
+		if (aArguments == NULL)
+			return E_OUTOFMEMORY;
+	}
+	DWORD dwFetched = 0;
+	for (; dwFetched < dwArguments && SUCCEEDED(hr); dwFetched++) {
+		VARIANT* pArgument = &aArguments[dwArguments - dwFetched - 1];
+		hr = Util::GetArrayElement(pCall, static_cast<LONG>(dwFetched + 1), pArgument);
+		if (FAILED(hr) || V_VT(pArgument) != VT_BSTR || V_BSTR(pArgument) == NULL || V_BSTR(pArgument)[0] != L'@')
+			continue;
+
+		BSTR bstrReference = V_BSTR(pArgument);
+		if (bstrReference[1] == L'@') {
+			V_BSTR(pArgument) = ::SysAllocString(bstrReference + 1);
+			hr = V_BSTR(pArgument) != NULL ? S_OK : E_OUTOFMEMORY;
+			::SysFreeString(bstrReference);
+			continue;
+		}
+
+		// "@n" with n the index of a previous call
+		DWORD dwResult = 0;
+		LPCWSTR wsz = bstrReference + 1;
+		for (; *wsz >= L'0' && *wsz <= L'9' && dwResult < dwCall; wsz++)
+			dwResult = dwResult * 10 + (*wsz - L'0');
+		if (wsz == bstrReference + 1 || *wsz != L'\0' || dwResult >= dwCall) {
+			hr = E_INVALIDARG;
+			continue;
+		}
+
+		::SysFreeString(bstrReference);
+		V_VT(pArgument) = VT_VARIANT | VT_BYREF;
+		V_VARIANTREF(pArgument) = &aResults[dwResult];
+	}
+
+	UINT uArgErr = 0;
+	DISPPARAMS params = { aArguments, NULL, dwArguments, 0 };
+	if (SUCCEEDED(hr))
+		hr = this->Dispatch(lDispId, &params, &aResults[dwCall], &uArgErr);
+
+	// References are not owned by the arguments
+	for (DWORD cx = 0; cx < dwFetched; cx++) {
+		VARIANT* pArgument = &aArguments[dwArguments - cx - 1];
+		if (V_VT(pArgument) != (VT_VARIANT | VT_BYREF))
+			::VariantClear(pArgument);
+	}
+	return hr;
+}
+
+/**
+ * @brief Execute a dynamic method on the worker pool.
+ * @details Parameters are the dispatch ID or the name of the method followed by its arguments. The arguments are copied
+ *          and a future object is returned straight away, see DynamicFuture.hpp.
+ * @param pDispParams List of parameters provided by the client.
+ * @param pVarResult Pointer to the location where the future is to be stored, or NULL if the caller expects no result.
+ * @return Whether the call has been queued.
+*/
+HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::InvokeAsync(
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult
+) {
+	if (pDispParams->cArgs < 1)
+		return DISP_E_BADPARAMCOUNT;
+
+	// Only dynamic methods can be executed away from the client thread
+	DISPID lDispId = DISPID_UNKNOWN;
+	HRESULT hr = this->ResolveMember(&pDispParams->rgvarg[pDispParams->cArgs - 1], &lDispId);
+	if (FAILED(hr))
+		return hr;
+	const DynamicMethod* pMethod = this->m_pAutomationFactory->GetMethod(lDispId);
+	if (pMethod == nullptr)
+		return DISP_E_MEMBERNOTFOUND;
+
+	// The future holds a reference to this object, hence to the method
+	IUnknown* pOwner = NULL;
+	this->QueryInterface(IID_IUnknown, reinterpret_cast<LPVOID*>(&pOwner));
+	DynamicFuture* pFuture = new (std::nothrow) DynamicFuture(pOwner, pMethod);
+	if (pFuture == nullptr) {
+		pOwner->Release();
+		return E_OUTOFMEMORY;
+	}
+
+	hr = pFuture->SetArguments(pDispParams->rgvarg, pDispParams->cArgs - 1);
+	if (FAILED(hr)) {
+		pFuture->Release();
+		return hr;
+	}
+
+	// One reference for the pool, released once the call is done
+	pFuture->AddRef();
+	hr = WorkerPool::Instance().Submit(pFuture);
+	if (FAILED(hr)) {
+		pFuture->Release();
+		pFuture->Release();
+		return hr;
+	}
+
+	if (pVarResult) {
+		V_VT(pVarResult) = VT_DISPATCH;
+		V_DISPATCH(pVarResult) = pFuture->GetDispatch();
+	}
+	pFuture->Release();
+	return S_OK;
+}
+
+/**
+ * @brief Wait until one of the futures is done.
+ * @details Parameters are an array of futures and an optional time-out interval in milliseconds, infinite by default.
+ *          The index of the first future done is returned, or -1 if the time-out interval elapsed.
+ * @param pDispParams List of parameters provided by the client.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::WaitAny(
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult
+) {
+	if (pDispParams->cArgs < 1 || pDispParams->cArgs > 2)
+		return DISP_E_BADPARAMCOUNT;
+
+	ULONGLONG qwMilliseconds = INFINITE;
+	if (pDispParams->cArgs == 2 && FAILED(Util::GetInteger(&pDispParams->rgvarg[0], &qwMilliseconds)))
+		return DISP_E_TYPEMISMATCH;
+
+	VARIANT* pFutures = &pDispParams->rgvarg[pDispParams->cArgs - 1];
+	LONG lFutures = 0;
+	HRESULT hr = Util::GetArrayLength(pFutures, &lFutures);
+	if (FAILED(hr))
+		return hr;
+	if (lFutures < 1)
+		return E_INVALIDARG;
+
+	// Every element must be a future, each one is referenced until the wait is over. Room is made first, hence adding a
+	// future never throws
+	std::vector<WorkerTask*> aTasks{};
+	try {
+		aTasks.reserve(static_cast<SIZE_T>(lFutures));
+	}
+	catch (...) {
+		return E_OUTOFMEMORY;
+	}
+	for (LONG cx = 0; cx < lFutures && SUCCEEDED(hr); cx++) {
+		VARIANT future;
+		hr = Util::GetArrayElement(pFutures, cx, &future);
+		if (FAILED(hr))
+			break;
+
+		DynamicFuture* pFuture = V_VT(&future) == VT_DISPATCH ? DynamicFuture::FromDispatch(V_DISPATCH(&future)) : nullptr;
+		if (pFuture != nullptr)
+			aTasks.push_back(pFuture);
+		else
+			hr = DISP_E_TYPEMISMATCH;
+		::VariantClear(&future);
+	}
+
+	DWORD dwIndex = 0;
+	if (SUCCEEDED(hr))
+		hr = WorkerPool::Instance().WaitAny(aTasks.data(), static_cast<DWORD>(aTasks.size()), static_cast<DWORD>(qwMilliseconds), &dwIndex);
+	for (WorkerTask* pTask : aTasks)
+		static_cast<DynamicFuture*>(pTask)->Release();
+	if (FAILED(hr))
+		return hr;
+
+	if (pVarResult) {
+		V_VT(pVarResult) = VT_I4;
+		V_I4(pVarResult) = hr == S_OK ? static_cast<LONG>(dwIndex) : -1;
+	}
+	return S_OK;
+}
+
+/**
+ * @brief Execute a dynamic method once per argument tuple, optionally on several threads.
+ * @details Parameters are the dispatch ID or the name of the method, the argument tuples and an optional number of
+ *          threads. Tuples are either the rows of a two-dimensional array or the elements of an array, each one being an
+ *          array of arguments or, for methods of one argument, the argument itself. The number of threads is 1 by
+ *          default, which executes the calls on the client thread, and true or a negative number uses every processor.
+ *          An array of the results is returned, in input order.
+ * @param pDispParams List of parameters provided by the client.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @param puArgErr The index of the tuple that is invalid or of the first call that has failed, if any.
+ * @return Whether all the calls executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::Map(
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult,
+	_Out_ UINT*       puArgErr
+) {
+	if (pDispParams->cArgs < 2 || pDispParams->cArgs > 3)
+		return DISP_E_BADPARAMCOUNT;
+
+	// Only dynamic methods can be executed away from the client thread
+	DISPID lDispId = DISPID_UNKNOWN;
+	HRESULT hr = this->ResolveMember(&pDispParams->rgvarg[pDispParams->cArgs - 1], &lDispId);
+	if (FAILED(hr))
+		return hr;
+	const DynamicMethod* pMethod = this->m_pAutomationFactory->GetMethod(lDispId);
+	if (pMethod == nullptr)
+		return DISP_E_MEMBERNOTFOUND;
+
+	// True is -1 once converted
+	DWORD dwThreads = 1;
+	if (pDispParams->cArgs == 3) {
+		ULONGLONG qwThreads = 0;
+		if (FAILED(Util::GetInteger(&pDispParams->rgvarg[0], &qwThreads)))
+			return DISP_E_TYPEMISMATCH;
+
+		if (static_cast<LONGLONG>(qwThreads) < 0) {
+			SYSTEM_INFO si = { 0 };
+			::GetSystemInfo(&si);
+			dwThreads = si.dwNumberOfProcessors;
+		}
+		else if (qwThreads > 1) {
+			dwThreads = static_cast<DWORD>(std::min<ULONGLONG>(qwThreads, MAXDWORD));
+		}
+	}
+
+	std::vector<VARIANT> aArguments{};
+	DWORD dwArity = 0;
+	DWORD dwCalls = 0;
+	hr = this->MapArguments(&pDispParams->rgvarg[pDispParams->cArgs - 2], pMethod->m_dwArguments, aArguments, &dwArity, &dwCalls, puArgErr);
+
+	SAFEARRAY* psa = NULL;
+	if (SUCCEEDED(hr)) {
+		psa = ::SafeArrayCreateVector(VT_VARIANT, 0, dwCalls);
+		hr = psa != NULL ? S_OK : E_OUTOFMEMORY;
+	}
+
+	// Calls write their result straight into the array
+	VARIANT* aResults = NULL;
+	if (SUCCEEDED(hr) && dwCalls != 0) {
+		hr = ::SafeArrayAccessData(psa, reinterpret_cast<LPVOID*>(&aResults));
+		if (SUCCEEDED(hr)) {
+			DWORD dwFailed = 0;
+			hr = ParallelMap::Run(pMethod, aArguments.data(), dwArity, dwCalls, aResults, dwThreads, &dwFailed);
+			if (FAILED(hr) && puArgErr)
+				*puArgErr = static_cast<UINT>(dwFailed);
+			::SafeArrayUnaccessData(psa);
+		}
+	}
+
+	for (VARIANT& var : aArguments)
+		::VariantClear(&var);
+
+	// The array owns the results
+	if (FAILED(hr) || pVarResult == NULL) {
+		if (psa != NULL)
+			::SafeArrayDestroy(psa);
+		return hr;
+	}
+
+	V_VT(pVarResult) = VT_ARRAY | VT_VARIANT;
+	V_ARRAY(pVarResult) = psa;
+	return S_OK;
+}
+
+/**
+ * @brief Flatten the argument tuples of a map.
+ * @param pTuples The argument tuples provided by the client.
+ * @param dwMethodArity The number of arguments of the method, DYNAMICMETHOD_ANY_ARITY if unknown.
+ * @param aArguments Receives the arguments, each tuple in reverse order as in DISPPARAMS. Must be cleared by the caller.
+ * @param pdwArity The address of a variable that receives the number of arguments per tuple.
+ * @param pdwCalls The address of a variable that receives the number of tuples.
+ * @param puArgErr The index of the tuple that is invalid, if any.
+ * @return Whether the tuples are valid.
+*/
+HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::MapArguments(
+	_In_    VARIANT*              pTuples,
+	_In_    DWORD                 dwMethodArity,
+	_Inout_ std::vector<VARIANT>& aArguments,
+	_Out_   PDWORD                pdwArity,
+	_Out_   PDWORD                pdwCalls,
+	_Out_   UINT*                 puArgErr
+) {
+	*pdwArity = 0;
+	*pdwCalls = 0;
+	if (V_VT(pTuples) == (VT_VARIANT | VT_BYREF))
+		pTuples = V_VARIANTREF(pTuples);
+
+	// Two-dimensional arrays hold one tuple per row, the right-most dimension being the one of the arguments
+	if (V_VT(pTuples) == (VT_ARRAY | VT_VARIANT) && V_ARRAY(pTuples) != NULL && ::SafeArrayGetDim(V_ARRAY(pTuples)) == 2) {
+		SAFEARRAY* psa = V_ARRAY(pTuples);
+		DWORD dwArity = psa->rgsabound[0].cElements;
+		DWORD dwCalls = psa->rgsabound[1].cElements;
+		if (static_cast<ULONGLONG>(dwArity) * dwCalls > MAXLONG)
+			return E_INVALIDARG;
+
+		// The size is given by the client, hence a failure is reported rather than thrown
+		try {
+			aArguments.resize(static_cast<SIZE_T>(dwArity) * dwCalls);
+		}
+		catch (...) {
+			return E_OUTOFMEMORY;
+		}
+		for (DWORD dwCall = 0; dwCall < dwCalls; dwCall++) {
+			for (DWORD cx = 0; cx < dwArity; cx++) {
+				LONG rgIndices[2] = { psa->rgsabound[0].lLbound + static_cast<LONG>(cx), psa->rgsabound[1].lLbound + static_cast<LONG>(dwCall) };
+				HRESULT hr = ::SafeArrayGetElement(psa, rgIndices, &aArguments[dwCall * dwArity + dwArity - cx - 1]);
+				if (FAILED(hr)) {
+					if (puArgErr)
+						*puArgErr = static_cast<UINT>(dwCall);
+					return hr;
+				}
+			}
+		}
+
+		*pdwArity = dwArity;
+		*pdwCalls = dwCalls;
+		return S_OK;
+	}
+
+	LONG lCalls = 0;
+	HRESULT hr = Util::GetArrayLength(pTuples, &lCalls);
+	if (FAILED(hr))
+		return hr;
+
+	// Every tuple must have the arity of the first one
+	DWORD dwArity = 0;
+	LONG lCall = 0;
+	for (; lCall < lCalls; lCall++) {
+		VARIANT tuple;
+		hr = Util::GetArrayElement(pTuples, lCall, &tuple);
+		if (FAILED(hr))
+			break;
+
+		// Arguments of a method of one argument are never tuples
+		LONG lArguments = 0;
+		BOOL bScalar = dwMethodArity == 1 || FAILED(Util::GetArrayLength(&tuple, &lArguments));
+		DWORD dwTupleArity = bScalar ? 1 : static_cast<DWORD>(lArguments);
+		if (lCall == 0)
+			dwArity = dwTupleArity;
+		if (dwTupleArity != dwArity || static_cast<ULONGLONG>(dwArity) * lCalls > MAXLONG) {
+			::VariantClear(&tuple);
+			hr = DISP_E_BADPARAMCOUNT;
+			break;
+		}
+
+		// Room for every tuple is made once the arity is known, hence adding a tuple never throws
+		if (lCall == 0) {
+			try {
+				aArguments.reserve(static_cast<SIZE_T>(dwArity) * lCalls);
+			}
+			catch (...) {
+				::VariantClear(&tuple);
+				hr = E_OUTOFMEMORY;
+				break;
+			}
+		}
+
+		SIZE_T cbFirst = aArguments.size();
+		aArguments.resize(cbFirst + dwArity);
+		if (bScalar) {
+			aArguments[cbFirst] = tuple;
+			continue;
+		}
+
+		for (DWORD cx = 0; cx < dwArity && SUCCEEDED(hr); cx++)
+			hr = Util::GetArrayElement(&tuple, static_cast<LONG>(cx), &aArguments[cbFirst + dwArity - cx - 1]);
+		::VariantClear(&tuple);
+		if (FAILED(hr))
+			break;
+	}
+
+	if (FAILED(hr)) {
+		if (puArgErr)
+			*puArgErr = static_cast<UINT>(lCall);
+		return hr;
+	}
+
+	*pdwArity = dwArity;
+	*pdwCalls = static_cast<DWORD>(lCalls);
+	return S_OK;
+}
+
+/**
+ * @brief Create a native callback collecting its arguments.
+ * @details Parameters are the signature of the callback, see MarshalPlan.hpp, and an optional value returned by the
+ *          callback, 1 by default. A collector object is returned, see Collector.hpp.
+ * @param pDispParams List of parameters provided by the client.
+ * @param pVarResult Pointer to the location where the collector is to be stored, or NULL if the caller expects no result.
+ * @return Whether the collector has been created.
+*/
+HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::CreateCollector(
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult
+) {
+	if (pDispParams->cArgs < 1 || pDispParams->cArgs > 2)
+		return DISP_E_BADPARAMCOUNT;
+
+	VARIANT* pSignature = &pDispParams->rgvarg[pDispParams->cArgs - 1];
+	if (V_VT(pSignature) == (VT_VARIANT | VT_BYREF))
+		pSignature = V_VARIANTREF(pSignature);
+	if (V_VT(pSignature) != VT_BSTR)
+		return DISP_E_TYPEMISMATCH;
+
+	ULONGLONG qwReturn = 1;
+	if (pDispParams->cArgs == 2 && FAILED(Util::GetInteger(&pDispParams->rgvarg[0], &qwReturn)))
+		return DISP_E_TYPEMISMATCH;
+
+	Collector* pCollector = nullptr;
+	HRESULT hr = Collector::Create(V_BSTR(pSignature), static_cast<LONGLONG>(qwReturn), &pCollector);
+	if (FAILED(hr))
+		return hr;
+
+	if (pVarResult) {
+		V_VT(pVarResult) = VT_DISPATCH;
+		V_DISPATCH(pVarResult) = pCollector->GetDispatch();
+	}
+	pCollector->Release();
+	return S_OK;
+}
+
+/**
+ * @brief Compile a structure layout.
+ * @details The only parameter is the definition of the structure, see StructLayout.hpp. A structure object is
+ *          returned, see DynamicStruct.hpp.
+ * @param pDispParams List of parameters provided by the client.
+ * @param pVarResult Pointer to the location where the structure is to be stored, or NULL if the caller expects no result.
+ * @return Whether the definition is valid.
+*/
+HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::CreateStruct(
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult
+) {
+	if (pDispParams->cArgs != 1)
+		return DISP_E_BADPARAMCOUNT;
+
+	VARIANT* pDefinition = &pDispParams->rgvarg[0];
+	if (V_VT(pDefinition) == (VT_VARIANT | VT_BYREF))
+		pDefinition = V_VARIANTREF(pDefinition);
+	if (V_VT(pDefinition) != VT_BSTR)
+		return DISP_E_TYPEMISMATCH;
+
+	std::unique_ptr<StructLayout> pLayout;
+	HRESULT hr = StructLayout::Compile(V_BSTR(pDefinition), &pLayout);
+	if (FAILED(hr))
+		return hr;
+
+	DynamicStruct* pStruct = new (std::nothrow) DynamicStruct(std::move(pLayout));
+	if (pStruct == nullptr)
+		return E_OUTOFMEMORY;
+	if (pVarResult) {
+		V_VT(pVarResult) = VT_DISPATCH;
+		V_DISPATCH(pVarResult) = pStruct->GetDispatch();
+	}
+	pStruct->Release();
+	return S_OK;
+}
+
+/**
+ * @brief Start or stop tracing the calls of dynamic methods, see CallTrace.hpp.
+ * @details With the path of a file, tracing starts into it, ending the trace in progress if any, and whether it has
+ *          started is returned. It never starts if DWEX_ENABLE_TRACE was not defined at build time. Without parameter,
+ *          tracing stops and the number of calls written to the file is returned.
+ * @param pDispParams List of parameters provided by the client.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::Trace(
+	_In_  DISPPARAMS* pDispParams,
+	_Out_ VARIANT*    pVarResult
+) {
+	if (pDispParams->cArgs > 1)
+		return DISP_E_BADPARAMCOUNT;
+
+	// Stop
+	if (pDispParams->cArgs == 0) {
+		ULONGLONG qwRecords = 0;
+		CallTrace::Instance().Stop(&qwRecords);
+		if (pVarResult) {
+			V_VT(pVarResult) = VT_UI8;
+			V_UI8(pVarResult) = qwRecords;
+		}
+		return S_OK;
+	}
+
+	// Start, a file that cannot be created is reported to the script rather than raised
+	VARIANT* pPath = &pDispParams->rgvarg[0];
+	if (V_VT(pPath) == (VT_VARIANT | VT_BYREF))
+		pPath = V_VARIANTREF(pPath);
+	if (V_VT(pPath) != VT_BSTR || V_BSTR(pPath) == NULL)
+		return DISP_E_TYPEMISMATCH;
+
+	HRESULT hr = CallTrace::Instance().Start(V_BSTR(pPath));
+	if (pVarResult) {
+		V_VT(pVarResult) = VT_BOOL;
+		V_BOOL(pVarResult) = SUCCEEDED(hr) ? VARIANT_TRUE : VARIANT_FALSE;
+	}
+	return S_OK;
+}
+
+/**
+ * @brief Get the dispatch ID of a method, provided by dispatch ID or by name.
+ * @param pMember The dispatch ID or the name of the method.
+ * @param plDispId The address of a variable that receives the dispatch ID.
+ * @return Whether the method has been found.
+*/
+HRESULT STDMETHODCALLTYPE IDynamicWrapperEx::ResolveMember(
+	_In_  VARIANT* pMember,
+	_Out_ DISPID*  plDispId
+) {
+	*plDispId = DISPID_UNKNOWN;
+	if (V_VT(pMember) == (VT_VARIANT | VT_BYREF))
+		pMember = V_VARIANTREF(pMember);
+	if (V_VT(pMember) == VT_BSTR)
+		return this->m_pAutomationFactory->FindName(V_BSTR(pMember), plDispId);
+
+	ULONGLONG qwDispId = 0;
+	HRESULT hr = Util::GetInteger(pMember, &qwDispId);
+	if (SUCCEEDED(hr))
+		*plDispId = static_cast<DISPID>(qwDispId);
 	return hr;
 }
@@ -0,0 +1,817 @@
+/**
+* @file         MarshalPlan.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Precompiled argument marshalling plan definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <intrin.h>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "MarshalPlan.hpp"
+
+#define MARSHAL_ASCII_BLOCK 16 /* Number of characters checked and converted at once by the ASCII fast paths */
+
+/**
+ * @brief Convert a VARIANT that is not already of the expected type.
+ * @param pVariant The VARIANT provided by the client.
+ * @param vt The type expected.
+ * @param pConverted The VARIANT that receives the converted value.
+ * @return Whether the VARIANT could be converted.
+*/
+static HRESULT CoerceVariant(
+	_In_  VARIANT* pVariant,
+	_In_  VARTYPE  vt,
+	_Out_ VARIANT* pConverted
+) {
+	::VariantInit(pConverted);
+	if (FAILED(::VariantChangeType(pConverted, pVariant, 0, vt)))
+		return DISP_E_TYPEMISMATCH;
+	return S_OK;
+}
+
+/**
+ * @brief Convert a VARIANT into a 32-bit integer, sign-extended to 64-bit.
+*/
+static HRESULT ConvertInt32(
+	_In_        VARIANT*    pVariant,
+	_Out_       PArgument   pArgument,
+	_Inout_opt_ ArenaScope*
+) {
+	pArgument->dwFlag = ARGUMENT_STD;
+	if (V_VT(pVariant) == VT_I4) {
+		pArgument->qwValue = static_cast<DWORD64>(static_cast<LONGLONG>(V_I4(pVariant)));
+		return S_OK;
+	}
+
+	VARIANT var;
+	if (FAILED(CoerceVariant(pVariant, VT_I4, &var)))
+		return DISP_E_TYPEMISMATCH;
+	pArgument->qwValue = static_cast<DWORD64>(static_cast<LONGLONG>(V_I4(&var)));
+	return S_OK;
+}
+
+/**
+ * @brief Convert a VARIANT into a 64-bit integer or a pointer.
+*/
+static HRESULT ConvertInt64(
+	_In_        VARIANT*    pVariant,
+	_Out_       PArgument   pArgument,
+	_Inout_opt_ ArenaScope*
+) {
+	pArgument->dwFlag = ARGUMENT_STD;
+	switch (V_VT(pVariant)) {
+	case VT_I8:
+	case VT_UI8:
+		pArgument->qwValue = V_UI8(pVariant);
+		return S_OK;
+	case VT_I4:
+		pArgument->qwValue = static_cast<DWORD64>(static_cast<LONGLONG>(V_I4(pVariant)));
+		return S_OK;
+	case VT_NULL:
+	case VT_EMPTY:
+		pArgument->qwValue = 0;
+		return S_OK;
+	}
+
+	VARIANT var;
+	if (FAILED(CoerceVariant(pVariant, VT_I8, &var)))
+		return DISP_E_TYPEMISMATCH;
+	pArgument->qwValue = static_cast<DWORD64>(V_I8(&var));
+	return S_OK;
+}
+
+/**
+ * @brief Convert a VARIANT into a pointer. Arrays of fixed-width elements are passed as their data.
+*/
+static HRESULT ConvertPointer(
+	_In_        VARIANT*    pVariant,
+	_Out_       PArgument   pArgument,
+	_Inout_opt_ ArenaScope* pScope
+) {
+	if ((V_VT(pVariant) & VT_ARRAY) == 0)
+		return ConvertInt64(pVariant, pArgument, pScope);
+
+	pArgument->dwFlag = ARGUMENT_STD;
+	HRESULT hr = pScope != nullptr ? MarshalPlan::LockArray(pVariant, pScope, &pArgument->lpValue) : S_FALSE;
+	return hr == S_FALSE ? DISP_E_TYPEMISMATCH : hr;
+}
+
+/**
+ * @brief Convert a VARIANT into a Win32 boolean (TRUE or FALSE).
+*/
+static HRESULT ConvertBool(
+	_In_        VARIANT*    pVariant,
+	_Out_       PArgument   pArgument,
+	_Inout_opt_ ArenaScope*
+) {
+	pArgument->dwFlag = ARGUMENT_STD;
+	if (V_VT(pVariant) == VT_BOOL) {
+		pArgument->qwValue = V_BOOL(pVariant) != VARIANT_FALSE;
+		return S_OK;
+	}
+
+	VARIANT var;
+	if (FAILED(CoerceVariant(pVariant, VT_BOOL, &var)))
+		return DISP_E_TYPEMISMATCH;
+	pArgument->qwValue = V_BOOL(&var) != VARIANT_FALSE;
+	return S_OK;
+}
+
+/**
+ * @brief Convert a VARIANT into a single precision floating point value.
+*/
+static HRESULT ConvertFloat(
+	_In_        VARIANT*    pVariant,
+	_Out_       PArgument   pArgument,
+	_Inout_opt_ ArenaScope*
+) {
+	pArgument->dwFlag = ARGUMENT_FLT;
+	pArgument->qwValue = 0;
+	if (V_VT(pVariant) == VT_R4) {
+		pArgument->flValue = V_R4(pVariant);
+		return S_OK;
+	}
+
+	VARIANT var;
+	if (FAILED(CoerceVariant(pVariant, VT_R4, &var)))
+		return DISP_E_TYPEMISMATCH;
+	pArgument->flValue = V_R4(&var);
+	return S_OK;
+}
+
+/**
+ * @brief Convert a VARIANT into a double precision floating point value.
+*/
+static HRESULT ConvertDouble(
+	_In_        VARIANT*    pVariant,
+	_Out_       PArgument   pArgument,
+	_Inout_opt_ ArenaScope*
+) {
+	pArgument->dwFlag = ARGUMENT_FLT;
+	if (V_VT(pVariant) == VT_R8) {
+		pArgument->rlValue = V_R8(pVariant);
+		return S_OK;
+	}
+
+	VARIANT var;
+	if (FAILED(CoerceVariant(pVariant, VT_R8, &var)))
+		return DISP_E_TYPEMISMATCH;
+	pArgument->rlValue = V_R8(&var);
+	return S_OK;
+}
+
+/**
+ * @brief Pass the buffer of a BSTR as a UTF-16 string. NULL and empty VARIANTs are passed as NULL.
+*/
+static HRESULT ConvertString(
+	_In_        VARIANT*    pVariant,
+	_Out_       PArgument   pArgument,
+	_Inout_opt_ ArenaScope*
+) {
+	pArgument->dwFlag = ARGUMENT_STD;
+	switch (V_VT(pVariant)) {
+	case VT_BSTR:
+		pArgument->lpValue = V_BSTR(pVariant);
+		return S_OK;
+	case VT_BSTR | VT_BYREF:
+		pArgument->lpValue = *pVariant->pbstrVal;
+		return S_OK;
+	case VT_NULL:
+	case VT_EMPTY:
+		pArgument->lpValue = NULL;
+		return S_OK;
+	}
+	return DISP_E_TYPEMISMATCH;
+}
+
+/**
+ * @brief Load a block of characters narrowed to bytes.
+ * @param wsz The characters, MARSHAL_ASCII_BLOCK of them.
+ * @param pBytes The address of a variable that receives the bytes.
+ * @return Whether every character is ASCII, otherwise the bytes are not stored.
+*/
+static inline BOOL LoadAsciiBlock(
+	_In_  LPCWSTR  wsz,
+	_Out_ __m128i* pBytes
+) {
+	const __m128i* lpBlock = reinterpret_cast<const __m128i*>(wsz);
+	__m128i xmmLow = _mm_loadu_si128(lpBlock);
+	__m128i xmmHigh = _mm_loadu_si128(lpBlock + 1);
+	__m128i xmmAny;
+	if constexpr (sizeof(WCHAR) == sizeof(SHORT)) {
+		xmmAny = _mm_or_si128(xmmLow, xmmHigh);
+		xmmAny = _mm_and_si128(xmmAny, _mm_set1_epi16(static_cast<SHORT>(0xFF80)));
+	}
+	else {
+		__m128i xmmLow2 = _mm_loadu_si128(lpBlock + 2);
+		__m128i xmmHigh2 = _mm_loadu_si128(lpBlock + 3);
+		xmmAny = _mm_or_si128(_mm_or_si128(xmmLow, xmmHigh), _mm_or_si128(xmmLow2, xmmHigh2));
+		xmmAny = _mm_and_si128(xmmAny, _mm_set1_epi32(~0x7F));
+		xmmLow = _mm_packs_epi32(xmmLow, xmmHigh);
+		xmmHigh = _mm_packs_epi32(xmmLow2, xmmHigh2);
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(xmmAny, _mm_setzero_si128())) != 0xFFFF)
+		return FALSE;
+
+	// ASCII characters are preserved by the saturation
+	*pBytes = _mm_packus_epi16(xmmLow, xmmHigh);
+	return TRUE;
+}
+
+/**
+ * @brief Store a block of ASCII bytes widened to characters.
+ * @param xmmBytes The bytes.
+ * @param wsz The address of MARSHAL_ASCII_BLOCK characters.
+*/
+static inline VOID StoreAsciiBlock(
+	_In_  __m128i xmmBytes,
+	_Out_ LPWSTR  wsz
+) {
+	__m128i* lpBlock = reinterpret_cast<__m128i*>(wsz);
+	__m128i xmmZero = _mm_setzero_si128();
+	__m128i xmmLow = _mm_unpacklo_epi8(xmmBytes, xmmZero);
+	__m128i xmmHigh = _mm_unpackhi_epi8(xmmBytes, xmmZero);
+	if constexpr (sizeof(WCHAR) == sizeof(SHORT)) {
+		_mm_storeu_si128(lpBlock, xmmLow);
+		_mm_storeu_si128(lpBlock + 1, xmmHigh);
+	}
+	else {
+		_mm_storeu_si128(lpBlock, _mm_unpacklo_epi16(xmmLow, xmmZero));
+		_mm_storeu_si128(lpBlock + 1, _mm_unpackhi_epi16(xmmLow, xmmZero));
+		_mm_storeu_si128(lpBlock + 2, _mm_unpacklo_epi16(xmmHigh, xmmZero));
+		_mm_storeu_si128(lpBlock + 3, _mm_unpackhi_epi16(xmmHigh, xmmZero));
+	}
+}
+
+/**
+ * @brief Copy the ASCII prefix of a UTF-16 string into a narrow string.
+ * @param wsz The UTF-16 string.
+ * @param cch The number of characters of the UTF-16 string.
+ * @param sz The narrow string, at least cch bytes.
+ * @return The number of characters copied, up to the first non-ASCII character.
+*/
+static UINT NarrowAscii(
+	_In_  LPCWSTR wsz,
+	_In_  UINT    cch,
+	_Out_ LPSTR   sz
+) {
+	UINT cx = 0;
+	__m128i xmmBytes;
+	for (; cx + MARSHAL_ASCII_BLOCK <= cch && LoadAsciiBlock(wsz + cx, &xmmBytes); cx += MARSHAL_ASCII_BLOCK)
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(sz + cx), xmmBytes);
+	for (; cx < cch && wsz[cx] < 0x80; cx++)
+		sz[cx] = static_cast<CHAR>(wsz[cx]);
+	return cx;
+}
+
+/**
+ * @brief Copy the ASCII prefix of a narrow string into a UTF-16 string.
+ * @param sz The narrow string.
+ * @param cch The number of bytes of the narrow string.
+ * @param wsz The UTF-16 string, at least cch characters.
+ * @return The number of characters copied, up to the first non-ASCII character.
+*/
+static UINT WidenAscii(
+	_In_  LPCSTR sz,
+	_In_  UINT   cch,
+	_Out_ LPWSTR wsz
+) {
+	UINT cx = 0;
+	for (; cx + MARSHAL_ASCII_BLOCK <= cch; cx += MARSHAL_ASCII_BLOCK) {
+		__m128i xmmBytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sz + cx));
+		if (_mm_movemask_epi8(xmmBytes) != 0)
+			break;
+		StoreAsciiBlock(xmmBytes, wsz + cx);
+	}
+	for (; cx < cch && static_cast<BYTE>(sz[cx]) < 0x80; cx++)
+		wsz[cx] = static_cast<WCHAR>(sz[cx]);
+	return cx;
+}
+
+/**
+ * @brief Convert the BSTR of a VARIANT into a narrow string allocated from the scratch memory of the call.
+ *        NULL and empty VARIANTs are passed as NULL.
+ * @param uCodePage The code page of the narrow string.
+*/
+static HRESULT ConvertNarrowString(
+	_In_        VARIANT*    pVariant,
+	_Out_       PArgument   pArgument,
+	_Inout_opt_ ArenaScope* pScope,
+	_In_        UINT        uCodePage
+) {
+	pArgument->dwFlag = ARGUMENT_STD;
+	BSTR bstr = NULL;
+	switch (V_VT(pVariant)) {
+	case VT_BSTR:
+		bstr = V_BSTR(pVariant);
+		break;
+	case VT_BSTR | VT_BYREF:
+		bstr = *pVariant->pbstrVal;
+		break;
+	case VT_NULL:
+	case VT_EMPTY:
+		pArgument->lpValue = NULL;
+		return S_OK;
+	default:
+		return DISP_E_TYPEMISMATCH;
+	}
+	if (bstr == NULL) {
+		pArgument->lpValue = NULL;
+		return S_OK;
+	}
+	if (pScope == nullptr)
+		return DISP_E_TYPEMISMATCH;
+
+	// Most strings are ASCII, which is the same in every code page
+	UINT cch = ::SysStringLen(bstr);
+	LPSTR sz = reinterpret_cast<LPSTR>(pScope->Allocate(static_cast<SIZE_T>(cch) + 1));
+	if (sz == NULL)
+		return E_OUTOFMEMORY;
+	UINT cchAscii = NarrowAscii(bstr, cch, sz);
+
+	// The rest may need more bytes than characters
+	UINT cchNarrow = cchAscii;
+	if (cchAscii < cch) {
+		int cbRest = ::WideCharToMultiByte(uCodePage, 0, bstr + cchAscii, static_cast<int>(cch - cchAscii), NULL, 0, NULL, NULL);
+		if (cbRest <= 0)
+			return DISP_E_TYPEMISMATCH;
+
+		if (static_cast<UINT>(cbRest) > cch - cchAscii) {
+			LPSTR szLarger = reinterpret_cast<LPSTR>(pScope->Allocate(static_cast<SIZE_T>(cchAscii) + cbRest + 1));
+			if (szLarger == NULL)
+				return E_OUTOFMEMORY;
+			std::memcpy(szLarger, sz, cchAscii);
+			sz = szLarger;
+		}
+		::WideCharToMultiByte(uCodePage, 0, bstr + cchAscii, static_cast<int>(cch - cchAscii), sz + cchAscii, cbRest, NULL, NULL);
+		cchNarrow += static_cast<UINT>(cbRest);
+	}
+
+	sz[cchNarrow] = '\0';
+	pArgument->lpValue = sz;
+	return S_OK;
+}
+
+/**
+ * @brief Convert the BSTR of a VARIANT into an ANSI string, in the active code page.
+*/
+static HRESULT ConvertAnsi(
+	_In_        VARIANT*    pVariant,
+	_Out_       PArgument   pArgument,
+	_Inout_opt_ ArenaScope* pScope
+) {
+	return ConvertNarrowString(pVariant, pArgument, pScope, CP_ACP);
+}
+
+/**
+ * @brief Convert the BSTR of a VARIANT into a UTF-8 string.
+*/
+static HRESULT ConvertUtf8(
+	_In_        VARIANT*    pVariant,
+	_Out_       PArgument   pArgument,
+	_Inout_opt_ ArenaScope* pScope
+) {
+	return ConvertNarrowString(pVariant, pArgument, pScope, CP_UTF8);
+}
+
+/**
+ * @brief Convert a narrow string returned by a native function into a BSTR.
+ * @param sz The narrow string.
+ * @param uCodePage The code page of the narrow string.
+ * @return The BSTR, or NULL if the string is NULL or could not be converted.
+*/
+static BSTR WidenString(
+	_In_opt_ LPCSTR sz,
+	_In_     UINT   uCodePage
+) {
+	if (sz == NULL)
+		return NULL;
+
+	// A narrow string never has fewer bytes than characters
+	UINT cch = static_cast<UINT>(std::strlen(sz));
+	BSTR bstr = ::SysAllocStringLen(NULL, cch);
+	if (bstr == NULL)
+		return NULL;
+	UINT cchAscii = WidenAscii(sz, cch, bstr);
+	if (cchAscii == cch)
+		return bstr;
+
+	int cchRest = ::MultiByteToWideChar(uCodePage, 0, sz + cchAscii, static_cast<int>(cch - cchAscii), NULL, 0);
+	BSTR bstrFull = cchRest > 0 ? ::SysAllocStringLen(NULL, cchAscii + static_cast<UINT>(cchRest)) : NULL;
+	if (bstrFull != NULL) {
+		std::memcpy(bstrFull, bstr, cchAscii * sizeof(WCHAR));
+		::MultiByteToWideChar(uCodePage, 0, sz + cchAscii, static_cast<int>(cch - cchAscii), bstrFull + cchAscii, cchRest);
+	}
+	::SysFreeString(bstr);
+	return bstrFull;
+}
+
+/**
+ * @brief Pass a variable of the client by reference, as the address of a slot holding a value of a given kind. Values
+ *        that are not passed by reference are addresses provided by the client.
+*/
+template<ArgumentKind eKind>
+static HRESULT ConvertReference(
+	_In_        VARIANT*    pVariant,
+	_Out_       PArgument   pArgument,
+	_Inout_opt_ ArenaScope* pScope
+) {
+	if ((V_VT(pVariant) & VT_BYREF) == 0 || (V_VT(pVariant) & VT_ARRAY) != 0)
+		return ConvertPointer(pVariant, pArgument, pScope);
+	if (pScope == nullptr)
+		return DISP_E_TYPEMISMATCH;
+	return MarshalPlan::LoadReference(pVariant, eKind, pScope, pArgument);
+}
+
+/**
+ * @brief Get the converter of an argument pointing to a value of a given kind.
+ * @param eKind The kind of the value.
+ * @return The converter, or NULL if the kind cannot be passed by reference.
+*/
+static ArgumentConverter GetReferenceConverter(
+	_In_ ArgumentKind eKind
+) {
+	switch (eKind) {
+	case ArgumentKindInt32:   return ConvertReference<ArgumentKindInt32>;
+	case ArgumentKindInt64:   return ConvertReference<ArgumentKindInt64>;
+	case ArgumentKindPointer: return ConvertReference<ArgumentKindPointer>;
+	case ArgumentKindBool:    return ConvertReference<ArgumentKindBool>;
+	case ArgumentKindFloat:   return ConvertReference<ArgumentKindFloat>;
+	case ArgumentKindDouble:  return ConvertReference<ArgumentKindDouble>;
+	default:                  return NULL;
+	}
+}
+
+/**
+ * @brief Whether a kind is an integer, stored in a slot as is.
+*/
+static inline BOOL IsIntegerKind(
+	_In_ ArgumentKind eKind
+) {
+	return eKind == ArgumentKindInt32 || eKind == ArgumentKindInt64 || eKind == ArgumentKindPointer;
+}
+
+/**
+ * @brief Whether a type is an integer, copied to and from a slot as is.
+*/
+static inline BOOL IsIntegerType(
+	_In_ VARTYPE vt
+) {
+	return vt != VT_BOOL && vt != VT_R4 && vt != VT_R8 && vt != VT_CY && vt != VT_DATE && MarshalPlan::GetFixedWidth(vt) != 0;
+}
+
+/**
+ * @brief Get the converter associated to a kind of argument.
+ * @param eKind The kind of argument.
+ * @return The converter, or NULL if the kind is not valid for an argument.
+*/
+ArgumentConverter MarshalPlan::GetConverter(
+	_In_ ArgumentKind eKind
+) {
+	switch (eKind) {
+	case ArgumentKindInt32:   return ConvertInt32;
+	case ArgumentKindInt64:   return ConvertInt64;
+	case ArgumentKindPointer: return ConvertPointer;
+	case ArgumentKindBool:    return ConvertBool;
+	case ArgumentKindFloat:   return ConvertFloat;
+	case ArgumentKindDouble:  return ConvertDouble;
+	case ArgumentKindString:  return ConvertString;
+	case ArgumentKindAnsi:    return ConvertAnsi;
+	case ArgumentKindUtf8:    return ConvertUtf8;
+	default:                  return NULL;
+	}
+}
+
+/**
+ * @brief Compile a signature string into a marshalling plan.
+ * @param wszSignature The signature string.
+ * @param ppPlan The address of a variable that receives the plan.
+ * @return Whether the signature is valid.
+*/
+HRESULT STDMETHODCALLTYPE MarshalPlan::Compile(
+	_In_  LPCWSTR                       wszSignature,
+	_Out_ std::unique_ptr<MarshalPlan>* ppPlan
+) {
+	ppPlan->reset();
+	if (wszSignature == NULL)
+		return E_INVALIDARG;
+
+	std::unique_ptr<MarshalPlan> plan = std::make_unique<MarshalPlan>();
+
+	// Arguments
+	LPCWSTR wsz = wszSignature;
+	for (; *wsz != L'\0' && *wsz != L'='; wsz++) {
+		ArgumentKind eKind = static_cast<ArgumentKind>(*wsz);
+		ArgumentKind eReference = ArgumentKindVoid;
+		ArgumentConverter lpConverter = NULL;
+
+		// Arguments passed by reference are pointers to their kind
+		if (*wsz == L'&') {
+			wsz++;
+			eReference = static_cast<ArgumentKind>(*wsz);
+			eKind = ArgumentKindPointer;
+			lpConverter = GetReferenceConverter(eReference);
+			plan->m_dwReferences++;
+		}
+		else {
+			lpConverter = GetConverter(eKind);
+		}
+		if (lpConverter == NULL)
+			return E_INVALIDARG;
+
+		if ((eKind == ArgumentKindFloat || eKind == ArgumentKindDouble) && plan->m_aKinds.size() < 4)
+			plan->m_dwFloatMask |= 1 << plan->m_aKinds.size();
+
+		plan->m_aKinds.push_back(eKind);
+		plan->m_aConverters.push_back(lpConverter);
+		plan->m_aReferences.push_back(eReference);
+	}
+	plan->m_dwArguments = static_cast<DWORD>(plan->m_aKinds.size());
+
+	// Return value
+	if (*wsz == L'=') {
+		wsz++;
+		plan->m_eReturn = static_cast<ArgumentKind>(*wsz);
+		if (plan->m_eReturn != ArgumentKindVoid && GetConverter(plan->m_eReturn) == NULL)
+			return E_INVALIDARG;
+		if (*wsz == L'\0' || *(wsz + 1) != L'\0')
+			return E_INVALIDARG;
+	}
+
+	if (plan->m_eReturn == ArgumentKindFloat || plan->m_eReturn == ArgumentKindDouble)
+		plan->m_dwReturnFlag = RETURN_FLT;
+
+	*ppPlan = std::move(plan);
+	return S_OK;
+}
+
+/**
+ * @brief Convert the parameters provided by the client into native arguments.
+ * @param pDispParams List of parameters provided by the client. Must contain exactly m_dwArguments elements.
+ * @param pArguments Array of m_dwArguments arguments, in native order.
+ * @param pScope Scratch memory of the call, must not be released before the native function returns.
+ * @param puArgErr The index within rgvarg of the first argument that has an error, if not NULL.
+ * @return Whether all arguments have been converted.
+*/
+HRESULT STDMETHODCALLTYPE MarshalPlan::Marshal(
+	_In_      DISPPARAMS* pDispParams,
+	_Out_     PArgument   pArguments,
+	_Inout_   ArenaScope* pScope,
+	_Out_opt_ UINT*       puArgErr
+) const {
+	// Arguments are provided by the client in reverse order
+	VARIANT* pVariant = pDispParams->rgvarg + this->m_dwArguments;
+	const ArgumentConverter* lpConverter = this->m_aConverters.data();
+	const ArgumentKind* lpReferences = this->m_aReferences.data();
+
+	for (DWORD cx = 0; cx < this->m_dwArguments; cx++) {
+		pVariant--;
+
+		// VBScript passes variables by reference, which is only kept for the arguments passed by reference
+		BOOL bVariable = V_VT(pVariant) == (VT_VARIANT | VT_BYREF) && lpReferences[cx] == ArgumentKindVoid;
+		VARIANT* pValue = bVariable ? V_VARIANTREF(pVariant) : pVariant;
+		HRESULT hr = lpConverter[cx](pValue, &pArguments[cx], pScope);
+		if (FAILED(hr)) {
+			if (puArgErr)
+				*puArgErr = this->m_dwArguments - cx - 1;
+			return hr == E_OUTOFMEMORY ? hr : DISP_E_TYPEMISMATCH;
+		}
+	}
+	return S_OK;
+}
+
+/**
+ * @brief Write the arguments passed by reference back into the variables of the client.
+ * @param pDispParams List of parameters provided by the client, as given to Marshal.
+ * @param pArguments Array of m_dwArguments arguments, as filled by Marshal.
+*/
+VOID STDMETHODCALLTYPE MarshalPlan::WriteBack(
+	_Inout_ DISPPARAMS*     pDispParams,
+	_In_    const Argument* pArguments
+) const {
+	if (this->m_dwReferences == 0)
+		return;
+
+	// Only references have been given a slot, other values were addresses
+	for (DWORD cx = 0; cx < this->m_dwArguments; cx++) {
+		VARIANT* pVariant = &pDispParams->rgvarg[this->m_dwArguments - cx - 1];
+		if (this->m_aReferences[cx] != ArgumentKindVoid && (V_VT(pVariant) & (VT_BYREF | VT_ARRAY)) == VT_BYREF)
+			MarshalPlan::StoreReference(pVariant, this->m_aReferences[cx], reinterpret_cast<const DWORD64*>(pArguments[cx].lpValue));
+	}
+}
+
+/**
+ * @brief Convert the value returned by the native function into a VARIANT.
+ * @param pResult The value returned by the native function.
+ * @param pVarResult Pointer to the location where the result is to be stored.
+*/
+VOID STDMETHODCALLTYPE MarshalPlan::Unmarshal(
+	_In_  PRESULT  pResult,
+	_Out_ VARIANT* pVarResult
+) const {
+	MarshalPlan::ToVariant(this->m_eReturn, pResult, pVarResult);
+}
+
+/**
+ * @brief Get the size of a type whose values are plain data of a fixed width, which native functions can use in place.
+ * @param vt The type.
+ * @return The size in bytes, or 0 if the values of the type are not plain data.
+*/
+ULONG MarshalPlan::GetFixedWidth(
+	_In_ VARTYPE vt
+) {
+	switch (vt) {
+	case VT_I1:
+	case VT_UI1:
+		return sizeof(BYTE);
+	case VT_I2:
+	case VT_UI2:
+	case VT_BOOL:
+		return sizeof(SHORT);
+	case VT_I4:
+	case VT_UI4:
+	case VT_INT:
+	case VT_UINT:
+	case VT_ERROR:
+	case VT_R4:
+		return sizeof(LONG);
+	case VT_I8:
+	case VT_UI8:
+	case VT_R8:
+	case VT_CY:
+	case VT_DATE:
+		return sizeof(LONGLONG);
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @brief Get the data of an array of fixed-width elements, locked until the scope of the call is destroyed.
+ * @param pVariant The VARIANT provided by the client.
+ * @param pScope Scratch memory of the call.
+ * @param ppvData The address of a variable that receives the address of the first element.
+ * @return S_OK if the data is locked, S_FALSE if the VARIANT is not an array of fixed-width elements.
+*/
+HRESULT STDMETHODCALLTYPE MarshalPlan::LockArray(
+	_In_    VARIANT*    pVariant,
+	_Inout_ ArenaScope* pScope,
+	_Out_   LPVOID*     ppvData
+) {
+	*ppvData = NULL;
+	if ((V_VT(pVariant) & VT_ARRAY) == 0 || MarshalPlan::GetFixedWidth(V_VT(pVariant) & VT_TYPEMASK) == 0)
+		return S_FALSE;
+
+	// VBScript passes array variables by reference, uninitialised arrays are NULL
+	SAFEARRAY* psa = (V_VT(pVariant) & VT_BYREF) ? *pVariant->pparray : V_ARRAY(pVariant);
+	if (psa == NULL)
+		return S_OK;
+
+	HRESULT hr = pScope->LockArray(psa);
+	if (FAILED(hr))
+		return hr;
+	*ppvData = psa->pvData;
+	return S_OK;
+}
+
+/**
+ * @brief Copy a value passed by reference into a slot of the call, whose address is passed to the native function.
+ * @param pReference The VARIANT provided by the client, VT_BYREF.
+ * @param eKind The kind of the value pointed to by the native argument.
+ * @param pScope Scratch memory of the call, which holds the slot.
+ * @param pArgument The argument to pass to the native function.
+ * @return Whether the value could be converted.
+*/
+HRESULT STDMETHODCALLTYPE MarshalPlan::LoadReference(
+	_In_    VARIANT*     pReference,
+	_In_    ArgumentKind eKind,
+	_Inout_ ArenaScope*  pScope,
+	_Out_   PArgument    pArgument
+) {
+	DWORD64* lpSlot = reinterpret_cast<DWORD64*>(pScope->Allocate(sizeof(DWORD64)));
+	if (lpSlot == NULL)
+		return E_OUTOFMEMORY;
+	*lpSlot = 0;
+
+	// Integers are copied as is, as the native function would read them, others are converted
+	VARTYPE vt = V_VT(pReference) & VT_TYPEMASK;
+	if (IsIntegerKind(eKind) && IsIntegerType(vt)) {
+		std::memcpy(lpSlot, V_BYREF(pReference), MarshalPlan::GetFixedWidth(vt));
+	}
+	else {
+		VARIANT var;
+		::VariantInit(&var);
+		if (FAILED(::VariantCopyInd(&var, pReference)))
+			return DISP_E_TYPEMISMATCH;
+
+		Argument value{};
+		HRESULT hr = MarshalPlan::GetConverter(eKind)(&var, &value, nullptr);
+		::VariantClear(&var);
+		if (FAILED(hr))
+			return hr;
+		*lpSlot = value.qwValue;
+	}
+
+	pArgument->dwFlag = ARGUMENT_STD;
+	pArgument->lpValue = lpSlot;
+	return S_OK;
+}
+
+/**
+ * @brief Write a slot filled by the native function back into the value passed by reference.
+ * @param pReference The VARIANT provided by the client, VT_BYREF. Variables receive a value of the kind, typed
+ *                   references keep their type.
+ * @param eKind The kind of the value pointed to by the native argument.
+ * @param lpSlot The slot.
+*/
+VOID STDMETHODCALLTYPE MarshalPlan::StoreReference(
+	_Inout_ VARIANT*       pReference,
+	_In_    ArgumentKind   eKind,
+	_In_    const DWORD64* lpSlot
+) {
+	RESULT value{};
+	value.int64 = static_cast<LONGLONG>(*lpSlot);
+
+	VARTYPE vt = V_VT(pReference) & VT_TYPEMASK;
+	if (vt == VT_VARIANT) {
+		VARIANT* pVariable = V_VARIANTREF(pReference);
+		::VariantClear(pVariable);
+		MarshalPlan::ToVariant(eKind, &value, pVariable);
+		return;
+	}
+
+	// Integers are truncated as the native function would write them, others are converted
+	ULONG ulWidth = MarshalPlan::GetFixedWidth(vt);
+	if (IsIntegerKind(eKind) && IsIntegerType(vt)) {
+		std::memcpy(V_BYREF(pReference), lpSlot, ulWidth);
+		return;
+	}
+
+	VARIANT var;
+	VARIANT converted;
+	MarshalPlan::ToVariant(eKind, &value, &var);
+	::VariantInit(&converted);
+	if (ulWidth != 0 && SUCCEEDED(::VariantChangeType(&converted, &var, 0, vt)))
+		std::memcpy(V_BYREF(pReference), &V_I8(&converted), ulWidth);
+}
+
+/**
+ * @brief Convert a native value into a VARIANT.
+ * @param eKind The kind of the value.
+ * @param pValue The native value.
+ * @param pVariant Pointer to the location where the VARIANT is to be stored.
+*/
+VOID STDMETHODCALLTYPE MarshalPlan::ToVariant(
+	_In_  ArgumentKind eKind,
+	_In_  PRESULT      pValue,
+	_Out_ VARIANT*     pVariant
+) {
+	switch (eKind) {
+	case ArgumentKindInt32:
+		V_VT(pVariant) = VT_I4;
+		V_I4(pVariant) = pValue->lgValue;
+		break;
+	case ArgumentKindInt64:
+		V_VT(pVariant) = VT_I8;
+		V_I8(pVariant) = pValue->int64;
+		break;
+	case ArgumentKindBool:
+		V_VT(pVariant) = VT_BOOL;
+		V_BOOL(pVariant) = pValue->inValue ? VARIANT_TRUE : VARIANT_FALSE;
+		break;
+	case ArgumentKindFloat:
+		V_VT(pVariant) = VT_R4;
+		V_R4(pVariant) = pValue->flValue;
+		break;
+	case ArgumentKindDouble:
+		V_VT(pVariant) = VT_R8;
+		V_R8(pVariant) = pValue->dbValue;
+		break;
+	case ArgumentKindString:
+		V_VT(pVariant) = VT_BSTR;
+		V_BSTR(pVariant) = pValue->lpValue ? ::SysAllocString(reinterpret_cast<LPCWSTR>(pValue->lpValue)) : NULL;
+		break;
+	case ArgumentKindAnsi:
+		V_VT(pVariant) = VT_BSTR;
+		V_BSTR(pVariant) = WidenString(reinterpret_cast<LPCSTR>(pValue->lpValue), CP_ACP);
+		break;
+	case ArgumentKindUtf8:
+		V_VT(pVariant) = VT_BSTR;
+		V_BSTR(pVariant) = WidenString(reinterpret_cast<LPCSTR>(pValue->lpValue), CP_UTF8);
+		break;
+	case ArgumentKindVoid:
+		V_VT(pVariant) = VT_EMPTY;
+		break;
+	default:
+		V_VT(pVariant) = VT_UI8;
+		V_UI8(pVariant) = reinterpret_cast<ULONGLONG>(pValue->lpValue);
+		break;
+	}
+}
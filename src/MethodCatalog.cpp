@@ -0,0 +1,157 @@
+/**
+* @file         MethodCatalog.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Process-wide catalog of dynamic methods definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "MethodCatalog.hpp"
+
+/**
+ * @brief Get the process-wide instance.
+*/
+MethodCatalog& MethodCatalog::Instance(VOID) {
+	static MethodCatalog catalog;
+	return catalog;
+}
+
+/**
+ * @brief Constructor.
+*/
+MethodCatalog::MethodCatalog() { }
+
+/**
+ * @brief Destructor.
+*/
+MethodCatalog::~MethodCatalog() { }
+
+/**
+ * @brief Find a method already published.
+ * @param wszModuleName The normalised name of the module (see ModuleCache::Normalize).
+ * @param wszFunctionName The name of the function, or its ordinal prefixed with '#'.
+ * @param wszSignature The signature of the function, or NULL.
+ * @param pdwIndex The address of a variable that receives the index of the method.
+ * @return Whether the method has been published.
+*/
+HRESULT STDMETHODCALLTYPE MethodCatalog::Find(
+	_In_     LPCWSTR wszModuleName,
+	_In_     LPCWSTR wszFunctionName,
+	_In_opt_ LPCWSTR wszSignature,
+	_Out_    PDWORD  pdwIndex
+) {
+	*pdwIndex = 0;
+	std::wstring wsKey{};
+	try {
+		wsKey = MethodCatalog::Key(wszModuleName, wszFunctionName, wszSignature);
+	}
+	catch (...) {
+		return E_OUTOFMEMORY;
+	}
+
+	::AcquireSRWLockShared(&this->m_Lock);
+	auto it = this->m_Keys.find(wsKey);
+	BOOL bFound = it != this->m_Keys.end();
+	if (bFound)
+		*pdwIndex = it->second;
+	::ReleaseSRWLockShared(&this->m_Lock);
+	return bFound ? S_OK : E_FAIL;
+}
+
+/**
+ * @brief Publish a method, unless the same one has already been published.
+ * @param wszModuleName The normalised name of the module (see ModuleCache::Normalize).
+ * @param wszFunctionName The name of the function, or its ordinal prefixed with '#'.
+ * @param wszSignature The signature of the function, or NULL.
+ * @param pPlan The marshalling plan compiled from the signature, or NULL.
+ * @param lpFunction The address of the function.
+ * @param pdwIndex The address of a variable that receives the index of the method.
+ * @return Whether the method has been published.
+*/
+HRESULT STDMETHODCALLTYPE MethodCatalog::Publish(
+	_In_     LPCWSTR                      wszModuleName,
+	_In_     LPCWSTR                      wszFunctionName,
+	_In_opt_ LPCWSTR                      wszSignature,
+	_In_opt_ std::unique_ptr<MarshalPlan> pPlan,
+	_In_     LPVOID                       lpFunction,
+	_Out_    PDWORD                       pdwIndex
+) {
+	*pdwIndex = 0;
+
+	// Strings and the node of the key are allocated before taking the lock, hence the locked section never throws
+	DynamicMethodInfo info{};
+	KeyIndex::node_type key{};
+	try {
+		info.wsFunctionName.assign(wszFunctionName);
+		info.wsModuleName.assign(wszModuleName);
+		if (pPlan != nullptr)
+			info.wsSignature.assign(wszSignature);
+
+		KeyIndex keys{};
+		key = keys.extract(keys.emplace(MethodCatalog::Key(wszModuleName, wszFunctionName, wszSignature), 0).first);
+	}
+	catch (...) {
+		return E_OUTOFMEMORY;
+	}
+	info.pPlan = std::move(pPlan);
+
+	// Another object may have published the same method meanwhile
+	::AcquireSRWLockExclusive(&this->m_Lock);
+	auto it = this->m_Keys.find(key.key());
+	if (it != this->m_Keys.end()) {
+		*pdwIndex = it->second;
+		::ReleaseSRWLockExclusive(&this->m_Lock);
+		return S_OK;
+	}
+
+	// Buckets are made room for before appending, hence the key is always added once the method is appended
+	HRESULT hr = S_OK;
+	if (this->m_Keys.size() + 1 > this->m_Keys.bucket_count() * this->m_Keys.max_load_factor()) {
+		try {
+			this->m_Keys.reserve(this->m_Keys.size() * 2 + 1);
+		}
+		catch (...) {
+			hr = E_OUTOFMEMORY;
+		}
+	}
+
+	DWORD dwIndex = 0;
+	if (SUCCEEDED(hr))
+		hr = this->m_Methods.Append(lpFunction, &info, &dwIndex);
+	if (SUCCEEDED(hr)) {
+		key.mapped() = dwIndex;
+		this->m_Keys.insert(std::move(key));
+		*pdwIndex = dwIndex;
+	}
+
+	::ReleaseSRWLockExclusive(&this->m_Lock);
+	return hr;
+}
+
+/**
+ * @brief Build the key of a method: module and function separated by '!', then the signature if any.
+*/
+std::wstring MethodCatalog::Key(
+	_In_     LPCWSTR wszModuleName,
+	_In_     LPCWSTR wszFunctionName,
+	_In_opt_ LPCWSTR wszSignature
+) {
+	std::wstring wsKey(wszModuleName);
+	wsKey.push_back(L'!');
+	wsKey.append(wszFunctionName);
+
+	// Names never contain NUL, hence a method without signature never collides with one with an empty signature
+	wsKey.push_back(L'\0');
+	if (wszSignature != nullptr) {
+		wsKey.push_back(L':');
+		wsKey.append(wszSignature);
+	}
+	return wsKey;
+}
@@ -0,0 +1,157 @@
+/**
+* @file         MethodTable.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Append-only table of dynamic methods definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <intrin.h>
+#include <atomic>
+#include <memory>
+#include <new>
+
+#include "MethodTable.hpp"
+
+/**
+ * @brief Constructor.
+*/
+MethodTable::MethodTable() {
+	for (DWORD cx = 0; cx < METHODTABLE_SEGMENTS; cx++) {
+		this->m_aSegments[cx].store(nullptr, std::memory_order_relaxed);
+		this->m_aInfoSegments[cx].store(nullptr, std::memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief Destructor.
+*/
+MethodTable::~MethodTable() {
+	DWORD dwSize = this->m_dwSize.load(std::memory_order_relaxed);
+	for (DWORD cx = 0; cx < dwSize; cx++) {
+		this->Get(cx)->~DynamicMethod();
+		this->GetInfo(cx)->~DynamicMethodInfo();
+	}
+
+	for (DWORD cx = 0; cx < METHODTABLE_SEGMENTS; cx++) {
+		DynamicMethod* aMethods = this->m_aSegments[cx].load(std::memory_order_relaxed);
+		if (aMethods != nullptr)
+			::operator delete(aMethods, std::align_val_t(METHODTABLE_ALIGNMENT));
+		::operator delete(this->m_aInfoSegments[cx].load(std::memory_order_relaxed));
+	}
+}
+
+/**
+ * @brief Append a method to the table. Never throws.
+ * @param lpFunction The address of the function to execute.
+ * @param pInfo The metadata of the method, moved into the table once appended. The type feedback is created by the
+ *        table for methods without marshalling plan.
+ * @param pdwIndex The address of a variable that receives the index of the method, if not NULL.
+ * @return Whether the method has been appended.
+*/
+HRESULT STDMETHODCALLTYPE MethodTable::Append(
+	_In_      LPVOID             lpFunction,
+	_Inout_   PDynamicMethodInfo pInfo,
+	_Out_opt_ PDWORD             pdwIndex
+) {
+	DWORD dwIndex = this->m_dwSize.load(std::memory_order_relaxed);
+	DWORD dwOffset = 0;
+	DWORD dwSegment = MethodTable::Segment(dwIndex, &dwOffset);
+	if (dwSegment >= METHODTABLE_SEGMENTS)
+		return E_OUTOFMEMORY;
+
+	// Allocate both segments on first use, slots are constructed in place
+	DynamicMethod* aMethods = this->m_aSegments[dwSegment].load(std::memory_order_relaxed);
+	PDynamicMethodInfo aInfos = this->m_aInfoSegments[dwSegment].load(std::memory_order_relaxed);
+	if (aMethods == nullptr) {
+		SIZE_T dwCount = static_cast<SIZE_T>(METHODTABLE_FIRST_SEGMENT) << dwSegment;
+		aMethods = static_cast<DynamicMethod*>(::operator new(dwCount * sizeof(DynamicMethod), std::align_val_t(METHODTABLE_ALIGNMENT), std::nothrow));
+		aInfos = static_cast<PDynamicMethodInfo>(::operator new(dwCount * sizeof(DynamicMethodInfo), std::nothrow));
+		if (aMethods == nullptr || aInfos == nullptr) {
+			if (aMethods != nullptr)
+				::operator delete(aMethods, std::align_val_t(METHODTABLE_ALIGNMENT));
+			::operator delete(aInfos);
+			return E_OUTOFMEMORY;
+		}
+
+		this->m_aInfoSegments[dwSegment].store(aInfos, std::memory_order_release);
+		this->m_aSegments[dwSegment].store(aMethods, std::memory_order_release);
+	}
+
+	// Functions without signature learn the types of their arguments
+	if (pInfo->pPlan == nullptr && pInfo->pFeedback == nullptr) {
+		pInfo->pFeedback.reset(new (std::nothrow) TypeFeedback());
+		if (pInfo->pFeedback == nullptr)
+			return E_OUTOFMEMORY;
+	}
+
+	// Write the slots before publishing them, moving the metadata never allocates
+	new (&aInfos[dwOffset]) DynamicMethodInfo(std::move(*pInfo));
+	new (&aMethods[dwOffset]) DynamicMethod(lpFunction, aInfos[dwOffset].pPlan.get(), aInfos[dwOffset].pFeedback.get());
+	this->m_dwSize.store(dwIndex + 1, std::memory_order_release);
+
+	if (pdwIndex)
+		*pdwIndex = dwIndex;
+	return S_OK;
+}
+
+/**
+ * @brief Get a method.
+ * @param dwIndex The index of the method.
+ * @return The method, or NULL if the index is out of range.
+*/
+const DynamicMethod* MethodTable::Get(
+	_In_ DWORD dwIndex
+) const {
+	if (dwIndex >= this->m_dwSize.load(std::memory_order_acquire))
+		return nullptr;
+
+	DWORD dwOffset = 0;
+	DWORD dwSegment = MethodTable::Segment(dwIndex, &dwOffset);
+	return &this->m_aSegments[dwSegment].load(std::memory_order_acquire)[dwOffset];
+}
+
+/**
+ * @brief Get the metadata of a method.
+ * @param dwIndex The index of the method.
+ * @return The metadata, or NULL if the index is out of range.
+*/
+DynamicMethodInfo* MethodTable::GetInfo(
+	_In_ DWORD dwIndex
+) const {
+	if (dwIndex >= this->m_dwSize.load(std::memory_order_acquire))
+		return nullptr;
+
+	DWORD dwOffset = 0;
+	DWORD dwSegment = MethodTable::Segment(dwIndex, &dwOffset);
+	return &this->m_aInfoSegments[dwSegment].load(std::memory_order_acquire)[dwOffset];
+}
+
+/**
+ * @brief Number of methods published.
+*/
+DWORD MethodTable::Size(VOID) const {
+	return this->m_dwSize.load(std::memory_order_acquire);
+}
+
+/**
+ * @brief Find the segment storing a method. Also used by other tables sharing the same layout.
+ * @param dwIndex The index of the method.
+ * @param pdwOffset The address of a variable that receives the index of the method within the segment.
+ * @return The index of the segment.
+*/
+DWORD MethodTable::Segment(
+	_In_  DWORD  dwIndex,
+	_Out_ PDWORD pdwOffset
+) {
+	// Segment n starts at METHODTABLE_FIRST_SEGMENT * (2^n - 1)
+	ULONGLONG qwBucket = (static_cast<ULONGLONG>(dwIndex) / METHODTABLE_FIRST_SEGMENT) + 1;
+	DWORD dwSegment = 0;
+	_BitScanReverse(&dwSegment, static_cast<DWORD>(qwBucket));
+
+	*pdwOffset = static_cast<DWORD>(dwIndex - ((1ULL << dwSegment) - 1) * METHODTABLE_FIRST_SEGMENT);
+	return dwSegment;
+}
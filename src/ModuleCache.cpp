@@ -0,0 +1,266 @@
+/**
+* @file         ModuleCache.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Process-wide module and export resolution cache definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <cstring>
+#include <cwctype>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "ModuleCache.hpp"
+
+#define MODULECACHE_MAX_EXPORT_NAME 0x200 /* Longest export name supported */
+#define MODULECACHE_MAX_FORWARDERS  0x08  /* Longest chain of forwarders followed */
+
+/**
+ * @brief Parse an ordinal name, i.e. '#' followed by decimal digits.
+ * @return Whether the name is an ordinal.
+*/
+static BOOL ParseOrdinal(
+	_In_  LPCSTR szName,
+	_Out_ PDWORD pdwOrdinal
+) {
+	*pdwOrdinal = 0;
+	if (szName[0] != '#' || szName[1] == '\0')
+		return FALSE;
+
+	for (szName++; *szName != '\0'; szName++) {
+		if (*szName < '0' || *szName > '9' || *pdwOrdinal > 0xFFFF)
+			return FALSE;
+		*pdwOrdinal = *pdwOrdinal * 10 + (*szName - '0');
+	}
+	return *pdwOrdinal <= 0xFFFF;
+}
+
+/**
+ * @brief Get the process-wide instance.
+*/
+ModuleCache& ModuleCache::Instance(VOID) {
+	static ModuleCache cache;
+	return cache;
+}
+
+/**
+ * @brief Constructor.
+*/
+ModuleCache::ModuleCache() { }
+
+/**
+ * @brief Destructor. Modules stay loaded until the process exits.
+*/
+ModuleCache::~ModuleCache() {
+	this->m_Indexes.clear();
+	this->m_Exports.clear();
+	this->m_Modules.clear();
+}
+
+/**
+ * @brief Get a module, loading it on first use.
+ * @param wszModuleName The name of the module (e.g. user32.dll).
+ * @param phModule The address of a variable that receives the module handle.
+ * @return Whether the module has been loaded.
+*/
+HRESULT STDMETHODCALLTYPE ModuleCache::GetModule(
+	_In_  LPCWSTR  wszModuleName,
+	_Out_ HMODULE* phModule
+) {
+	*phModule = NULL;
+	std::wstring wsModuleName = ModuleCache::Normalize(wszModuleName);
+
+	// Fast path
+	::AcquireSRWLockShared(&this->m_Lock);
+	auto it = this->m_Modules.find(wsModuleName);
+	if (it != this->m_Modules.end())
+		*phModule = it->second;
+	::ReleaseSRWLockShared(&this->m_Lock);
+	if (*phModule != NULL)
+		return S_OK;
+
+	// Load the module outside of the lock, the loader has its own
+	HMODULE hModule = ::LoadLibraryW(wsModuleName.c_str());
+	if (hModule == NULL)
+		return E_FAIL;
+
+	::AcquireSRWLockExclusive(&this->m_Lock);
+	auto result = this->m_Modules.emplace(wsModuleName, hModule);
+	*phModule = result.first->second;
+	::ReleaseSRWLockExclusive(&this->m_Lock);
+
+	// Another thread loaded it meanwhile
+	if (!result.second)
+		::FreeLibrary(hModule);
+	return S_OK;
+}
+
+/**
+ * @brief Get the address of an exported function, resolving it on first use.
+ * @param wszModuleName The name of the module (e.g. user32.dll).
+ * @param wszFunctionName The name of the function (e.g. MessageBoxW), or its ordinal prefixed with '#' (e.g. #12).
+ * @param ppFunction The address of pointer variable that receives the address of the function.
+ * @return Whether the address of the function has been found.
+*/
+HRESULT STDMETHODCALLTYPE ModuleCache::GetExport(
+	_In_  LPCWSTR wszModuleName,
+	_In_  LPCWSTR wszFunctionName,
+	_Out_ LPVOID* ppFunction
+) {
+	*ppFunction = NULL;
+	if (wszModuleName == NULL || *wszModuleName == L'\0' || wszFunctionName == NULL || *wszFunctionName == L'\0')
+		return E_FAIL;
+
+	std::wstring wsKey = ModuleCache::Normalize(wszModuleName);
+	SIZE_T dwModuleLength = wsKey.size();
+	wsKey.push_back(L'!');
+	wsKey.append(wszFunctionName);
+
+	// Fast path
+	::AcquireSRWLockShared(&this->m_Lock);
+	auto it = this->m_Exports.find(wsKey);
+	if (it != this->m_Exports.end())
+		*ppFunction = it->second;
+	::ReleaseSRWLockShared(&this->m_Lock);
+	if (*ppFunction != NULL)
+		return S_OK;
+
+	// Export names are ASCII
+	CHAR szFunctionName[MODULECACHE_MAX_EXPORT_NAME];
+	SIZE_T cx = 0;
+	for (LPCWSTR wsz = wszFunctionName; *wsz != L'\0'; wsz++, cx++) {
+		if (*wsz >= 0x80 || cx + 1 >= MODULECACHE_MAX_EXPORT_NAME)
+			return E_FAIL;
+		szFunctionName[cx] = static_cast<CHAR>(*wsz);
+	}
+	szFunctionName[cx] = '\0';
+
+	HMODULE hModule = NULL;
+	if (FAILED(this->GetModule(wsKey.substr(0, dwModuleLength).c_str(), &hModule)))
+		return E_FAIL;
+
+	LPVOID lpFunction = NULL;
+	if (FAILED(this->Resolve(hModule, szFunctionName, 0, &lpFunction)))
+		return E_FAIL;
+
+	::AcquireSRWLockExclusive(&this->m_Lock);
+	this->m_Exports.emplace(wsKey, lpFunction);
+	::ReleaseSRWLockExclusive(&this->m_Lock);
+
+	*ppFunction = lpFunction;
+	return S_OK;
+}
+
+/**
+ * @brief Resolve an export of a loaded module, following forwarders.
+ * @param hModule The handle of the module.
+ * @param szFunctionName The name of the function, or its ordinal prefixed with '#'.
+ * @param dwDepth Number of forwarders already followed.
+ * @param ppFunction The address of pointer variable that receives the address of the function.
+ * @return Whether the address of the function has been found.
+*/
+HRESULT STDMETHODCALLTYPE ModuleCache::Resolve(
+	_In_  HMODULE hModule,
+	_In_  LPCSTR  szFunctionName,
+	_In_  DWORD   dwDepth,
+	_Out_ LPVOID* ppFunction
+) {
+	*ppFunction = NULL;
+	DWORD dwOrdinal = 0;
+	BOOL bOrdinal = ParseOrdinal(szFunctionName, &dwOrdinal);
+
+	// Look up the export directory of the module
+	PeExport Export = { 0 };
+	const PeExportIndex* pIndex = this->GetIndex(hModule);
+	HRESULT hr = E_FAIL;
+	if (pIndex != nullptr)
+		hr = bOrdinal ? pIndex->FindOrdinal(dwOrdinal, &Export) : pIndex->FindName(szFunctionName, &Export);
+
+	if (SUCCEEDED(hr) && Export.szForwarder == nullptr) {
+		*ppFunction = reinterpret_cast<LPBYTE>(hModule) + Export.dwRva;
+		return S_OK;
+	}
+
+	// Follow the forwarder: "MODULE.Function" or "MODULE.#Ordinal"
+	if (SUCCEEDED(hr) && dwDepth < MODULECACHE_MAX_FORWARDERS) {
+		LPCSTR szSeparator = ::strrchr(Export.szForwarder, '.');
+		SIZE_T dwModuleLength = szSeparator != nullptr ? static_cast<SIZE_T>(szSeparator - Export.szForwarder) : 0;
+
+		if (dwModuleLength != 0 && szSeparator[1] != '\0') {
+			std::wstring wsModuleName(Export.szForwarder, Export.szForwarder + dwModuleLength);
+			HMODULE hForwarded = NULL;
+			if (SUCCEEDED(this->GetModule(wsModuleName.c_str(), &hForwarded)) && SUCCEEDED(this->Resolve(hForwarded, szSeparator + 1, dwDepth + 1, ppFunction)))
+				return S_OK;
+		}
+	}
+
+	// Let the loader deal with anything the index cannot, e.g. API set forwarders
+	FARPROC lpProcAddress = bOrdinal
+		? ::GetProcAddress(hModule, reinterpret_cast<LPCSTR>(static_cast<ULONG_PTR>(dwOrdinal)))
+		: ::GetProcAddress(hModule, szFunctionName);
+	if (lpProcAddress == nullptr)
+		return E_FAIL;
+
+	*ppFunction = reinterpret_cast<LPVOID>(lpProcAddress);
+	return S_OK;
+}
+
+/**
+ * @brief Get the export index of a loaded module, building it on first use.
+ * @param hModule The handle of the module.
+ * @return The index, or NULL if the export directory could not be parsed.
+*/
+const PeExportIndex* ModuleCache::GetIndex(
+	_In_ HMODULE hModule
+) {
+	const PeExportIndex* pIndex = nullptr;
+
+	// Fast path
+	::AcquireSRWLockShared(&this->m_Lock);
+	auto it = this->m_Indexes.find(hModule);
+	BOOL bFound = it != this->m_Indexes.end();
+	if (bFound)
+		pIndex = it->second.get();
+	::ReleaseSRWLockShared(&this->m_Lock);
+	if (bFound)
+		return pIndex;
+
+	// Parse the image mapped by the loader. Failures are cached as well.
+	const BYTE* lpBase = reinterpret_cast<const BYTE*>(hModule);
+	std::unique_ptr<PeExportIndex> index = std::make_unique<PeExportIndex>();
+	if (FAILED(index->Parse(lpBase, PeExportIndex::ImageSize(lpBase), TRUE)))
+		index.reset();
+
+	::AcquireSRWLockExclusive(&this->m_Lock);
+	auto result = this->m_Indexes.emplace(hModule, std::move(index));
+	pIndex = result.first->second.get();
+	::ReleaseSRWLockExclusive(&this->m_Lock);
+	return pIndex;
+}
+
+/**
+ * @brief Normalise a module name: lower case, with the default ".dll" extension if none is provided.
+ * @param wszModuleName The name of the module.
+ * @return The normalised name.
+*/
+std::wstring ModuleCache::Normalize(
+	_In_ LPCWSTR wszModuleName
+) {
+	std::wstring wsModuleName(wszModuleName);
+	for (WCHAR& wc : wsModuleName)
+		wc = static_cast<WCHAR>(std::towlower(wc));
+
+	// Same rule as LoadLibrary: no extension in the file name means .dll, a trailing dot means no extension
+	SIZE_T dwFileName = wsModuleName.find_last_of(L"\\/");
+	dwFileName = dwFileName == std::wstring::npos ? 0 : dwFileName + 1;
+	SIZE_T dwExtension = wsModuleName.find(L'.', dwFileName);
+	if (dwExtension == std::wstring::npos)
+		wsModuleName.append(L".dll");
+
+	return wsModuleName;
+}
@@ -0,0 +1,284 @@
+/**
+* @file         NameIndex.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Interned name to dispatch ID hash index definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <algorithm>
+#include <atomic>
+#include <cwctype>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "NameIndex.hpp"
+
+#define NAMEINDEX_INITIAL_SIZE 16   /* Initial number of entries, must be a power of two */
+#define NAMEINDEX_FIRST_BLOCK  128  /* Number of characters of the first block of interned names, must be a power of two */
+#define NAMEINDEX_BLOCK_SIZE   4096 /* Largest number of characters per block of interned names, must be a power of two */
+
+/**
+ * @brief Fold a character to lower case. ASCII characters do not go through the CRT.
+*/
+static inline WCHAR FoldCase(WCHAR wc) {
+	if (wc < 0x80)
+		return (wc >= L'A' && wc <= L'Z') ? static_cast<WCHAR>(wc | 0x20) : wc;
+	return static_cast<WCHAR>(std::towlower(wc));
+}
+
+/**
+ * @brief Constructor. The first table is allocated by the first insertion.
+*/
+NameIndex::NameIndex() {}
+
+/**
+ * @brief Destructor.
+*/
+NameIndex::~NameIndex() {
+	this->m_pTable.store(nullptr, std::memory_order_relaxed);
+	this->m_aTables.clear();
+	this->m_aBlocks.clear();
+}
+
+/**
+ * @brief Insert a new name into the index.
+ * @param wszName The name to insert.
+ * @param lDispId The dispatch ID associated to the name.
+ * @param ppwszInterned The address of a pointer variable that receives the interned copy of the name, if not NULL.
+ * @return S_OK if inserted, S_FALSE if the name was already present, error otherwise.
+*/
+HRESULT STDMETHODCALLTYPE NameIndex::Insert(
+	_In_      LPCWSTR  wszName,
+	_In_      DISPID   lDispId,
+	_Out_opt_ LPCWSTR* ppwszInterned
+) {
+	if (wszName == nullptr || *wszName == L'\0')
+		return E_INVALIDARG;
+
+	// Keep the load factor under 50%
+	PNameIndexTable pTable = this->m_pTable.load(std::memory_order_relaxed);
+	if (pTable == nullptr || (this->m_dwEntries + 1) * 2 > pTable->dwMask + 1) {
+		if (!this->Grow())
+			return E_OUTOFMEMORY;
+		pTable = this->m_pTable.load(std::memory_order_relaxed);
+	}
+
+	DWORD dwLength = 0;
+	DWORD dwHash = NameIndex::Hash(wszName, &dwLength);
+
+	// Linear probing
+	for (SIZE_T cx = dwHash & pTable->dwMask; ; cx = (cx + 1) & pTable->dwMask) {
+		NameIndexEntry& entry = pTable->aEntries[cx];
+		LPCWSTR wszEntryName = entry.wszName.load(std::memory_order_relaxed);
+		if (wszEntryName == nullptr) {
+			LPCWSTR wszInterned = this->Intern(wszName, dwLength);
+			if (wszInterned == nullptr)
+				return E_OUTOFMEMORY;
+			entry.dwHash = dwHash;
+			entry.lDispId = lDispId;
+			entry.wszName.store(wszInterned, std::memory_order_release);
+			this->m_dwEntries++;
+
+			if (ppwszInterned)
+				*ppwszInterned = wszInterned;
+			return S_OK;
+		}
+
+		if (entry.dwHash == dwHash && NameIndex::Equals(wszEntryName, wszName)) {
+			if (ppwszInterned)
+				*ppwszInterned = wszEntryName;
+			return S_FALSE;
+		}
+	}
+}
+
+/**
+ * @brief Find the dispatch ID associated to a name.
+ * @param wszName The name to look for.
+ * @param plDispId The address of a variable that receives the dispatch ID.
+ * @return Whether the name has been found.
+*/
+HRESULT STDMETHODCALLTYPE NameIndex::Find(
+	_In_  LPCWSTR wszName,
+	_Out_ DISPID* plDispId
+) const {
+	*plDispId = DISPID_UNKNOWN;
+	if (wszName == nullptr)
+		return E_INVALIDARG;
+
+	DWORD dwLength = 0;
+	DWORD dwHash = NameIndex::Hash(wszName, &dwLength);
+	const NameIndexTable* pTable = this->m_pTable.load(std::memory_order_acquire);
+	if (pTable == nullptr)
+		return DISP_E_UNKNOWNNAME;
+
+	// The name is loaded first, the rest of the entry is visible once the name is
+	for (SIZE_T cx = dwHash & pTable->dwMask; ; cx = (cx + 1) & pTable->dwMask) {
+		const NameIndexEntry& entry = pTable->aEntries[cx];
+		LPCWSTR wszEntryName = entry.wszName.load(std::memory_order_acquire);
+		if (wszEntryName == nullptr)
+			return DISP_E_UNKNOWNNAME;
+
+		if (entry.dwHash == dwHash && NameIndex::Equals(wszEntryName, wszName)) {
+			*plDispId = entry.lDispId;
+			return S_OK;
+		}
+	}
+}
+
+/**
+ * @brief Compute the case-insensitive hash of a name.
+ * @param wszName The name to hash.
+ * @param pdwLength The address of a variable that receives the length of the name, in characters.
+ * @return The FNV-1a hash of the case-folded name.
+*/
+DWORD NameIndex::Hash(
+	_In_  LPCWSTR wszName,
+	_Out_ PDWORD  pdwLength
+) {
+	DWORD dwHash = 0x811C9DC5;
+	LPCWSTR wsz = wszName;
+	for (; *wsz != L'\0'; wsz++) {
+		dwHash ^= FoldCase(*wsz);
+		dwHash *= 0x01000193;
+	}
+
+	*pdwLength = static_cast<DWORD>(wsz - wszName);
+	return dwHash;
+}
+
+/**
+ * @brief Case-insensitive comparison of two names.
+ * @return Whether both names are equal.
+*/
+BOOL NameIndex::Equals(
+	_In_ LPCWSTR wszLeft,
+	_In_ LPCWSTR wszRight
+) {
+	for (; *wszLeft != L'\0'; wszLeft++, wszRight++) {
+		if (*wszLeft != *wszRight && FoldCase(*wszLeft) != FoldCase(*wszRight))
+			return FALSE;
+	}
+	return *wszRight == L'\0';
+}
+
+/**
+ * @brief Copy a name into the storage owned by the index.
+ * @param wszName The name to copy.
+ * @param dwLength The length of the name, in characters.
+ * @return The interned copy of the name, or NULL on failure.
+*/
+LPCWSTR NameIndex::Intern(
+	_In_ LPCWSTR wszName,
+	_In_ DWORD   dwLength
+) {
+	DWORD dwRequired = dwLength + 1;
+
+	// Make room for one more block first, hence adding a block never throws
+	if (this->m_aBlocks.size() == this->m_aBlocks.capacity()) {
+		try {
+			this->m_aBlocks.reserve(this->m_aBlocks.empty() ? 8 : this->m_aBlocks.size() * 2);
+		}
+		catch (...) {
+			return nullptr;
+		}
+	}
+
+	// Names larger than the largest block get their own block, the partially used block stays last
+	if (dwRequired > NAMEINDEX_BLOCK_SIZE) {
+		std::unique_ptr<WCHAR[]> block(new (std::nothrow) WCHAR[dwRequired]);
+		if (!block)
+			return nullptr;
+		WCHAR* wszLarge = block.get();
+		::memcpy(wszLarge, wszName, dwRequired * sizeof(WCHAR));
+
+		this->m_aBlocks.insert(this->m_aBlocks.end() - (this->m_dwBlockAvailable ? 1 : 0), std::move(block));
+		return wszLarge;
+	}
+
+	// Blocks double up to the largest size, hence an index with a few names stays small
+	if (dwRequired > this->m_dwBlockAvailable) {
+		DWORD dwBlockSize = this->m_dwBlockSize == 0 ? NAMEINDEX_FIRST_BLOCK : std::min<DWORD>(this->m_dwBlockSize * 2, NAMEINDEX_BLOCK_SIZE);
+		while (dwBlockSize < dwRequired)
+			dwBlockSize *= 2;
+
+		std::unique_ptr<WCHAR[]> block(new (std::nothrow) WCHAR[dwBlockSize]);
+		if (!block)
+			return nullptr;
+		this->m_aBlocks.push_back(std::move(block));
+		this->m_dwBlockSize = dwBlockSize;
+		this->m_dwBlockAvailable = dwBlockSize;
+	}
+
+	WCHAR* wszInterned = this->m_aBlocks.back().get() + (this->m_dwBlockSize - this->m_dwBlockAvailable);
+	::memcpy(wszInterned, wszName, dwRequired * sizeof(WCHAR));
+	this->m_dwBlockAvailable -= dwRequired;
+	return wszInterned;
+}
+
+/**
+ * @brief Allocate an empty table.
+ * @param dwSize The number of entries, must be a power of two.
+ * @return The table, or NULL on failure.
+*/
+std::unique_ptr<NameIndex::NameIndexTable> NameIndex::CreateTable(
+	_In_ SIZE_T dwSize
+) {
+	std::unique_ptr<NameIndexTable> table(new (std::nothrow) NameIndexTable{ dwSize - 1, nullptr });
+	if (!table)
+		return nullptr;
+
+	table->aEntries.reset(new (std::nothrow) NameIndexEntry[dwSize]);
+	if (!table->aEntries)
+		return nullptr;
+
+	for (SIZE_T cx = 0; cx < dwSize; cx++) {
+		table->aEntries[cx].dwHash = 0;
+		table->aEntries[cx].lDispId = 0;
+		table->aEntries[cx].wszName.store(nullptr, std::memory_order_relaxed);
+	}
+	return table;
+}
+
+/**
+ * @brief Double the size of the table, or allocate the first one, re-insert all entries and publish the new table.
+ * @return Whether the table has grown.
+*/
+BOOL NameIndex::Grow(VOID) {
+	const NameIndexTable* pOld = this->m_pTable.load(std::memory_order_relaxed);
+	std::unique_ptr<NameIndexTable> table = NameIndex::CreateTable(pOld != nullptr ? (pOld->dwMask + 1) * 2 : NAMEINDEX_INITIAL_SIZE);
+	if (!table)
+		return FALSE;
+
+	for (SIZE_T cx = 0; pOld != nullptr && cx <= pOld->dwMask; cx++) {
+		const NameIndexEntry& entry = pOld->aEntries[cx];
+		LPCWSTR wszName = entry.wszName.load(std::memory_order_relaxed);
+		if (wszName == nullptr)
+			continue;
+
+		SIZE_T dwEntry = entry.dwHash & table->dwMask;
+		while (table->aEntries[dwEntry].wszName.load(std::memory_order_relaxed) != nullptr)
+			dwEntry = (dwEntry + 1) & table->dwMask;
+
+		table->aEntries[dwEntry].dwHash = entry.dwHash;
+		table->aEntries[dwEntry].lDispId = entry.lDispId;
+		table->aEntries[dwEntry].wszName.store(wszName, std::memory_order_relaxed);
+	}
+
+	// Lookups still probing the old table keep running on it, hence it is retired rather than freed. The table is owned
+	// by the index before being published, so that a failure never frees a table lookups can see.
+	PNameIndexTable pTable = table.get();
+	try {
+		this->m_aTables.push_back(std::move(table));
+	}
+	catch (...) {
+		return FALSE;
+	}
+	this->m_pTable.store(pTable, std::memory_order_release);
+	return TRUE;
+}
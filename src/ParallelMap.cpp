@@ -0,0 +1,259 @@
+/**
+* @file         ParallelMap.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Execution of a dynamic method over many argument tuples definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+
+#include "ParallelMap.hpp"
+
+/**
+ * @brief Pack a range of calls.
+*/
+static inline ULONGLONG MakeRange(
+	_In_ DWORD dwBegin,
+	_In_ DWORD dwEnd
+) {
+	return (static_cast<ULONGLONG>(dwEnd) << 32) | dwBegin;
+}
+
+/**
+ * @brief Execute the calls.
+ * @param pMethod The method to execute.
+ * @param aArguments The arguments, dwArity per call, each tuple in reverse order as in DISPPARAMS.
+ * @param dwArity The number of arguments per call.
+ * @param dwCalls The number of calls.
+ * @param aResults Array of dwCalls VARIANTs that receives the results, in input order.
+ * @param dwThreads The largest number of threads to use, 1 to execute the calls sequentially on the calling thread.
+ * @param pdwFailed The address of a variable that receives the index of the first call that failed, if any.
+ * @return Whether all calls executed successfully. Calls are abandoned after the first failure.
+*/
+HRESULT STDMETHODCALLTYPE ParallelMap::Run(
+	_In_  const DynamicMethod* pMethod,
+	_In_  VARIANT*             aArguments,
+	_In_  DWORD                dwArity,
+	_In_  DWORD                dwCalls,
+	_Out_ VARIANT*             aResults,
+	_In_  DWORD                dwThreads,
+	_Out_ PDWORD               pdwFailed
+) {
+	*pdwFailed = 0;
+
+	// Small maps are not worth waking a worker
+	DWORD dwParticipants = std::min<DWORD>(dwThreads, PARALLELMAP_MAX_PARTICIPANTS);
+	dwParticipants = std::min<DWORD>(dwParticipants, dwCalls / PARALLELMAP_MIN_CALLS);
+	if (dwParticipants < 2) {
+		for (DWORD cx = 0; cx < dwCalls; cx++) {
+			UINT uArgErr = 0;
+			DISPPARAMS params = { &aArguments[cx * dwArity], NULL, dwArity, 0 };
+			HRESULT hr = pMethod->Invoke(&params, &aResults[cx], &uArgErr);
+			if (FAILED(hr)) {
+				*pdwFailed = cx;
+				return hr;
+			}
+		}
+		return S_OK;
+	}
+
+	ParallelMap* pMap = new (std::nothrow) ParallelMap(pMethod, aArguments, dwArity, aResults, dwCalls, dwParticipants);
+	if (pMap == nullptr || pMap->m_aRanges == nullptr || pMap->m_aHelpers == nullptr) {
+		delete pMap;
+		return E_OUTOFMEMORY;
+	}
+
+	// Helpers that cannot be queued leave their range to be stolen
+	for (DWORD cx = 1; cx < dwParticipants; cx++) {
+		Helper* pHelper = &pMap->m_aHelpers[cx - 1];
+		pHelper->m_pMap = pMap;
+		pHelper->m_dwParticipant = cx;
+		pMap->m_lReferences.fetch_add(1, std::memory_order_relaxed);
+		if (FAILED(WorkerPool::Instance().Submit(pHelper)))
+			pMap->m_lReferences.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	pMap->Work(0);
+	pMap->Wait();
+
+	HRESULT hr = pMap->m_hr;
+	if (FAILED(hr))
+		*pdwFailed = pMap->m_dwFailed;
+	pMap->Release();
+	return hr;
+}
+
+/**
+ * @brief Constructor.
+*/
+ParallelMap::ParallelMap(
+	_In_ const DynamicMethod* pMethod,
+	_In_ VARIANT*             aArguments,
+	_In_ DWORD                dwArity,
+	_In_ VARIANT*             aResults,
+	_In_ DWORD                dwCalls,
+	_In_ DWORD                dwParticipants
+) : m_lPending(static_cast<LONG>(dwCalls)) {
+	this->m_pMethod = pMethod;
+	this->m_aArguments = aArguments;
+	this->m_dwArity = dwArity;
+	this->m_aResults = aResults;
+	this->m_dwParticipants = dwParticipants;
+
+	// About sixteen grains per thread, so that late threads still find something to steal
+	this->m_dwGrain = std::max<DWORD>(1, std::min<DWORD>(dwCalls / (dwParticipants * 16), PARALLELMAP_MAX_GRAIN));
+
+	this->m_aRanges.reset(new (std::nothrow) MapRange[dwParticipants]);
+	this->m_aHelpers.reset(new (std::nothrow) Helper[dwParticipants - 1]);
+	if (this->m_aRanges == nullptr)
+		return;
+
+	// Split the calls evenly between the threads
+	for (DWORD cx = 0; cx < dwParticipants; cx++) {
+		DWORD dwBegin = static_cast<DWORD>((static_cast<ULONGLONG>(dwCalls) * cx) / dwParticipants);
+		DWORD dwEnd = static_cast<DWORD>((static_cast<ULONGLONG>(dwCalls) * (cx + 1)) / dwParticipants);
+		this->m_aRanges[cx].qwRange.store(MakeRange(dwBegin, dwEnd), std::memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief Release a reference, destroying the map when none is left.
+*/
+VOID ParallelMap::Release(VOID) {
+	if (this->m_lReferences.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		delete this;
+}
+
+/**
+ * @brief Execute calls until none is left to take or to steal.
+ * @param dwParticipant The index of the range of the thread.
+*/
+VOID ParallelMap::Work(
+	_In_ DWORD dwParticipant
+) {
+	DWORD dwBegin = 0;
+	DWORD dwEnd = 0;
+	do {
+		while (this->Pop(dwParticipant, &dwBegin, &dwEnd))
+			this->Execute(dwBegin, dwEnd);
+	} while (this->Steal(dwParticipant));
+}
+
+/**
+ * @brief Take a grain of calls from the front of a range.
+ * @return Whether calls have been taken.
+*/
+BOOL ParallelMap::Pop(
+	_In_  DWORD  dwParticipant,
+	_Out_ PDWORD pdwBegin,
+	_Out_ PDWORD pdwEnd
+) {
+	std::atomic<ULONGLONG>& range = this->m_aRanges[dwParticipant].qwRange;
+	ULONGLONG qwRange = range.load(std::memory_order_acquire);
+	for (;;) {
+		DWORD dwBegin = static_cast<DWORD>(qwRange);
+		DWORD dwEnd = static_cast<DWORD>(qwRange >> 32);
+		if (dwBegin >= dwEnd)
+			return FALSE;
+
+		// Thieves shrink the range from the back, hence the compare-exchange
+		DWORD dwNext = std::min<DWORD>(dwBegin + this->m_dwGrain, dwEnd);
+		if (range.compare_exchange_weak(qwRange, MakeRange(dwNext, dwEnd), std::memory_order_acq_rel, std::memory_order_acquire)) {
+			*pdwBegin = dwBegin;
+			*pdwEnd = dwNext;
+			return TRUE;
+		}
+	}
+}
+
+/**
+ * @brief Move the back half of the range of another thread into the range of the thread.
+ * @return Whether calls have been stolen.
+*/
+BOOL ParallelMap::Steal(
+	_In_ DWORD dwParticipant
+) {
+	for (DWORD cx = 1; cx < this->m_dwParticipants; cx++) {
+		std::atomic<ULONGLONG>& victim = this->m_aRanges[(dwParticipant + cx) % this->m_dwParticipants].qwRange;
+		ULONGLONG qwRange = victim.load(std::memory_order_acquire);
+		for (;;) {
+			DWORD dwBegin = static_cast<DWORD>(qwRange);
+			DWORD dwEnd = static_cast<DWORD>(qwRange >> 32);
+			if (dwBegin >= dwEnd)
+				break;
+
+			DWORD dwMiddle = dwBegin + (dwEnd - dwBegin) / 2;
+			if (victim.compare_exchange_weak(qwRange, MakeRange(dwBegin, dwMiddle), std::memory_order_acq_rel, std::memory_order_acquire)) {
+				// The range of the thread is empty, hence nobody else can be updating it
+				this->m_aRanges[dwParticipant].qwRange.store(MakeRange(dwMiddle, dwEnd), std::memory_order_release);
+				return TRUE;
+			}
+		}
+	}
+	return FALSE;
+}
+
+/**
+ * @brief Execute a range of calls and account for them.
+*/
+VOID ParallelMap::Execute(
+	_In_ DWORD dwBegin,
+	_In_ DWORD dwEnd
+) {
+	for (DWORD cx = dwBegin; cx < dwEnd; cx++) {
+		if (this->m_bFailed.load(std::memory_order_relaxed))
+			break;
+
+		UINT uArgErr = 0;
+		DISPPARAMS params = { &this->m_aArguments[cx * this->m_dwArity], NULL, this->m_dwArity, 0 };
+		HRESULT hr = this->m_pMethod->Invoke(&params, &this->m_aResults[cx], &uArgErr);
+		if (FAILED(hr)) {
+			::AcquireSRWLockExclusive(&this->m_Lock);
+			if (cx < this->m_dwFailed) {
+				this->m_dwFailed = cx;
+				this->m_hr = hr;
+			}
+			::ReleaseSRWLockExclusive(&this->m_Lock);
+			this->m_bFailed.store(TRUE, std::memory_order_relaxed);
+		}
+	}
+
+	// Skipped calls are accounted for as well
+	LONG lCalls = static_cast<LONG>(dwEnd - dwBegin);
+	if (this->m_lPending.fetch_sub(lCalls, std::memory_order_acq_rel) == lCalls) {
+		::AcquireSRWLockExclusive(&this->m_Lock);
+		::WakeAllConditionVariable(&this->m_Done);
+		::ReleaseSRWLockExclusive(&this->m_Lock);
+	}
+}
+
+/**
+ * @brief Wait until every call is done.
+*/
+VOID ParallelMap::Wait(VOID) {
+	::AcquireSRWLockExclusive(&this->m_Lock);
+	while (this->m_lPending.load(std::memory_order_acquire) != 0)
+		::SleepConditionVariableSRW(&this->m_Done, &this->m_Lock, INFINITE, 0);
+	::ReleaseSRWLockExclusive(&this->m_Lock);
+}
+
+/**
+ * @brief Run the thread of the helper.
+*/
+VOID ParallelMap::Helper::Execute(VOID) {
+	this->m_pMap->Work(this->m_dwParticipant);
+}
+
+/**
+ * @brief Release the reference held by the helper.
+*/
+VOID ParallelMap::Helper::Detach(VOID) {
+	this->m_pMap->Release();
+}
@@ -0,0 +1,337 @@
+/**
+* @file         PeExportIndex.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        PE export directory index definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <cstring>
+#include <vector>
+
+#include "PeExportIndex.hpp"
+
+#define PE_DOS_SIGNATURE    0x5A4D     /* MZ */
+#define PE_NT_SIGNATURE     0x00004550 /* PE\0\0 */
+#define PE_MAGIC_PE32       0x010B
+#define PE_MAGIC_PE32PLUS   0x020B
+#define PE_SECTION_SIZE     40
+#define PE_EXPORT_DIR_SIZE  40
+#define PE_MAX_EXPORTS      0x100000   /* Sanity limit on the number of functions and names */
+
+/**
+ * @brief Read a little-endian 16-bit value.
+*/
+static inline WORD ReadWord(_In_ const BYTE* lpData) {
+	return static_cast<WORD>(lpData[0] | (lpData[1] << 8));
+}
+
+/**
+ * @brief Read a little-endian 32-bit value.
+*/
+static inline DWORD ReadDword(_In_ const BYTE* lpData) {
+	return static_cast<DWORD>(lpData[0]) | (static_cast<DWORD>(lpData[1]) << 8) | (static_cast<DWORD>(lpData[2]) << 16) | (static_cast<DWORD>(lpData[3]) << 24);
+}
+
+/**
+ * @brief Parse the headers and the export directory of an image.
+ * @param lpBase The address of the image. Must stay valid as long as the index is used.
+ * @param dwSize The size of the image, in bytes.
+ * @param bMapped TRUE if the image has been mapped by the loader, FALSE for raw file bytes.
+ * @return Whether the image has been parsed.
+*/
+HRESULT STDMETHODCALLTYPE PeExportIndex::Parse(
+	_In_ const BYTE* lpBase,
+	_In_ SIZE_T      dwSize,
+	_In_ BOOL        bMapped
+) {
+	this->m_lpBase = lpBase;
+	this->m_dwSize = dwSize;
+	this->m_bMapped = bMapped;
+	this->m_aSections.clear();
+	this->m_aFunctions.clear();
+	this->m_aNames.clear();
+	this->m_dwNames = 0;
+
+	// DOS and NT headers
+	if (lpBase == nullptr || dwSize < 0x40 || ReadWord(lpBase) != PE_DOS_SIGNATURE)
+		return E_INVALIDARG;
+	SIZE_T dwNtHeaders = ReadDword(lpBase + 0x3C);
+	if (dwNtHeaders + 24 > dwSize || ReadDword(lpBase + dwNtHeaders) != PE_NT_SIGNATURE)
+		return E_INVALIDARG;
+
+	DWORD dwSections = ReadWord(lpBase + dwNtHeaders + 6);
+	this->m_dwTimeDateStamp = ReadDword(lpBase + dwNtHeaders + 8);
+	SIZE_T dwOptionalHeaderSize = ReadWord(lpBase + dwNtHeaders + 20);
+	SIZE_T dwOptionalHeader = dwNtHeaders + 24;
+	if (dwOptionalHeader + dwOptionalHeaderSize > dwSize)
+		return E_INVALIDARG;
+
+	// Optional header, data directories are at a different offset for PE32 and PE32+
+	SIZE_T dwDirectories = 0;
+	switch (ReadWord(lpBase + dwOptionalHeader)) {
+	case PE_MAGIC_PE32:     dwDirectories = 96;  break;
+	case PE_MAGIC_PE32PLUS: dwDirectories = 112; break;
+	default:                return E_INVALIDARG;
+	}
+	if (dwDirectories + 8 > dwOptionalHeaderSize || ReadDword(lpBase + dwOptionalHeader + dwDirectories - 4) == 0)
+		return E_INVALIDARG;
+
+	this->m_dwSizeOfImage = ReadDword(lpBase + dwOptionalHeader + 56);
+	this->m_dwCheckSum = ReadDword(lpBase + dwOptionalHeader + 64);
+	this->m_dwExportRva = ReadDword(lpBase + dwOptionalHeader + dwDirectories);
+	this->m_dwExportSize = ReadDword(lpBase + dwOptionalHeader + dwDirectories + 4);
+
+	// Section headers
+	SIZE_T dwSectionHeaders = dwOptionalHeader + dwOptionalHeaderSize;
+	if (dwSectionHeaders + dwSections * PE_SECTION_SIZE > dwSize)
+		return E_INVALIDARG;
+	for (DWORD cx = 0; cx < dwSections; cx++) {
+		const BYTE* lpSection = lpBase + dwSectionHeaders + cx * PE_SECTION_SIZE;
+		this->m_aSections.push_back(ReadDword(lpSection + 12));
+		this->m_aSections.push_back(ReadDword(lpSection + 8));
+		this->m_aSections.push_back(ReadDword(lpSection + 20));
+		this->m_aSections.push_back(ReadDword(lpSection + 16));
+	}
+
+	// Export directory
+	if (this->m_dwExportRva == 0)
+		return E_FAIL;
+	const BYTE* lpDirectory = this->At(this->m_dwExportRva, PE_EXPORT_DIR_SIZE);
+	if (lpDirectory == nullptr)
+		return E_INVALIDARG;
+
+	this->m_dwOrdinalBase = ReadDword(lpDirectory + 16);
+	DWORD dwFunctions = ReadDword(lpDirectory + 20);
+	DWORD dwNames = ReadDword(lpDirectory + 24);
+	if (dwFunctions > PE_MAX_EXPORTS || dwNames > PE_MAX_EXPORTS)
+		return E_INVALIDARG;
+
+	const BYTE* lpFunctions = this->At(ReadDword(lpDirectory + 28), dwFunctions * sizeof(DWORD));
+	const BYTE* lpNames = this->At(ReadDword(lpDirectory + 32), dwNames * sizeof(DWORD));
+	const BYTE* lpOrdinals = this->At(ReadDword(lpDirectory + 36), dwNames * sizeof(WORD));
+	if ((dwFunctions && lpFunctions == nullptr) || (dwNames && (lpNames == nullptr || lpOrdinals == nullptr)))
+		return E_INVALIDARG;
+
+	this->m_aFunctions.resize(dwFunctions);
+	for (DWORD cx = 0; cx < dwFunctions; cx++)
+		this->m_aFunctions[cx] = ReadDword(lpFunctions + cx * sizeof(DWORD));
+
+	// Hash the names, keeping the load factor under 50%
+	SIZE_T dwTable = 16;
+	while (dwTable < dwNames * 2)
+		dwTable <<= 1;
+	this->m_aNames.resize(dwTable, { 0, 0, nullptr });
+	SIZE_T dwMask = dwTable - 1;
+
+	for (DWORD cx = 0; cx < dwNames; cx++) {
+		LPCSTR szName = this->StringAt(ReadDword(lpNames + cx * sizeof(DWORD)));
+		DWORD dwFunction = ReadWord(lpOrdinals + cx * sizeof(WORD));
+		if (szName == nullptr || dwFunction >= dwFunctions)
+			continue;
+
+		DWORD dwHash = PeExportIndex::Hash(szName);
+		SIZE_T dwEntry = dwHash & dwMask;
+		while (this->m_aNames[dwEntry].szName != nullptr && ::strcmp(this->m_aNames[dwEntry].szName, szName) != 0)
+			dwEntry = (dwEntry + 1) & dwMask;
+
+		if (this->m_aNames[dwEntry].szName == nullptr) {
+			this->m_aNames[dwEntry] = { dwHash, dwFunction, szName };
+			this->m_dwNames++;
+		}
+	}
+	return S_OK;
+}
+
+/**
+ * @brief Find an export by name.
+ * @param szName The name of the export, case-sensitive.
+ * @param pExport The address of a variable that receives the export.
+ * @return Whether the export has been found.
+*/
+HRESULT STDMETHODCALLTYPE PeExportIndex::FindName(
+	_In_  LPCSTR    szName,
+	_Out_ PPeExport pExport
+) const {
+	if (this->m_aNames.empty())
+		return E_FAIL;
+
+	DWORD dwHash = PeExportIndex::Hash(szName);
+	SIZE_T dwMask = this->m_aNames.size() - 1;
+	for (SIZE_T cx = dwHash & dwMask; this->m_aNames[cx].szName != nullptr; cx = (cx + 1) & dwMask) {
+		const PeNameEntry& entry = this->m_aNames[cx];
+		if (entry.dwHash == dwHash && ::strcmp(entry.szName, szName) == 0) {
+			this->MakeExport(entry.dwFunction, pExport);
+			return S_OK;
+		}
+	}
+	return E_FAIL;
+}
+
+/**
+ * @brief Find an export by ordinal.
+ * @param dwOrdinal The biased ordinal of the export.
+ * @param pExport The address of a variable that receives the export.
+ * @return Whether the export has been found.
+*/
+HRESULT STDMETHODCALLTYPE PeExportIndex::FindOrdinal(
+	_In_  DWORD     dwOrdinal,
+	_Out_ PPeExport pExport
+) const {
+	DWORD dwFunction = dwOrdinal - this->m_dwOrdinalBase;
+	if (dwOrdinal < this->m_dwOrdinalBase || dwFunction >= this->m_aFunctions.size() || this->m_aFunctions[dwFunction] == 0)
+		return E_FAIL;
+
+	this->MakeExport(dwFunction, pExport);
+	return S_OK;
+}
+
+/**
+ * @brief Get the size of an image mapped by the loader, read from its headers.
+ * @param lpBase The address of the image.
+ * @return The size of the image, or 0 if the headers are not valid.
+*/
+SIZE_T PeExportIndex::ImageSize(
+	_In_ const BYTE* lpBase
+) {
+	if (ReadWord(lpBase) != PE_DOS_SIGNATURE)
+		return 0;
+
+	const BYTE* lpNtHeaders = lpBase + ReadDword(lpBase + 0x3C);
+	if (ReadDword(lpNtHeaders) != PE_NT_SIGNATURE)
+		return 0;
+	return ReadDword(lpNtHeaders + 24 + 56);
+}
+
+/**
+ * @brief Get the identity of an image mapped by the loader, read from its headers without parsing its exports.
+ * @param lpBase The address of the image.
+ * @param pdwTimeDateStamp The address of a variable that receives the time stamp of the image.
+ * @param pdwCheckSum The address of a variable that receives the checksum of the image.
+ * @param pdwSizeOfImage The address of a variable that receives the size of the image once mapped.
+ * @return Whether the headers are valid.
+*/
+HRESULT STDMETHODCALLTYPE PeExportIndex::Identity(
+	_In_  const BYTE* lpBase,
+	_Out_ PDWORD      pdwTimeDateStamp,
+	_Out_ PDWORD      pdwCheckSum,
+	_Out_ PDWORD      pdwSizeOfImage
+) {
+	*pdwTimeDateStamp = 0;
+	*pdwCheckSum = 0;
+	*pdwSizeOfImage = 0;
+	if (ReadWord(lpBase) != PE_DOS_SIGNATURE)
+		return E_INVALIDARG;
+
+	const BYTE* lpNtHeaders = lpBase + ReadDword(lpBase + 0x3C);
+	if (ReadDword(lpNtHeaders) != PE_NT_SIGNATURE)
+		return E_INVALIDARG;
+
+	// Same offsets for PE32 and PE32+
+	*pdwTimeDateStamp = ReadDword(lpNtHeaders + 8);
+	*pdwSizeOfImage = ReadDword(lpNtHeaders + 24 + 56);
+	*pdwCheckSum = ReadDword(lpNtHeaders + 24 + 64);
+	return S_OK;
+}
+
+/**
+ * @brief Translate an RVA into a pointer within the image.
+ * @param dwRva The address of the data, relative to the image base.
+ * @param pdwAvailable The address of a variable that receives the number of bytes readable from the pointer.
+ * @return The address of the data, or NULL if out of bounds.
+*/
+const BYTE* PeExportIndex::Translate(
+	_In_  DWORD   dwRva,
+	_Out_ SIZE_T* pdwAvailable
+) const {
+	*pdwAvailable = 0;
+
+	// Mapped images are laid out by RVA
+	if (this->m_bMapped) {
+		if (dwRva >= this->m_dwSize)
+			return nullptr;
+		*pdwAvailable = this->m_dwSize - dwRva;
+		return this->m_lpBase + dwRva;
+	}
+
+	// Raw files must go through the section table
+	for (SIZE_T cx = 0; cx < this->m_aSections.size(); cx += 4) {
+		DWORD dwVirtualAddress = this->m_aSections[cx];
+		DWORD dwRawOffset = this->m_aSections[cx + 2];
+		DWORD dwRawSize = this->m_aSections[cx + 3];
+		if (dwRva < dwVirtualAddress || dwRva - dwVirtualAddress >= dwRawSize)
+			continue;
+
+		SIZE_T dwOffset = static_cast<SIZE_T>(dwRawOffset) + (dwRva - dwVirtualAddress);
+		if (dwOffset >= this->m_dwSize)
+			return nullptr;
+
+		SIZE_T dwSectionLeft = dwRawSize - (dwRva - dwVirtualAddress);
+		SIZE_T dwFileLeft = this->m_dwSize - dwOffset;
+		*pdwAvailable = dwSectionLeft < dwFileLeft ? dwSectionLeft : dwFileLeft;
+		return this->m_lpBase + dwOffset;
+	}
+	return nullptr;
+}
+
+/**
+ * @brief Get a pointer to data within the image.
+ * @param dwRva The address of the data, relative to the image base.
+ * @param dwSize The number of bytes that must be readable.
+ * @return The address of the data, or NULL if out of bounds.
+*/
+const BYTE* PeExportIndex::At(
+	_In_ DWORD  dwRva,
+	_In_ SIZE_T dwSize
+) const {
+	SIZE_T dwAvailable = 0;
+	const BYTE* lpData = this->Translate(dwRva, &dwAvailable);
+	return (lpData != nullptr && dwSize <= dwAvailable) ? lpData : nullptr;
+}
+
+/**
+ * @brief Get a NUL-terminated string within the image.
+ * @return The string, or NULL if not terminated within the image.
+*/
+LPCSTR PeExportIndex::StringAt(
+	_In_ DWORD dwRva
+) const {
+	SIZE_T dwAvailable = 0;
+	const BYTE* lpData = this->Translate(dwRva, &dwAvailable);
+	if (lpData == nullptr || ::memchr(lpData, 0, dwAvailable) == nullptr)
+		return nullptr;
+	return reinterpret_cast<LPCSTR>(lpData);
+}
+
+/**
+ * @brief Build an export from the index of a function.
+*/
+VOID PeExportIndex::MakeExport(
+	_In_  DWORD     dwFunction,
+	_Out_ PPeExport pExport
+) const {
+	DWORD dwRva = this->m_aFunctions[dwFunction];
+	pExport->dwRva = dwRva;
+	pExport->dwOrdinal = this->m_dwOrdinalBase + dwFunction;
+	pExport->szForwarder = nullptr;
+
+	if (dwRva >= this->m_dwExportRva && dwRva - this->m_dwExportRva < this->m_dwExportSize)
+		pExport->szForwarder = this->StringAt(dwRva);
+}
+
+/**
+ * @brief FNV-1a hash of a name.
+*/
+DWORD PeExportIndex::Hash(
+	_In_ LPCSTR szName
+) {
+	DWORD dwHash = 0x811C9DC5;
+	for (; *szName != '\0'; szName++) {
+		dwHash ^= static_cast<BYTE>(*szName);
+		dwHash *= 0x01000193;
+	}
+	return dwHash;
+}
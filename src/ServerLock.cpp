@@ -0,0 +1,37 @@
+/**
+* @file         ServerLock.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Lock count of the COM server definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <atomic>
+
+#include "ServerLock.hpp"
+
+std::atomic<LONG> ServerLock::s_lLocks{ 0 };
+
+/**
+ * @brief Take a lock on the server.
+*/
+VOID ServerLock::Lock(VOID) {
+	ServerLock::s_lLocks.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Release a lock on the server.
+*/
+VOID ServerLock::Unlock(VOID) {
+	ServerLock::s_lLocks.fetch_sub(1, std::memory_order_release);
+}
+
+/**
+ * @brief Whether no lock is held on the server.
+*/
+BOOL ServerLock::CanUnload(VOID) {
+	return ServerLock::s_lLocks.load(std::memory_order_acquire) == 0;
+}
@@ -0,0 +1,270 @@
+/**
+* @file         StructLayout.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Compiled structure layout definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "StructLayout.hpp"
+
+/**
+ * @brief Size of an element of a given kind, which is also its natural alignment.
+ * @return The size, or 0 if the kind is not valid for a field.
+*/
+static DWORD GetElementSize(
+	_In_ ArgumentKind eKind
+) {
+	switch (eKind) {
+	case ArgumentKindInt8:    return sizeof(CHAR);
+	case ArgumentKindInt16:   return sizeof(SHORT);
+	case ArgumentKindInt32:   return sizeof(LONG);
+	case ArgumentKindBool:    return sizeof(BOOL);
+	case ArgumentKindFloat:   return sizeof(FLOAT);
+	case ArgumentKindInt64:   return sizeof(LONGLONG);
+	case ArgumentKindDouble:  return sizeof(DOUBLE);
+	case ArgumentKindPointer: return sizeof(LPVOID);
+	case ArgumentKindString:  return sizeof(LPVOID);
+	default:                  return 0;
+	}
+}
+
+/**
+ * @brief Skip blank characters.
+*/
+static LPCWSTR SkipBlanks(
+	_In_ LPCWSTR wsz
+) {
+	while (*wsz == L' ' || *wsz == L'\t' || *wsz == L'\r' || *wsz == L'\n')
+		wsz++;
+	return wsz;
+}
+
+/**
+ * @brief Compile a definition into a layout.
+ * @param wszDefinition The definition of the structure.
+ * @param ppLayout The address of a variable that receives the layout.
+ * @return Whether the definition is valid.
+*/
+HRESULT STDMETHODCALLTYPE StructLayout::Compile(
+	_In_  LPCWSTR                        wszDefinition,
+	_Out_ std::unique_ptr<StructLayout>* ppLayout
+) {
+	ppLayout->reset();
+	if (wszDefinition == NULL)
+		return E_INVALIDARG;
+
+	// Compiled within Invoke, hence allocation failures are reported rather than thrown
+	std::unique_ptr<StructLayout> layout(new (std::nothrow) StructLayout());
+	if (!layout)
+		return E_OUTOFMEMORY;
+	DWORD dwOffset = 0;
+
+	LPCWSTR wsz = SkipBlanks(wszDefinition);
+	while (*wsz != L'\0') {
+		// Name
+		LPCWSTR wszName = wsz;
+		while (*wsz != L'\0' && *wsz != L':' && *wsz != L';' && *wsz != L' ' && *wsz != L'\t')
+			wsz++;
+		std::wstring name{};
+		try {
+			name.assign(wszName, static_cast<SIZE_T>(wsz - wszName));
+		}
+		catch (...) {
+			return E_OUTOFMEMORY;
+		}
+		wsz = SkipBlanks(wsz);
+		if (name.empty() || *wsz != L':')
+			return E_INVALIDARG;
+
+		// Kind
+		StructField field{};
+		wsz = SkipBlanks(wsz + 1);
+		field.eKind = static_cast<ArgumentKind>(*wsz);
+		field.dwSize = GetElementSize(field.eKind);
+		if (field.dwSize == 0)
+			return E_INVALIDARG;
+		wsz = SkipBlanks(wsz + 1);
+
+		// Number of elements
+		field.dwCount = 1;
+		if (*wsz == L'[') {
+			field.dwCount = 0;
+			for (wsz = SkipBlanks(wsz + 1); *wsz >= L'0' && *wsz <= L'9' && field.dwCount <= STRUCTLAYOUT_MAX_SIZE; wsz++)
+				field.dwCount = field.dwCount * 10 + (*wsz - L'0');
+			wsz = SkipBlanks(wsz);
+			if (field.dwCount == 0 || field.dwCount > STRUCTLAYOUT_MAX_SIZE || *wsz != L']')
+				return E_INVALIDARG;
+			wsz = SkipBlanks(wsz + 1);
+		}
+
+		if (*wsz == L';')
+			wsz = SkipBlanks(wsz + 1);
+		else if (*wsz != L'\0')
+			return E_INVALIDARG;
+
+		// Natural alignment
+		dwOffset = (dwOffset + field.dwSize - 1) & ~(field.dwSize - 1);
+		if (static_cast<ULONGLONG>(dwOffset) + static_cast<ULONGLONG>(field.dwSize) * field.dwCount > STRUCTLAYOUT_MAX_SIZE)
+			return E_INVALIDARG;
+		field.dwOffset = dwOffset;
+		field.dwElement = layout->m_dwElements;
+		dwOffset += field.dwSize * field.dwCount;
+		layout->m_dwElements += field.dwCount;
+		if (field.dwSize > layout->m_dwAlignment)
+			layout->m_dwAlignment = field.dwSize;
+
+		// Names are unique
+		HRESULT hr = layout->m_Names.Insert(name.c_str(), static_cast<DISPID>(layout->m_aFields.size()), &field.wszName);
+		if (hr != S_OK)
+			return FAILED(hr) ? hr : E_INVALIDARG;
+		try {
+			layout->m_aFields.push_back(field);
+		}
+		catch (...) {
+			return E_OUTOFMEMORY;
+		}
+	}
+
+	if (layout->m_aFields.empty())
+		return E_INVALIDARG;
+
+	// Trailing padding, so that arrays of the structure keep every element aligned
+	layout->m_dwSize = (dwOffset + layout->m_dwAlignment - 1) & ~(layout->m_dwAlignment - 1);
+	*ppLayout = std::move(layout);
+	return S_OK;
+}
+
+/**
+ * @brief Get a field by name.
+ * @param wszName The case-insensitive name of the field.
+ * @return The field, or NULL if the structure has no such field.
+*/
+const StructField* StructLayout::Find(
+	_In_ LPCWSTR wszName
+) const {
+	DISPID lIndex = DISPID_UNKNOWN;
+	if (wszName == NULL || FAILED(this->m_Names.Find(wszName, &lIndex)))
+		return NULL;
+	return &this->m_aFields[static_cast<SIZE_T>(lIndex)];
+}
+
+/**
+ * @brief Write a structure. Padding is zeroed.
+ * @param lpBuffer The address of the structure, m_dwSize bytes.
+ * @param aValues The value of every element, m_dwElements values in field order.
+ * @param pdwFailed The address of a variable that receives the index of the element that could not be converted.
+ * @return Whether every element has been converted.
+*/
+HRESULT STDMETHODCALLTYPE StructLayout::Pack(
+	_Out_ LPVOID   lpBuffer,
+	_In_  VARIANT* aValues,
+	_Out_ PDWORD   pdwFailed
+) const {
+	*pdwFailed = 0;
+	std::memset(lpBuffer, 0, this->m_dwSize);
+
+	for (const StructField& field : this->m_aFields) {
+		for (DWORD cx = 0; cx < field.dwCount; cx++) {
+			HRESULT hr = StructLayout::PackElement(&field, cx, &aValues[field.dwElement + cx], reinterpret_cast<PBYTE>(lpBuffer));
+			if (FAILED(hr)) {
+				*pdwFailed = field.dwElement + cx;
+				return hr;
+			}
+		}
+	}
+	return S_OK;
+}
+
+/**
+ * @brief Read a structure.
+ * @param lpBuffer The address of the structure, m_dwSize bytes.
+ * @param aValues Array of m_dwElements VARIANTs that receives the value of every element in field order.
+*/
+VOID STDMETHODCALLTYPE StructLayout::Unpack(
+	_In_  LPCVOID  lpBuffer,
+	_Out_ VARIANT* aValues
+) const {
+	for (const StructField& field : this->m_aFields) {
+		for (DWORD cx = 0; cx < field.dwCount; cx++)
+			StructLayout::UnpackElement(&field, cx, reinterpret_cast<const BYTE*>(lpBuffer), &aValues[field.dwElement + cx]);
+	}
+}
+
+/**
+ * @brief Write an element of a field.
+ * @param pField The field.
+ * @param dwIndex The index of the element within the field.
+ * @param pValue The value of the element. Strings are written as pointers, hence must be provided as addresses.
+ * @param lpBuffer The address of the structure.
+ * @return Whether the value could be converted.
+*/
+HRESULT STDMETHODCALLTYPE StructLayout::PackElement(
+	_In_ const StructField* pField,
+	_In_ DWORD              dwIndex,
+	_In_ VARIANT*           pValue,
+	_In_ PBYTE              lpBuffer
+) {
+	// The client strings do not outlive the call, narrow integers are truncated
+	ArgumentKind eKind = pField->eKind;
+	if (eKind == ArgumentKindString)
+		eKind = ArgumentKindPointer;
+	else if (eKind == ArgumentKindInt8 || eKind == ArgumentKindInt16)
+		eKind = ArgumentKindInt32;
+
+	// VBScript passes variables by reference
+	if (V_VT(pValue) == (VT_VARIANT | VT_BYREF))
+		pValue = V_VARIANTREF(pValue);
+
+	Argument argument{};
+	if (FAILED(MarshalPlan::GetConverter(eKind)(pValue, &argument, nullptr)))
+		return DISP_E_TYPEMISMATCH;
+
+	// Values are little-endian, the element is the low part of the argument
+	std::memcpy(lpBuffer + pField->dwOffset + dwIndex * pField->dwSize, &argument.qwValue, pField->dwSize);
+	return S_OK;
+}
+
+/**
+ * @brief Read an element of a field.
+ * @param pField The field.
+ * @param dwIndex The index of the element within the field.
+ * @param lpBuffer The address of the structure.
+ * @param pValue Pointer to the location where the value is to be stored.
+*/
+VOID STDMETHODCALLTYPE StructLayout::UnpackElement(
+	_In_  const StructField* pField,
+	_In_  DWORD              dwIndex,
+	_In_  const BYTE*        lpBuffer,
+	_Out_ VARIANT*           pValue
+) {
+	const BYTE* lpElement = lpBuffer + pField->dwOffset + dwIndex * pField->dwSize;
+	RESULT value{};
+	ArgumentKind eKind = pField->eKind;
+
+	// Narrow integers are sign-extended
+	if (eKind == ArgumentKindInt8) {
+		value.lgValue = *reinterpret_cast<const signed char*>(lpElement);
+		eKind = ArgumentKindInt32;
+	}
+	else if (eKind == ArgumentKindInt16) {
+		SHORT sValue = 0;
+		std::memcpy(&sValue, lpElement, sizeof(SHORT));
+		value.lgValue = sValue;
+		eKind = ArgumentKindInt32;
+	}
+	else {
+		std::memcpy(&value, lpElement, pField->dwSize);
+	}
+
+	MarshalPlan::ToVariant(eKind, &value, pValue);
+}
@@ -0,0 +1,100 @@
+/**
+* @file         ThreadArena.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Per-thread bump allocator definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "ThreadArena.hpp"
+
+#define ARENA_ALIGNMENT 0x10 /* Alignment of every allocation */
+
+std::atomic<ULONGLONG> ThreadArena::s_qwHeapAllocations{ 0 };
+
+/**
+ * @brief Get the arena of the calling thread.
+*/
+ThreadArena& ThreadArena::Current(VOID) {
+	thread_local ThreadArena arena;
+	return arena;
+}
+
+/**
+ * @brief Allocate memory from the arena.
+ * @param dwSize The number of bytes to allocate.
+ * @return The address of the memory, 16-byte aligned, or NULL on failure.
+*/
+LPVOID ThreadArena::Allocate(
+	_In_ SIZE_T dwSize
+) {
+	dwSize = (dwSize + ARENA_ALIGNMENT - 1) & ~static_cast<SIZE_T>(ARENA_ALIGNMENT - 1);
+
+	// Move to the next block large enough, allocating a new one if required
+	while (this->m_dwBlock >= this->m_aBlocks.size() || this->m_dwOffset + dwSize > this->m_aBlocks[this->m_dwBlock].dwSize) {
+		if (this->m_dwBlock < this->m_aBlocks.size() && this->m_dwOffset != 0) {
+			this->m_dwBlock++;
+			this->m_dwOffset = 0;
+			continue;
+		}
+
+		if (this->m_dwBlock >= this->m_aBlocks.size()) {
+			SIZE_T dwBlockSize = dwSize > ARENA_BLOCK_SIZE ? dwSize : ARENA_BLOCK_SIZE;
+			std::unique_ptr<BYTE[]> lpBase(new (std::nothrow) BYTE[dwBlockSize + ARENA_ALIGNMENT]);
+			if (!lpBase)
+				return NULL;
+
+			// Callers run within Invoke, hence a failure is reported rather than thrown
+			try {
+				this->m_aBlocks.push_back({ std::move(lpBase), dwBlockSize });
+			}
+			catch (...) {
+				return NULL;
+			}
+			s_qwHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+
+		// Empty block too small for this allocation
+		this->m_dwBlock++;
+	}
+
+	// Blocks are over-allocated to align the first allocation
+	ArenaBlock& block = this->m_aBlocks[this->m_dwBlock];
+	ULONG_PTR lpAligned = (reinterpret_cast<ULONG_PTR>(block.lpBase.get()) + ARENA_ALIGNMENT - 1) & ~static_cast<ULONG_PTR>(ARENA_ALIGNMENT - 1);
+	LPVOID lpMemory = reinterpret_cast<LPVOID>(lpAligned + this->m_dwOffset);
+	this->m_dwOffset += dwSize;
+	return lpMemory;
+}
+
+/**
+ * @brief Get the current position in the arena.
+*/
+ArenaMark ThreadArena::Mark(VOID) const {
+	return { this->m_dwBlock, this->m_dwOffset };
+}
+
+/**
+ * @brief Release everything allocated since a given position.
+*/
+VOID ThreadArena::Release(
+	_In_ ArenaMark Mark
+) {
+	this->m_dwBlock = Mark.dwBlock;
+	this->m_dwOffset = Mark.dwOffset;
+}
+
+/**
+ * @brief Number of blocks allocated from the heap by all the arenas of the process.
+*/
+ULONGLONG ThreadArena::HeapAllocations(VOID) {
+	return s_qwHeapAllocations.load(std::memory_order_relaxed);
+}
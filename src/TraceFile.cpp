@@ -0,0 +1,293 @@
+/**
+* @file         TraceFile.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Call trace file definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <string>
+#include <vector>
+
+#include "TraceFile.hpp"
+
+#define TRACEFILE_HEADER_SIZE 16 /* Magic, version, size of a record, reserved */
+#define TRACEFILE_BLOCK_SIZE  8  /* Tag, size of the content */
+
+/**
+ * @brief Read a little-endian 16-bit value.
+*/
+static inline WORD ReadWord(_In_ const BYTE* lpData) {
+	return static_cast<WORD>(lpData[0] | (lpData[1] << 8));
+}
+
+/**
+ * @brief Read a little-endian 32-bit value.
+*/
+static inline DWORD ReadDword(_In_ const BYTE* lpData) {
+	return static_cast<DWORD>(lpData[0]) | (static_cast<DWORD>(lpData[1]) << 8) | (static_cast<DWORD>(lpData[2]) << 16) | (static_cast<DWORD>(lpData[3]) << 24);
+}
+
+/**
+ * @brief Read a little-endian 64-bit value.
+*/
+static inline ULONGLONG ReadQword(_In_ const BYTE* lpData) {
+	return static_cast<ULONGLONG>(ReadDword(lpData)) | (static_cast<ULONGLONG>(ReadDword(lpData + 4)) << 32);
+}
+
+/**
+ * @brief Append a little-endian value of any width.
+*/
+static inline VOID WriteValue(_Inout_ std::vector<BYTE>* pData, _In_ ULONGLONG qwValue, _In_ DWORD dwSize) {
+	for (DWORD cx = 0; cx < dwSize; cx++)
+		pData->push_back(static_cast<BYTE>(qwValue >> (cx * 8)));
+}
+
+/**
+ * @brief Append a string as UTF-16, prefixed by its length in characters.
+*/
+static VOID WriteString(_Inout_ std::vector<BYTE>* pData, _In_ const std::wstring& wsString) {
+	WriteValue(pData, wsString.size(), sizeof(DWORD));
+	for (WCHAR wc : wsString)
+		WriteValue(pData, static_cast<WORD>(wc), sizeof(WORD));
+}
+
+/**
+ * @brief Read a string written by WriteString.
+ * @param ppData The address of the cursor, moved past the string.
+ * @param lpEnd The end of the block.
+ * @return Whether the string lies within the block.
+*/
+static BOOL ReadString(_Inout_ const BYTE** ppData, _In_ const BYTE* lpEnd, _Out_ std::wstring* pString) {
+	pString->clear();
+	if (static_cast<SIZE_T>(lpEnd - *ppData) < sizeof(DWORD))
+		return FALSE;
+	SIZE_T dwLength = ReadDword(*ppData);
+	*ppData += sizeof(DWORD);
+	if (static_cast<SIZE_T>(lpEnd - *ppData) / sizeof(WORD) < dwLength)
+		return FALSE;
+
+	pString->resize(dwLength);
+	for (SIZE_T cx = 0; cx < dwLength; cx++)
+		(*pString)[cx] = static_cast<WCHAR>(ReadWord(*ppData + cx * sizeof(WORD)));
+	*ppData += dwLength * sizeof(WORD);
+	return TRUE;
+}
+
+/**
+ * @brief Append the header of a file.
+ * @param pData The content of the file.
+*/
+VOID TraceFile::WriteHeader(
+	_Inout_ std::vector<BYTE>* pData
+) {
+	WriteValue(pData, TRACEFILE_MAGIC, sizeof(DWORD));
+	WriteValue(pData, TRACEFILE_VERSION, sizeof(DWORD));
+	WriteValue(pData, TRACEFILE_RECORD_SIZE, sizeof(DWORD));
+	WriteValue(pData, 0, sizeof(DWORD));
+}
+
+/**
+ * @brief Append the description of a method.
+ * @param pMethod The method.
+ * @param pData The content of the file.
+*/
+VOID TraceFile::WriteMethod(
+	_In_    const TraceMethod* pMethod,
+	_Inout_ std::vector<BYTE>* pData
+) {
+	std::vector<BYTE> block{};
+	WriteValue(&block, pMethod->dwMethod, sizeof(DWORD));
+	WriteValue(&block, pMethod->bSignature ? 1 : 0, sizeof(DWORD));
+	WriteString(&block, pMethod->wsModuleName);
+	WriteString(&block, pMethod->wsFunctionName);
+	WriteString(&block, pMethod->wsSignature);
+
+	WriteValue(pData, TRACEFILE_BLOCK_METHOD, sizeof(DWORD));
+	WriteValue(pData, block.size(), sizeof(DWORD));
+	pData->insert(pData->end(), block.begin(), block.end());
+}
+
+/**
+ * @brief Append a block of records.
+ * @param aRecords The records.
+ * @param dwRecords The number of records.
+ * @param pData The content of the file.
+*/
+VOID TraceFile::WriteRecords(
+	_In_    const TraceRecord* aRecords,
+	_In_    DWORD              dwRecords,
+	_Inout_ std::vector<BYTE>* pData
+) {
+	WriteValue(pData, TRACEFILE_BLOCK_RECORDS, sizeof(DWORD));
+	WriteValue(pData, sizeof(DWORD) + static_cast<ULONGLONG>(dwRecords) * TRACEFILE_RECORD_SIZE, sizeof(DWORD));
+	WriteValue(pData, dwRecords, sizeof(DWORD));
+
+	// Field by field, hence the file does not depend on the layout of the structure
+	pData->reserve(pData->size() + static_cast<SIZE_T>(dwRecords) * TRACEFILE_RECORD_SIZE);
+	for (DWORD cx = 0; cx < dwRecords; cx++) {
+		const TraceRecord& record = aRecords[cx];
+		WriteValue(pData, record.qwTimestamp, sizeof(ULONGLONG));
+		WriteValue(pData, record.qwDuration, sizeof(ULONGLONG));
+		WriteValue(pData, record.qwReturn, sizeof(ULONGLONG));
+		WriteValue(pData, record.dwThreadId, sizeof(DWORD));
+		WriteValue(pData, static_cast<DWORD>(record.lDispId), sizeof(DWORD));
+		WriteValue(pData, record.dwMethod, sizeof(DWORD));
+		WriteValue(pData, static_cast<DWORD>(record.hr), sizeof(DWORD));
+		WriteValue(pData, record.wArguments, sizeof(WORD));
+		WriteValue(pData, record.vtReturn, sizeof(WORD));
+		for (VARTYPE vt : record.aTypes)
+			WriteValue(pData, vt, sizeof(WORD));
+		WriteValue(pData, 0, sizeof(DWORD));
+		for (ULONGLONG qwWord : record.aWords)
+			WriteValue(pData, qwWord, sizeof(ULONGLONG));
+	}
+}
+
+/**
+ * @brief Append the end block.
+ * @param qwRecords The number of records written.
+ * @param qwDropped The number of records dropped.
+ * @param pData The content of the file.
+*/
+VOID TraceFile::WriteEnd(
+	_In_    ULONGLONG          qwRecords,
+	_In_    ULONGLONG          qwDropped,
+	_Inout_ std::vector<BYTE>* pData
+) {
+	WriteValue(pData, TRACEFILE_BLOCK_END, sizeof(DWORD));
+	WriteValue(pData, 2 * sizeof(ULONGLONG), sizeof(DWORD));
+	WriteValue(pData, qwRecords, sizeof(ULONGLONG));
+	WriteValue(pData, qwDropped, sizeof(ULONGLONG));
+}
+
+/**
+ * @brief Parse a call trace file. Every field is read with bounds checking, hence untrusted files can be parsed.
+ * @param lpData The content of the file.
+ * @param dwSize The size of the file, in bytes.
+ * @return S_OK if the trace is complete, S_FALSE if it has been cut short, in which case the blocks before the cut are
+ *         kept, or an error if the file is not a call trace.
+*/
+HRESULT STDMETHODCALLTYPE TraceFile::Parse(
+	_In_ const BYTE* lpData,
+	_In_ SIZE_T      dwSize
+) {
+	this->m_aMethods.clear();
+	this->m_aRecords.clear();
+	this->m_bComplete = FALSE;
+	this->m_qwDropped = 0;
+
+	// Header
+	if (lpData == nullptr || dwSize < TRACEFILE_HEADER_SIZE || ReadDword(lpData) != TRACEFILE_MAGIC)
+		return E_INVALIDARG;
+	if (ReadDword(lpData + 4) != TRACEFILE_VERSION || ReadDword(lpData + 8) != TRACEFILE_RECORD_SIZE)
+		return E_INVALIDARG;
+
+	// Blocks, up to the end block or the first block cut short
+	SIZE_T dwOffset = TRACEFILE_HEADER_SIZE;
+	while (dwOffset < dwSize && !this->m_bComplete) {
+		if (dwSize - dwOffset < TRACEFILE_BLOCK_SIZE)
+			return S_FALSE;
+		DWORD dwTag = ReadDword(lpData + dwOffset);
+		SIZE_T dwBlock = ReadDword(lpData + dwOffset + 4);
+		dwOffset += TRACEFILE_BLOCK_SIZE;
+		if (dwSize - dwOffset < dwBlock)
+			return S_FALSE;
+
+		const BYTE* lpBlock = lpData + dwOffset;
+		dwOffset += dwBlock;
+		switch (dwTag) {
+		case TRACEFILE_BLOCK_METHOD:
+			if (!this->ParseMethod(lpBlock, dwBlock))
+				return E_INVALIDARG;
+			break;
+		case TRACEFILE_BLOCK_RECORDS:
+			if (!this->ParseRecords(lpBlock, dwBlock))
+				return E_INVALIDARG;
+			break;
+		case TRACEFILE_BLOCK_END:
+			if (dwBlock != 2 * sizeof(ULONGLONG))
+				return E_INVALIDARG;
+			this->m_qwDropped = ReadQword(lpBlock + sizeof(ULONGLONG));
+			this->m_bComplete = TRUE;
+			break;
+		}
+	}
+	return this->m_bComplete ? S_OK : S_FALSE;
+}
+
+/**
+ * @brief Find the description of a method.
+ * @param dwMethod The index of the method in the catalog.
+ * @return The method, or NULL if it has not been described.
+*/
+const TraceMethod* TraceFile::FindMethod(
+	_In_ DWORD dwMethod
+) const {
+	for (const TraceMethod& method : this->m_aMethods) {
+		if (method.dwMethod == dwMethod)
+			return &method;
+	}
+	return nullptr;
+}
+
+/**
+ * @brief Parse the content of a method block.
+*/
+BOOL TraceFile::ParseMethod(
+	_In_ const BYTE* lpBlock,
+	_In_ SIZE_T      dwSize
+) {
+	if (dwSize < 2 * sizeof(DWORD))
+		return FALSE;
+
+	TraceMethod method{};
+	method.dwMethod = ReadDword(lpBlock);
+	method.bSignature = ReadDword(lpBlock + 4) != 0;
+
+	const BYTE* lpCursor = lpBlock + 2 * sizeof(DWORD);
+	const BYTE* lpEnd = lpBlock + dwSize;
+	if (!ReadString(&lpCursor, lpEnd, &method.wsModuleName) || !ReadString(&lpCursor, lpEnd, &method.wsFunctionName) || !ReadString(&lpCursor, lpEnd, &method.wsSignature))
+		return FALSE;
+	this->m_aMethods.push_back(std::move(method));
+	return TRUE;
+}
+
+/**
+ * @brief Parse the content of a records block.
+*/
+BOOL TraceFile::ParseRecords(
+	_In_ const BYTE* lpBlock,
+	_In_ SIZE_T      dwSize
+) {
+	if (dwSize < sizeof(DWORD))
+		return FALSE;
+	SIZE_T dwRecords = ReadDword(lpBlock);
+	if (dwSize - sizeof(DWORD) != dwRecords * TRACEFILE_RECORD_SIZE)
+		return FALSE;
+
+	SIZE_T dwFirst = this->m_aRecords.size();
+	this->m_aRecords.resize(dwFirst + dwRecords);
+	for (SIZE_T cx = 0; cx < dwRecords; cx++) {
+		const BYTE* lpRecord = lpBlock + sizeof(DWORD) + cx * TRACEFILE_RECORD_SIZE;
+		TraceRecord& record = this->m_aRecords[dwFirst + cx];
+		record.qwTimestamp = ReadQword(lpRecord);
+		record.qwDuration = ReadQword(lpRecord + 8);
+		record.qwReturn = ReadQword(lpRecord + 16);
+		record.dwThreadId = ReadDword(lpRecord + 24);
+		record.lDispId = static_cast<DISPID>(ReadDword(lpRecord + 28));
+		record.dwMethod = ReadDword(lpRecord + 32);
+		record.hr = static_cast<HRESULT>(ReadDword(lpRecord + 36));
+		record.wArguments = ReadWord(lpRecord + 40);
+		record.vtReturn = ReadWord(lpRecord + 42);
+		for (DWORD dx = 0; dx < TRACEFILE_ARGUMENTS; dx++)
+			record.aTypes[dx] = ReadWord(lpRecord + 44 + dx * sizeof(WORD));
+		record.dwReserved = 0;
+		for (DWORD dx = 0; dx < TRACEFILE_ARGUMENTS; dx++)
+			record.aWords[dx] = ReadQword(lpRecord + 64 + dx * sizeof(ULONGLONG));
+	}
+	return TRUE;
+}
@@ -0,0 +1,104 @@
+/**
+* @file         TypeFeedback.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Type feedback of the dynamic methods definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <atomic>
+#include <new>
+
+#include "TypeFeedback.hpp"
+
+/**
+ * @brief Constructor.
+*/
+TypeFeedback::TypeFeedback() {
+	for (auto& slot : this->m_aShapes)
+		slot.store(nullptr, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Destructor.
+*/
+TypeFeedback::~TypeFeedback() {
+	for (auto& slot : this->m_aShapes)
+		delete slot.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Compute the key of the arguments provided by the client.
+ * @param pDispParams List of parameters provided by the client.
+ * @return The key, or TYPEFEEDBACK_NO_KEY if there are too many arguments or some of them are references or arrays.
+*/
+ULONGLONG TypeFeedback::Key(
+	_In_ const DISPPARAMS* pDispParams
+) {
+	if (pDispParams->cArgs > TYPEFEEDBACK_ARGUMENTS)
+		return TYPEFEEDBACK_NO_KEY;
+
+	ULONGLONG qwKey = 0;
+	for (UINT cx = 0; cx < pDispParams->cArgs; cx++) {
+		const VARIANT* pVariant = &pDispParams->rgvarg[cx];
+		if (V_VT(pVariant) == (VT_VARIANT | VT_BYREF))
+			pVariant = V_VARIANTREF(pVariant);
+
+		// Flags are above the first byte, hence references and arrays never fit
+		if (V_VT(pVariant) > 0xFF)
+			return TYPEFEEDBACK_NO_KEY;
+		qwKey |= static_cast<ULONGLONG>(V_VT(pVariant)) << (cx * 8);
+	}
+	return qwKey;
+}
+
+/**
+ * @brief Record the shape of a call that went through the generic path. Nothing is recorded once every slot is used.
+ * @param pDispParams List of parameters provided by the client.
+ * @param qwKey The key of the arguments, not TYPEFEEDBACK_NO_KEY.
+*/
+VOID TypeFeedback::Record(
+	_In_ const DISPPARAMS* pDispParams,
+	_In_ ULONGLONG         qwKey
+) {
+	// Calls of further shapes keep going through the generic path
+	if (this->m_aShapes[TYPEFEEDBACK_SHAPES - 1].load(std::memory_order_acquire) != nullptr)
+		return;
+
+	// Shape of the arguments, the float mask is in argument order whereas rgvarg is reversed
+	PFeedbackShape pShape = new (std::nothrow) FeedbackShape{ qwKey, pDispParams->cArgs, NULL, {} };
+	if (pShape == nullptr)
+		return;
+
+	DWORD dwFloatMask = 0;
+	for (UINT cx = 0; cx < pDispParams->cArgs; cx++) {
+		pShape->aOperations[cx] = TypeFeedback::GetOperation(static_cast<VARTYPE>((qwKey >> (cx * 8)) & 0xFF));
+		DWORD dwArgument = pDispParams->cArgs - cx - 1;
+		if (pShape->aOperations[cx] == FeedbackCopyFloat && dwArgument < THUNK_REGISTERS)
+			dwFloatMask |= 1 << dwArgument;
+	}
+	pShape->lpThunk = CallThunkCache::Instance().Get(pDispParams->cArgs, dwFloatMask, RETURN_STD);
+
+	// First free slot, unless another thread recorded the same shape in the meantime
+	for (auto& slot : this->m_aShapes) {
+		const FeedbackShape* pExpected = nullptr;
+		if (slot.compare_exchange_strong(pExpected, pShape, std::memory_order_release, std::memory_order_acquire))
+			return;
+		if (pExpected->qwKey == qwKey && pExpected->dwArguments == pShape->dwArguments)
+			break;
+	}
+	delete pShape;
+}
+
+/**
+ * @brief Number of shapes recorded.
+*/
+DWORD TypeFeedback::Size(VOID) const {
+	DWORD dwShapes = 0;
+	while (dwShapes < TYPEFEEDBACK_SHAPES && this->m_aShapes[dwShapes].load(std::memory_order_acquire) != nullptr)
+		dwShapes++;
+	return dwShapes;
+}
@@ -9,7 +9,22 @@
 * @copyright	This project has been released under the GNU Public License v3 license.
 */
 #include <windows.h>
+#include <cstring>
 #include "Util.hpp"
+#include "MarshalPlan.hpp"
+
+/**
+ * @brief Set a boolean result, if the client expects one.
+*/
+static VOID SetBoolResult(
+    _Out_ VARIANT* pVarResult,
+    _In_  BOOL     bValue
+) {
+    if (pVarResult != NULL) {
+        V_VT(pVarResult) = VT_BOOL;
+        V_BOOL(pVarResult) = bValue ? VARIANT_TRUE : VARIANT_FALSE;
+    }
+}
 
 /**
  * @brief Write a byte at a given location.
@@ -46,3 +61,355 @@ HRESULT STDMETHODCALLTYPE Util::WriteByte(
 
     return S_OK;
 }
+
+/**
+ * @brief Write a buffer at a given location.
+ * @details Parameters are the data (array of bytes or BSTR), the address and the offset. The number of bytes written is returned.
+ * @param pDispParams Pointer to a DISPPARAMS structure containing an array of arguments provided by the client.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE Util::WriteBytes(
+    _In_  DISPPARAMS* pDispParams,
+    _Out_ VARIANT*    pVarResult
+) {
+    // Check number of arguments
+    if (pDispParams->cArgs != 3) {
+        SetBoolResult(pVarResult, FALSE);
+        return E_FAIL;
+    }
+
+    // Get parameters
+    ULONGLONG qwAddress = 0;
+    ULONGLONG qwOffset = 0;
+    if (FAILED(Util::GetInteger(&pDispParams->rgvarg[1], &qwAddress)) || FAILED(Util::GetInteger(&pDispParams->rgvarg[0], &qwOffset)))
+        return DISP_E_TYPEMISMATCH;
+    PBYTE lpAddress = reinterpret_cast<PBYTE>(qwAddress + qwOffset);
+
+    VARIANT* pData = &pDispParams->rgvarg[2];
+    if (V_VT(pData) == (VT_VARIANT | VT_BYREF))
+        pData = V_VARIANTREF(pData);
+
+    // Copy the data
+    ULONG ulBytes = 0;
+    if (V_VT(pData) == VT_BSTR) {
+        ulBytes = ::SysStringByteLen(V_BSTR(pData));
+        ::memcpy(lpAddress, V_BSTR(pData), ulBytes);
+    }
+    else if (V_VT(pData) == (VT_ARRAY | VT_UI1) || V_VT(pData) == (VT_ARRAY | VT_I1)) {
+        SAFEARRAY* psa = V_ARRAY(pData);
+        if (psa == NULL || ::SafeArrayGetDim(psa) != 1)
+            return DISP_E_TYPEMISMATCH;
+
+        LPVOID lpData = NULL;
+        if (FAILED(::SafeArrayAccessData(psa, &lpData)))
+            return E_FAIL;
+        ulBytes = psa->rgsabound[0].cElements;
+        ::memcpy(lpAddress, lpData, ulBytes);
+        ::SafeArrayUnaccessData(psa);
+    }
+    else {
+        return DISP_E_TYPEMISMATCH;
+    }
+
+    if (pVarResult != NULL) {
+        V_VT(pVarResult) = VT_I4;
+        V_I4(pVarResult) = static_cast<LONG>(ulBytes);
+    }
+    return S_OK;
+}
+
+/**
+ * @brief Read a buffer from a given location.
+ * @details Parameters are the address, the offset and the number of bytes. An array of bytes is returned.
+ * @param pDispParams Pointer to a DISPPARAMS structure containing an array of arguments provided by the client.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE Util::ReadBytes(
+    _In_  DISPPARAMS* pDispParams,
+    _Out_ VARIANT*    pVarResult
+) {
+    // Check number of arguments
+    if (pDispParams->cArgs != 3 || pVarResult == NULL)
+        return E_FAIL;
+
+    // Get parameters
+    ULONGLONG qwAddress = 0;
+    ULONGLONG qwOffset = 0;
+    ULONGLONG qwBytes = 0;
+    if (FAILED(Util::GetInteger(&pDispParams->rgvarg[2], &qwAddress)) || FAILED(Util::GetInteger(&pDispParams->rgvarg[1], &qwOffset)) || FAILED(Util::GetInteger(&pDispParams->rgvarg[0], &qwBytes)))
+        return DISP_E_TYPEMISMATCH;
+    if (qwBytes > MAXLONG)
+        return E_INVALIDARG;
+
+    // Copy into a new array of bytes
+    SAFEARRAY* psa = ::SafeArrayCreateVector(VT_UI1, 0, static_cast<ULONG>(qwBytes));
+    if (psa == NULL)
+        return E_OUTOFMEMORY;
+
+    LPVOID lpData = NULL;
+    if (FAILED(::SafeArrayAccessData(psa, &lpData))) {
+        ::SafeArrayDestroy(psa);
+        return E_FAIL;
+    }
+    ::memcpy(lpData, reinterpret_cast<LPCVOID>(qwAddress + qwOffset), static_cast<SIZE_T>(qwBytes));
+    ::SafeArrayUnaccessData(psa);
+
+    V_VT(pVarResult) = VT_ARRAY | VT_UI1;
+    V_ARRAY(pVarResult) = psa;
+    return S_OK;
+}
+
+/**
+ * @brief Copy memory from one location to another. Both locations may overlap.
+ * @details Parameters are the destination, the source and the number of bytes.
+ * @param pDispParams Pointer to a DISPPARAMS structure containing an array of arguments provided by the client.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE Util::CopyBytes(
+    _In_  DISPPARAMS* pDispParams,
+    _Out_ VARIANT*    pVarResult
+) {
+    // Check number of arguments
+    if (pDispParams->cArgs != 3) {
+        SetBoolResult(pVarResult, FALSE);
+        return E_FAIL;
+    }
+
+    // Get parameters
+    ULONGLONG qwDestination = 0;
+    ULONGLONG qwSource = 0;
+    ULONGLONG qwBytes = 0;
+    if (FAILED(Util::GetInteger(&pDispParams->rgvarg[2], &qwDestination)) || FAILED(Util::GetInteger(&pDispParams->rgvarg[1], &qwSource)) || FAILED(Util::GetInteger(&pDispParams->rgvarg[0], &qwBytes)))
+        return DISP_E_TYPEMISMATCH;
+
+    ::memmove(reinterpret_cast<LPVOID>(qwDestination), reinterpret_cast<LPCVOID>(qwSource), static_cast<SIZE_T>(qwBytes));
+    SetBoolResult(pVarResult, TRUE);
+    return S_OK;
+}
+
+/**
+ * @brief Fill memory with a byte.
+ * @details Parameters are the destination, the byte and the number of bytes.
+ * @param pDispParams Pointer to a DISPPARAMS structure containing an array of arguments provided by the client.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE Util::FillBytes(
+    _In_  DISPPARAMS* pDispParams,
+    _Out_ VARIANT*    pVarResult
+) {
+    // Check number of arguments
+    if (pDispParams->cArgs != 3) {
+        SetBoolResult(pVarResult, FALSE);
+        return E_FAIL;
+    }
+
+    // Get parameters
+    ULONGLONG qwDestination = 0;
+    ULONGLONG qwValue = 0;
+    ULONGLONG qwBytes = 0;
+    if (FAILED(Util::GetInteger(&pDispParams->rgvarg[2], &qwDestination)) || FAILED(Util::GetInteger(&pDispParams->rgvarg[1], &qwValue)) || FAILED(Util::GetInteger(&pDispParams->rgvarg[0], &qwBytes)))
+        return DISP_E_TYPEMISMATCH;
+
+    ::memset(reinterpret_cast<LPVOID>(qwDestination), static_cast<BYTE>(qwValue), static_cast<SIZE_T>(qwBytes));
+    SetBoolResult(pVarResult, TRUE);
+    return S_OK;
+}
+
+/**
+ * @brief Create an array aliasing native memory, without copying it.
+ * @details Parameters are the address, the number of elements and optionally the type of the elements, VT_UI1 by
+ *          default. The memory must outlive the array. Copies of the array made by the script engine are regular arrays.
+ * @param pDispParams Pointer to a DISPPARAMS structure containing an array of arguments provided by the client.
+ * @param pVarResult Pointer to the location where the result is to be stored, or NULL if the caller expects no result.
+ * @return Whether the function executed successfully.
+*/
+HRESULT STDMETHODCALLTYPE Util::CreateView(
+    _In_  DISPPARAMS* pDispParams,
+    _Out_ VARIANT*    pVarResult
+) {
+    // Check number of arguments
+    if (pDispParams->cArgs < 2 || pDispParams->cArgs > 3 || pVarResult == NULL)
+        return E_FAIL;
+
+    // Get parameters
+    ULONGLONG qwAddress = 0;
+    ULONGLONG qwElements = 0;
+    ULONGLONG qwType = VT_UI1;
+    if (FAILED(Util::GetInteger(&pDispParams->rgvarg[pDispParams->cArgs - 1], &qwAddress)) || FAILED(Util::GetInteger(&pDispParams->rgvarg[pDispParams->cArgs - 2], &qwElements)))
+        return DISP_E_TYPEMISMATCH;
+    if (pDispParams->cArgs == 3 && FAILED(Util::GetInteger(&pDispParams->rgvarg[0], &qwType)))
+        return DISP_E_TYPEMISMATCH;
+    if (qwElements > MAXLONG || (qwAddress == 0 && qwElements != 0) || qwType > VT_TYPEMASK || MarshalPlan::GetFixedWidth(static_cast<VARTYPE>(qwType)) == 0)
+        return E_INVALIDARG;
+
+    SAFEARRAY* psa = NULL;
+    HRESULT hr = ::SafeArrayAllocDescriptorEx(static_cast<VARTYPE>(qwType), 1, &psa);
+    if (FAILED(hr))
+        return hr;
+
+    // Static arrays are destroyed without releasing their data, and cannot be resized
+    psa->fFeatures |= FADF_STATIC | FADF_FIXEDSIZE;
+    psa->rgsabound[0].cElements = static_cast<ULONG>(qwElements);
+    psa->rgsabound[0].lLbound = 0;
+    psa->pvData = reinterpret_cast<PVOID>(qwAddress);
+
+    V_VT(pVarResult) = VT_ARRAY | static_cast<VARTYPE>(qwType);
+    V_ARRAY(pVarResult) = psa;
+    return S_OK;
+}
+
+/**
+ * @brief Get the integer value of a VARIANT, e.g. an address or a size.
+ * @param pVariant The VARIANT provided by the client. References are followed.
+ * @param pqwValue The address of a variable that receives the value.
+ * @return Whether the VARIANT could be converted.
+*/
+HRESULT STDMETHODCALLTYPE Util::GetInteger(
+    _In_  VARIANT*   pVariant,
+    _Out_ ULONGLONG* pqwValue
+) {
+    if (V_VT(pVariant) == (VT_VARIANT | VT_BYREF))
+        pVariant = V_VARIANTREF(pVariant);
+
+    switch (V_VT(pVariant)) {
+    case VT_I8:
+    case VT_UI8:
+        *pqwValue = V_UI8(pVariant);
+        return S_OK;
+    case VT_I4:
+    case VT_INT:
+        *pqwValue = static_cast<ULONGLONG>(static_cast<LONGLONG>(V_I4(pVariant)));
+        return S_OK;
+    case VT_NULL:
+    case VT_EMPTY:
+        *pqwValue = 0;
+        return S_OK;
+    }
+
+    VARIANT var;
+    ::VariantInit(&var);
+    if (FAILED(::VariantChangeType(&var, pVariant, 0, VT_I8)))
+        return DISP_E_TYPEMISMATCH;
+    *pqwValue = static_cast<ULONGLONG>(V_I8(&var));
+    return S_OK;
+}
+
+/**
+ * @brief Get a property of a script object.
+*/
+static HRESULT GetProperty(
+    _In_  IDispatch* pDispatch,
+    _In_  LPCWSTR    wszName,
+    _Out_ VARIANT*   pVarResult
+) {
+    DISPID lDispId = DISPID_UNKNOWN;
+    LPOLESTR wszNames[] = { const_cast<LPOLESTR>(wszName) };
+    HRESULT hr = pDispatch->GetIDsOfNames(IID_NULL, wszNames, 1, LOCALE_USER_DEFAULT, &lDispId);
+    if (FAILED(hr))
+        return hr;
+
+    DISPPARAMS params = { NULL, NULL, 0, 0 };
+    return pDispatch->Invoke(lDispId, IID_NULL, LOCALE_USER_DEFAULT, DISPATCH_PROPERTYGET, &params, pVarResult, NULL, NULL);
+}
+
+/**
+ * @brief Get the number of elements of an array provided by the client.
+ * @details Both one-dimensional SAFEARRAY and script array objects, through their "length" property, are supported.
+ * @param pArray The VARIANT provided by the client. References are followed.
+ * @param plLength The address of a variable that receives the number of elements.
+ * @return Whether the VARIANT is an array.
+*/
+HRESULT STDMETHODCALLTYPE Util::GetArrayLength(
+    _In_  VARIANT* pArray,
+    _Out_ LONG*    plLength
+) {
+    *plLength = 0;
+    if (V_VT(pArray) == (VT_VARIANT | VT_BYREF))
+        pArray = V_VARIANTREF(pArray);
+
+    if ((V_VT(pArray) & VT_ARRAY) != 0 && (V_VT(pArray) & VT_BYREF) == 0) {
+        SAFEARRAY* psa = V_ARRAY(pArray);
+        if (psa == NULL || ::SafeArrayGetDim(psa) != 1)
+            return DISP_E_TYPEMISMATCH;
+        *plLength = static_cast<LONG>(psa->rgsabound[0].cElements);
+        return S_OK;
+    }
+
+    if (V_VT(pArray) == VT_DISPATCH && V_DISPATCH(pArray) != NULL) {
+        VARIANT var;
+        ::VariantInit(&var);
+        ULONGLONG qwLength = 0;
+        HRESULT hr = GetProperty(V_DISPATCH(pArray), L"length", &var);
+        if (SUCCEEDED(hr))
+            hr = Util::GetInteger(&var, &qwLength);
+        ::VariantClear(&var);
+        if (FAILED(hr) || qwLength > MAXLONG)
+            return DISP_E_TYPEMISMATCH;
+
+        *plLength = static_cast<LONG>(qwLength);
+        return S_OK;
+    }
+    return DISP_E_TYPEMISMATCH;
+}
+
+/**
+ * @brief Get an element of an array provided by the client.
+ * @param pArray The VARIANT provided by the client. References are followed.
+ * @param lIndex The zero-based index of the element.
+ * @param pElement The address of a VARIANT that receives a copy of the element. Must be cleared by the caller.
+ * @return Whether the element has been retrieved.
+*/
+HRESULT STDMETHODCALLTYPE Util::GetArrayElement(
+    _In_  VARIANT* pArray,
+    _In_  LONG     lIndex,
+    _Out_ VARIANT* pElement
+) {
+    ::VariantInit(pElement);
+    if (V_VT(pArray) == (VT_VARIANT | VT_BYREF))
+        pArray = V_VARIANTREF(pArray);
+
+    // Script array objects expose their elements as properties named after the index
+    if (V_VT(pArray) == VT_DISPATCH && V_DISPATCH(pArray) != NULL) {
+        WCHAR wszIndex[12] = { 0 };
+        SIZE_T cx = ARRAYSIZE(wszIndex) - 1;
+        ULONG ulIndex = static_cast<ULONG>(lIndex);
+        do {
+            wszIndex[--cx] = static_cast<WCHAR>(L'0' + ulIndex % 10);
+            ulIndex /= 10;
+        } while (ulIndex != 0);
+        return GetProperty(V_DISPATCH(pArray), &wszIndex[cx], pElement);
+    }
+
+    if ((V_VT(pArray) & VT_ARRAY) == 0 || (V_VT(pArray) & VT_BYREF) != 0 || V_ARRAY(pArray) == NULL)
+        return DISP_E_TYPEMISMATCH;
+
+    SAFEARRAY* psa = V_ARRAY(pArray);
+    LONG lElement = psa->rgsabound[0].lLbound + lIndex;
+    switch (V_VT(pArray) & VT_TYPEMASK) {
+    case VT_VARIANT:
+        return ::SafeArrayGetElement(psa, &lElement, pElement);
+    case VT_BSTR:
+        V_VT(pElement) = VT_BSTR;
+        V_BSTR(pElement) = NULL;
+        return ::SafeArrayGetElement(psa, &lElement, &V_BSTR(pElement));
+    case VT_I4:
+    case VT_INT:
+        V_VT(pElement) = VT_I4;
+        return ::SafeArrayGetElement(psa, &lElement, &V_I4(pElement));
+    case VT_UI4:
+    case VT_UINT:
+        V_VT(pElement) = VT_UI4;
+        return ::SafeArrayGetElement(psa, &lElement, &V_UI4(pElement));
+    case VT_UI1:
+        V_VT(pElement) = VT_UI1;
+        return ::SafeArrayGetElement(psa, &lElement, &V_UI1(pElement));
+    case VT_I1:
+        V_VT(pElement) = VT_I1;
+        return ::SafeArrayGetElement(psa, &lElement, &V_I1(pElement));
+    }
+    return DISP_E_TYPEMISMATCH;
+}
@@ -0,0 +1,166 @@
+/**
+* @file         WorkerPool.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Process-wide pool of native worker threads definition.
+* @details
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+
+#include "WorkerPool.hpp"
+
+/**
+ * @brief Get the process-wide instance.
+*/
+WorkerPool& WorkerPool::Instance(VOID) {
+	static WorkerPool pool;
+	return pool;
+}
+
+/**
+ * @brief Constructor.
+*/
+WorkerPool::WorkerPool() { }
+
+/**
+ * @brief Queue a task.
+ * @param pTask The task. Detach is called once the task has been executed.
+ * @return Whether the task has been queued.
+*/
+HRESULT STDMETHODCALLTYPE WorkerPool::Submit(
+	_In_ WorkerTask* pTask
+) {
+	// Start a new worker only if every existing one is already busy. The lock is released before reporting a failure
+	::AcquireSRWLockExclusive(&this->m_Lock);
+	try {
+		this->m_Queue.push_back(pTask);
+	}
+	catch (...) {
+		::ReleaseSRWLockExclusive(&this->m_Lock);
+		return E_OUTOFMEMORY;
+	}
+	BOOL bSpawn = this->m_Queue.size() > this->m_dwIdle && this->m_dwThreads < WORKERPOOL_MAX_THREADS;
+	if (bSpawn)
+		this->m_dwThreads++;
+	else
+		::WakeConditionVariable(&this->m_TaskQueued);
+	::ReleaseSRWLockExclusive(&this->m_Lock);
+	if (!bSpawn)
+		return S_OK;
+
+	// The worker holds a reference to the module until it exits
+	HMODULE hModule = NULL;
+	if (::GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, reinterpret_cast<LPCWSTR>(&WorkerPool::WorkerThread), &hModule)) {
+		HANDLE hThread = ::CreateThread(NULL, 0, &WorkerPool::WorkerThread, hModule, 0, NULL);
+		if (hThread != NULL) {
+			::CloseHandle(hThread);
+			return S_OK;
+		}
+		::FreeLibrary(hModule);
+	}
+	HRESULT hr = HRESULT_FROM_WIN32(::GetLastError());
+
+	// Existing workers will pick the task up eventually, otherwise nobody will
+	::AcquireSRWLockExclusive(&this->m_Lock);
+	this->m_dwThreads--;
+	if (this->m_dwThreads == 0) {
+		this->m_Queue.erase(std::find(this->m_Queue.begin(), this->m_Queue.end(), pTask));
+		::ReleaseSRWLockExclusive(&this->m_Lock);
+		return FAILED(hr) ? hr : E_FAIL;
+	}
+	::ReleaseSRWLockExclusive(&this->m_Lock);
+	return S_OK;
+}
+
+/**
+ * @brief Wait until one of the tasks has been executed.
+ * @param apTasks The tasks.
+ * @param dwTasks The number of tasks.
+ * @param dwMilliseconds The time-out interval, in milliseconds, or INFINITE.
+ * @param pdwIndex The address of a variable that receives the index of the first task done.
+ * @return S_OK if a task is done, S_FALSE if the time-out interval elapsed.
+*/
+HRESULT STDMETHODCALLTYPE WorkerPool::WaitAny(
+	_In_  WorkerTask* const* apTasks,
+	_In_  DWORD              dwTasks,
+	_In_  DWORD              dwMilliseconds,
+	_Out_ PDWORD             pdwIndex
+) {
+	*pdwIndex = 0;
+	ULONGLONG qwDeadline = ::GetTickCount64() + dwMilliseconds;
+
+	// Tasks are marked as done under the lock, hence no completion can be missed between the check and the sleep
+	::AcquireSRWLockExclusive(&this->m_Lock);
+	for (;;) {
+		for (DWORD cx = 0; cx < dwTasks; cx++) {
+			if (apTasks[cx]->IsDone()) {
+				::ReleaseSRWLockExclusive(&this->m_Lock);
+				*pdwIndex = cx;
+				return S_OK;
+			}
+		}
+
+		DWORD dwWait = INFINITE;
+		if (dwMilliseconds != INFINITE) {
+			ULONGLONG qwNow = ::GetTickCount64();
+			if (qwNow >= qwDeadline)
+				break;
+			dwWait = static_cast<DWORD>(qwDeadline - qwNow);
+		}
+		::SleepConditionVariableSRW(&this->m_TaskDone, &this->m_Lock, dwWait, 0);
+	}
+	::ReleaseSRWLockExclusive(&this->m_Lock);
+	return S_FALSE;
+}
+
+/**
+ * @brief Entry point of the worker threads.
+ * @param lpParameter The module handle referenced for the thread.
+*/
+DWORD WINAPI WorkerPool::WorkerThread(
+	_In_ LPVOID lpParameter
+) {
+	WorkerPool::Instance().Work();
+	::FreeLibraryAndExitThread(reinterpret_cast<HMODULE>(lpParameter), 0);
+	return 0;
+}
+
+/**
+ * @brief Execute tasks until the thread has been idle for too long.
+*/
+VOID WorkerPool::Work(VOID) {
+	::AcquireSRWLockExclusive(&this->m_Lock);
+	for (;;) {
+		this->m_dwIdle++;
+		BOOL bSignalled = TRUE;
+		while (this->m_Queue.empty() && bSignalled)
+			bSignalled = ::SleepConditionVariableSRW(&this->m_TaskQueued, &this->m_Lock, WORKERPOOL_IDLE_TIMEOUT, 0);
+		this->m_dwIdle--;
+		if (this->m_Queue.empty())
+			break;
+
+		WorkerTask* pTask = this->m_Queue.front();
+		this->m_Queue.pop_front();
+		::ReleaseSRWLockExclusive(&this->m_Lock);
+
+		pTask->Execute();
+
+		::AcquireSRWLockExclusive(&this->m_Lock);
+		pTask->m_bDone.store(TRUE, std::memory_order_release);
+		::WakeAllConditionVariable(&this->m_TaskDone);
+		::ReleaseSRWLockExclusive(&this->m_Lock);
+
+		// The last reference may be the one of the pool
+		pTask->Detach();
+		::AcquireSRWLockExclusive(&this->m_Lock);
+	}
+
+	this->m_dwThreads--;
+	::ReleaseSRWLockExclusive(&this->m_Lock);
+}
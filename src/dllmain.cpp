@@ -12,6 +12,8 @@
 #include <memory>
 
 #include "CDynamicWrapperEx.hpp"
+#include "IDynamicWrapperEx.hpp"
+#include "ServerLock.hpp"
 
 /**
  * @brief Dynamic-Link Library entry point.
@@ -40,6 +42,11 @@ BOOL STDMETHODCALLTYPE DllMain(
  * @return Whether the module can be unloaded.
 */
 HRESULT STDMETHODCALLTYPE DllCanUnloadNow(VOID) {
+	if (!ServerLock::CanUnload())
+		return S_FALSE;
+
+	// Released objects kept for the next instances are not locking the server
+	IDynamicWrapperEx::DrainPool();
 	return S_OK;
 }
 
@@ -70,11 +77,6 @@ HRESULT STDMETHODCALLTYPE DllGetClassObject(REFCLSID rclsid, REFIID riid, LPVOID
 	if (!IsEqualGUID(rclsid, CLSID_CDynamicWrapperEx))
 		return CLASS_E_CLASSNOTAVAILABLE;
 	
-	CDynamicWrapperEx* pClassFactory = new CDynamicWrapperEx;
-	if (pClassFactory == nullptr)
-		return E_OUTOFMEMORY;
-
-	HRESULT hr = pClassFactory->QueryInterface(riid, ppv);
-	pClassFactory->Release();
-	return hr;
+	// The class factory is shared by every caller
+	return CDynamicWrapperEx::Instance().QueryInterface(riid, ppv);
 }
\ No newline at end of file
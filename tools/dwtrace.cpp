@@ -0,0 +1,525 @@
+/**
+* @file         dwtrace.cpp
+* @date         01-10-2020
+* @author       Paul Laine (@am0nsec)
+* @version      1.0
+* @brief        Decoder and replayer of the call traces written by DwTrace.
+* @details      Builds on Linux with GCC or Clang against the shim in bench/shim, see TraceFile.hpp for the format. A trace
+*               is decoded into text or CSV, one line per call sorted by time stamp, or its calls are replayed through
+*               the marshalling and call path of the DLL against a stub target, to measure them on a real workload. The
+*               replay results are written to stdout as JSON lines, as the benchmarks. Run with --help for the commands.
+* @link         https://github.com/am0nsec/DynamicWrapperEx
+* @copyright    This project has been released under the GNU Public License v3 license.
+*/
+#include <windows.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "types.hpp"
+#include "MarshalPlan.hpp"
+#include "CallThunk.hpp"
+#include "DynamicMethod.hpp"
+#include "TraceFile.hpp"
+
+#define DWTRACE_ITERATIONS 10 /* Default number of passes over the calls when replaying */
+
+/**
+ * @brief Replay of the calls of a method.
+*/
+typedef struct _ReplayMethod {
+	const TraceMethod*             pTrace;     /* Description of the method in the trace */
+	std::unique_ptr<MarshalPlan>   pPlan;      /* Compiled signature, NULL if registered without signature */
+	std::unique_ptr<TypeFeedback>  pFeedback;  /* Type feedback, methods without signature only */
+	std::unique_ptr<DynamicMethod> pMethod;    /* Method calling the stub target, NULL if it cannot be replayed */
+	std::vector<DISPPARAMS>        aCalls;     /* Replayable calls, in the order of the trace */
+	ULONGLONG                      qwCalls;    /* Calls recorded */
+	ULONGLONG                      qwTicks;    /* Time spent in the recorded calls, in TSC ticks */
+	DOUBLE                         dbNs;       /* Time per replayed call, in nanoseconds */
+} ReplayMethod;
+
+/**
+ * @brief Sink of the results, keeps the compiler from discarding the replayed calls.
+*/
+static volatile ULONGLONG s_qwSink = 0;
+
+/**
+ * @brief Target of the replayed calls. Only the marshalling and call overhead is measured, hence it ignores its
+ *        arguments.
+*/
+__attribute__((noinline)) static ULONGLONG THUNKCALLTYPE ReplayTarget(VOID) {
+	__asm__ __volatile__("");
+	return 0;
+}
+
+#ifndef DWTRACE_DYNAMICCALL
+/**
+ * @brief Stand-in for the NASM routine when it is not built. Methods relying on it are not replayed.
+*/
+extern "C" BOOL THUNKCALLTYPE DynamicCall(
+	_In_  PArgumentTable lpTable,
+	_In_  LPVOID         lpFunction,
+	_Out_ PRESULT        lpResut,
+	_In_  DWORD          dwReturnFlag
+) {
+	(VOID)lpTable, (VOID)lpFunction, (VOID)dwReturnFlag;
+	lpResut->int64 = 0;
+	return FALSE;
+}
+#endif
+
+/**
+ * @brief Convert a string to UTF-8.
+*/
+static std::string Narrow(
+	_In_ const std::wstring& wsString
+) {
+	if (wsString.empty())
+		return std::string();
+	int cbSize = ::WideCharToMultiByte(CP_UTF8, 0, wsString.c_str(), static_cast<int>(wsString.size()), NULL, 0, NULL, NULL);
+	std::string szString(cbSize > 0 ? cbSize : 0, '\0');
+	if (cbSize > 0)
+		::WideCharToMultiByte(CP_UTF8, 0, wsString.c_str(), static_cast<int>(wsString.size()), &szString[0], cbSize, NULL, NULL);
+	return szString;
+}
+
+/**
+ * @brief Get the name of a method, "module!function", or its index if it has not been described.
+*/
+static std::string MethodName(
+	_In_ const TraceFile& trace,
+	_In_ DWORD            dwMethod
+) {
+	const TraceMethod* pMethod = trace.FindMethod(dwMethod);
+	if (pMethod == nullptr)
+		return "#" + std::to_string(dwMethod);
+	return Narrow(pMethod->wsModuleName) + "!" + Narrow(pMethod->wsFunctionName);
+}
+
+/**
+ * @brief Get the name of a variant type, without the VT_ prefix.
+*/
+static std::string TypeName(
+	_In_ VARTYPE vt
+) {
+	static const LPCSTR aNames[] = {
+		"EMPTY", "NULL", "I2", "I4", "R4", "R8", "CY", "DATE", "BSTR", "DISPATCH", "ERROR", "BOOL", "VARIANT", "UNKNOWN",
+		"DECIMAL", "15", "I1", "UI1", "UI2", "UI4", "I8", "UI8", "INT", "UINT"
+	};
+
+	VARTYPE vtBase = vt & VT_TYPEMASK;
+	std::string szName = vtBase < ARRAYSIZE(aNames) ? aNames[vtBase] : std::to_string(vtBase);
+	if (vt & VT_ARRAY)
+		szName = "ARRAY|" + szName;
+	if (vt & VT_BYREF)
+		szName = "BYREF|" + szName;
+	return szName;
+}
+
+/**
+ * @brief Format the word of a value recorded with its type.
+*/
+static std::string FormatValue(
+	_In_ VARTYPE   vt,
+	_In_ ULONGLONG qwWord
+) {
+	if (vt & VT_BYREF)
+		return "&";
+	if (vt & VT_ARRAY)
+		return "array";
+
+	CHAR szValue[64] = { 0 };
+	switch (vt) {
+	case VT_EMPTY: return "empty";
+	case VT_NULL: return "null";
+	case VT_BOOL: return static_cast<SHORT>(qwWord) != 0 ? "true" : "false";
+	case VT_BSTR: return "string[" + std::to_string(qwWord) + "]";
+	case VT_DISPATCH: return "object";
+	case VT_UNKNOWN: return "object";
+	case VT_I1: return std::to_string(static_cast<signed char>(qwWord));
+	case VT_UI1: return std::to_string(static_cast<BYTE>(qwWord));
+	case VT_I2: return std::to_string(static_cast<SHORT>(qwWord));
+	case VT_UI2: return std::to_string(static_cast<WORD>(qwWord));
+	case VT_I4:
+	case VT_INT: return std::to_string(static_cast<LONG>(qwWord));
+	case VT_UI4:
+	case VT_UINT: return std::to_string(static_cast<DWORD>(qwWord));
+	case VT_I8: return std::to_string(static_cast<LONGLONG>(qwWord));
+	case VT_UI8: return std::to_string(qwWord);
+	case VT_ERROR:
+		std::snprintf(szValue, sizeof(szValue), "0x%08X", static_cast<DWORD>(qwWord));
+		return szValue;
+	case VT_CY:
+		std::snprintf(szValue, sizeof(szValue), "%.4f", static_cast<DOUBLE>(static_cast<LONGLONG>(qwWord)) / 10000);
+		return szValue;
+	case VT_R4: {
+		DWORD dwBits = static_cast<DWORD>(qwWord);
+		FLOAT flValue = 0;
+		std::memcpy(&flValue, &dwBits, sizeof(flValue));
+		std::snprintf(szValue, sizeof(szValue), "%g", flValue);
+		return szValue;
+	}
+	case VT_R8:
+	case VT_DATE: {
+		DOUBLE dbValue = 0;
+		std::memcpy(&dbValue, &qwWord, sizeof(dbValue));
+		std::snprintf(szValue, sizeof(szValue), "%g", dbValue);
+		return szValue;
+	}
+	}
+	std::snprintf(szValue, sizeof(szValue), "0x%llX", static_cast<unsigned long long>(qwWord));
+	return szValue;
+}
+
+/**
+ * @brief Quote a field of a CSV line.
+*/
+static std::string QuoteCsv(
+	_In_ const std::string& szField
+) {
+	std::string szQuoted = "\"";
+	for (CHAR c : szField) {
+		if (c == '"')
+			szQuoted.push_back('"');
+		szQuoted.push_back(c);
+	}
+	szQuoted.push_back('"');
+	return szQuoted;
+}
+
+/**
+ * @brief Escape a string within a JSON string.
+*/
+static std::string EscapeJson(
+	_In_ const std::string& szString
+) {
+	std::string szEscaped{};
+	for (CHAR c : szString) {
+		if (c == '"' || c == '\\') {
+			szEscaped.push_back('\\');
+			szEscaped.push_back(c);
+		}
+		else if (static_cast<BYTE>(c) < 0x20) {
+			CHAR szCode[8] = { 0 };
+			std::snprintf(szCode, sizeof(szCode), "\\u%04x", static_cast<BYTE>(c));
+			szEscaped.append(szCode);
+		}
+		else {
+			szEscaped.push_back(c);
+		}
+	}
+	return szEscaped;
+}
+
+/**
+ * @brief Read and parse a trace file.
+ * @param szPath The path of the file.
+ * @param pTrace The trace that receives the content of the file.
+ * @return Whether the file has been parsed, a trace cut short included.
+*/
+static BOOL LoadTrace(
+	_In_  LPCSTR     szPath,
+	_Out_ TraceFile* pTrace
+) {
+	std::FILE* pFile = std::fopen(szPath, "rb");
+	if (pFile == nullptr) {
+		std::fprintf(stderr, "%s: cannot open the file\n", szPath);
+		return FALSE;
+	}
+
+	std::vector<BYTE> data{};
+	BYTE aBuffer[0x10000];
+	SIZE_T dwRead = 0;
+	while ((dwRead = std::fread(aBuffer, 1, sizeof(aBuffer), pFile)) != 0)
+		data.insert(data.end(), aBuffer, aBuffer + dwRead);
+	std::fclose(pFile);
+
+	HRESULT hr = pTrace->Parse(data.data(), data.size());
+	if (FAILED(hr)) {
+		std::fprintf(stderr, "%s: not a valid call trace\n", szPath);
+		return FALSE;
+	}
+	if (hr == S_FALSE)
+		std::fprintf(stderr, "%s: the trace has been cut short, the calls recorded so far are decoded\n", szPath);
+	return TRUE;
+}
+
+/**
+ * @brief Get the records sorted by time stamp. Records of each thread are already in order.
+*/
+static std::vector<const TraceRecord*> SortRecords(
+	_In_ const TraceFile& trace
+) {
+	std::vector<const TraceRecord*> aRecords{};
+	aRecords.reserve(trace.m_aRecords.size());
+	for (const TraceRecord& record : trace.m_aRecords)
+		aRecords.push_back(&record);
+	std::stable_sort(aRecords.begin(), aRecords.end(), [](const TraceRecord* pLeft, const TraceRecord* pRight) {
+		return pLeft->qwTimestamp < pRight->qwTimestamp;
+	});
+	return aRecords;
+}
+
+/**
+ * @brief Decode a trace into text, one line per call.
+*/
+static VOID DecodeText(
+	_In_ const TraceFile& trace
+) {
+	std::printf("# %s trace, %zu methods, %zu calls, %llu dropped\n", trace.m_bComplete ? "complete" : "partial",
+		trace.m_aMethods.size(), trace.m_aRecords.size(), static_cast<unsigned long long>(trace.m_qwDropped));
+
+	for (const TraceRecord* pRecord : SortRecords(trace)) {
+		std::string szArguments{};
+		for (DWORD cx = 0; cx < pRecord->wArguments && cx < TRACEFILE_ARGUMENTS; cx++) {
+			if (cx != 0)
+				szArguments.append(", ");
+			szArguments.append(FormatValue(pRecord->aTypes[cx], pRecord->aWords[cx]));
+		}
+		if (pRecord->wArguments > TRACEFILE_ARGUMENTS)
+			szArguments.append(", ...");
+
+		std::printf("%llu tid=%u dispid=%d %s(%s) -> %s hr=0x%08X ticks=%llu\n",
+			static_cast<unsigned long long>(pRecord->qwTimestamp), pRecord->dwThreadId, pRecord->lDispId,
+			MethodName(trace, pRecord->dwMethod).c_str(), szArguments.c_str(), FormatValue(pRecord->vtReturn, pRecord->qwReturn).c_str(),
+			static_cast<DWORD>(pRecord->hr), static_cast<unsigned long long>(pRecord->qwDuration));
+	}
+}
+
+/**
+ * @brief Decode a trace into CSV, one line per call.
+*/
+static VOID DecodeCsv(
+	_In_ const TraceFile& trace
+) {
+	std::printf("timestamp,thread,dispid,method,hr,ticks,arguments,return_type,return");
+	for (DWORD cx = 1; cx <= TRACEFILE_ARGUMENTS; cx++)
+		std::printf(",arg%u_type,arg%u", cx, cx);
+	std::printf("\n");
+
+	for (const TraceRecord* pRecord : SortRecords(trace)) {
+		std::printf("%llu,%u,%d,%s,0x%08X,%llu,%u,%s,%s",
+			static_cast<unsigned long long>(pRecord->qwTimestamp), pRecord->dwThreadId, pRecord->lDispId,
+			QuoteCsv(MethodName(trace, pRecord->dwMethod)).c_str(), static_cast<DWORD>(pRecord->hr),
+			static_cast<unsigned long long>(pRecord->qwDuration), pRecord->wArguments, TypeName(pRecord->vtReturn).c_str(),
+			QuoteCsv(FormatValue(pRecord->vtReturn, pRecord->qwReturn)).c_str());
+		for (DWORD cx = 0; cx < TRACEFILE_ARGUMENTS; cx++) {
+			if (cx < pRecord->wArguments)
+				std::printf(",%s,%s", TypeName(pRecord->aTypes[cx]).c_str(), QuoteCsv(FormatValue(pRecord->aTypes[cx], pRecord->aWords[cx])).c_str());
+			else
+				std::printf(",,");
+		}
+		std::printf("\n");
+	}
+}
+
+/**
+ * @brief Whether an argument can be rebuilt from its record. Addresses of references, arrays and objects are not
+ *        recorded.
+*/
+static BOOL IsReplayable(
+	_In_ VARTYPE vt
+) {
+	switch (vt) {
+	case VT_EMPTY: case VT_NULL: case VT_I2: case VT_I4: case VT_R4: case VT_R8: case VT_CY: case VT_DATE:
+	case VT_BSTR: case VT_ERROR: case VT_BOOL: case VT_I1: case VT_UI1: case VT_UI2: case VT_UI4: case VT_I8:
+	case VT_UI8: case VT_INT: case VT_UINT:
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * @brief Rebuild the parameters of a recorded call, in the reverse order as in DISPPARAMS.
+ * @return Whether the call can be replayed.
+*/
+static BOOL RebuildCall(
+	_In_  const TraceRecord* pRecord,
+	_Out_ DISPPARAMS*        pDispParams
+) {
+	*pDispParams = DISPPARAMS{ nullptr, nullptr, 0, 0 };
+	if (pRecord->wArguments > TRACEFILE_ARGUMENTS)
+		return FALSE;
+	for (DWORD cx = 0; cx < pRecord->wArguments; cx++) {
+		if (!IsReplayable(pRecord->aTypes[cx]))
+			return FALSE;
+	}
+
+	// Strings are rebuilt with their recorded length, hence converted at the same cost
+	VARIANT* aArguments = new VARIANT[pRecord->wArguments + 1];
+	for (DWORD cx = 0; cx < pRecord->wArguments; cx++) {
+		VARIANT* pVariant = &aArguments[pRecord->wArguments - cx - 1];
+		::VariantInit(pVariant);
+		V_VT(pVariant) = pRecord->aTypes[cx];
+		if (pRecord->aTypes[cx] == VT_BSTR) {
+			std::wstring wsString(static_cast<SIZE_T>(std::min<ULONGLONG>(pRecord->aWords[cx], 0x100000)), L'x');
+			V_BSTR(pVariant) = ::SysAllocStringLen(wsString.c_str(), static_cast<UINT>(wsString.size()));
+		}
+		else {
+			V_UI8(pVariant) = pRecord->aWords[cx];
+		}
+	}
+	pDispParams->rgvarg = aArguments;
+	pDispParams->cArgs = pRecord->wArguments;
+	return TRUE;
+}
+
+/**
+ * @brief Replay every call of the trace through the call path of the DLL.
+ * @param trace The trace.
+ * @param dwIterations The number of passes over the calls.
+*/
+static VOID Replay(
+	_In_ const TraceFile& trace,
+	_In_ DWORD            dwIterations
+) {
+	// Methods calling the stub target through the same plans, thunks and type feedback as the DLL
+	std::vector<ReplayMethod> aMethods(trace.m_aMethods.size());
+	for (SIZE_T cx = 0; cx < trace.m_aMethods.size(); cx++) {
+		ReplayMethod& method = aMethods[cx];
+		method.pTrace = &trace.m_aMethods[cx];
+		method.qwCalls = 0;
+		method.qwTicks = 0;
+		method.dbNs = 0;
+		if (method.pTrace->bSignature && FAILED(MarshalPlan::Compile(method.pTrace->wsSignature.c_str(), &method.pPlan)))
+			continue;
+		if (!method.pTrace->bSignature)
+			method.pFeedback = std::make_unique<TypeFeedback>();
+		method.pMethod = std::make_unique<DynamicMethod>(reinterpret_cast<LPVOID>(&ReplayTarget), method.pPlan.get(), method.pFeedback.get());
+
+#ifndef DWTRACE_DYNAMICCALL
+		if (method.pPlan != nullptr && method.pMethod->m_lpThunk == NULL)
+			method.pMethod.reset();
+#endif
+	}
+
+	// Calls in the order of the trace, and by method
+	std::vector<std::pair<const DynamicMethod*, DISPPARAMS>> aCalls{};
+	ULONGLONG qwSkipped = 0;
+	for (const TraceRecord* pRecord : SortRecords(trace)) {
+		ReplayMethod* pMethod = nullptr;
+		for (ReplayMethod& method : aMethods) {
+			if (method.pTrace->dwMethod == pRecord->dwMethod)
+				pMethod = &method;
+		}
+
+		DISPPARAMS params{};
+		if (pMethod == nullptr || pMethod->pMethod == nullptr || FAILED(pRecord->hr) || !RebuildCall(pRecord, &params)) {
+			qwSkipped++;
+			if (pMethod != nullptr)
+				pMethod->qwCalls++;
+			continue;
+		}
+		pMethod->qwCalls++;
+		pMethod->qwTicks += pRecord->qwDuration;
+		pMethod->aCalls.push_back(params);
+		aCalls.emplace_back(pMethod->pMethod.get(), params);
+	}
+
+	// Each method on its own
+	for (ReplayMethod& method : aMethods) {
+		if (method.aCalls.empty())
+			continue;
+		auto start = std::chrono::steady_clock::now();
+		for (DWORD dwIteration = 0; dwIteration < dwIterations; dwIteration++) {
+			for (DISPPARAMS& params : method.aCalls) {
+				VARIANT result;
+				::VariantInit(&result);
+				method.pMethod->Invoke(&params, &result, nullptr);
+				s_qwSink += V_UI8(&result);
+				::VariantClear(&result);
+			}
+		}
+		DOUBLE dbElapsed = static_cast<DOUBLE>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		method.dbNs = dbElapsed / (static_cast<DOUBLE>(method.aCalls.size()) * dwIterations);
+	}
+
+	// Every call in the order of the trace
+	DOUBLE dbTotalNs = 0;
+	if (!aCalls.empty()) {
+		auto start = std::chrono::steady_clock::now();
+		for (DWORD dwIteration = 0; dwIteration < dwIterations; dwIteration++) {
+			for (auto& call : aCalls) {
+				VARIANT result;
+				::VariantInit(&result);
+				call.first->Invoke(&call.second, &result, nullptr);
+				s_qwSink += V_UI8(&result);
+				::VariantClear(&result);
+			}
+		}
+		DOUBLE dbElapsed = static_cast<DOUBLE>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		dbTotalNs = dbElapsed / (static_cast<DOUBLE>(aCalls.size()) * dwIterations);
+	}
+
+	for (const ReplayMethod& method : aMethods) {
+		std::string szName = Narrow(method.pTrace->wsModuleName) + "!" + Narrow(method.pTrace->wsFunctionName);
+		std::string szSignature = method.pTrace->bSignature ? "\"" + EscapeJson(Narrow(method.pTrace->wsSignature)) + "\"" : "null";
+		std::printf("{\"method\":\"%s\",\"signature\":%s,\"calls\":%llu,\"replayed\":%zu,\"recorded_ticks\":%.1f,\"replay_ns\":%.3f}\n",
+			EscapeJson(szName).c_str(), szSignature.c_str(), static_cast<unsigned long long>(method.qwCalls), method.aCalls.size(),
+			method.aCalls.empty() ? 0.0 : static_cast<DOUBLE>(method.qwTicks) / method.aCalls.size(), method.dbNs);
+	}
+	std::printf("{\"method\":\"*\",\"calls\":%zu,\"replayed\":%zu,\"skipped\":%llu,\"iterations\":%u,\"replay_ns\":%.3f}\n",
+		trace.m_aRecords.size(), aCalls.size(), static_cast<unsigned long long>(qwSkipped), dwIterations, dbTotalNs);
+
+	for (auto& call : aCalls) {
+		for (UINT cx = 0; cx < call.second.cArgs; cx++)
+			::VariantClear(&call.second.rgvarg[cx]);
+		delete[] call.second.rgvarg;
+	}
+}
+
+/**
+ * @brief Print the usage of the program.
+*/
+static VOID Usage(
+	_In_ LPCSTR szProgram
+) {
+	std::fprintf(stderr,
+		"Usage: %s text|csv|replay FILE [--iterations N]\n"
+		"  text          One line per call, sorted by time stamp\n"
+		"  csv           One line per call, sorted by time stamp, with a header\n"
+		"  replay        Replay the calls against a stub target and report the time per call as JSON lines\n"
+		"  --iterations  Number of passes over the calls when replaying (default %u)\n",
+		szProgram, DWTRACE_ITERATIONS);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		Usage(argv[0]);
+		return argc == 2 && std::string(argv[1]) == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	std::string Command = argv[1];
+	DWORD dwIterations = DWTRACE_ITERATIONS;
+	for (int cx = 3; cx < argc; cx++) {
+		std::string Argument = argv[cx];
+		if (Argument == "--iterations" && cx + 1 < argc) {
+			dwIterations = static_cast<DWORD>(std::max(1, std::atoi(argv[++cx])));
+		}
+		else {
+			Usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (Command != "text" && Command != "csv" && Command != "replay") {
+		Usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	TraceFile trace{};
+	if (!LoadTrace(argv[2], &trace))
+		return EXIT_FAILURE;
+
+	if (Command == "text")
+		DecodeText(trace);
+	else if (Command == "csv")
+		DecodeCsv(trace);
+	else
+		Replay(trace, dwIterations);
+	return EXIT_SUCCESS;
+}